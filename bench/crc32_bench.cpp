@@ -0,0 +1,145 @@
+/**
+ * Microbenchmark for the CRC32 implementations. Each one is checked against the
+ * bytewise table code (which is what the nodes use) before being timed over a
+ * range of buffer sizes typical for framebuffer packets.
+ *
+ * Usage: crc32_bench [seconds per test]
+ */
+#include "crc32/crc32.h"
+
+#include <chrono>
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+
+/// an implementation to benchmark
+struct Variant {
+	const char *name;
+	uint32_t (*function)(const void *data, size_t length, uint32_t previousCrc32);
+	bool supported;
+};
+
+/// wraps crc32_16bytes_prefetch, since it takes an extra argument
+static uint32_t crc32_prefetch(const void *data, size_t length, uint32_t previousCrc32) {
+	return crc32_16bytes_prefetch(data, length, previousCrc32);
+}
+
+/**
+ * Checks that the implementation produces the same results as the table code for
+ * all lengths up to the size of the buffer, starting at a few different offsets.
+ */
+static bool validate(const Variant &variant, const std::vector<uint8_t> &buffer) {
+	static const char *check = "123456789";
+
+	if(variant.function(check, 9, 0) != 0xCBF43926) {
+		return false;
+	}
+
+	for(size_t offset = 0; offset < 4; offset++) {
+		for(size_t length = 0; length < (buffer.size() - offset); length++) {
+			const uint8_t *data = buffer.data() + offset;
+
+			if(variant.function(data, length, 0) != crc32_1byte(data, length, 0)) {
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Runs the implementation over a buffer of the given size for roughly the given
+ * time, and returns the throughput in MB/s.
+ */
+static double benchmark(const Variant &variant, const std::vector<uint8_t> &buffer, size_t length, double seconds) {
+	auto start = std::chrono::steady_clock::now();
+	std::chrono::duration<double> elapsed(0);
+
+	size_t iterations = 0;
+	volatile uint32_t sink = 0;
+
+	do {
+		// check the time only every so often
+		for(size_t i = 0; i < 256; i++) {
+			sink = variant.function(buffer.data(), length, sink);
+		}
+
+		iterations += 256;
+		elapsed = std::chrono::steady_clock::now() - start;
+	} while(elapsed.count() < seconds);
+
+	return (double(iterations) * length) / elapsed.count() / (1000 * 1000);
+}
+
+int main(int argc, const char *argv[]) {
+	double seconds = (argc > 1) ? atof(argv[1]) : 0.25;
+
+	Variant variants[] = {
+		{"bitwise", crc32_bitwise, true},
+		{"1byte", crc32_1byte, true},
+		{"16bytes", crc32_16bytes, true},
+		{"16bytes_prefetch", crc32_prefetch, true},
+		{"pclmul", crc32_pclmul, crc32_pclmul_supported()},
+		{"armv8", crc32_armv8, crc32_armv8_supported()},
+		{"fast", crc32_fast, true},
+	};
+
+	// packet sizes: a small delta, a few typical channels, and a jumbo frame
+	static const size_t sizes[] = {64, 256, 512, 1024, 1472, 4096, 8192};
+
+	std::vector<uint8_t> buffer(8192 + 16);
+
+	for(size_t i = 0; i < buffer.size(); i++) {
+		buffer[i] = uint8_t(rand());
+	}
+
+	printf("crc32_fast uses: %s\n\n", crc32_fast_name());
+
+	// validate all implementations first
+	bool allValid = true;
+
+	for(Variant &variant : variants) {
+		if(!variant.supported) {
+			printf("%-18s not supported\n", variant.name);
+			continue;
+		}
+
+		std::vector<uint8_t> small(buffer.begin(), buffer.begin() + 1100);
+		bool valid = validate(variant, small);
+
+		printf("%-18s %s\n", variant.name, valid ? "ok" : "MISMATCH");
+
+		if(!valid) {
+			variant.supported = false;
+			allValid = false;
+		}
+	}
+
+	// then print a table of throughputs
+	printf("\n%-18s", "MB/s");
+
+	for(size_t size : sizes) {
+		printf("%10zu", size);
+	}
+
+	printf("\n");
+
+	for(const Variant &variant : variants) {
+		if(!variant.supported) {
+			continue;
+		}
+
+		printf("%-18s", variant.name);
+
+		for(size_t size : sizes) {
+			printf("%10.0f", benchmark(variant, buffer, size, seconds));
+			fflush(stdout);
+		}
+
+		printf("\n");
+	}
+
+	return allValid ? 0 : 1;
+}
@@ -0,0 +1,564 @@
+/**
+ * Microbenchmarks for the kernels on the frame's hot path: pixel conversion,
+ * packet checksums and byte order conversion, the scan for changed pixels, and
+ * the bulk operations on script buffers. Everything is timed over channel sizes
+ * from 150 to 10,000 pixels.
+ *
+ * Before any benchmarks run, all variants of each kernel are checked against
+ * the scalar reference code; mismatches are printed to stderr, and make the
+ * benchmark exit with a non-zero status.
+ *
+ * This uses Google Benchmark, so all of its flags are supported; results can be
+ * written as JSON with --benchmark_format=json or --benchmark_out=<file>.
+ */
+#include "HSIPixel.h"
+#include "LichtensteinUtils.h"
+#include "EffectRunner.h"
+#include "ProtocolHandler.h"
+#include "Routine.h"
+#include "lichtenstein_proto.h"
+
+#include "crc32/crc32.h"
+
+#include <benchmark/benchmark.h>
+
+#include <random>
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+/// channel sizes, in pixels
+static const int64_t kPixelCounts[] = {150, 300, 1000, 4096, 10000};
+
+/**
+ * Adds an argument for each channel size to the benchmark.
+ */
+static void PixelCounts(benchmark::internal::Benchmark *b) {
+	for(int64_t count : kPixelCounts) {
+		b->Arg(count);
+	}
+}
+
+/**
+ * Returns the given number of random pixels; they're normalized like the
+ * framebuffer's, i.e. hue in [0, 360) and saturation and intensity in [0, 1].
+ */
+static std::vector<HSIPixel> randomPixels(size_t count, unsigned int seed = 420) {
+	std::mt19937 random(seed);
+
+	std::uniform_real_distribution<double> hue(0, 360);
+	std::uniform_real_distribution<double> unit(0, 1);
+
+	std::vector<HSIPixel> pixels(count);
+
+	for(auto &pixel : pixels) {
+		pixel = HSIPixel(hue(random), unit(random), unit(random));
+	}
+
+	return pixels;
+}
+
+/**
+ * Splits pixels into separate hue, saturation and intensity planes.
+ */
+struct Planes {
+	std::vector<float> h, s, i;
+
+	Planes(const std::vector<HSIPixel> &pixels) {
+		for(auto const& pixel : pixels) {
+			this->h.push_back(pixel.h);
+			this->s.push_back(pixel.s);
+			this->i.push_back(pixel.i);
+		}
+	}
+};
+
+/**
+ * Returns a framebuffer data packet for the given number of RGB pixels, in host
+ * byte order.
+ */
+static std::vector<uint8_t> framebufferPacket(size_t numPixels) {
+	std::vector<uint8_t> packet(ProtocolHandler::framebufferDataSize(numPixels, false));
+
+	lichtenstein_framebuffer_data_t *fb = reinterpret_cast<lichtenstein_framebuffer_data_t *>(packet.data());
+
+	LichtensteinUtils::populateHeader(&fb->header, kOpcodeFramebufferData);
+	fb->header.payloadLength = (packet.size() - sizeof(lichtenstein_header_t));
+
+	fb->dataFormat = kDataFormatRGB;
+	fb->dataElements = numPixels;
+
+	return packet;
+}
+
+/**
+ * Returns a framebuffer delta packet with a range for every tenth pixel, in
+ * host byte order.
+ */
+static std::vector<uint8_t> deltaPacket(size_t numPixels) {
+	std::vector<ProtocolHandler::PixelRange> ranges;
+
+	for(size_t start = 0; start < numPixels; start += 10) {
+		ranges.push_back({start, 1});
+	}
+
+	std::vector<uint8_t> packet(ProtocolHandler::framebufferDeltaSize(ranges, false));
+
+	lichtenstein_framebuffer_delta_t *fb = reinterpret_cast<lichtenstein_framebuffer_delta_t *>(packet.data());
+
+	LichtensteinUtils::populateHeader(&fb->header, kOpcodeFramebufferDelta);
+	fb->header.payloadLength = (packet.size() - sizeof(lichtenstein_header_t));
+
+	fb->dataFormat = kDataFormatRGB;
+	fb->numRanges = ranges.size();
+
+	size_t offset = sizeof(lichtenstein_framebuffer_delta_t);
+
+	for(auto const& range : ranges) {
+		lichtenstein_framebuffer_range_t *out;
+		out = reinterpret_cast<lichtenstein_framebuffer_range_t *>(packet.data() + offset);
+
+		out->start = range.start;
+		out->count = range.count;
+
+		offset += sizeof(lichtenstein_framebuffer_range_t) + (range.count * 3);
+	}
+
+	return packet;
+}
+
+/**
+ * Returns a copy of the converted pixels in which the given percentage of
+ * pixels, spread evenly across the buffer, is changed.
+ */
+static std::vector<uint8_t> changePixels(const std::vector<uint8_t> &in, size_t stride, int percent) {
+	std::vector<uint8_t> out(in);
+	size_t numPixels = (in.size() / stride);
+
+	std::mt19937 random(69);
+
+	for(size_t i = 0; i < numPixels; i++) {
+		if(int(random() % 100) < percent) {
+			out[i * stride] ^= 0x01;
+		}
+	}
+
+	return out;
+}
+
+#pragma mark - Cross-checks
+/**
+ * Returns the largest difference between two buffers of converted pixels.
+ */
+static int maxDifference(const std::vector<uint8_t> &a, const std::vector<uint8_t> &b) {
+	int max = 0;
+
+	for(size_t i = 0; i < a.size(); i++) {
+		max = std::max(max, std::abs(int(a[i]) - int(b[i])));
+	}
+
+	return max;
+}
+
+/**
+ * The bytewise reference for findChangedRanges: pixels are compared one at a
+ * time, and ranges separated by at most as many pixels as a range header takes
+ * up are merged.
+ */
+static void referenceChangedRanges(const uint8_t *prev, const uint8_t *cur, size_t numPixels, size_t stride, std::vector<ProtocolHandler::PixelRange> &ranges) {
+	size_t mergeGap = sizeof(lichtenstein_framebuffer_range_t) / stride;
+
+	for(size_t i = 0; i < numPixels; i++) {
+		if(memcmp(prev + (i * stride), cur + (i * stride), stride) == 0) {
+			continue;
+		}
+
+		if(!ranges.empty()) {
+			ProtocolHandler::PixelRange &last = ranges.back();
+			size_t end = last.start + last.count;
+
+			if((i - end) <= mergeGap) {
+				last.count = (i + 1) - last.start;
+				continue;
+			}
+		}
+
+		ranges.push_back({i, 1});
+	}
+}
+
+/**
+ * Prints the result of a cross-check, and returns it.
+ */
+static bool report(const char *name, bool ok) {
+	fprintf(stderr, "%-36s %s\n", name, ok ? "ok" : "MISMATCH");
+	return ok;
+}
+
+/**
+ * Checks that all variants of the kernels produce the same results as the
+ * scalar reference code, within the tolerances they document.
+ */
+static bool crossCheck(void) {
+	bool ok = true;
+	size_t count = 10000;
+
+	auto pixels = randomPixels(count);
+	Planes planes(pixels);
+
+	std::vector<uint8_t> reference3(count * 3), reference4(count * 4);
+	std::vector<uint8_t> out3(count * 3), out4(count * 4);
+
+	// exact conversion: the span and plane conversions are within ±1 LSB
+	HSIPixel::setConversionMode(HSIPixel::kConversionExact);
+
+	for(size_t i = 0; i < count; i++) {
+		HSIPixel::convertPixelToRGB(pixels[i], &reference3[i * 3]);
+		HSIPixel::convertPixelToRGBW(pixels[i], &reference4[i * 4]);
+	}
+
+	HSIPixel::convertSpanToRGB(pixels.data(), count, out3.data());
+	ok &= report("convertSpanToRGB", maxDifference(reference3, out3) <= 1);
+	HSIPixel::convertSpanToRGBW(pixels.data(), count, out4.data());
+	ok &= report("convertSpanToRGBW", maxDifference(reference4, out4) <= 1);
+
+	HSIPixel::convertPlanesToRGB(planes.h.data(), planes.s.data(), planes.i.data(), count, out3.data());
+	ok &= report("convertPlanesToRGB", maxDifference(reference3, out3) <= 1);
+	HSIPixel::convertPlanesToRGBW(planes.h.data(), planes.s.data(), planes.i.data(), count, out4.data());
+	ok &= report("convertPlanesToRGBW", maxDifference(reference4, out4) <= 1);
+
+	// lookup conversion is within ±4 LSB of the exact conversion
+	HSIPixel::setConversionMode(HSIPixel::kConversionLookup);
+
+	HSIPixel::convertSpanToRGB(pixels.data(), count, out3.data());
+	ok &= report("convertSpanToRGB (lookup)", maxDifference(reference3, out3) <= 4);
+	HSIPixel::convertSpanToRGBW(pixels.data(), count, out4.data());
+	ok &= report("convertSpanToRGBW (lookup)", maxDifference(reference4, out4) <= 4);
+
+	HSIPixel::setConversionMode(HSIPixel::kConversionExact);
+
+	// all CRC implementations must match the bytewise table code
+	std::vector<uint8_t> data(count * 4);
+	std::mt19937 random(1337);
+
+	for(auto &byte : data) {
+		byte = uint8_t(random());
+	}
+
+	bool crcOk = true;
+
+	for(size_t length : {0, 1, 15, 64, 453, 1472, 8192, 40000}) {
+		uint32_t expected = crc32_1byte(data.data(), length, 0);
+
+		crcOk &= (crc32_16bytes(data.data(), length) == expected);
+		crcOk &= (crc32_fast(data.data(), length) == expected);
+
+		if(crc32_pclmul_supported()) {
+			crcOk &= (crc32_pclmul(data.data(), length) == expected);
+		}
+		if(crc32_armv8_supported()) {
+			crcOk &= (crc32_armv8(data.data(), length) == expected);
+		}
+	}
+
+	ok &= report("crc32", crcOk);
+
+	// converting packets to network byte order and back is lossless
+	bool orderOk = true;
+
+	for(auto const& packet : {framebufferPacket(1000), deltaPacket(1000)}) {
+		std::vector<uint8_t> converted(packet);
+
+		orderOk &= (LichtensteinUtils::convertToNetworkByteOrder(converted.data(), converted.size()) == 0);
+		orderOk &= (LichtensteinUtils::convertToHostByteOrder(converted.data(), converted.size()) == 0);
+		orderOk &= (converted == packet);
+	}
+
+	ok &= report("convertPacketByteOrder", orderOk);
+
+	// the changed ranges match the bytewise scan
+	bool rangesOk = true;
+
+	for(int percent : {0, 1, 10, 50, 100}) {
+		auto changed = changePixels(reference3, 3, percent);
+
+		std::vector<ProtocolHandler::PixelRange> ranges, expected;
+
+		EffectRunner::findChangedRanges(reference3.data(), changed.data(), count, 3, ranges);
+		referenceChangedRanges(reference3.data(), changed.data(), count, 3, expected);
+
+		rangesOk &= (ranges.size() == expected.size());
+
+		for(size_t i = 0; rangesOk && i < ranges.size(); i++) {
+			rangesOk &= (ranges[i].start == expected[i].start && ranges[i].count == expected[i].count);
+		}
+	}
+
+	ok &= report("findChangedRanges", rangesOk);
+
+	fprintf(stderr, "\n");
+	return ok;
+}
+
+#pragma mark - Pixel Conversion
+static void BM_PixelToRGB(benchmark::State &state, HSIPixel::ConversionMode mode) {
+	auto pixels = randomPixels(state.range(0));
+	std::vector<uint8_t> out(pixels.size() * 3);
+
+	HSIPixel::setConversionMode(mode);
+
+	for(auto _ : state) {
+		for(size_t i = 0; i < pixels.size(); i++) {
+			HSIPixel::convertPixelToRGB(pixels[i], &out[i * 3]);
+		}
+
+		benchmark::DoNotOptimize(out.data());
+	}
+
+	HSIPixel::setConversionMode(HSIPixel::kConversionExact);
+	state.SetItemsProcessed(state.iterations() * pixels.size());
+}
+BENCHMARK_CAPTURE(BM_PixelToRGB, exact, HSIPixel::kConversionExact)->Apply(PixelCounts);
+BENCHMARK_CAPTURE(BM_PixelToRGB, lookup, HSIPixel::kConversionLookup)->Apply(PixelCounts);
+
+static void BM_PixelToRGBW(benchmark::State &state, HSIPixel::ConversionMode mode) {
+	auto pixels = randomPixels(state.range(0));
+	std::vector<uint8_t> out(pixels.size() * 4);
+
+	HSIPixel::setConversionMode(mode);
+
+	for(auto _ : state) {
+		for(size_t i = 0; i < pixels.size(); i++) {
+			HSIPixel::convertPixelToRGBW(pixels[i], &out[i * 4]);
+		}
+
+		benchmark::DoNotOptimize(out.data());
+	}
+
+	HSIPixel::setConversionMode(HSIPixel::kConversionExact);
+	state.SetItemsProcessed(state.iterations() * pixels.size());
+}
+BENCHMARK_CAPTURE(BM_PixelToRGBW, exact, HSIPixel::kConversionExact)->Apply(PixelCounts);
+BENCHMARK_CAPTURE(BM_PixelToRGBW, lookup, HSIPixel::kConversionLookup)->Apply(PixelCounts);
+
+static void BM_SpanToRGB(benchmark::State &state) {
+	auto pixels = randomPixels(state.range(0));
+	std::vector<uint8_t> out(pixels.size() * 3);
+
+	for(auto _ : state) {
+		HSIPixel::convertSpanToRGB(pixels.data(), pixels.size(), out.data());
+		benchmark::DoNotOptimize(out.data());
+	}
+
+	state.SetItemsProcessed(state.iterations() * pixels.size());
+}
+BENCHMARK(BM_SpanToRGB)->Apply(PixelCounts);
+
+static void BM_SpanToRGBW(benchmark::State &state) {
+	auto pixels = randomPixels(state.range(0));
+	std::vector<uint8_t> out(pixels.size() * 4);
+
+	for(auto _ : state) {
+		HSIPixel::convertSpanToRGBW(pixels.data(), pixels.size(), out.data());
+		benchmark::DoNotOptimize(out.data());
+	}
+
+	state.SetItemsProcessed(state.iterations() * pixels.size());
+}
+BENCHMARK(BM_SpanToRGBW)->Apply(PixelCounts);
+
+static void BM_PlanesToRGB(benchmark::State &state) {
+	Planes planes(randomPixels(state.range(0)));
+	std::vector<uint8_t> out(planes.h.size() * 3);
+
+	for(auto _ : state) {
+		HSIPixel::convertPlanesToRGB(planes.h.data(), planes.s.data(), planes.i.data(), planes.h.size(), out.data());
+		benchmark::DoNotOptimize(out.data());
+	}
+
+	state.SetItemsProcessed(state.iterations() * planes.h.size());
+}
+BENCHMARK(BM_PlanesToRGB)->Apply(PixelCounts);
+
+static void BM_PlanesToRGBW(benchmark::State &state) {
+	Planes planes(randomPixels(state.range(0)));
+	std::vector<uint8_t> out(planes.h.size() * 4);
+
+	for(auto _ : state) {
+		HSIPixel::convertPlanesToRGBW(planes.h.data(), planes.s.data(), planes.i.data(), planes.h.size(), out.data());
+		benchmark::DoNotOptimize(out.data());
+	}
+
+	state.SetItemsProcessed(state.iterations() * planes.h.size());
+}
+BENCHMARK(BM_PlanesToRGBW)->Apply(PixelCounts);
+
+#pragma mark - Checksums
+/**
+ * Checksums a framebuffer packet for the given number of RGB pixels.
+ */
+static void BM_Crc32(benchmark::State &state, uint32_t (*function)(const void *, size_t, uint32_t), bool supported) {
+	if(!supported) {
+		state.SkipWithError("not supported by this CPU");
+		return;
+	}
+
+	auto packet = framebufferPacket(state.range(0));
+
+	for(auto _ : state) {
+		benchmark::DoNotOptimize(function(packet.data(), packet.size(), 0));
+	}
+
+	state.SetBytesProcessed(state.iterations() * packet.size());
+}
+
+/// wraps the CRC functions with default arguments, so they can be passed around
+static uint32_t crc32_16bytesWrapper(const void *d, size_t l, uint32_t p) { return crc32_16bytes(d, l, p); }
+static uint32_t crc32_pclmulWrapper(const void *d, size_t l, uint32_t p) { return crc32_pclmul(d, l, p); }
+static uint32_t crc32_armv8Wrapper(const void *d, size_t l, uint32_t p) { return crc32_armv8(d, l, p); }
+static uint32_t crc32_fastWrapper(const void *d, size_t l, uint32_t p) { return crc32_fast(d, l, p); }
+
+BENCHMARK_CAPTURE(BM_Crc32, 1byte, crc32_1byte, true)->Apply(PixelCounts);
+BENCHMARK_CAPTURE(BM_Crc32, 16bytes, crc32_16bytesWrapper, true)->Apply(PixelCounts);
+BENCHMARK_CAPTURE(BM_Crc32, pclmul, crc32_pclmulWrapper, crc32_pclmul_supported())->Apply(PixelCounts);
+BENCHMARK_CAPTURE(BM_Crc32, armv8, crc32_armv8Wrapper, crc32_armv8_supported())->Apply(PixelCounts);
+BENCHMARK_CAPTURE(BM_Crc32, fast, crc32_fastWrapper, true)->Apply(PixelCounts);
+
+#pragma mark - Byte Order
+/**
+ * Converts a packet to network byte order and back.
+ */
+static void BM_PacketByteOrder(benchmark::State &state, bool delta) {
+	auto packet = delta ? deltaPacket(state.range(0)) : framebufferPacket(state.range(0));
+
+	for(auto _ : state) {
+		LichtensteinUtils::convertToNetworkByteOrder(packet.data(), packet.size());
+		LichtensteinUtils::convertToHostByteOrder(packet.data(), packet.size());
+
+		benchmark::DoNotOptimize(packet.data());
+	}
+
+	state.SetBytesProcessed(state.iterations() * packet.size());
+}
+BENCHMARK_CAPTURE(BM_PacketByteOrder, data, false)->Apply(PixelCounts);
+BENCHMARK_CAPTURE(BM_PacketByteOrder, delta, true)->Apply(PixelCounts);
+
+#pragma mark - Delta Scan
+/**
+ * Finds the changed ranges in a channel where the given percentage of pixels
+ * changed since the previous frame.
+ */
+static void BM_FindChangedRanges(benchmark::State &state) {
+	auto pixels = randomPixels(state.range(0));
+	std::vector<uint8_t> prev(pixels.size() * 3);
+
+	HSIPixel::convertSpanToRGB(pixels.data(), pixels.size(), prev.data());
+	auto cur = changePixels(prev, 3, state.range(1));
+
+	std::vector<ProtocolHandler::PixelRange> ranges;
+
+	for(auto _ : state) {
+		ranges.clear();
+		EffectRunner::findChangedRanges(prev.data(), cur.data(), pixels.size(), 3, ranges);
+
+		benchmark::DoNotOptimize(ranges.data());
+	}
+
+	state.SetBytesProcessed(state.iterations() * prev.size());
+}
+BENCHMARK(BM_FindChangedRanges)->ArgsProduct({
+	{150, 300, 1000, 4096, 10000},
+	{0, 1, 10, 100}
+});
+
+#pragma mark - Script Buffers
+static void BM_ScriptBufferFill(benchmark::State &state) {
+	std::vector<HSIPixel> pixels(state.range(0));
+
+	Routine::ScriptBuffer buffer;
+	buffer.bind(pixels.data(), pixels.size());
+
+	for(auto _ : state) {
+		buffer.fill(HSIPixel(120, 1, 0.5), 0, pixels.size());
+		benchmark::DoNotOptimize(pixels.data());
+	}
+
+	state.SetItemsProcessed(state.iterations() * pixels.size());
+}
+BENCHMARK(BM_ScriptBufferFill)->Apply(PixelCounts);
+
+static void BM_ScriptBufferGradient(benchmark::State &state) {
+	std::vector<HSIPixel> pixels(state.range(0));
+
+	Routine::ScriptBuffer buffer;
+	buffer.bind(pixels.data(), pixels.size());
+
+	for(auto _ : state) {
+		buffer.gradient(HSIPixel(0, 1, 0), HSIPixel(300, 1, 1), 0, pixels.size());
+		benchmark::DoNotOptimize(pixels.data());
+	}
+
+	state.SetItemsProcessed(state.iterations() * pixels.size());
+}
+BENCHMARK(BM_ScriptBufferGradient)->Apply(PixelCounts);
+
+static void BM_ScriptBufferRotate(benchmark::State &state) {
+	auto pixels = randomPixels(state.range(0));
+
+	Routine::ScriptBuffer buffer;
+	buffer.bind(pixels.data(), pixels.size());
+
+	for(auto _ : state) {
+		buffer.rotate(1, 0, pixels.size());
+		benchmark::DoNotOptimize(pixels.data());
+	}
+
+	state.SetItemsProcessed(state.iterations() * pixels.size());
+}
+BENCHMARK(BM_ScriptBufferRotate)->Apply(PixelCounts);
+
+static void BM_ScriptBufferScaleIntensity(benchmark::State &state) {
+	auto pixels = randomPixels(state.range(0));
+
+	Routine::ScriptBuffer buffer;
+	buffer.bind(pixels.data(), pixels.size());
+
+	for(auto _ : state) {
+		buffer.scaleIntensity(0.99, 0, pixels.size());
+		benchmark::DoNotOptimize(pixels.data());
+	}
+
+	state.SetItemsProcessed(state.iterations() * pixels.size());
+}
+BENCHMARK(BM_ScriptBufferScaleIntensity)->Apply(PixelCounts);
+
+static void BM_ScriptBufferHueShift(benchmark::State &state) {
+	auto pixels = randomPixels(state.range(0));
+
+	Routine::ScriptBuffer buffer;
+	buffer.bind(pixels.data(), pixels.size());
+
+	for(auto _ : state) {
+		buffer.hueShift(1.5, 0, pixels.size());
+		benchmark::DoNotOptimize(pixels.data());
+	}
+
+	state.SetItemsProcessed(state.iterations() * pixels.size());
+}
+BENCHMARK(BM_ScriptBufferHueShift)->Apply(PixelCounts);
+
+int main(int argc, char *argv[]) {
+	bool valid = crossCheck();
+
+	benchmark::Initialize(&argc, argv);
+
+	if(benchmark::ReportUnrecognizedArguments(argc, argv)) {
+		return 1;
+	}
+
+	benchmark::RunSpecifiedBenchmarks();
+
+	return valid ? 0 : 1;
+}
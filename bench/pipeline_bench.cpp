@@ -0,0 +1,446 @@
+/**
+ * Benchmark for the full frame pipeline. An in-memory data store is populated
+ * with the given number of nodes, channels and groups, one of the bundled
+ * routines is mapped to each group, and the effect runner then renders frames
+ * as quickly as the frame rate allows for a while.
+ *
+ * Pixel data is sent to the nodes' addresses on the loopback interface, where a
+ * sink drains it; nodes never acknowledge writes, so the runner doesn't wait for
+ * them. The achieved frame rate and the time taken by each stage of the frame
+ * are then printed.
+ *
+ * Usage: pipeline_bench [--nodes=N] [--channels=N] [--pixels=N] [--groups=N]
+ *                       [--fps=N] [--seconds=N] [--scripts=path]
+ *                       [--options=section.key=value,...]
+ */
+#include "DataStore.h"
+#include "ProtocolHandler.h"
+#include "EffectRunner.h"
+#include "OutputMapper.h"
+#include "Routine.h"
+#include "Metrics.h"
+
+#include "db/Node.h"
+#include "db/Channel.h"
+#include "db/Group.h"
+#include "db/Routine.h"
+
+#include "INIReader.h"
+
+#include <glog/logging.h>
+#include <gflags/gflags.h>
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <map>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+DEFINE_int32(nodes, 4, "Number of nodes");
+DEFINE_int32(channels, 2, "Number of channels on each node");
+DEFINE_int32(pixels, 300, "Number of pixels on each channel");
+DEFINE_int32(groups, 8, "Number of groups the framebuffer is split into");
+DEFINE_int32(fps, 240, "Frame rate the runner targets");
+DEFINE_double(seconds, 5, "How long to render frames for");
+DEFINE_double(warmup, 1, "How long to render frames for before measuring");
+DEFINE_string(scripts, "./scripts", "Directory containing the routines to run");
+DEFINE_string(options, "", "Comma-separated list of additional config options, as section.key=value");
+DEFINE_int32(port, 7430, "Port the protocol handler listens on");
+
+/// config sections and their keys
+typedef std::map<std::string, std::map<std::string, std::string>> Config;
+
+/**
+ * Builds the server configuration: the database is kept in memory, and neither
+ * the sync nor the pending writes wait on acknowledgements.
+ */
+static Config makeConfig(void) {
+	Config config;
+
+	config["db"]["path"] = ":memory:";
+	config["db"]["journal"] = "MEMORY";
+
+	config["server"]["listen"] = "127.0.0.1";
+	config["server"]["port"] = std::to_string(FLAGS_port);
+
+	config["runner"]["fps"] = std::to_string(FLAGS_fps);
+
+	config["proto"]["syncTimeout"] = "0";
+	config["proto"]["writeTimeout"] = "10";
+	config["proto"]["maxPendingWrites"] = "65536";
+
+	// apply the overrides
+	std::stringstream options(FLAGS_options);
+	std::string option;
+
+	while(std::getline(options, option, ',')) {
+		size_t dot = option.find('.');
+		size_t equals = option.find('=');
+
+		CHECK(dot != std::string::npos && equals != std::string::npos && dot < equals) << "Invalid option '" << option << "'; expected section.key=value";
+
+		std::string section = option.substr(0, dot);
+		std::string key = option.substr(dot + 1, equals - dot - 1);
+
+		config[section][key] = option.substr(equals + 1);
+	}
+
+	return config;
+}
+
+/**
+ * Writes the config to a temporary file, and parses it from there.
+ */
+static INIReader *loadConfig(const Config &config) {
+	char path[] = "/tmp/pipeline_bench.XXXXXX";
+
+	int fd = mkstemp(path);
+	PCHECK(fd >= 0) << "Couldn't create config file";
+
+	std::ofstream out(path);
+
+	for(auto const& section : config) {
+		out << "[" << section.first << "]" << std::endl;
+
+		for(auto const& option : section.second) {
+			out << option.first << " = " << option.second << std::endl;
+		}
+	}
+
+	out.close();
+	close(fd);
+
+	INIReader *reader = new INIReader(path);
+	CHECK(reader->ParseError() == 0) << "Couldn't parse generated config";
+
+	unlink(path);
+	return reader;
+}
+
+/**
+ * Creates routines from all scripts in the given directory.
+ */
+static std::vector<DbRoutine *> loadRoutines(DataStore *store, const std::string &path) {
+	std::vector<DbRoutine *> routines;
+
+	DIR *dir = opendir(path.c_str());
+	PCHECK(dir != nullptr) << "Couldn't open scripts directory " << path;
+
+	std::vector<std::string> names;
+
+	while(struct dirent *entry = readdir(dir)) {
+		std::string name = entry->d_name;
+
+		// the test script logs every frame, which would skew the results
+		if(name == "test.as") {
+			continue;
+		}
+
+		if(name.size() > 3 && name.compare(name.size() - 3, 3, ".as") == 0) {
+			names.push_back(name);
+		}
+	}
+
+	closedir(dir);
+
+	std::sort(names.begin(), names.end());
+
+	for(auto const& name : names) {
+		std::ifstream file(path + "/" + name);
+		std::stringstream code;
+
+		code << file.rdbuf();
+
+		DbRoutine *routine = new DbRoutine();
+		routine->name = name;
+		routine->code = code.str();
+
+		store->update(routine);
+		routines.push_back(routine);
+	}
+
+	CHECK(!routines.empty()) << "No routines found in " << path;
+
+	return routines;
+}
+
+/**
+ * Creates the nodes and their channels. Each node gets its own address on the
+ * loopback interface, and the channels are laid out back to back in the
+ * framebuffer.
+ */
+static void createNodes(DataStore *store) {
+	int fbOffset = 0;
+
+	for(int i = 0; i < FLAGS_nodes; i++) {
+		DbNode *node = new DbNode();
+
+		node->ip = htonl(0x7F020000 + i + 1);
+
+		memset(node->macAddr, 0, sizeof(node->macAddr));
+		node->macAddr[0] = 0x02;
+		node->macAddr[4] = (i >> 8) & 0xFF;
+		node->macAddr[5] = (i & 0xFF);
+
+		node->hostname = "bench-" + std::to_string(i);
+		node->adopted = true;
+		node->numChannels = FLAGS_channels;
+		node->fbSize = (FLAGS_channels * FLAGS_pixels * 3);
+
+		store->update(node);
+
+		for(int j = 0; j < FLAGS_channels; j++) {
+			DbChannel *channel = new DbChannel();
+
+			channel->node = node;
+			channel->nodeOffset = j;
+			channel->numPixels = FLAGS_pixels;
+			channel->fbOffset = fbOffset;
+			channel->format = DbChannel::kPixelFormatRGB;
+
+			store->update(channel);
+
+			fbOffset += FLAGS_pixels;
+		}
+	}
+}
+
+/**
+ * Splits the framebuffer into groups of (roughly) equal size.
+ */
+static std::vector<DbGroup *> createGroups(DataStore *store) {
+	std::vector<DbGroup *> groups;
+
+	int total = (FLAGS_nodes * FLAGS_channels * FLAGS_pixels);
+	int start = 0;
+
+	for(int i = 0; i < FLAGS_groups; i++) {
+		int end = (int) ((int64_t(total) * (i + 1)) / FLAGS_groups);
+
+		DbGroup *group = new DbGroup();
+
+		group->name = "bench-" + std::to_string(i);
+		group->enabled = true;
+		group->start = start;
+		group->end = (end - 1);
+		group->currentRoutine = nullptr;
+
+		store->update(group);
+		groups.push_back(group);
+
+		start = end;
+	}
+
+	return groups;
+}
+
+/**
+ * Receives and discards the pixel data sent to the nodes.
+ */
+struct Sink {
+	int sock;
+	std::thread *thread;
+
+	std::atomic_bool run{true};
+
+	std::atomic<uint64_t> packets{0};
+	std::atomic<uint64_t> bytes{0};
+
+	Sink() {
+		int err;
+		unsigned int yes = 1;
+
+		this->sock = socket(AF_INET, SOCK_DGRAM, 0);
+		PCHECK(this->sock >= 0) << "Couldn't create sink socket";
+
+		err = setsockopt(this->sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+		PCHECK(err == 0) << "Couldn't set SO_REUSEADDR";
+
+		// wake up regularly to check whether we should stop
+		struct timeval tv = {0, 100 * 1000};
+		err = setsockopt(this->sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		PCHECK(err == 0) << "Couldn't set receive timeout";
+
+		// the nodes' addresses are all on the loopback interface
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_ANY);
+		addr.sin_port = htons(7420);
+
+		err = bind(this->sock, (struct sockaddr *) &addr, sizeof(addr));
+		PCHECK(err == 0) << "Couldn't bind sink to port 7420";
+
+		this->thread = new std::thread([this]{
+			static char buffer[65536];
+
+			while(this->run) {
+				ssize_t len = recv(this->sock, buffer, sizeof(buffer), 0);
+
+				if(len > 0) {
+					this->packets++;
+					this->bytes += len;
+				}
+			}
+		});
+	}
+
+	~Sink() {
+		this->run = false;
+		this->thread->join();
+
+		delete this->thread;
+		close(this->sock);
+	}
+};
+
+/**
+ * Takes a snapshot of all frame stage and routine histograms.
+ */
+static std::map<std::string, Histogram::Snapshot> snapshotHistograms(void) {
+	std::map<std::string, Histogram::Snapshot> snapshots;
+
+	Metrics::shared()->forEach([&](const std::string &name, const Metrics::Labels &labels,
+								   const std::string &help, const Histogram &histogram) {
+		std::string key;
+
+		if(name == "lichtenstein_frame_stage_seconds") {
+			key = labels.at("stage");
+		} else if(name == "lichtenstein_routine_execution_seconds") {
+			key = "routine " + labels.at("routine");
+		} else {
+			return;
+		}
+
+		histogram.snapshot(snapshots[key]);
+	});
+
+	return snapshots;
+}
+
+/**
+ * Subtracts the earlier snapshot from the later one, so that only the values
+ * recorded in between remain. The maximum can't be subtracted, so it's that of
+ * the later snapshot.
+ */
+static void subtract(Histogram::Snapshot &later, const Histogram::Snapshot &earlier) {
+	for(size_t i = 0; i < Histogram::kNumBuckets; i++) {
+		later.counts[i] -= earlier.counts[i];
+	}
+
+	later.count -= earlier.count;
+	later.sum -= earlier.sum;
+}
+
+int main(int argc, char *argv[]) {
+	FLAGS_logtostderr = 1;
+	google::InitGoogleLogging(argv[0]);
+
+	gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+	CHECK(FLAGS_nodes > 0 && FLAGS_channels > 0 && FLAGS_pixels > 0) << "Need at least one pixel";
+	CHECK(FLAGS_groups > 0 && FLAGS_groups <= (FLAGS_nodes * FLAGS_channels * FLAGS_pixels)) << "Invalid number of groups";
+
+	// set up the data store; groups must exist before the runner is created
+	INIReader *config = loadConfig(makeConfig());
+	DataStore *store = new DataStore(config);
+
+	std::vector<DbRoutine *> dbRoutines = loadRoutines(store, FLAGS_scripts);
+	createNodes(store);
+	std::vector<DbGroup *> dbGroups = createGroups(store);
+
+	Sink *sink = new Sink();
+
+	ProtocolHandler *proto = new ProtocolHandler(store, config);
+	EffectRunner *runner = new EffectRunner(store, config, proto);
+
+	// map the routines to the groups, round robin
+	std::vector<OutputMapper::OutputGroup *> groups;
+	std::vector<Routine *> routines;
+
+	for(size_t i = 0; i < dbGroups.size(); i++) {
+		OutputMapper::OutputGroup *group = new OutputMapper::OutputGroup(dbGroups[i]);
+		Routine *routine = new Routine(dbRoutines[i % dbRoutines.size()]);
+
+		runner->getMapper()->addMapping(group, routine);
+
+		groups.push_back(group);
+		routines.push_back(routine);
+	}
+
+	printf("%d nodes, %d channels of %d pixels each, %d groups, %zu routines\n",
+		   FLAGS_nodes, FLAGS_channels, FLAGS_pixels, FLAGS_groups, dbRoutines.size());
+
+	// warm up, then measure
+	std::this_thread::sleep_for(std::chrono::duration<double>(FLAGS_warmup));
+
+	auto before = snapshotHistograms();
+	uint64_t packetsBefore = sink->packets, bytesBefore = sink->bytes;
+	auto start = std::chrono::steady_clock::now();
+
+	std::this_thread::sleep_for(std::chrono::duration<double>(FLAGS_seconds));
+
+	auto after = snapshotHistograms();
+	uint64_t packets = (sink->packets - packetsBefore), bytes = (sink->bytes - bytesBefore);
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	for(auto &snapshot : after) {
+		if(before.count(snapshot.first)) {
+			subtract(snapshot.second, before[snapshot.first]);
+		}
+	}
+
+	// print the results
+	double frames = after.count("frame") ? after["frame"].count : 0;
+
+	printf("\n%.1f frames/sec (target %d), %.0f packets/sec, %.1f Mbit/s\n",
+		   (frames / elapsed.count()), FLAGS_fps, (packets / elapsed.count()),
+		   ((bytes * 8) / elapsed.count() / (1000 * 1000)));
+
+	printf("\n%-18s%10s%10s%10s%10s%10s\n", "µS", "count", "mean", "p50", "p99", "max");
+
+	for(auto const& snapshot : after) {
+		const Histogram::Snapshot &s = snapshot.second;
+
+		if(s.count == 0) {
+			continue;
+		}
+
+		printf("%-18s%10llu%10.1f%10.1f%10.1f%10.1f\n", snapshot.first.c_str(),
+			   (unsigned long long) s.count, (double(s.sum) / s.count / 1000.),
+			   (s.percentile(0.5) / 1000.), (s.percentile(0.99) / 1000.),
+			   (s.max / 1000.));
+	}
+
+	// clean up
+	delete runner;
+	delete proto;
+	delete sink;
+
+	for(auto routine : routines) {
+		delete routine;
+	}
+
+	for(auto group : groups) {
+		delete group;
+	}
+
+	delete store;
+	delete config;
+
+	return 0;
+}
@@ -9,18 +9,19 @@
  */
 double step = 0;
 
-void effectStep() {
-	double stepSize = double(properties['stepSize']);
-	double maxIntensity = double(properties['maxIntensity']);
-	double hue = double(properties['hue']);
-	double saturation = double(properties['saturation']);
+// filled in with the properties by the server
+double param_stepSize = 0.01;
+double param_maxIntensity = 1;
+double param_hue = 0;
+double param_saturation = 1;
 
+void effectStep() {
 	for(uint x = 0; x < buffer.length(); x++) {
-		buffer[x].h = hue;
-		buffer[x].s = saturation;
+		buffer[x].h = param_hue;
+		buffer[x].s = param_saturation;
 
-		buffer[x].i = (1 - abs(sin(step))) * maxIntensity;
+		buffer[x].i = (1 - abs(sin(step))) * param_maxIntensity;
 	}
 
-	step = stepSize * double(frameCounter);
+	step = param_stepSize * double(frameCounter);
 }
@@ -11,11 +11,8 @@ void effectStep() {
 
 	debug_print("length of buffer array: " + formatInt(buffer.length()));
 
-	double intensityStep = 1.0 / double(buffer.length() - 1);
+	HSIPixel dark = {0, 1, 0};
+	HSIPixel bright = {0, 1, 1};
 
-	for(uint i = 0; i < buffer.length(); i++) {
-		buffer[i].h = 0;
-		buffer[i].s = 1;
-		buffer[i].i = intensityStep * double(i);
-	}
+	buffer.gradient(dark, bright);
 }
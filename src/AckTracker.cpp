@@ -0,0 +1,386 @@
+#include "AckTracker.h"
+
+#include <glog/logging.h>
+#include <pthread.h>
+
+/// index returned by find() if a transaction isn't in the table
+static const size_t kNotFound = SIZE_MAX;
+
+/**
+ * Timing wheel thread entry point
+ */
+void AckTrackerWheelEntry(void *ctx) {
+#ifdef __APPLE__
+	pthread_setname_np("Ack Timeouts");
+#else
+  #ifdef pthread_setname_np
+    pthread_setname_np(pthread_self(), "Ack Timeouts");
+  #endif
+#endif
+
+	AckTracker *tracker = static_cast<AckTracker *>(ctx);
+	tracker->wheelThreadEntry();
+}
+
+/**
+ * Sets up the tracker. Up to capacity writes can be outstanding at once; the
+ * hash table is sized to be at most half full at that point. Timeouts are
+ * rounded up to the given resolution.
+ */
+AckTracker::AckTracker(size_t capacity, std::chrono::milliseconds resolution, TimeoutCallback callback) {
+	CHECK(capacity > 0) << "Ack tracker capacity must be positive";
+	CHECK(resolution.count() > 0) << "Ack tracker resolution must be positive";
+
+	this->capacity = capacity;
+	this->resolution = resolution;
+	this->callback = callback;
+
+	// allocate the table
+	size_t tableSz = 16;
+
+	while(tableSz < (capacity * 2)) {
+		tableSz <<= 1;
+	}
+
+	this->table.resize(tableSz);
+	this->mask = (tableSz - 1);
+
+	for(auto &entry : this->table) {
+		entry.used = false;
+	}
+
+	// pre-size the wheel slots so adding writes usually doesn't allocate
+	for(size_t i = 0; i < kWheelSlots; i++) {
+		this->wheel[i].reserve(std::max(size_t(16), ((capacity * 2) / kWheelSlots)));
+	}
+
+	this->expired.reserve(capacity);
+
+	// start the wheel
+	this->epoch = clock::now();
+	this->nextTick = 0;
+
+	this->wheelThread = new std::thread(AckTrackerWheelEntry, this);
+}
+
+/**
+ * Stops the timing wheel. Outstanding writes are dropped without invoking the
+ * timeout callback.
+ */
+AckTracker::~AckTracker() {
+	{
+		std::lock_guard<std::mutex> lk(this->lock);
+
+		this->run = false;
+		this->runCv.notify_all();
+
+		this->waitsCancelled = true;
+		this->emptyCv.notify_all();
+	}
+
+	this->wheelThread->join();
+	delete this->wheelThread;
+}
+
+#pragma mark - Tracking
+/**
+ * Starts tracking a write with the given transaction number, which times out
+ * after the given time unless it's acknowledged first. If a write with the
+ * same transaction number is still outstanding, it's replaced.
+ *
+ * @return Whether the write is tracked; this fails if the tracker is full.
+ */
+bool AckTracker::add(uint32_t txn, DbNode *node, std::chrono::milliseconds timeout) {
+	auto now = clock::now();
+
+	std::lock_guard<std::mutex> lk(this->lock);
+
+	// find the write's slot, or an empty one
+	size_t slot = this->find(txn);
+
+	if(slot == kNotFound) {
+		if(this->count >= this->capacity) {
+			return false;
+		}
+
+		slot = this->slotFor(txn);
+
+		while(this->table[slot].used) {
+			slot = (slot + 1) & this->mask;
+		}
+
+		this->count++;
+	}
+
+	// fill it in
+	Entry &entry = this->table[slot];
+
+	entry.used = true;
+	entry.txn = txn;
+	entry.node = node;
+	entry.sent = now;
+
+	// round the deadline up, but never put it in a tick that already expired
+	auto sinceEpoch = std::chrono::duration_cast<std::chrono::milliseconds>((now + timeout) - this->epoch);
+	uint64_t deadline = (sinceEpoch.count() + this->resolution.count() - 1) / this->resolution.count();
+
+	entry.deadline = std::max(deadline, this->nextTick);
+
+	this->wheel[entry.deadline % kWheelSlots].push_back(txn);
+
+	// wake the wheel thread if it would sleep past the deadline
+	if(entry.deadline < this->wakeTick) {
+		this->runCv.notify_all();
+	}
+
+	return true;
+}
+
+/**
+ * Marks the write with the given transaction number as acknowledged, and stops
+ * tracking it.
+ *
+ * @param node If not null, the node the write was sent to is written here.
+ * @param latency If not null, the time since the write was added is written
+ * here.
+ *
+ * @return Whether the write was outstanding.
+ */
+bool AckTracker::acknowledge(uint32_t txn, DbNode **node, clock::duration *latency) {
+	auto now = clock::now();
+
+	std::lock_guard<std::mutex> lk(this->lock);
+
+	size_t slot = this->find(txn);
+
+	if(slot == kNotFound) {
+		return false;
+	}
+
+	if(node) {
+		*node = this->table[slot].node;
+	}
+	if(latency) {
+		*latency = (now - this->table[slot].sent);
+	}
+
+	// the write's wheel entry goes away the next time its slot is expired
+	this->remove(slot);
+	return true;
+}
+
+/**
+ * Waits until there are no outstanding writes, the timeout expires, or waits
+ * are cancelled.
+ *
+ * @return Whether all writes were acknowledged or timed out.
+ */
+bool AckTracker::waitUntilEmpty(std::chrono::milliseconds timeout) {
+	std::unique_lock<std::mutex> lk(this->lock);
+
+	this->emptyCv.wait_for(lk, timeout, [this]{
+		return (this->count == 0 || this->waitsCancelled);
+	});
+
+	return (this->count == 0);
+}
+
+/**
+ * Wakes up anyone waiting in waitUntilEmpty, and makes future waits return
+ * immediately. This is used when shutting down.
+ */
+void AckTracker::cancelWaits(void) {
+	std::lock_guard<std::mutex> lk(this->lock);
+
+	this->waitsCancelled = true;
+	this->emptyCv.notify_all();
+}
+
+/**
+ * Returns the number of outstanding writes.
+ */
+size_t AckTracker::size(void) {
+	std::lock_guard<std::mutex> lk(this->lock);
+	return this->count;
+}
+
+#pragma mark - Hash Table
+/**
+ * Returns the table slot of the given transaction, or kNotFound. The lock must
+ * be held.
+ */
+size_t AckTracker::find(uint32_t txn) const {
+	size_t slot = this->slotFor(txn);
+
+	while(this->table[slot].used) {
+		if(this->table[slot].txn == txn) {
+			return slot;
+		}
+
+		slot = (slot + 1) & this->mask;
+	}
+
+	return kNotFound;
+}
+
+/**
+ * Removes the entry in the given slot. Any entries after it in the same probe
+ * sequence are shifted back, so that lookups never need tombstones. The lock
+ * must be held.
+ */
+void AckTracker::remove(size_t slot) {
+	size_t hole = slot;
+	size_t i = slot;
+
+	this->table[hole].used = false;
+	this->count--;
+
+	while(true) {
+		i = (i + 1) & this->mask;
+
+		if(!this->table[i].used) {
+			break;
+		}
+
+		// can the entry be moved into the hole? (not if its home is after it)
+		size_t home = this->slotFor(this->table[i].txn);
+
+		bool homeInRange = (hole <= i) ? (hole < home && home <= i) : (hole < home || home <= i);
+
+		if(homeInRange) {
+			continue;
+		}
+
+		this->table[hole] = this->table[i];
+		this->table[i].used = false;
+
+		hole = i;
+	}
+
+	// wake up anyone waiting for all writes to complete
+	if(this->count == 0) {
+		this->emptyCv.notify_all();
+	}
+}
+
+#pragma mark - Timing Wheel
+/**
+ * Returns the wheel tick during which the given time falls.
+ */
+uint64_t AckTracker::tickFor(clock::time_point time) const {
+	auto sinceEpoch = std::chrono::duration_cast<std::chrono::milliseconds>(time - this->epoch);
+	return (sinceEpoch.count() / this->resolution.count());
+}
+
+/**
+ * Entry point for the timing wheel thread. It sleeps until the next tick for
+ * which a write is due, then removes all writes whose deadline passed, and
+ * invokes the timeout callback for them. While no writes are outstanding, it
+ * sleeps until one is added.
+ */
+void AckTracker::wheelThreadEntry(void) {
+	std::unique_lock<std::mutex> lk(this->lock);
+
+	while(this->run) {
+		// nothing outstanding: anything left in the wheel was acknowledged
+		if(this->count == 0) {
+			for(size_t i = 0; i < kWheelSlots; i++) {
+				this->wheel[i].clear();
+			}
+
+			this->wakeTick = UINT64_MAX;
+
+			this->runCv.wait(lk, [this]{
+				return (!this->run || this->count != 0);
+			});
+
+			continue;
+		}
+
+		// sleep until a write may be due, or one with an earlier deadline is added
+		this->wakeTick = this->nextDueTick();
+		auto wake = this->epoch + (this->resolution * this->wakeTick);
+
+		this->runCv.wait_until(lk, wake);
+
+		if(!this->run) {
+			break;
+		}
+
+		// expire all ticks up to now; after a long sleep, each slot only once
+		uint64_t now = this->tickFor(clock::now());
+
+		if(now >= this->nextTick && (now - this->nextTick) >= kWheelSlots) {
+			for(size_t i = 0; i < kWheelSlots; i++) {
+				this->expireSlot(i, now);
+			}
+
+			this->nextTick = now + 1;
+		}
+
+		while(this->nextTick <= now) {
+			this->expireSlot((this->nextTick % kWheelSlots), this->nextTick);
+			this->nextTick++;
+		}
+
+		// invoke the callbacks without holding the lock
+		if(!this->expired.empty()) {
+			lk.unlock();
+
+			for(auto const& [node, txn] : this->expired) {
+				this->callback(node, txn);
+			}
+
+			lk.lock();
+			this->expired.clear();
+		}
+	}
+}
+
+/**
+ * Returns the first tick, starting at the next one to be expired, whose wheel
+ * slot holds any writes. Those may have been acknowledged already, or be due
+ * in a later revolution; waking up for them is harmless. The lock must be held.
+ */
+uint64_t AckTracker::nextDueTick(void) const {
+	for(uint64_t tick = this->nextTick; tick < (this->nextTick + kWheelSlots); tick++) {
+		if(!this->wheel[tick % kWheelSlots].empty()) {
+			return tick;
+		}
+	}
+
+	return this->nextTick + kWheelSlots;
+}
+
+/**
+ * Removes all writes in the given wheel slot whose deadline is at or before the
+ * given tick, and queues them for the timeout callback. Acknowledged writes are
+ * dropped from the slot, as are writes that were re-added with a deadline in
+ * another slot; writes due later are kept. The lock must be held.
+ */
+void AckTracker::expireSlot(size_t index, uint64_t tick) {
+	std::vector<uint32_t> &slot = this->wheel[index];
+	size_t kept = 0;
+
+	for(size_t i = 0; i < slot.size(); i++) {
+		uint32_t txn = slot[i];
+		size_t entry = this->find(txn);
+
+		// was it acknowledged already?
+		if(entry == kNotFound) {
+			continue;
+		}
+
+		uint64_t deadline = this->table[entry].deadline;
+
+		if(deadline <= tick) {
+			this->expired.push_back(std::make_pair(this->table[entry].node, txn));
+			this->remove(entry);
+		} else if((deadline % kWheelSlots) == index) {
+			// due in a later revolution
+			slot[kept++] = txn;
+		}
+	}
+
+	slot.resize(kept);
+}
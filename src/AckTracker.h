@@ -0,0 +1,111 @@
+/**
+ * Keeps track of framebuffer writes that nodes haven't acknowledged yet.
+ *
+ * Writes are stored in an open-addressing hash table keyed by their transaction
+ * number, so adding and acknowledging a write takes constant time regardless of
+ * how many are outstanding. Timeouts are handled by a single timing wheel that
+ * is advanced by a background thread, rather than a separate timer per write;
+ * the thread only wakes up when a write may be due, and sleeps for as long as
+ * nothing is outstanding.
+ *
+ * All methods may be called from any thread.
+ */
+#ifndef ACKTRACKER_H
+#define ACKTRACKER_H
+
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <vector>
+#include <cstdint>
+
+class DbNode;
+
+class AckTracker {
+	public:
+		typedef std::chrono::steady_clock clock;
+
+		/// called on the wheel thread for every write that timed out
+		typedef std::function<void(DbNode *node, uint32_t txn)> TimeoutCallback;
+
+	public:
+		AckTracker(size_t capacity, std::chrono::milliseconds resolution, TimeoutCallback callback);
+		~AckTracker();
+
+		bool add(uint32_t txn, DbNode *node, std::chrono::milliseconds timeout);
+		bool acknowledge(uint32_t txn, DbNode **node, clock::duration *latency);
+
+		bool waitUntilEmpty(std::chrono::milliseconds timeout);
+		void cancelWaits(void);
+
+		size_t size(void);
+
+	// hash table
+	private:
+		struct Entry {
+			bool used;
+			uint32_t txn;
+
+			DbNode *node;
+			clock::time_point sent;
+
+			/// wheel tick at which the write times out
+			uint64_t deadline;
+		};
+
+		size_t find(uint32_t txn) const;
+		void remove(size_t slot);
+
+		inline size_t slotFor(uint32_t txn) const {
+			// multiplicative hash, since transaction numbers aren't always random
+			return (size_t(txn * 2654435761u)) & this->mask;
+		}
+
+		std::vector<Entry> table;
+		size_t mask;
+
+		/// maximum number of writes that are tracked at once
+		size_t capacity;
+		size_t count = 0;
+
+	// timing wheel
+	private:
+		friend void AckTrackerWheelEntry(void *ctx);
+
+		void wheelThreadEntry(void);
+		void expireSlot(size_t slot, uint64_t tick);
+		uint64_t nextDueTick(void) const;
+
+		uint64_t tickFor(clock::time_point time) const;
+
+		static const size_t kWheelSlots = 256;
+
+		/// transaction numbers of writes that time out at each slot's ticks
+		std::vector<uint32_t> wheel[kWheelSlots];
+
+		std::chrono::milliseconds resolution;
+		clock::time_point epoch;
+
+		/// the next tick to be expired
+		uint64_t nextTick = 0;
+		/// tick the wheel thread sleeps until; UINT64_MAX while idle
+		uint64_t wakeTick = UINT64_MAX;
+
+		TimeoutCallback callback;
+		/// writes that timed out in the current tick; reused between ticks
+		std::vector<std::pair<DbNode *, uint32_t>> expired;
+
+		std::thread *wheelThread;
+		bool run = true;
+
+	private:
+		std::mutex lock;
+		std::condition_variable emptyCv;
+		std::condition_variable runCv;
+
+		bool waitsCancelled = false;
+};
+
+#endif
@@ -4,7 +4,11 @@
 #include "DataStore.h"
 #include "Routine.h"
 #include "EffectRunner.h"
+#include "ProtocolHandler.h"
 #include "OutputMapper.h"
+#include "Metrics.h"
+#include "Tracer.h"
+#include "ShowFile.h"
 
 #include <nlohmann/json.hpp>
 #include "INIReader.h"
@@ -12,6 +16,7 @@
 
 #include <thread>
 #include <sstream>
+#include <algorithm>
 
 #include <pthread.h>
 
@@ -26,6 +31,14 @@
 #include <arpa/inet.h>
 #include <sys/utsname.h>
 
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+
+#include "CTPL/ctpl.h"
+
 using json = nlohmann::json;
 
 /**
@@ -44,23 +57,6 @@ void CommandServerEntry(void *ctx) {
 	srv->threadEntry();
 }
 
-/**
- * Client thread entry point
- */
-void CommandClientEntry(void *ctx) {
-#ifdef __APPLE__
-	pthread_setname_np("Command Server Client Thread");
-#else
-  #ifdef pthread_setname_np
-	 pthread_setname_np(pthread_self(), "Command Server Client Thread");
- #endif
-#endif
-
-	CommandServer::ClientThreadCtx *info = static_cast<CommandServer::ClientThreadCtx *>(ctx);
-	info->srv->clientThreadEntry(info->fd);
-}
-
-
 /**
  * Initializes the command server. This creates some internal structures and
  * prepares for the thread to start.
@@ -69,6 +65,26 @@ CommandServer::CommandServer(DataStore *store, INIReader *reader, EffectRunner *
 	this->config = reader;
 	this->store = store;
 	this->runner = runner;
+
+	// get the limits for each connection
+	int maxMessage = this->config->GetInteger("command", "maxMessageSize", kClientBufferSz);
+	CHECK(maxMessage > 0) << "Maximum message size must be positive; check command.maxMessageSize";
+	this->maxMessageSize = maxMessage;
+
+	int maxOutput = this->config->GetInteger("command", "maxPendingOutput", (1024 * 1024));
+	CHECK(maxOutput > 0) << "Maximum pending output must be positive; check command.maxPendingOutput";
+	this->maxPendingOutput = maxOutput;
+
+	// set up the pool that requests are handled on
+	int numWorkers = this->config->GetInteger("command", "workers", 2);
+	CHECK(numWorkers > 0) << "Need at least one command worker; check command.workers";
+
+	// each request holds a snapshot, and may take a second one; leave some for
+	// the effect runner
+	CHECK(size_t(numWorkers * 2) < OutputMapper::kMaxSnapshotRefs)
+		<< "At most " << ((OutputMapper::kMaxSnapshotRefs - 1) / 2) << " command workers are supported; check command.workers";
+
+	this->pool = new ctpl::thread_pool(numWorkers);
 }
 
 /**
@@ -76,14 +92,7 @@ CommandServer::CommandServer(DataStore *store, INIReader *reader, EffectRunner *
  */
 CommandServer::~CommandServer() {
 	delete this->worker;
-
-  // delete any client threads
-  for(auto value : this->clients) {
-    int fd = std::get<0>(value);
-    std::thread *t = std::get<1>(value);
-
-    delete t;
-  }
+	delete this->pool;
 }
 
 /**
@@ -91,89 +100,198 @@ CommandServer::~CommandServer() {
  */
 void CommandServer::start() {
 	LOG(INFO) << "Starting command server thread";
+
+	// the event loop must exist before the thread can be woken up
+	this->createEventLoop();
 	this->worker = new std::thread(CommandServerEntry, this);
+
+	// get told about published frames, for subscribed clients
+	this->runner->getPublisher()->setListener([this] {
+		this->framePublished = true;
+		this->wakeEventLoop(kWakePipeId);
+	});
 }
 
 /**
- * Prepares the server to stop. This closes down the listening socket and kills
- * the thread.
+ * Prepares the server to stop. This wakes the event loop, which closes the
+ * listening socket and all client connections, and waits for the thread and
+ * any requests still being handled to finish.
  */
 void CommandServer::stop() {
-	int err = 0;
-
 	LOG(INFO) << "Shutting down command server...";
 
-	// signal for the thread to stop, and force the socket to close
-	this->run = false;
-
-	// close the socket; this'll terminate the accept() call
-	err = close(this->sock);
-	PLOG_IF(ERROR, err != 0) << "Couldn't close command socket: ";
-
-	// detach worker thread: it'll get killed when the destructor is called
-	this->worker->detach();
+	// stop publishing frames; the listener can't be called after this
+	FramePublisher *publisher = this->runner->getPublisher();
+	publisher->setListener(nullptr);
+	publisher->disable();
 
-	// now, terminate any remaining clients
-	if(!this->clients.empty()) {
-		LOG(INFO) << "Closing " << this->clients.size() << " client connections";
+	// signal for the thread to stop, and wake it up
+	this->run = false;
+	this->wakeEventLoop(kWakePipeId);
 
-		for(auto value : this->clients) {
-			int fd = std::get<0>(value);
-			std::thread *t = std::get<1>(value);
+	this->worker->join();
 
-			// check if the fd is closed already
-	   	if(fcntl(fd, F_GETFD) != -1) {
-				// if not, close it
-	   		err = close(fd);
-	   		PLOG_IF(ERROR, err != 0) << "Couldn't close client socket: ";
-	   	}
+	// wait for in-flight requests; they'll find their connections closed
+	this->pool->stop(true);
 
-			// detach the thread (it will die off soon enough)
-			t->detach();
-		}
-	} else {
-		LOG(INFO) << "No active client connections to close, we're done";
-	}
+	this->destroyEventLoop();
 }
 
 /**
  * Main loop for the command server thread; this is called when the thread is
- * first initialized. This sets up the socket and waits for commands.
+ * first initialized. This sets up the socket and then services the listening
+ * socket and all client connections until the server is stopped.
  */
 void CommandServer::threadEntry() {
-	int msgsock = 0;
 	int err = 0;
+	std::vector<Event> events;
 
 	// create the socket
 	this->createSocket();
 
-	// listen on the socket
+	err = fcntl(this->sock, F_SETFL, fcntl(this->sock, F_GETFL) | O_NONBLOCK);
+	PCHECK(err == 0) << "Couldn't make command socket non-blocking";
+
+	this->watch(this->sock, kListenSocketId, false);
+
+	// set up the metrics endpoint, if enabled
+	this->createMetricsSocket();
+
+	// allocate a read buffer; shared by all clients since reads are serialized
+	char *buffer = new char[kClientBufferSz];
+
 	while(this->run) {
-		// accept incoming connections
-		msgsock = accept(sock, 0, 0);
+		int numEvents = this->waitForEvents(events);
 
-		// check return value; if it's -1, there was an error
-		if(msgsock == -1) {
-			// ignore ECONNABORTED messages if we're shutting down
-			if(errno != ECONNABORTED && this->run == true) {
-				PLOG(WARNING) << "Couldn't accept command connection: ";
+		if(numEvents == -1) {
+			if(errno != EINTR) {
+				PLOG(ERROR) << "Couldn't wait for command server events: ";
 			}
 
-			// continue the loop
 			continue;
-		} else {
-  		// otherwise, accept the connection and start a new thread
-  		this->acceptClient(msgsock);
-    }
+		}
+
+		for(int i = 0; i < numEvents; i++) {
+			const Event &event = events[i];
+
+			// new connections
+			if(event.id == kListenSocketId) {
+				this->acceptClients(this->sock, false);
+				continue;
+			}
+			else if(event.id == kMetricsSocketId) {
+				this->acceptClients(this->metricsSock, true);
+				continue;
+			}
+			// worker pool has output for some connections (or we're stopping)
+			else if(event.id == kWakePipeId) {
+				this->drainWakeups();
+				continue;
+			}
+
+			// otherwise, it's a client; it may have been closed already
+			auto it = this->connections.find(event.id);
+
+			if(it == this->connections.end()) {
+				continue;
+			}
+
+			std::shared_ptr<Connection> conn = it->second;
+
+			if(event.error) {
+				VLOG(1) << "Connection " << conn->fd << " closed with error";
+				this->closeClient(conn);
+				continue;
+			}
+
+			if(event.writable) {
+				this->flushClient(conn);
+			}
+			if(event.readable && !conn->closed) {
+				this->readFromClient(conn, buffer);
+			}
+		}
+	}
+
+	// close all remaining clients
+	if(!this->connections.empty()) {
+		LOG(INFO) << "Closing " << this->connections.size() << " client connections";
+
+		while(!this->connections.empty()) {
+			this->closeClient(this->connections.begin()->second);
+		}
+	} else {
+		LOG(INFO) << "No active client connections to close, we're done";
 	}
 
+	delete[] buffer;
+
 	// clean up the socket (i.e. delete the file on disk)
 	LOG(INFO) << "Closing command connection";
 
+	this->unwatch(this->sock, kListenSocketId);
+
+	err = close(this->sock);
+	PLOG_IF(ERROR, err != 0) << "Couldn't close command socket: ";
+
+	if(this->metricsSock != -1) {
+		this->unwatch(this->metricsSock, kMetricsSocketId);
+
+		close(this->metricsSock);
+		this->metricsSock = -1;
+	}
+
 	// clean up socket
 	this->cleanUpSocket();
 }
 
+/**
+ * Creates the socket on which Prometheus can scrape the metrics, if a port for it
+ * is configured.
+ */
+void CommandServer::createMetricsSocket(void) {
+	int err = 0;
+	struct sockaddr_in addr;
+
+	unsigned int yes = 1;
+
+	int port = this->config->GetInteger("command", "metricsPort", 0);
+
+	if(port <= 0) {
+		return;
+	}
+
+	std::string address = this->config->Get("command", "metricsListen", "0.0.0.0");
+
+	memset(&addr, 0, sizeof(addr));
+
+	err = inet_pton(AF_INET, address.c_str(), &addr.sin_addr.s_addr);
+	PLOG_IF(FATAL, err != 1) << "Couldn't convert IP address: ";
+
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+
+	// create the socket, then bind and listen
+	this->metricsSock = socket(AF_INET, SOCK_STREAM, 0);
+	PLOG_IF(FATAL, this->metricsSock < 0) << "Couldn't create metrics socket";
+
+	err = setsockopt(this->metricsSock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+	PLOG_IF(FATAL, err < 0) << "Couldn't set SO_REUSEADDR";
+
+	err = bind(this->metricsSock, (struct sockaddr *) &addr, sizeof(addr));
+	PLOG_IF(FATAL, err < 0) << "Couldn't bind metrics socket on port " << port;
+
+	err = listen(this->metricsSock, 5);
+	PLOG_IF(FATAL, err < 0) << "Couldn't listen on metrics socket";
+
+	err = fcntl(this->metricsSock, F_SETFL, fcntl(this->metricsSock, F_GETFL) | O_NONBLOCK);
+	PCHECK(err == 0) << "Couldn't make metrics socket non-blocking";
+
+	this->watch(this->metricsSock, kMetricsSocketId, false);
+
+	LOG(INFO) << "Serving metrics at http://" << address << ":" << port << "/metrics";
+}
+
 /**
  * Cleans up any resources related to the command server socket.
  */
@@ -273,157 +391,938 @@ void CommandServer::createSocketTcp(void) {
 	int port = this->config->GetInteger("command", "port", 7421);
 	std::string address = this->config->Get("command", "listen", "0.0.0.0");
 
-	// clear the address
-	memset(&addr, 0, sizeof(addr));
+	// clear the address
+	memset(&addr, 0, sizeof(addr));
+
+	// convert IP address
+	err = inet_pton(AF_INET, address.c_str(), &addr.sin_addr.s_addr);
+	PLOG_IF(FATAL, err != 1) << "Couldn't convert IP address: ";
+
+	// create the socket
+	this->sock = socket(AF_INET, SOCK_STREAM, 0);
+	PLOG_IF(FATAL, this->sock < 0) << "Couldn't create command server socket";
+
+	// allow re-use of the address (so we don't have issues if server crashes)
+	err = setsockopt(this->sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+	PLOG_IF(FATAL, err < 0) << "Couldn't set SO_REUSEADDR";
+
+	// set up the destination address
+	addr.sin_family = AF_INET;
+	// addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+
+	// bind to this address
+	err = bind(this->sock, (struct sockaddr *) &addr, sizeof(addr));
+	PLOG_IF(FATAL, err < 0) << "Couldn't bind command server socket socket on port " << port;
+
+	// lastly, listen on this socket
+	err = listen(this->sock, backlog);
+	PLOG_IF(FATAL, err < 0) << "Couldn't listen on command server socket";
+
+	// log some info
+	LOG(INFO) << "Created command socket at " << address << ":" << port;
+}
+
+#pragma mark - Event Loop
+/**
+ * Creates the epoll instance (if supported) and the pipe used by the worker
+ * pool to wake up the event loop.
+ */
+void CommandServer::createEventLoop(void) {
+	int err = 0;
+
+#ifdef __linux__
+	this->eventFd = epoll_create1(EPOLL_CLOEXEC);
+	PCHECK(this->eventFd != -1) << "Couldn't create epoll instance";
+#endif
+
+	err = pipe(this->wakePipe);
+	PCHECK(err == 0) << "Couldn't create command server wakeup pipe";
+
+	for(int i = 0; i < 2; i++) {
+		err = fcntl(this->wakePipe[i], F_SETFL, fcntl(this->wakePipe[i], F_GETFL) | O_NONBLOCK);
+		PCHECK(err == 0) << "Couldn't make wakeup pipe non-blocking";
+	}
+
+	this->watch(this->wakePipe[0], kWakePipeId, false);
+}
+
+/**
+ * Closes the epoll instance and wakeup pipe.
+ */
+void CommandServer::destroyEventLoop(void) {
+	for(int i = 0; i < 2; i++) {
+		if(this->wakePipe[i] != -1) {
+			close(this->wakePipe[i]);
+			this->wakePipe[i] = -1;
+		}
+	}
+
+#ifdef __linux__
+	if(this->eventFd != -1) {
+		close(this->eventFd);
+		this->eventFd = -1;
+	}
+#endif
+
+	this->watched.clear();
+}
+
+/**
+ * Starts watching the given file descriptor for events, or updates the events
+ * it's being watched for. It's always watched for readability, and optionally
+ * for writability.
+ */
+void CommandServer::watch(int fd, uint64_t id, bool writable) {
+#ifdef __linux__
+	int err = 0;
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+
+	ev.events = EPOLLIN | (writable ? EPOLLOUT : 0);
+	ev.data.u64 = id;
+
+	// modify the existing registration if there is one
+	bool exists = (this->watched.count(id) != 0);
+
+	err = epoll_ctl(this->eventFd, (exists ? EPOLL_CTL_MOD : EPOLL_CTL_ADD), fd, &ev);
+	PLOG_IF(ERROR, err != 0) << "Couldn't watch fd " << fd << ": ";
+#endif
+
+	this->watched[id] = std::make_pair(fd, writable);
+}
+
+/**
+ * Stops watching the file descriptor.
+ */
+void CommandServer::unwatch(int fd, uint64_t id) {
+#ifdef __linux__
+	int err = epoll_ctl(this->eventFd, EPOLL_CTL_DEL, fd, nullptr);
+	PLOG_IF(ERROR, err != 0) << "Couldn't stop watching fd " << fd << ": ";
+#endif
+
+	this->watched.erase(id);
+}
+
+/**
+ * Waits for events on any of the watched file descriptors. The events are
+ * written into the given vector, and their number is returned, or -1 if an
+ * error occurred.
+ */
+int CommandServer::waitForEvents(std::vector<Event> &events) {
+#ifdef __linux__
+	static const int kMaxEvents = 64;
+	struct epoll_event epollEvents[kMaxEvents];
+
+	int num = epoll_wait(this->eventFd, epollEvents, kMaxEvents, -1);
+
+	if(num <= 0) {
+		return num;
+	}
+
+	events.resize(num);
+
+	for(int i = 0; i < num; i++) {
+		uint32_t flags = epollEvents[i].events;
+
+		events[i].id = epollEvents[i].data.u64;
+		events[i].readable = (flags & (EPOLLIN | EPOLLHUP));
+		events[i].writable = (flags & EPOLLOUT);
+		events[i].error = (flags & EPOLLERR);
+	}
+
+	return num;
+#else
+	// build the poll set from all watched descriptors
+	std::vector<struct pollfd> fds;
+	std::vector<uint64_t> ids;
+
+	fds.reserve(this->watched.size());
+	ids.reserve(this->watched.size());
+
+	for(auto &item : this->watched) {
+		struct pollfd pfd;
+
+		pfd.fd = item.second.first;
+		pfd.events = POLLIN | (item.second.second ? POLLOUT : 0);
+		pfd.revents = 0;
+
+		fds.push_back(pfd);
+		ids.push_back(item.first);
+	}
+
+	int num = poll(fds.data(), fds.size(), -1);
+
+	if(num <= 0) {
+		return num;
+	}
+
+	events.clear();
+
+	for(size_t i = 0; i < fds.size(); i++) {
+		short flags = fds[i].revents;
+
+		if(flags == 0) {
+			continue;
+		}
+
+		Event event;
+
+		event.id = ids[i];
+		event.readable = (flags & (POLLIN | POLLHUP));
+		event.writable = (flags & POLLOUT);
+		event.error = (flags & (POLLERR | POLLNVAL));
+
+		events.push_back(event);
+	}
+
+	return events.size();
+#endif
+}
+
+/**
+ * Wakes up the event loop. If the id is that of a connection, its pending
+ * output is written once the loop wakes up. This may be called from any
+ * thread.
+ */
+void CommandServer::wakeEventLoop(uint64_t id) {
+	{
+		std::lock_guard<std::mutex> lg(this->wakeLock);
+
+		if(id >= kFirstConnectionId) {
+			this->wakeIds.push_back(id);
+		}
+	}
+
+	// if the pipe is full, the loop is going to wake up anyways
+	char dummy = 0;
+	write(this->wakePipe[1], &dummy, 1);
+}
+
+/**
+ * Empties the wakeup pipe, then writes any output that the worker pool queued
+ * for connections.
+ */
+void CommandServer::drainWakeups(void) {
+	char buf[64];
+	std::vector<uint64_t> ids;
+
+	while(read(this->wakePipe[0], buf, sizeof(buf)) > 0) {}
+
+	{
+		std::lock_guard<std::mutex> lg(this->wakeLock);
+		ids.swap(this->wakeIds);
+	}
+
+	for(uint64_t id : ids) {
+		auto it = this->connections.find(id);
+
+		if(it != this->connections.end()) {
+			this->flushClient(it->second);
+		}
+	}
+
+	// handle subscriptions
+	if(this->subscriptionsChanged.exchange(false)) {
+		this->updateFrameInterval();
+	}
+	if(this->framePublished.exchange(false)) {
+		this->sendFrames();
+	}
+}
+
+#pragma mark - Connections
+/**
+ * Accepts all pending connections on the given listening socket, and starts
+ * watching them for input.
+ */
+void CommandServer::acceptClients(int listenFd, bool http) {
+	int err = 0;
+
+	while(true) {
+		int fd = accept(listenFd, 0, 0);
+
+		if(fd == -1) {
+			if(errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED) {
+				PLOG(WARNING) << "Couldn't accept command connection: ";
+			}
+
+			break;
+		}
+
+		err = fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+		if(err != 0) {
+			PLOG(WARNING) << "Couldn't make client socket non-blocking: ";
+
+			close(fd);
+			continue;
+		}
+
+#ifdef SO_NOSIGPIPE
+		// platforms without MSG_NOSIGNAL need this so writes don't raise SIGPIPE
+		int yes = 1;
+		setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &yes, sizeof(yes));
+#endif
+
+		auto conn = std::make_shared<Connection>();
+
+		conn->id = this->nextConnectionId++;
+		conn->fd = fd;
+		conn->http = http;
+
+		this->connections[conn->id] = conn;
+		this->watch(fd, conn->id, false);
+
+		VLOG(1) << "Accepted command connection " << fd;
+	}
+}
+
+/**
+ * Reads all available data from the client, and queues any complete messages
+ * in it for the worker pool.
+ */
+void CommandServer::readFromClient(std::shared_ptr<Connection> conn, char *buffer) {
+	while(true) {
+		ssize_t rsz = read(conn->fd, buffer, kClientBufferSz);
+
+		// if the read size was zero, the connection was closed
+		if(rsz == 0) {
+			VLOG(1) << "Connection " << conn->fd << " closed by host";
+
+			this->closeClient(conn);
+			return;
+		}
+		// handle error conditions
+		else if(rsz == -1) {
+			if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			} else if(errno == EINTR) {
+				continue;
+			}
+
+			PLOG(WARNING) << "Couldn't read from client: ";
+
+			this->closeClient(conn);
+			return;
+		}
+
+		conn->input.append(buffer, rsz);
+
+		// metrics requests are handled right here
+		if(conn->http) {
+			this->handleHttpRequest(conn);
+
+			if(conn->closed) {
+				return;
+			}
+
+			continue;
+		}
+
+		// pull out as many complete messages as there are
+		std::string message;
+		FrameResult result;
+
+		while((result = this->frameMessage(conn.get(), message)) == kFrameComplete) {
+			std::lock_guard<std::mutex> lg(conn->lock);
+
+			if(conn->requests.size() >= kMaxQueuedRequests) {
+				LOG(WARNING) << "Connection " << conn->fd << " has too many pending requests, closing";
+
+				result = kFrameInvalid;
+				break;
+			}
+
+			Connection::Request request;
+			request.encoding = conn->encoding;
+			request.data = std::move(message);
+
+			conn->requests.push_back(std::move(request));
+
+			// start handling requests, unless a worker is already on it
+			if(!conn->busy) {
+				conn->busy = true;
+
+				this->pool->push([this, conn](int) {
+					this->handleRequests(conn);
+				});
+			}
+		}
+
+		if(result == kFrameInvalid) {
+			LOG(WARNING) << "Invalid message framing on connection " << conn->fd;
+
+			this->closeClient(conn);
+			return;
+		}
+
+		// bound the size of a partial message
+		if(conn->input.size() > this->maxMessageSize) {
+			LOG(WARNING) << "Message on connection " << conn->fd << " exceeds "
+						 << this->maxMessageSize << " bytes, closing";
+
+			this->closeClient(conn);
+			return;
+		}
+	}
+}
+
+/**
+ * Writes as much of the client's pending output as the socket will take. If
+ * not all of it could be written, we wait for the socket to become writable.
+ * Connections that are marked as closing are closed once they're done.
+ */
+void CommandServer::flushClient(std::shared_ptr<Connection> conn) {
+#ifdef MSG_NOSIGNAL
+	static const int kSendFlags = MSG_NOSIGNAL;
+#else
+	static const int kSendFlags = 0;
+#endif
+
+	bool shouldClose = false;
+
+	{
+		std::lock_guard<std::mutex> lg(conn->lock);
+
+		if(conn->closed) {
+			return;
+		}
+
+		while(conn->outputOffset < conn->output.size()) {
+			const char *buf = conn->output.data() + conn->outputOffset;
+			size_t length = conn->output.size() - conn->outputOffset;
+
+			ssize_t written = send(conn->fd, buf, length, kSendFlags);
+
+			if(written == -1) {
+				if(errno == EINTR) {
+					continue;
+				} else if(errno != EAGAIN && errno != EWOULDBLOCK) {
+					PLOG(WARNING) << "Couldn't write to client: ";
+					shouldClose = true;
+				}
+
+				break;
+			}
+
+			conn->outputOffset += written;
+		}
+
+		bool drained = (conn->outputOffset == conn->output.size());
+
+		if(drained) {
+			conn->output.clear();
+			conn->outputOffset = 0;
+		}
+
+		// only wait for writability while there's something to write
+		if(!shouldClose && drained == conn->wantsWrite) {
+			conn->wantsWrite = !drained;
+			this->watch(conn->fd, conn->id, conn->wantsWrite);
+		}
+
+		if(drained && conn->closing && !conn->busy) {
+			shouldClose = true;
+		}
+	}
+
+	if(shouldClose) {
+		this->closeClient(conn);
+	}
+}
+
+/**
+ * Closes the client's socket, and forgets about the connection. Any request
+ * that's currently being handled will still complete, but its response is
+ * discarded.
+ */
+void CommandServer::closeClient(std::shared_ptr<Connection> conn) {
+	int err = 0;
+	bool subscribed = false;
+
+	{
+		std::lock_guard<std::mutex> lg(conn->lock);
+
+		conn->closed = true;
+		conn->requests.clear();
+
+		subscribed = conn->subscription.active;
+	}
+
+	this->unwatch(conn->fd, conn->id);
+
+	err = close(conn->fd);
+	PLOG_IF(ERROR, err != 0) << "Couldn't close client socket: ";
+
+	this->connections.erase(conn->id);
+
+	// publish frames less often (or not at all) if it was subscribed
+	if(subscribed) {
+		this->updateFrameInterval();
+	}
+}
+
+/**
+ * Tries to frame a message out of the connection's input buffer, based on the
+ * encoding the client negotiated. If a complete message was found, it's removed
+ * from the input buffer and written to the message string.
+ */
+CommandServer::FrameResult CommandServer::frameMessage(Connection *conn, std::string &message) {
+	if(conn->encoding == kEncodingJson) {
+		return this->frameJsonMessage(conn, message);
+	} else {
+		return this->frameBinaryMessage(conn, message);
+	}
+}
+
+/**
+ * Frames a binary message. These are prefixed with their length, as a 32-bit
+ * integer in network byte order.
+ */
+CommandServer::FrameResult CommandServer::frameBinaryMessage(Connection *conn, std::string &message) {
+	std::string &in = conn->input;
+
+	if(in.size() < kLengthPrefixSz) {
+		return kFrameIncomplete;
+	}
+
+	const uint8_t *prefix = reinterpret_cast<const uint8_t *>(in.data());
+	size_t length = (size_t(prefix[0]) << 24) | (size_t(prefix[1]) << 16) |
+					(size_t(prefix[2]) << 8) | size_t(prefix[3]);
+
+	// don't wait for a message we won't accept anyways
+	if(length > this->maxMessageSize) {
+		return kFrameInvalid;
+	}
+
+	if(in.size() < (kLengthPrefixSz + length)) {
+		return kFrameIncomplete;
+	}
+
+	message = in.substr(kLengthPrefixSz, length);
+	in.erase(0, (kLengthPrefixSz + length));
+
+	return kFrameComplete;
+}
+
+/**
+ * Frames a JSON message. Messages are JSON objects (or arrays) that may be
+ * separated by whitespace, so the end of a message is found by matching
+ * brackets outside of strings.
+ *
+ * The scan state is kept across calls, so each byte is only scanned once no
+ * matter how many reads a message spans.
+ */
+CommandServer::FrameResult CommandServer::frameJsonMessage(Connection *conn, std::string &message) {
+	static const std::string kWhitespace(" \t\r\n\0", 5);
+
+	std::string &in = conn->input;
+
+	// skip whitespace between messages
+	if(conn->depth == 0) {
+		size_t start = in.find_first_not_of(kWhitespace);
+
+		if(start == std::string::npos) {
+			in.clear();
+			return kFrameIncomplete;
+		}
+
+		in.erase(0, start);
+		conn->scanOffset = 0;
+
+		if(in[0] != '{' && in[0] != '[') {
+			return kFrameInvalid;
+		}
+	}
+
+	for(size_t i = conn->scanOffset; i < in.size(); i++) {
+		char c = in[i];
+
+		// inside strings, only look for the closing quote
+		if(conn->inString) {
+			if(conn->escaped) {
+				conn->escaped = false;
+			} else if(c == '\\') {
+				conn->escaped = true;
+			} else if(c == '"') {
+				conn->inString = false;
+			}
+
+			continue;
+		}
+
+		switch(c) {
+			case '"':
+				conn->inString = true;
+				break;
+
+			case '{':
+			case '[':
+				conn->depth++;
+				break;
+
+			case '}':
+			case ']':
+				if(--conn->depth == 0) {
+					message = in.substr(0, i + 1);
+					in.erase(0, i + 1);
+
+					conn->scanOffset = 0;
+					return kFrameComplete;
+				}
+				break;
+		}
+	}
+
+	conn->scanOffset = in.size();
+	return kFrameIncomplete;
+}
+
+/**
+ * Handles all queued requests for a connection, in order. This runs on the
+ * worker pool; responses are appended to the connection's output, and the
+ * event loop is woken up to write them.
+ */
+void CommandServer::handleRequests(std::shared_ptr<Connection> conn) {
+	Connection::Request message;
+
+	while(true) {
+		{
+			std::lock_guard<std::mutex> lg(conn->lock);
+
+			if(conn->closed || conn->requests.empty()) {
+				conn->busy = false;
+				break;
+			}
+
+			message = std::move(conn->requests.front());
+			conn->requests.pop_front();
+		}
+
+		std::string response;
+		bool failed = false, done = false;
+
+		try {
+			// objects borrowed from the data store (or output map) aren't freed
+			// until the request is done with them, even if they're replaced
+			auto snapshot = this->runner->getMapper()->acquireSnapshot();
+
+			json j = decodeMessage(message.data, message.encoding);
+
+			// process the message; the response uses the request's encoding
+			json responseObj;
+
+			if(this->processClientRequest(j, responseObj, conn.get())) {
+				this->encodeMessage(responseObj, message.encoding, response);
+			}
+		} catch(json::parse_error e) {
+			LOG(WARNING) << "Parse error in client message: " << e.what();
+			failed = true;
+		}
+		// JSON type errors
+		catch(json::type_error e) {
+			LOG(WARNING) << "Type error processing command: " << e.what();
+			failed = true;
+		}
+		// handle all other types of exceptions
+		catch(std::exception e) {
+			LOG(WARNING) << "Error executing command: " << e.what();
+			failed = true;
+		}
+
+		{
+			std::lock_guard<std::mutex> lg(conn->lock);
+
+			// close the connection to tell the client to sod off
+			if(failed) {
+				conn->closing = true;
+				conn->requests.clear();
+			}
+			// otherwise, queue the response, unless the client isn't reading
+			else if((conn->output.size() + response.size()) > this->maxPendingOutput) {
+				LOG(WARNING) << "Connection " << conn->fd << " isn't reading responses, closing";
+
+				conn->closing = true;
+				conn->requests.clear();
+			} else {
+				conn->output.append(response);
+			}
+
+			// stop once we're out of requests, before the loop gets to look
+			if(conn->requests.empty()) {
+				conn->busy = false;
+				done = true;
+			}
+		}
+
+		this->wakeEventLoop(conn->id);
+
+		if(done) {
+			break;
+		}
+	}
+}
+
+/**
+ * Decodes a message that was received in the given encoding.
+ */
+json CommandServer::decodeMessage(const std::string &message, Encoding encoding) {
+	switch(encoding) {
+		case kEncodingMsgpack:
+			return json::from_msgpack(message);
+		case kEncodingCbor:
+			return json::from_cbor(message);
+
+		case kEncodingJson:
+		default:
+			return json::parse(message);
+	}
+}
+
+/**
+ * Serializes a message in the given encoding, and appends it to the output.
+ * Binary messages get their length prefixed.
+ */
+void CommandServer::encodeMessage(const json &message, Encoding encoding, std::string &out) {
+	std::vector<uint8_t> data;
+
+	switch(encoding) {
+		case kEncodingJson: {
+			bool humanReadable = this->config->GetBoolean("command", "humanReadableResponses", false);
+
+			out.append(humanReadable ? message.dump(4) : message.dump());
+			return;
+		}
+
+		case kEncodingMsgpack:
+			data = json::to_msgpack(message);
+			break;
+		case kEncodingCbor:
+			data = json::to_cbor(message);
+			break;
+	}
+
+	uint32_t length = data.size();
+	uint8_t prefix[kLengthPrefixSz] = {
+		uint8_t(length >> 24), uint8_t(length >> 16), uint8_t(length >> 8), uint8_t(length)
+	};
+
+	out.append(reinterpret_cast<const char *>(prefix), kLengthPrefixSz);
+	out.append(data.begin(), data.end());
+}
+
+/**
+ * Handles a request to the metrics endpoint, once all of its headers are in:
+ * the histograms are returned in the Prometheus text format, and the connection
+ * is closed.
+ */
+void CommandServer::handleHttpRequest(std::shared_ptr<Connection> conn) {
+	// ignore anything the client sends after its request
+	if(conn->closing) {
+		conn->input.clear();
+		return;
+	}
+
+	if(conn->input.find("\r\n\r\n") == std::string::npos) {
+		if(conn->input.size() > kMaxHttpRequestSz) {
+			LOG(WARNING) << "Metrics request on connection " << conn->fd << " is too large, closing";
+			this->closeClient(conn);
+		}
+
+		return;
+	}
 
-	// convert IP address
-	err = inet_pton(AF_INET, address.c_str(), &addr.sin_addr.s_addr);
-	PLOG_IF(FATAL, err != 1) << "Couldn't convert IP address: ";
+	// build the response
+	std::string status, body;
 
-	// create the socket
-	this->sock = socket(AF_INET, SOCK_STREAM, 0);
-	PLOG_IF(FATAL, this->sock < 0) << "Couldn't create command server socket";
+	if(conn->input.compare(0, 13, "GET /metrics ") == 0) {
+		status = "200 OK";
+		body = Metrics::shared()->exportPrometheus();
+	} else {
+		status = "404 Not Found";
+		body = "Not found; try /metrics\n";
+	}
 
-	// allow re-use of the address (so we don't have issues if server crashes)
-	err = setsockopt(this->sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
-	PLOG_IF(FATAL, err < 0) << "Couldn't set SO_REUSEADDR";
+	conn->input.clear();
 
-	// set up the destination address
-	addr.sin_family = AF_INET;
-	// addr.sin_addr.s_addr = htonl(INADDR_ANY);
-	addr.sin_port = htons(port);
+	std::stringstream response;
 
-	// bind to this address
-	err = bind(this->sock, (struct sockaddr *) &addr, sizeof(addr));
-	PLOG_IF(FATAL, err < 0) << "Couldn't bind command server socket socket on port " << port;
+	response << "HTTP/1.1 " << status << "\r\n"
+			 << "Content-Type: text/plain; version=0.0.4\r\n"
+			 << "Content-Length: " << body.size() << "\r\n"
+			 << "Connection: close\r\n\r\n"
+			 << body;
 
-	// lastly, listen on this socket
-	err = listen(this->sock, backlog);
-	PLOG_IF(FATAL, err < 0) << "Couldn't listen on command server socket";
+	{
+		std::lock_guard<std::mutex> lg(conn->lock);
 
-	// log some info
-	LOG(INFO) << "Created command socket at " << address << ":" << port;
+		conn->output.append(response.str());
+		conn->closing = true;
+	}
+
+	this->flushClient(conn);
 }
 
+#pragma mark - Frame Subscriptions
 /**
- * Processes a request from a client. This has the effect of creating a new
- * thread for that client and continuously reading from that socket.
+ * Tells the effect runner's frame publisher how often the subscribed clients
+ * want frames; that's the shortest interval any of them asked for. If nobody
+ * is subscribed, no frames are published at all.
  */
-void CommandServer::acceptClient(int fd) {
-	// allocate context and pass it to the new thread
-	ClientThreadCtx *ctx = new ClientThreadCtx(this, fd);
-	std::thread *t = new std::thread(CommandClientEntry, ctx);
+void CommandServer::updateFrameInterval(void) {
+	FramePublisher *publisher = this->runner->getPublisher();
+
+	bool any = false;
+	FramePublisher::clock::duration interval = FramePublisher::clock::duration::max();
+
+	for(auto &item : this->connections) {
+		Connection *conn = item.second.get();
+		std::lock_guard<std::mutex> lg(conn->lock);
+
+		if(conn->subscription.active) {
+			any = true;
+			interval = std::min(interval, conn->subscription.interval);
+		}
+	}
 
-	// store this info for later so we can cleanly terminate connections
-	this->clients.push_back(make_tuple(fd, t));
+	if(any) {
+		publisher->setInterval(interval);
+	} else {
+		publisher->disable();
+	}
 }
 
 /**
- * Entry point for the client thread.
+ * Sends the most recently published frame to all subscribed clients that are
+ * due for one. Clients that haven't yet read everything we sent them before
+ * skip it, so slow clients don't make data pile up.
  */
-void CommandServer::clientThreadEntry(int fd) {
-	int err = 0, rsz = 0, len = 0;
+void CommandServer::sendFrames(void) {
+	std::shared_ptr<const FramePublisher::Frame> frame = this->runner->getPublisher()->latest();
 
-	// allocate a read buffer
-	char *buffer = new char[kClientBufferSz];
-	// std::fill(buffer, buffer + kClientBufferSz, 0);
+	if(!frame) {
+		return;
+	}
 
-	// keep reading from the socket while we are running
-	while(this->run) {
-		// clear the buffer, then read from the socket
-		std::fill(buffer, buffer + kClientBufferSz, 0);
-		rsz = read(fd, buffer, kClientBufferSz);
+	for(auto &item : this->connections) {
+		std::shared_ptr<Connection> conn = item.second;
+		bool queued = false;
 
-		// LOG(INFO) << "Read " << rsz << " bytes";
+		{
+			std::lock_guard<std::mutex> lg(conn->lock);
+			Connection::Subscription &sub = conn->subscription;
 
-		// if the read size was zero, the connection was closed
-		if(rsz == 0) {
-			LOG(WARNING) << "Connection " << fd << " closed by host";
-			break;
-		}
-		// handle error conditions
-		else if(rsz == -1) {
-			// ignore ECONNABORTED messages if we're shutting down
-			if(this->run == true) {
-				PLOG(WARNING) << "Couldn't read from client: ";
-				break;
+			if(!sub.active || sub.lastFrame == frame->number) {
+				continue;
+			}
+			if(!FramePublisher::isDue(sub.lastSent, frame->time, sub.interval)) {
+				continue;
 			}
-		}
-		// otherwise, try to parse the JSON
-		else {
-			// zero-terminate the string for good measure
-			int zeroByte = rsz;
 
-			if(zeroByte >= kClientBufferSz) {
-				zeroByte = kClientBufferSz - 1;
+			// drop the frame if the client is still behind
+			if(conn->outputOffset < conn->output.size()) {
+				sub.dropped++;
+				continue;
 			}
 
-			buffer[zeroByte] = 0;
+			this->encodeFrame(*frame, sub, conn->encoding, conn->output);
 
-			// create a string from it
-      std::string jsonStr = std::string(buffer);
-			// LOG(INFO) << jsonStr;
+			sub.lastFrame = frame->number;
+			sub.lastSent = frame->time;
 
-			try {
-				json j = json::parse(jsonStr);
+			queued = true;
+		}
 
-				// process the message
-				this->processClientRequest(j, fd);
-			} catch(json::parse_error e) {
-				LOG(WARNING) << "Parse error in client message: " << e.what();
+		if(queued) {
+			this->flushClient(conn);
+		}
+	}
+}
 
-				// close the connection to tell the client to sod off
-				close(fd);
-				break;
-			}
-      // JSON type errors
-      catch(json::type_error e) {
-				LOG(WARNING) << "Type error processing command: " << e.what();
+/**
+ * Encodes the subscribed regions of a frame, and appends it to the output.
+ *
+ * Each frame is sent as a header (a regular message in the connection's
+ * encoding), followed immediately by the number of bytes of pixel data given in
+ * the header's length field. The header lists
+ * the regions, whose pixels are sent back to back in that order. Each pixel is
+ * four bytes: the hue scaled from [0, 360) to a 16-bit integer in network byte
+ * order, followed by the saturation and intensity scaled to 8 bits each.
+ */
+void CommandServer::encodeFrame(const FramePublisher::Frame &frame, Connection::Subscription &sub, Encoding encoding, std::string &out) {
+	static const size_t kBytesPerPixel = 4;
 
-				// close the connection to tell the client to sod off
-				close(fd);
-				break;
-      }
-      // handle all other types of exceptions
-      catch(std::exception e) {
-        LOG(WARNING) << "Error executing command (" << jsonStr << "): " << e.what();
+	json header;
+	json regions = json::array();
 
-				// close the connection to tell the client to sod off
-				close(fd);
-				break;
-      }
+	size_t length = 0;
+
+	// clip all regions to the frame, which may have changed size
+	std::vector<std::pair<size_t, size_t>> ranges;
+
+	for(auto const& region : sub.regions) {
+		size_t offset = std::min(region.offset, frame.size());
+		size_t count = std::min(region.count, (frame.size() - offset));
+
+		json r;
+
+		if(region.group >= 0) {
+			r["group"] = region.group;
 		}
-	}
 
-	/*
-	 * we _could_ remove this thread from the clients vector, but since the
-	 * socket is already closed, we can simply check if it's been closed by
-	 * the shutdown procedure (or another external source) and only close it
-	 * if needed. the shutdown procedure will only close file descriptors that
-	 * haven't been closed and wait for the thread to terminate.
- 	 */
-	if(fcntl(fd, F_GETFD) != -1) {
-		err = close(fd);
-		PLOG_IF(ERROR, err != 0) << "Couldn't close client socket: ";
+		r["offset"] = offset;
+		r["count"] = count;
+
+		regions.push_back(r);
+		ranges.push_back(std::make_pair(offset, count));
+
+		length += (count * kBytesPerPixel);
 	}
 
-	// de-allocate the buffer
-	delete[] buffer;
+	header["type"] = kMessageFrame;
+	header["frame"] = frame.number;
+	header["dropped"] = sub.dropped;
+	header["encoding"] = "hsi";
+	header["bytesPerPixel"] = kBytesPerPixel;
+	header["regions"] = regions;
+	header["length"] = length;
+
+	this->encodeMessage(header, encoding, out);
+
+	// then, the pixel data
+	size_t pos = out.size();
+	out.resize(pos + length);
+
+	uint8_t *data = reinterpret_cast<uint8_t *>(&out[pos]);
+
+	for(auto const& [offset, count] : ranges) {
+		for(size_t i = offset; i < (offset + count); i++) {
+			uint16_t hue = uint16_t(std::clamp(frame.h[i] / 360.f, 0.f, 1.f) * 65535.f);
+
+			*data++ = (hue >> 8);
+			*data++ = (hue & 0xFF);
+			*data++ = uint8_t(std::clamp(frame.s[i], 0.f, 1.f) * 255.f);
+			*data++ = uint8_t(std::clamp(frame.i[i], 0.f, 1.f) * 255.f);
+		}
+	}
 }
 
+#pragma mark - Requests
 /**
- * Processes a client request by unwrapping the JSON.
+ * Processes a client request by unwrapping the JSON, and builds the response.
+ *
+ * Returns whether the response should be sent: requests with the noreply key
+ * set don't get one, not even if they fail. This is intended for high-rate
+ * controls, like faders.
  */
-void CommandServer::processClientRequest(json &j, int fd) {
-	int err = 0;
-
+bool CommandServer::processClientRequest(json &j, json &response, Connection *conn) {
 	// extract the message type
 	MessageType msgType = static_cast<MessageType>(j["type"]);
 	VLOG(2) << "Received request type " << msgType;
 
 	// invoke the correct handler
-	json response;
-
 	switch(msgType) {
 		case kMessageStatus:
 			this->clientRequestStatus(response, j);
@@ -479,6 +1378,38 @@ void CommandServer::processClientRequest(json &j, int fd) {
     case kMessageNewChannel:
       this->clientRequesNewChannel(response, j);
       break;
+
+		case kMessageSubscribe:
+			this->clientRequestSubscribe(response, j, conn);
+			break;
+		case kMessageUnsubscribe:
+			this->clientRequestUnsubscribe(response, j, conn);
+			break;
+
+		case kMessageSetEncoding:
+			this->clientRequestSetEncoding(response, j, conn);
+			break;
+		case kMessageSetParams:
+			this->clientRequestSetParams(response, j);
+			break;
+
+		case kMessageGetMetrics:
+			this->clientRequestGetMetrics(response, j);
+			break;
+
+		case kMessageTrace:
+			this->clientRequestTrace(response, j);
+			break;
+
+		case kMessageShow:
+			this->clientRequestShow(response, j);
+			break;
+
+		// clients can't send frames
+		case kMessageFrame:
+			response["status"] = kErrorInvalidArguments;
+			response["error"] = "Invalid message type";
+			break;
 	}
 
 	// add the txn field if it exists
@@ -488,22 +1419,13 @@ void CommandServer::processClientRequest(json &j, int fd) {
 		}
 	} catch(std::exception e) {}
 
-	// serialize it to a string and send it
-	bool humanReadable = this->config->GetBoolean("command", "humanReadableResponses", false);
-
-  std::string responseStr = humanReadable ? response.dump(4) : response.dump();
-
-	const char *responseBuf = responseStr.c_str();
-	size_t length = strlen(responseBuf);
-
-	err = write(fd, responseBuf, length);
-
-	// check for error
-	PLOG_IF(ERROR, err == -1) << "Couldn't write to client: ";
-
-	if(err != length) {
-		LOG(WARNING) << "Wrote " << err << " bytes, buffer was " << length << "!";
+	// fire-and-forget requests don't get a response
+	if(j.count("noreply") == 1 && j["noreply"] == true) {
+		LOG_IF_EVERY_N(WARNING, (response.value("status", 0) != 0), 60) << "Request type " << msgType << " failed: " << response.value("error", "");
+		return false;
 	}
+
+	return true;
 }
 
 
@@ -558,6 +1480,93 @@ void CommandServer::clientRequestStatus(json &response, json &request) {
 
   // also, include average fps from effect handler
   response["actualFps"] = this->runner->getActualFps();
+
+  // and how long conversion of the channels takes
+  response["conversion"] = {
+    {"time", this->runner->getAvgConversionTime()},
+    {"pixels", this->runner->getConversionPixels()}
+  };
+
+  // as well as sending the frame's data to the nodes
+  response["send"] = {
+    {"time", this->runner->getMedianSendTime()}
+  };
+
+  // how consistently frames are started
+  auto jitter = this->runner->getJitterStats();
+
+  response["timing"] = {
+    {"jitter", {
+      {"p50", jitter.p50},
+      {"p90", jitter.p90},
+      {"p99", jitter.p99},
+      {"max", jitter.max},
+      {"samples", jitter.samples}
+    }},
+    {"overruns", this->runner->getFrameOverruns()},
+    {"skipped", this->runner->getFramesSkipped()}
+  };
+
+  // how long each node takes to acknowledge framebuffer writes
+  auto proto = this->runner->getProtocolHandler();
+
+  std::vector<double> bounds(std::begin(ProtocolHandler::kAckLatencyBounds),
+                             std::end(ProtocolHandler::kAckLatencyBounds));
+  json nodes = json::object();
+
+  for(auto const& [nodeId, histogram] : proto->getAckLatencyHistograms()) {
+    std::vector<uint64_t> counts(std::begin(histogram.counts),
+                                 std::end(histogram.counts));
+
+    nodes[std::to_string(nodeId)] = {
+      {"counts", counts},
+      {"timeouts", histogram.timeouts}
+    };
+  }
+
+  // how often data is sent to each node
+  for(auto const& [nodeId, rate] : proto->getNodeRates()) {
+    nodes[std::to_string(nodeId)]["rate"] = {
+      {"divisor", rate.divisor},
+      {"rtt", rate.rtt},
+      {"loss", rate.loss}
+    };
+  }
+
+  response["acks"] = {
+    {"bounds", bounds},
+    {"nodes", nodes}
+  };
+
+  // execution stats of each mapped routine
+  json routines = json::array();
+  auto snapshot = this->runner->getMapper()->acquireSnapshot();
+
+  for(auto const& mapping : snapshot->mappings) {
+    Routine *routine = mapping.routine;
+    json groups = json::array();
+
+    if(mapping.isUbergroup) {
+      auto *ug = static_cast<OutputMapper::OutputUberGroup *>(mapping.group);
+
+      for(auto const& span : ug->getSpans()) {
+        groups.push_back(span.member->getGroupId());
+      }
+    } else {
+      groups.push_back(mapping.group->getGroupId());
+    }
+
+    routines.push_back({
+      {"id", routine->getDbRoutine()->id},
+      {"groups", groups},
+      {"backend", routine->getBackendName()},
+      {"time", routine->getAvgExecutionTime()},
+      {"overruns", routine->getOverruns()},
+      {"disabled", routine->isDisabled()}
+    });
+  }
+
+  response["routines"] = routines;
 }
 
 
@@ -592,9 +1601,6 @@ void CommandServer::clientRequestListNodes(json &response, json &request) {
     else {
       response["node"] = json(*node);
     }
-
-    // delete node pls
-    delete node;
   }
   // if not, return all node
   else {
@@ -605,9 +1611,6 @@ void CommandServer::clientRequestListNodes(json &response, json &request) {
     std::vector<DbNode *> nodes = this->store->getAllNodes();
     for(auto node : nodes) {
       response["nodes"].push_back(json(*node));
-
-      // delete the nodes in the vector; they're temporary
-      delete node;
     }
   }
 
@@ -621,8 +1624,8 @@ void CommandServer::clientRequestListNodes(json &response, json &request) {
  * - id: ID of node to update.
  * - set: Key/value array of keys to update: TODO: figure out keys
  *
- * TODO: find a way to propagate this to all existing instances of the node
- * so that code changes are reflected immediately?
+ * The data store only has one instance of each node, so changes are visible
+ * everywhere right away.
  */
 void CommandServer::clientRequestUpdateNode(nlohmann::json &response, nlohmann::json &request) {
   int nodeId = request["id"];
@@ -642,7 +1645,6 @@ void CommandServer::clientRequestUpdateNode(nlohmann::json &response, nlohmann::
 
   // we need to save this node now
   this->store->update(node);
-  delete node;
 
   // done!
   response["status"] = 0;
@@ -680,9 +1682,6 @@ void CommandServer::clientRequestListGroups(nlohmann::json &response, json &requ
     else {
       response["group"] = json(*group);
     }
-
-    // delete group pls
-    delete group;
   }
   // if not, return all groups
   else {
@@ -693,9 +1692,6 @@ void CommandServer::clientRequestListGroups(nlohmann::json &response, json &requ
     std::vector<DbGroup *> groups = this->store->getAllGroups();
     for(auto group : groups) {
       response["groups"].push_back(json(*group));
-
-      // delete the groups in the vector; they're temporary
-      delete group;
     }
   }
 
@@ -709,16 +1705,17 @@ void CommandServer::clientRequestListGroups(nlohmann::json &response, json &requ
  * - id: ID of group to update.
  * - set: Key/value array of keys to update: enabled, start, end, name.
  *
- * TODO: find a way to propagate this to all existing instances of the group
- * so that code changes are reflected immediately?
+ * The group in the data store is in use by the effect runner, so the changes are
+ * made to a copy, which replaces it; the runner picks it up before the next
+ * frame.
  */
 void CommandServer::clientRequestUpdateGroup(nlohmann::json &response, nlohmann::json &request) {
   int groupId = request["id"];
 
   // try to find routine
-  DbGroup *group = this->store->findGroupWithId(groupId);
+  DbGroup *existing = this->store->findGroupWithId(groupId);
 
-  if(group == nullptr) {
+  if(existing == nullptr) {
 		response["status"] = kErrorInvalidGroupId;
 		response["error"] = "Couldn't find group with the specified ID";
 		response["id"] = groupId;
@@ -726,6 +1723,8 @@ void CommandServer::clientRequestUpdateGroup(nlohmann::json &response, nlohmann:
     return;
   }
 
+  DbGroup *group = new DbGroup(*existing);
+
   // update keys
   if(request.count("enabled") == 1) {
     group->enabled = request["enabled"];
@@ -744,7 +1743,7 @@ void CommandServer::clientRequestUpdateGroup(nlohmann::json &response, nlohmann:
 
   // we need to save this group now
   this->store->update(group);
-  delete group;
+  this->runner->groupsChanged();
 
   // done!
   response["status"] = 0;
@@ -782,13 +1781,11 @@ void CommandServer::clientRequestNewGroup(nlohmann::json &response, nlohmann::js
 
   // save the group
   this->store->update(group);
+  this->runner->groupsChanged();
 
   // done!
   response["status"] = 0;
   response["id"] = group->getId();
-
-  // clean up
-  delete group;
 }
 
 
@@ -823,9 +1820,6 @@ void CommandServer::clientRequesListRoutines(nlohmann::json &response, nlohmann:
     else {
       response["routine"] = json(*routine);
     }
-
-    // delete routine pls
-    delete routine;
   }
   // if not, return all routines
   else {
@@ -836,9 +1830,6 @@ void CommandServer::clientRequesListRoutines(nlohmann::json &response, nlohmann:
     std::vector<DbRoutine *> routines = this->store->getAllRoutines();
     for(auto routine : routines) {
       response["routines"].push_back(json(*routine));
-
-      // delete the routines in the vector; they're temporary
-      delete routine;
     }
   }
 
@@ -852,8 +1843,8 @@ void CommandServer::clientRequesListRoutines(nlohmann::json &response, nlohmann:
  * - id: ID of routine to update.
  * - set: Key/value array of keys to update: can be name, code, or defaults.
  *
- * TODO: find a way to propagate this to all existing instances of the routine
- * so that code changes are reflected immediately?
+ * The data store only has one instance of each routine, so changes are visible
+ * everywhere right away.
  */
 void CommandServer::clientRequestUpdateRoutine(nlohmann::json &response, nlohmann::json &request) {
   int routineId = request["id"];
@@ -885,7 +1876,6 @@ void CommandServer::clientRequestUpdateRoutine(nlohmann::json &response, nlohman
 
   // we need to save this routine now
   this->store->update(routine);
-  delete routine;
 
   // done!
   response["status"] = 0;
@@ -926,9 +1916,6 @@ void CommandServer::clientRequestNewRoutine(nlohmann::json &response, nlohmann::
   // done!
   response["status"] = 0;
   response["id"] = routine->getId();
-
-  // clean up
-  delete routine;
 }
 
 
@@ -963,9 +1950,6 @@ void CommandServer::clientRequesListChannels(nlohmann::json &response, nlohmann:
     else {
       response["channel"] = json(*channel);
     }
-
-    // delete channel pls
-    delete channel;
   }
   // if not, return all channels
   else {
@@ -976,9 +1960,6 @@ void CommandServer::clientRequesListChannels(nlohmann::json &response, nlohmann:
     std::vector<DbChannel *> channels = this->store->getAllChannels();
     for(auto channel : channels) {
       response["channels"].push_back(json(*channel));
-
-      // delete the channels in the vector; they're temporary
-      delete channel;
     }
   }
 
@@ -992,16 +1973,17 @@ void CommandServer::clientRequesListChannels(nlohmann::json &response, nlohmann:
  * - id: ID of the channel to update.
  * - set: Key/value array of keys to update: can be fbOffset, node, nodeIndex, size.
  *
- * TODO: find a way to propagate this to all existing instances of the channel
- * so all changes are reflected immediately?
+ * The channel in the data store is in use by the effect runner, so the changes
+ * are made to a copy, which replaces it; the runner reallocates the channel
+ * buffers before the next frame.
  */
 void CommandServer::clientRequesUpdateChannel(nlohmann::json &response, nlohmann::json &request) {
   int channelId = request["id"];
 
   // try to find channel
-  DbChannel *channel = this->store->findChannelWithId(channelId);
+  DbChannel *existing = this->store->findChannelWithId(channelId);
 
-  if(channel == nullptr) {
+  if(existing == nullptr) {
 		response["status"] = kErrorInvalidChannelId;
 		response["error"] = "Couldn't find channel with the specified ID";
 		response["id"] = channelId;
@@ -1009,11 +1991,8 @@ void CommandServer::clientRequesUpdateChannel(nlohmann::json &response, nlohmann
     return;
   }
 
-  // update keys
-  if(request.count("fbOffset") == 1) {
-    // offset into internal computed framebuffer
-    channel->fbOffset = request["fbOffset"];
-  }
+  // update keys; the node is validated first so nothing is changed on error
+  DbChannel *channel = new DbChannel(*existing);
 
   if(request.count("node") == 1) {
     // find node
@@ -1033,6 +2012,11 @@ void CommandServer::clientRequesUpdateChannel(nlohmann::json &response, nlohmann
     channel->node = node;
   }
 
+  if(request.count("fbOffset") == 1) {
+    // offset into internal computed framebuffer
+    channel->fbOffset = request["fbOffset"];
+  }
+
   if(request.count("nodeIndex") == 1) {
     // channel number on node
     channel->nodeOffset = request["nodeIndex"];
@@ -1043,9 +2027,9 @@ void CommandServer::clientRequesUpdateChannel(nlohmann::json &response, nlohmann
     channel->numPixels = request["size"];
   }
 
-  // we need to save this routine now
+  // we need to save this channel now
   this->store->update(channel);
-  delete channel;
+  this->runner->channelsChanged();
 
   // done!
   response["status"] = 0;
@@ -1114,13 +2098,11 @@ void CommandServer::clientRequesNewChannel(nlohmann::json &response, nlohmann::j
 
   // save the channel
   this->store->update(channel);
+  this->runner->channelsChanged();
 
   // done!
   response["status"] = 0;
   response["id"] = channel->getId();
-
-  // clean up
-  delete channel;
 }
 
 
@@ -1253,11 +2235,12 @@ void CommandServer::clientRequestGetBrightness(nlohmann::json &response, nlohman
   int groupId = request["group"];
   double brightness = request["brightness"];
 
-  // get groups
+  // get groups; the snapshot keeps them from being freed while we're at it
 	OutputMapper *mapper = this->runner->getMapper();
+  auto snapshot = mapper->acquireSnapshot();
 
   std::vector<OutputMapper::OutputGroup *> groups;
-  mapper->getAllGroups(groups);
+  mapper->getAllGroups(snapshot.get(), groups);
 
   // find the output group
   for(auto group : groups) {
@@ -1287,11 +2270,12 @@ void CommandServer::clientRequestSetBrightness(nlohmann::json &response, nlohman
   int groupId = request["group"];
   double brightness = request["brightness"];
 
-  // get groups
+  // get groups; the snapshot keeps them from being freed while we're at it
 	OutputMapper *mapper = this->runner->getMapper();
+  auto snapshot = mapper->acquireSnapshot();
 
   std::vector<OutputMapper::OutputGroup *> groups;
-  mapper->getAllGroups(groups);
+  mapper->getAllGroups(snapshot.get(), groups);
 
   // find the output group
   for(auto group : groups) {
@@ -1310,3 +2294,289 @@ void CommandServer::clientRequestSetBrightness(nlohmann::json &response, nlohman
 	response["error"] = "Couldn't find group with the specified ID";
 	response["id"] = groupId;
 }
+
+
+
+/**
+ * Subscribes the client to the live output. Frames are then pushed to it as
+ * they're published; see encodeFrame() for their format. Subscribing again
+ * replaces the existing subscription.
+ *
+ * The regions of groups are looked up when subscribing; they aren't updated if
+ * the groups change later.
+ *
+ * Parameters:
+ * - fps: Maximum number of frames to send per second. If not specified, or
+ *        zero, every frame is sent.
+ * - groups: IDs of groups whose pixels to send. If not specified, the entire
+ *           framebuffer is sent.
+ */
+void CommandServer::clientRequestSubscribe(nlohmann::json &response, nlohmann::json &request, Connection *conn) {
+	Connection::Subscription sub;
+
+	// get the rate
+	double fps = 0;
+
+	if(request.count("fps") == 1) {
+		fps = request["fps"];
+	}
+
+	if(fps < 0) {
+		response["status"] = kErrorInvalidArguments;
+		response["error"] = "fps may not be negative";
+
+		return;
+	} else if(fps > 0) {
+		auto interval = std::chrono::duration<double>(1.0 / fps);
+		sub.interval = std::chrono::duration_cast<FramePublisher::clock::duration>(interval);
+	} else {
+		sub.interval = FramePublisher::clock::duration::zero();
+	}
+
+	// find the regions to send
+	if(request.count("groups") == 1) {
+		for(int groupId : request["groups"]) {
+			DbGroup *group = this->store->findGroupWithId(groupId);
+
+			if(group == nullptr) {
+				response["status"] = kErrorInvalidGroupId;
+				response["error"] = "Couldn't find group with the specified ID";
+				response["id"] = groupId;
+
+				return;
+			}
+
+			size_t count = (group->end - group->start + 1);
+			sub.regions.push_back({groupId, size_t(group->start), count});
+		}
+	} else {
+		sub.regions.push_back({-1, 0, SIZE_MAX});
+	}
+
+	sub.active = true;
+
+	{
+		std::lock_guard<std::mutex> lg(conn->lock);
+		conn->subscription = sub;
+	}
+
+	// the event loop picks this up once it's woken up for the response
+	this->subscriptionsChanged = true;
+
+	response["status"] = 0;
+}
+
+/**
+ * Cancels the client's subscription to the live output, if any.
+ *
+ * Returns:
+ * - dropped: Number of frames that were skipped because the client was behind.
+ */
+void CommandServer::clientRequestUnsubscribe(nlohmann::json &response, nlohmann::json &request, Connection *conn) {
+	{
+		std::lock_guard<std::mutex> lg(conn->lock);
+
+		response["dropped"] = conn->subscription.dropped;
+		conn->subscription = Connection::Subscription();
+	}
+
+	this->subscriptionsChanged = true;
+
+	response["status"] = 0;
+}
+
+/**
+ * Changes the encoding of all further messages on this connection. The
+ * response is still sent in the current encoding; the client must wait for it
+ * before sending any messages in the new encoding.
+ *
+ * Binary messages (MessagePack or CBOR) are prefixed with their length as a
+ * 32-bit integer, in network byte order.
+ *
+ * Parameters:
+ * - encoding: One of "json", "msgpack" or "cbor".
+ */
+void CommandServer::clientRequestSetEncoding(nlohmann::json &response, nlohmann::json &request, Connection *conn) {
+	std::string name = request["encoding"];
+
+	if(name == "json") {
+		conn->encoding = kEncodingJson;
+	} else if(name == "msgpack") {
+		conn->encoding = kEncodingMsgpack;
+	} else if(name == "cbor") {
+		conn->encoding = kEncodingCbor;
+	} else {
+		response["status"] = kErrorInvalidArguments;
+		response["error"] = "Unknown encoding";
+		response["encoding"] = name;
+
+		return;
+	}
+
+	response["status"] = 0;
+}
+
+/**
+ * Changes the parameters of the routine mapped to a group. If the group is part
+ * of an ubergroup, the routine of the ubergroup is changed.
+ *
+ * Parameters:
+ * - group: ID of the group whose routine to change.
+ * - params: Dictionary of parameters to set; parameters that aren't specified
+ *           are reset to their defaults.
+ */
+void CommandServer::clientRequestSetParams(nlohmann::json &response, nlohmann::json &request) {
+	int groupId = request["group"];
+	std::map<std::string, double> params = request["params"];
+
+	// find the mapping. the snapshot keeps its groups from being freed while
+	// we look at them; routines are never freed once created, so the
+	// routine stays valid even if its mapping is removed in the meantime
+	auto snapshot = this->runner->getMapper()->acquireSnapshot();
+
+	for(auto const& mapping : snapshot->mappings) {
+		bool matches = false;
+
+		if(mapping.isUbergroup) {
+			auto *ug = static_cast<OutputMapper::OutputUberGroup *>(mapping.group);
+
+			for(auto const& span : ug->getSpans()) {
+				if(span.member->getGroupId() == groupId) {
+					matches = true;
+					break;
+				}
+			}
+		} else {
+			matches = (mapping.group->getGroupId() == groupId);
+		}
+
+		if(matches) {
+			mapping.routine->changeParams(params);
+
+			response["status"] = 0;
+			return;
+		}
+	}
+
+	// if we get down here, the group isn't mapped
+	response["status"] = kErrorInvalidGroupId;
+	response["error"] = "Couldn't find a mapping for the specified group";
+	response["id"] = groupId;
+}
+
+/**
+ * Returns a summary of all latency histograms, such as those for each stage of
+ * the frame, each routine, and each node. All times are in µS.
+ *
+ * Returns:
+ * - histograms: An array of histograms: each has a name and labels, the number
+ *               of values recorded, their sum, and the p50, p90, p99, p999 and
+ *               maximum.
+ */
+void CommandServer::clientRequestGetMetrics(nlohmann::json &response, nlohmann::json &request) {
+	json histograms = json::array();
+	auto snapshot = std::make_unique<Histogram::Snapshot>();
+
+	Metrics::shared()->forEach([&](const std::string &name, const Metrics::Labels &labels,
+								   const std::string &help, const Histogram &histogram) {
+		histogram.snapshot(*snapshot);
+
+		histograms.push_back({
+			{"name", name},
+			{"labels", labels},
+			{"count", snapshot->count},
+			{"sum", double(snapshot->sum) / 1000.},
+			{"p50", double(snapshot->percentile(0.5)) / 1000.},
+			{"p90", double(snapshot->percentile(0.9)) / 1000.},
+			{"p99", double(snapshot->percentile(0.99)) / 1000.},
+			{"p999", double(snapshot->percentile(0.999)) / 1000.},
+			{"max", double(snapshot->max) / 1000.}
+		});
+	});
+
+	response["histograms"] = histograms;
+	response["status"] = 0;
+}
+
+/**
+ * Controls tracing of the frame pipeline.
+ *
+ * Parameters:
+ * - action: Either "start" to start recording spans (discarding any recorded
+ *           previously), "stop" to stop recording them, or "dump" to return the
+ *           spans recorded so far.
+ *
+ * Returns:
+ * - trace: For "dump", the spans in the Chrome trace format.
+ */
+void CommandServer::clientRequestTrace(nlohmann::json &response, nlohmann::json &request) {
+#ifdef WITH_TRACING
+	std::string action = request["action"];
+
+	if(action == "start") {
+		Tracer::shared()->start();
+	} else if(action == "stop") {
+		Tracer::shared()->stop();
+	} else if(action == "dump") {
+		response["trace"] = Tracer::shared()->exportChromeTrace();
+	} else {
+		response["status"] = kErrorInvalidArguments;
+		response["error"] = "Invalid tracing action";
+		return;
+	}
+
+	response["status"] = 0;
+#else
+	response["status"] = kErrorInvalidArguments;
+	response["error"] = "Server was built without tracing support";
+#endif
+}
+
+/**
+ * Records or plays back shows: the converted output of all channels, which is
+ * stored in the show directory under the given name.
+ *
+ * Parameters:
+ * - action: "record" to start recording a show, "play" to play one back in
+ *           place of running the effects, "stop" to stop either, or "status" to
+ *           return what's being recorded or played.
+ * - name: For "record" and "play", name of the show.
+ * - loop: For "play", whether the show starts over once it ends.
+ *
+ * Returns:
+ * - recording, playing: Whether a show is being recorded or played back.
+ * - name: Name of that show.
+ * - frames: Number of frames recorded so far, or in the show being played.
+ * - position: Number of frames played since the start of the show.
+ */
+void CommandServer::clientRequestShow(nlohmann::json &response, nlohmann::json &request) {
+	std::string action = request["action"];
+
+	try {
+		if(action == "record") {
+			this->runner->startRecording(request["name"]);
+		} else if(action == "play") {
+			this->runner->startPlayback(request["name"], request.value("loop", false));
+		} else if(action == "stop") {
+			this->runner->stopShow();
+		} else if(action != "status") {
+			response["status"] = kErrorInvalidArguments;
+			response["error"] = "Invalid show action";
+			return;
+		}
+	} catch(ShowFile::Error &e) {
+		response["status"] = kErrorInvalidArguments;
+		response["error"] = e.what();
+		return;
+	}
+
+	EffectRunner::ShowStatus status = this->runner->getShowStatus();
+
+	response["recording"] = status.recording;
+	response["playing"] = status.playing;
+	response["name"] = status.name;
+	response["frames"] = status.frames;
+	response["position"] = status.position;
+
+	response["status"] = 0;
+}
@@ -3,6 +3,24 @@
  * requests on an UNIX socket and responds to them. This is the primary
  * interface through which the server is controlled and can be configured, for
  * example, from a web application.
+ *
+ * All client connections are serviced by a single event loop (using epoll, or
+ * poll on platforms without it) on the command server thread. Messages are
+ * framed out of the byte stream, so requests may be split across reads or sent
+ * back to back, and are handed off to a small worker pool. Requests from one
+ * connection are always handled and answered in the order they were received.
+ *
+ * Messages are JSON by default, but a connection can switch to MessagePack or
+ * CBOR, where each message is prefixed with its length. That, and requests that
+ * don't want a response, keep the overhead of high-rate controls down.
+ *
+ * Latency histograms can also be scraped by Prometheus over HTTP, if a port
+ * for that is configured; those requests are answered by the event loop.
+ *
+ * Clients can also subscribe to the live output, in which case frames are
+ * pushed to them in a compact binary encoding as they're published by the
+ * effect runner. A client that can't keep up misses frames, rather than having
+ * them queue up.
  */
 #ifndef COMMANDSERVER_H
 #define COMMANDSERVER_H
@@ -11,13 +29,24 @@
 #include <string>
 #include <atomic>
 #include <vector>
+#include <deque>
+#include <mutex>
+#include <memory>
+#include <unordered_map>
+#include <cstdint>
 
 #include <nlohmann/json.hpp>
 
+#include "FramePublisher.h"
+
 class DataStore;
 class EffectRunner;
 class INIReader;
 
+namespace ctpl {
+	class thread_pool;
+}
+
 class CommandServer {
 	public:
 		CommandServer(DataStore *store, INIReader *reader, EffectRunner *runner);
@@ -26,6 +55,9 @@ class CommandServer {
 		void start();
 		void stop();
 
+	private:
+		struct Connection;
+
 	private:
 		void threadEntry();
 
@@ -35,10 +67,9 @@ class CommandServer {
 		void createSocketUnix(void);
 		void createSocketTcp(void);
 
-		void acceptClient(int fd);
-		void clientThreadEntry(int fd);
+		void createMetricsSocket(void);
 
-		void processClientRequest(nlohmann::json &j, int fd);
+		bool processClientRequest(nlohmann::json &j, nlohmann::json &response, Connection *conn);
 
 		void clientRequestAddMapping(nlohmann::json &response, nlohmann::json &request);
     void clientRequestRemoveMapping(nlohmann::json &response, nlohmann::json &request);
@@ -62,6 +93,16 @@ class CommandServer {
     void clientRequesListChannels(nlohmann::json &response, nlohmann::json &request);
     void clientRequesUpdateChannel(nlohmann::json &response, nlohmann::json &request);
     void clientRequesNewChannel(nlohmann::json &response, nlohmann::json &request);
+
+		void clientRequestSubscribe(nlohmann::json &response, nlohmann::json &request, Connection *conn);
+		void clientRequestUnsubscribe(nlohmann::json &response, nlohmann::json &request, Connection *conn);
+
+		void clientRequestSetEncoding(nlohmann::json &response, nlohmann::json &request, Connection *conn);
+		void clientRequestSetParams(nlohmann::json &response, nlohmann::json &request);
+
+		void clientRequestGetMetrics(nlohmann::json &response, nlohmann::json &request);
+		void clientRequestTrace(nlohmann::json &response, nlohmann::json &request);
+		void clientRequestShow(nlohmann::json &response, nlohmann::json &request);
 	private:
 		enum MessageType {
 			kMessageStatus = 0,
@@ -86,7 +127,19 @@ class CommandServer {
 
       kMessageGetChannels = 13,
       kMessageUpdateChannel = (kMessageGetChannels + 1),
-      kMessageNewChannel = (kMessageGetChannels + 2)
+      kMessageNewChannel = (kMessageGetChannels + 2),
+
+			kMessageSubscribe = 16,
+			kMessageUnsubscribe = (kMessageSubscribe + 1),
+			/// pushed to subscribed clients; never sent by clients
+			kMessageFrame = (kMessageSubscribe + 2),
+
+			kMessageSetEncoding = 19,
+			kMessageSetParams = 20,
+
+			kMessageGetMetrics = 21,
+			kMessageTrace = 22,
+			kMessageShow = 23
 		};
 
 		enum Error {
@@ -98,6 +151,12 @@ class CommandServer {
       kErrorInvalidArguments
 		};
 
+		enum Encoding {
+			kEncodingJson,
+			kEncodingMsgpack,
+			kEncodingCbor
+		};
+
 		enum SocketMode {
 			kSocketModeTcp,
 			kSocketModeUnix
@@ -105,16 +164,124 @@ class CommandServer {
 
 	private:
 		friend void CommandServerEntry(void *ctx);
-		friend void CommandClientEntry(void *ctx);
 
-		class ClientThreadCtx {
-			public:
-				ClientThreadCtx(CommandServer *srv, int fd) : srv(srv), fd(fd) {}
+	// connections and the event loop
+	private:
+		/**
+		 * State for a single client connection. The input buffer and framing
+		 * state are only touched by the event loop; everything else is shared
+		 * with the worker pool and protected by the connection's lock.
+		 */
+		struct Connection {
+			uint64_t id;
+			int fd;
+
+			/// whether this is a connection to the metrics endpoint
+			bool http = false;
+
+			/// bytes read from the socket that aren't part of a complete message
+			std::string input;
+			/// how far into the input buffer we've scanned for a message end
+			size_t scanOffset = 0;
+			/// nesting depth of brackets in the message being framed
+			int depth = 0;
+			bool inString = false;
+			bool escaped = false;
+
+			std::mutex lock;
+
+			/// encoding that new messages from the client are framed with
+			std::atomic<Encoding> encoding{kEncodingJson};
+
+			/// a complete message, and the encoding it was framed with
+			struct Request {
+				Encoding encoding;
+				std::string data;
+			};
+
+			/// complete messages waiting to be handled, in arrival order
+			std::deque<Request> requests;
+			/// whether a worker is currently handling this connection's requests
+			bool busy = false;
+
+			/// responses waiting to be written to the socket
+			std::string output;
+			size_t outputOffset = 0;
+			/// whether we're waiting for the socket to become writable
+			bool wantsWrite = false;
+
+			/// close the connection once all output has been written
+			bool closing = false;
+			/// the event loop closed the connection
+			bool closed = false;
+
+			/// live frame subscription, if any
+			struct Subscription {
+				bool active = false;
+
+				/// minimum time between frames sent to the client
+				FramePublisher::clock::duration interval{0};
+				/// time of the last frame that was sent
+				FramePublisher::clock::time_point lastSent;
+				uint64_t lastFrame = 0;
+
+				/// number of frames skipped because the client was behind
+				unsigned long dropped = 0;
+
+				/// ranges of the framebuffer to send; group is -1 for all of it
+				struct Region {
+					int group;
+					size_t offset;
+					size_t count;
+				};
+
+				std::vector<Region> regions;
+			} subscription;
+		};
 
-				CommandServer *srv;
-				int fd;
+		enum FrameResult {
+			kFrameIncomplete,
+			kFrameComplete,
+			kFrameInvalid
 		};
 
+		struct Event {
+			uint64_t id;
+
+			bool readable;
+			bool writable;
+			bool error;
+		};
+
+		void createEventLoop(void);
+		void destroyEventLoop(void);
+
+		void watch(int fd, uint64_t id, bool writable);
+		void unwatch(int fd, uint64_t id);
+		int waitForEvents(std::vector<Event> &events);
+
+		void wakeEventLoop(uint64_t id);
+		void drainWakeups(void);
+
+		void acceptClients(int listenFd, bool http);
+		void readFromClient(std::shared_ptr<Connection> conn, char *buffer);
+		void flushClient(std::shared_ptr<Connection> conn);
+		void closeClient(std::shared_ptr<Connection> conn);
+
+		FrameResult frameMessage(Connection *conn, std::string &message);
+		FrameResult frameJsonMessage(Connection *conn, std::string &message);
+		FrameResult frameBinaryMessage(Connection *conn, std::string &message);
+
+		static nlohmann::json decodeMessage(const std::string &message, Encoding encoding);
+		void encodeMessage(const nlohmann::json &message, Encoding encoding, std::string &out);
+
+		void handleRequests(std::shared_ptr<Connection> conn);
+		void handleHttpRequest(std::shared_ptr<Connection> conn);
+
+		void updateFrameInterval(void);
+		void sendFrames(void);
+		void encodeFrame(const FramePublisher::Frame &frame, Connection::Subscription &sub, Encoding encoding, std::string &out);
+
 	private:
 		DataStore *store;
 		INIReader *config;
@@ -124,15 +291,59 @@ class CommandServer {
 		std::string socketPath;
 
 		int sock = 0;
+		/// socket for the metrics endpoint; -1 if it's disabled
+		int metricsSock = -1;
 
 		std::thread *worker = nullptr;
 
 		std::atomic_bool run;
 
-		std::vector<std::tuple<int, std::thread *>> clients;
+		/// all open connections, keyed by their id; only used by the event loop
+		std::unordered_map<uint64_t, std::shared_ptr<Connection>> connections;
+		uint64_t nextConnectionId = kFirstConnectionId;
+
+		/// epoll file descriptor, if supported
+		int eventFd = -1;
+		/// file descriptors being watched by poll, and whether they want writes
+		std::unordered_map<uint64_t, std::pair<int, bool>> watched;
+
+		/// pipe used to wake the event loop from the worker pool
+		int wakePipe[2] = {-1, -1};
+
+		/// connections that have new output to write
+		std::mutex wakeLock;
+		std::vector<uint64_t> wakeIds;
+
+		/// a frame was published since subscribers were last serviced
+		std::atomic_bool framePublished{false};
+		/// a connection subscribed or unsubscribed
+		std::atomic_bool subscriptionsChanged{false};
+
+		/// pool on which requests are handled
+		ctpl::thread_pool *pool = nullptr;
+
+		/// maximum size of a single message, in bytes
+		size_t maxMessageSize;
+		/// maximum number of bytes of responses allowed to queue per connection
+		size_t maxPendingOutput;
 
 	private:
 		static const size_t kClientBufferSz = (1024 * 32);
+
+		/// size of the length prefix of binary messages
+		static const size_t kLengthPrefixSz = 4;
+
+		/// maximum number of complete messages queued per connection
+		static const size_t kMaxQueuedRequests = 64;
+
+		/// event ids for the listening sockets and wakeup pipe
+		static const uint64_t kListenSocketId = 0;
+		static const uint64_t kWakePipeId = 1;
+		static const uint64_t kMetricsSocketId = 2;
+		static const uint64_t kFirstConnectionId = 3;
+
+		/// maximum size of a HTTP request to the metrics endpoint
+		static const size_t kMaxHttpRequestSz = (1024 * 8);
 };
 
 #endif
@@ -1,21 +1,37 @@
 #include "EffectRunner.h"
 
 #include "ProtocolHandler.h"
+#include "Shard.h"
 #include "DataStore.h"
 #include "OutputMapper.h"
 #include "Framebuffer.h"
 #include "Routine.h"
+#include "ScriptEngine.h"
+#include "Metrics.h"
+#include "Tracer.h"
+#include "ShowFile.h"
 
 #include "HSIPixel.h"
+#include "lichtenstein_proto.h"
 
 #include <glog/logging.h>
 
 #include <thread>
 #include <chrono>
+#include <algorithm>
+#include <memory>
 #include <atomic>
+#include <future>
+#include <tuple>
+#include <vector>
 #include <condition_variable>
 
 #include <ctime>
+#include <pthread.h>
+#include <cstring>
+#include <cerrno>
+
+#include <sys/stat.h>
 
 // log FPS counters
 #define LOG_FPS							0
@@ -33,9 +49,21 @@ EffectRunner::EffectRunner(DataStore *store, INIReader *config, ProtocolHandler
 	this->fb = new Framebuffer(store, config);
 	this->fb->recalculateMinSize();
 
+	this->groupUpdatePending = false;
+	this->channelUpdatePending = false;
+
 	// create the output mapper
 	this->mapper = new OutputMapper(store, this->fb, config);
 
+	// configure the pixel conversion
+	this->setUpConversion();
+	this->setUpDeltaFrames();
+
+	this->setUpHistograms();
+	this->setUpTracing();
+	this->setUpScriptCache();
+	this->setUpShows();
+
 	// set up the worker thread pool
 	this->setUpThreadPool();
 
@@ -53,31 +81,14 @@ EffectRunner::~EffectRunner(void) {
 	this->workPool->stop(false);
 
 	/*
-	 * If the server is terminated while there are still outstanding conversions
-	 * or effects, but before we've pushed them all, we could deadlock because
-	 * the coordinator expects them all to complete. So, trick the coordinator
-	 * into thinking that all conversions are done, let it do its thing (which
-	 * would perhaps be some additional conversions we'll throw away) and then
-	 * it'll return and exit by itself.
-	 *
-	 * This lets us save some complexity by avoiding additional locking around
-	 * pushing functions onto the worker pool and checking whether the pool has
-	 * been deallocated.
-	 *
-	 * It _would_ be possible to do this with signals, but then we'd have to add
-	 * a signal handler and complicate the code some more.
+	 * Stopping the pool can't deadlock the coordinator: any effects that were
+	 * still queued have their futures broken when the pool is stopped, and the
+	 * coordinator never waits on them past the frame deadline anyways. It also
+	 * takes part in the conversions itself, so any conversion chunks that the
+	 * pool would've picked up get converted on the coordinator instead.
 	 */
 	this->coordinatorRunning = false;
 
-	this->outstandingConversions = 0;
-	this->outstandingEffects = 0;
-
-	this->effectLock.unlock();
-	this->effectsCv.notify_one();
-
-  this->effectLock.unlock();
-  this->conversionCv.notify_one();
-
 	// signal the output handler
 	this->proto->prepareForShutDown();
 
@@ -95,12 +106,7 @@ EffectRunner::~EffectRunner(void) {
 	delete this->fb;
 	delete this->mapper;
 
-	// deallocate buffers and the channels
-	for(auto channel : this->outputChannels) {
-		delete channel;
-	}
-
-	// delete all buffers
+	// deallocate buffers; the channels belong to the data store
 	this->deleteChannelBuffers();
 }
 
@@ -152,8 +158,10 @@ void CoordinatorEntryPoint(void *ctx) {
 void EffectRunner::setUpCoordinatorThread(void) {
 	// initialize some atomics
 	this->frameCounter = 0;
-	this->outstandingEffects = 0;
-	this->outstandingConversions = 0;
+	this->effectOverruns = 0;
+
+	this->frameOverruns = 0;
+	this->framesSkipped = 0;
 
 	// allow the thread to run
 	this->coordinatorRunning = true;
@@ -172,84 +180,124 @@ void EffectRunner::coordinatorThreadEntry(void) {
 	LOG(INFO) << "Started coordinator thread, fps = " << fps;
 
 	// set up the timer
-	double sleepTimeNs = ((1000 * 1000 * 1000) / double(fps));
+	this->setUpCoordinatorScheduling();
+	this->setUpFrameTimer(fps);
+
+	// effects may take at most this long (default is one frame period)
+	int deadlineMs = this->config->GetInteger("runner", "effectDeadline", 0);
+
+	if(deadlineMs > 0) {
+		this->effectDeadline = std::chrono::milliseconds(deadlineMs);
+	} else {
+		this->effectDeadline = this->framePeriod;
+	}
 
-	struct timespec sleep;
-	sleep.tv_sec = 0;
+	// scripts are aborted once they've used up their budget
+	int budgetMs = this->config->GetInteger("runner", "routineBudget", 0);
+	int maxOverruns = this->config->GetInteger("runner", "maxRoutineOverruns", 10);
+	CHECK(maxOverruns >= 0) << "Overrun limit may not be negative; check runner.maxRoutineOverruns";
+
+	if(budgetMs > 0) {
+		Routine::setBudget(std::chrono::milliseconds(budgetMs), maxOverruns);
+	} else if(budgetMs == 0) {
+		Routine::setBudget(this->effectDeadline, maxOverruns);
+	} else {
+		Routine::setBudget(std::chrono::nanoseconds::zero(), maxOverruns);
+	}
 
 	// fetch all output channels and set up buffers
 	this->updateChannels();
 
+	// send frames on a separate thread?
+	this->pipelined = this->config->GetBoolean("runner", "pipelineOutput", false);
+
+	if(this->pipelined) {
+		this->setUpOutputThread();
+	}
+
 	// starting time
-	auto start = std::chrono::high_resolution_clock::now();
+	this->nextFrameDeadline = std::chrono::steady_clock::now();
 	this->fpsStart = std::chrono::high_resolution_clock::now();
 
 	// run as long as the main thread is still alive
 	while(this->coordinatorRunning) {
-		// shall we update the channel buffers?
-		if(this->channelUpdatePending == true) {
+		// pick up any changes to groups, then channels (which are checked
+		// against the groups); a change made meanwhile gets picked up next time
+		if(this->groupUpdatePending.exchange(false)) {
+			this->updateGroups();
+		}
+
+		if(this->channelUpdatePending.exchange(false)) {
 			this->updateChannels();
 		}
 
-		// check if we have effects to run
-		if(this->mapper->outputMap.empty() == false) {
-			// run the effect routines
+		// check if we have effects to run, or a show to play back
+		bool playing = this->playingShow;
+
+		if(playing || this->mapper->acquireSnapshot()->mappings.empty() == false) {
+			TRACE_SCOPE_ARG("frame", "frame", this->outputFrame);
+			auto frameStart = std::chrono::steady_clock::now();
+
+			// all shards number frames the same by the wall clock
+			if(this->proto->getShard()->isSharded()) {
+				this->wallFrame = Shard::wallFrame(this->framePeriod);
+			}
+
+			// run the effect routines, unless the show provides the pixels
 			if(this->coordinatorRunning == false) goto cleanup;
-			this->coordinatorRunEffects();
+
+			if(!playing) {
+				this->coordinatorRunEffects();
+				this->effectsHistogram->record(std::chrono::steady_clock::now() - frameStart);
+			} else {
+				this->loadingRanges.clear();
+			}
 
 			// acquire the buffer lock (so they don't get modified)
       std::unique_lock<std::mutex> lk(this->channelBufferMutex);
 
 			// do the framebuffer conversions
-			if(this->coordinatorRunning == false) goto cleanup;
-			this->coordinatorDoConversions();
+			uint64_t frame = this->outputFrame++;
+			this->wallFrames[frame % kOutputSlots] = this->wallFrame;
+			this->heldRanges[frame % kOutputSlots] = this->loadingRanges;
 
-			// send pixel data
 			if(this->coordinatorRunning == false) goto cleanup;
-			this->coordinatorSendData();
-
-			// explicitly unlock it (good practice; it'll get unlocked in the dtor)
-			lk.unlock();
-		}
 
-		// determine how long it took to do all that, sleep for the remainder
-		auto end = std::chrono::high_resolution_clock::now();
-		std::chrono::duration<double, std::nano> difference = (end - start);
-		long differenceNanos = difference.count();
+			if(playing) {
+				this->playShowFrame(frame);
+			} else {
+				this->coordinatorDoConversions(frame);
 
-		sleep.tv_nsec = (sleepTimeNs - differenceNanos);
-		sleep.tv_nsec -= this->sleepInaccuracy;
-		nanosleep(&sleep, nullptr);
+				// hand a copy of the frame to any observers
+				if(this->publisher.wantsFrame()) {
+					this->publishFrame(frame);
+				}
 
-		// immediately after we wake up, get the new starting time
-		start = std::chrono::high_resolution_clock::now();
+				this->recordShowFrame(frame);
+			}
 
-		// VLOG(1) << "Slept for " <<  sleep.tv_nsec << " ns";
-
-		// fps accounting
-		this->calculateActualFps();
-
-		// how long did we sleep for?
-		auto sleepTime = std::chrono::high_resolution_clock::now() - end;
-		std::chrono::duration<double, std::micro> micros = sleepTime;
+			// send pixel data; when pipelined, this overlaps with the next frame
+			if(this->coordinatorRunning == false) goto cleanup;
 
-		double sleepTimeUs = micros.count();
-		double sleepTimeNs = std::chrono::duration<double, std::nano>(sleepTime).count();
+			if(this->pipelined) {
+				this->queueFrameForOutput(frame);
+			} else {
+				this->coordinatorSendData(frame);
+			}
 
-		// calculate the compensation factor
-		this->compensateSleepInaccuracies(sleep.tv_nsec, sleepTimeNs);
+			// explicitly unlock it (good practice; it'll get unlocked in the dtor)
+			lk.unlock();
 
-		// add it to the moving average
-		double n = this->avgSleepTimeSamples;
-		double oldAvg = this->avgSleepTime;
+			this->frameHistogram->record(std::chrono::steady_clock::now() - frameStart);
+		}
 
-		double newAvg = ((oldAvg * n) + sleepTimeUs) / (n + 1);
+		// sleep until the next frame is due
+		this->waitForNextFrame();
 
-		this->avgSleepTime = newAvg;
-		this->avgSleepTimeSamples++;
+		// fps accounting
+		this->calculateActualFps();
 
 #if LOG_FPS
-		LOG_EVERY_N(INFO, 60) << "Avg sleep time: " << this->avgSleepTime << " µS";
 		LOG_EVERY_N(INFO, 60) << "Actual fps: " << this->actualFps;
 #endif
 	}
@@ -259,386 +307,1800 @@ void EffectRunner::coordinatorThreadEntry(void) {
 	// cleanup
 	LOG(INFO) << "Shutting down coordinator thread";
 
-	// delete all channels
-	for(auto channel : this->outputChannels) {
-		delete channel;
-	}
+	// finish sending the last frame before the buffers are deleted
+	this->stopOutputThread();
+
+	// finish the recording, if there is one
+	this->stopShow();
+
+	// forget the channels (the data store owns them)
 	this->outputChannels.clear();
 
 	// delete all buffers
 	this->deleteChannelBuffers();
 }
 
+/**
+ * Reads the pixel conversion settings from the config.
+ */
+void EffectRunner::setUpConversion(void) {
+	// how many pixels to convert in one go
+	int chunkSize = this->config->GetInteger("runner", "conversionChunkSize", 256);
+	CHECK(chunkSize > 0) << "Conversion chunk size must be positive; check runner.conversionChunkSize";
+
+	this->conversionChunkSize = chunkSize;
+
+	// which algorithm to use
+	std::string mode = this->config->Get("runner", "conversionMode", "exact");
+
+	if(mode == "exact") {
+		HSIPixel::setConversionMode(HSIPixel::kConversionExact);
+	} else if(mode == "lookup") {
+		HSIPixel::setConversionMode(HSIPixel::kConversionLookup);
+	} else {
+		LOG(FATAL) << "Invalid conversion mode '" << mode << "'; check runner.conversionMode";
+	}
+
+	LOG(INFO) << "Using " << mode << " pixel conversion, " << chunkSize << " pixels per chunk";
+
+	// only reconvert and diff regions of the framebuffer that were written to?
+	this->dirtyTracking = this->config->GetBoolean("runner", "dirtyTracking", true);
+
+	// convert straight from the group buffers?
+	this->fusedConversion = this->config->GetBoolean("runner", "fusedConversion", false);
+	LOG_IF(INFO, this->fusedConversion) << "Converting group buffers straight into channel buffers";
+}
+
+/**
+ * Reads the configuration for delta frames, where only the ranges of pixels
+ * that changed are sent to nodes.
+ */
+void EffectRunner::setUpDeltaFrames(void) {
+	this->deltaFrames = this->config->GetBoolean("proto", "deltaFrames", false);
+
+	double threshold = this->config->GetReal("proto", "deltaThreshold", 0.75);
+	CHECK(threshold > 0 && threshold <= 1) << "Delta threshold must be in (0, 1]; check proto.deltaThreshold";
+
+	this->deltaThreshold = threshold;
+
+	LOG_IF(INFO, this->deltaFrames) << "Sending delta frames if smaller than " << (threshold * 100) << "% of a full frame";
+}
+
 /**
  * Fetches all channels and allocates buffers for them.
  */
 void EffectRunner::updateChannels(void) {
+	// the output thread may still be sending from the old buffers
+	this->waitForOutput();
+
 	// attempt to acquire the lock
   std::unique_lock<std::mutex> lk(this->channelBufferMutex);
 
 	// delete all buffers
 	this->deleteChannelBuffers();
 
-	// delete all old channels
-	for(auto channel : this->outputChannels) {
-		delete channel;
+	// channels replaced until now aren't in the list we're about to fetch
+	auto replaced = this->store->takeReplacedChannels();
+
+	// fetch all output channels
+	this->outputChannels.clear();
+
+	const Shard *shard = this->proto->getShard();
+
+	for(auto channel : this->store->getAllChannels()) {
+		// other shards output the channels of their nodes
+		if(!shard->ownsChannel(channel)) {
+			continue;
+		}
+
+		this->outputChannels.push_back(channel);
 	}
 
-	// fetch all output channels (TODO: do this if they change too)
-	this->outputChannels = this->store->getAllChannels();
+	LOG_IF(INFO, shard->isSharded()) << "Shard " << shard->getIndex() << " of " << shard->getCount()
+									 << " outputs " << this->outputChannels.size() << " channels";
+
+	// channels may cover pixels past the end of the groups
+	this->fitFramebufferToChannels();
 
 	// allocate buffers
+	this->channelOutputs.reserve(this->outputChannels.size());
+
 	for(auto channel : this->outputChannels) {
-		size_t numBytes = channel->numPixels;
+		ChannelOutput output;
 
-		// multiply the number of pixels by the number of bytes per pixel
-		switch(channel->format) {
-			case DbChannel::kPixelFormatRGB:
-				numBytes = numBytes * 3;
-				break;
+		output.channel = channel;
+		output.isRGBW = (channel->format == DbChannel::kPixelFormatRGBW);
+		output.stride = output.isRGBW ? 4 : 3;
 
-			case DbChannel::kPixelFormatRGBW:
-				numBytes = numBytes * 4;
-				break;
+		// allocate the packets; each frame is converted into one's payload
+		for(size_t i = 0; i < kOutputSlots; i++) {
+			output.packets[i] = ProtocolHandler::allocFramebufferPacket(channel->numPixels, output.isRGBW, &output.buffers[i]);
+		}
+
+		// deltas are never larger than a full frame, so they fit in the same size
+		output.deltaPacket = nullptr;
+
+		if(this->deltaFrames) {
+			output.deltaPacket = ProtocolHandler::allocFramebufferPacket(channel->numPixels, output.isRGBW, nullptr);
 		}
 
-		// allocate the buffer for frame to output
-		uint8_t *buf = new uint8_t[numBytes];
-		this->channelBuffers[channel] = buf;
+		// the first frame is always converted and sent in full
+		output.hasPrevFrame = false;
+		output.hasConvertedFrame = false;
 
-		// allocate the buffer for the previous frame (used for delta updates)
-		uint8_t *prevFrameBuf = new uint8_t[numBytes];
-		this->channelBuffersPrevFrame[channel] = prevFrameBuf;
+		this->channelOutputs.push_back(output);
 	}
 
-	// reset the update flag
-	this->channelUpdatePending = false;
+	// split the channels up into chunks for conversion
+	this->updateConversionChunks();
+
+	// index which pixels feed which channels
+	this->fb->updateChannelIndex(this->outputChannels);
+
+	for(auto channel : this->outputChannels) {
+		LOG_IF(WARNING, !this->fb->hasGroupsOverlapping(channel->fbOffset, channel->numPixels))
+			<< "No group covers any pixels of " << channel << "; it will only output black";
+	}
+
+	// recordings can't change channels midway, but shows can be output again
+	{
+		std::lock_guard<std::mutex> lg(this->showLock);
+
+		if(this->recorder) {
+			LOG(WARNING) << "Channels changed; stopped recording " << this->showName;
+
+			this->recorder->finish();
+			this->recorder.reset();
+		}
+
+		if(this->player) {
+			this->mapShowChannels();
+		}
+	}
 
 	// unlock the lock
 	lk.unlock();
+
+	// nothing here uses the replaced channels anymore, but command requests may
+	this->mapper->retire(replaced);
 }
+
 /**
- * Deallocates the buffers for ALL channel buffers.
+ * Updates the framebuffer and output groups for changes to the groups. This is
+ * done on the coordinator thread between frames, since effects read the
+ * framebuffer and group buffers without any locks.
+ *
+ * The framebuffer is resized to fit all groups, and output groups whose group
+ * was replaced in the data store are rebuilt with a buffer of its new size.
  */
-void EffectRunner::deleteChannelBuffers(void) {
-  // delete output buffers
-  for(auto const& [channel, buffer] : this->channelBuffers) {
-		delete[] buffer;
-	}
+void EffectRunner::updateGroups(void) {
+	// groups replaced until now aren't in what's fetched below
+	auto replaced = this->store->takeReplacedGroups();
+
+	this->fb->recalculateMinSize();
 
-	this->channelBuffers.clear();
+	// channels keep reading the pixels they cover, even if no group does anymore
+	this->fitFramebufferToChannels();
 
-  // delete prev frame buffers
-	for(auto const& [channel, buffer] : this->channelBuffersPrevFrame) {
-		delete[] buffer;
-	}
+	this->mapper->updateGroups();
+	this->mapper->retire(replaced);
 
-	this->channelBuffersPrevFrame.clear();
+	// the fused segments read from the groups
+	this->fusedSegmentsValid = false;
 }
 
+/**
+ * Grows the framebuffer, if needed, so that it covers all pixels of every output
+ * channel; pixels that no group covers stay black.
+ */
+void EffectRunner::fitFramebufferToChannels(void) {
+	size_t extent = this->fb->size();
+
+	for(auto channel : this->outputChannels) {
+		extent = std::max(extent, size_t(channel->fbOffset + channel->numPixels));
+	}
 
+	if(extent > size_t(this->fb->size())) {
+		LOG(INFO) << "Growing framebuffer to " << extent << " pixels to cover all channels";
+		this->fb->resize(extent);
+	}
+}
 
 /**
- * Calculates the "compensation factor" on the nanosleep() call. This calculates
- * a moving average of the difference between the actual and requested sleep
- * times, and applies that as a correction.
- *
- * TODO: Reset the average every now and then? If the system suddenly becomes
- * heavily loaded, we may not compensate quickly enough.
+ * Splits every output channel into chunks of at most conversionChunkSize
+ * pixels. This must be called with the channel buffer lock held, after the
+ * buffers for each channel have been allocated; chunks point into the list of
+ * channel outputs, so they must be rebuilt whenever it changes.
  */
-void EffectRunner::compensateSleepInaccuracies(long requestedNs, long actualNs) {
-	// calculate the difference
-	double difference = (actualNs - requestedNs);
+void EffectRunner::updateConversionChunks(void) {
+	this->conversionChunks.clear();
+	this->conversionPixels = 0;
 
-	// add to average
-	double n = this->sleepInaccuracySamples;
-	double oldAvg = this->sleepInaccuracy;
+	for(auto &output : this->channelOutputs) {
+		size_t numPixels = output.channel->numPixels;
 
-	double newAvg = ((oldAvg * n) + difference) / (n + 1);
+		CHECK(output.buffer(0) != nullptr) << "Don't have output buffer for channel " << output.channel;
 
-	this->sleepInaccuracy = newAvg;
-	this->sleepInaccuracySamples++;
+		for(size_t start = 0; start < numPixels; start += this->conversionChunkSize) {
+			ConversionChunk chunk;
 
-	// logging
-#if LOG_FPS
-	VLOG_EVERY_N(1, 60) << "nanosleep inaccuracy: " << this->sleepInaccuracy << " ns";
-#endif
+			chunk.output = &output;
+			chunk.start = start;
+			chunk.count = std::min(this->conversionChunkSize, (numPixels - start));
+
+			chunk.firstSegment = 0;
+			chunk.numSegments = 0;
+
+			this->conversionChunks.push_back(chunk);
+		}
+
+		this->conversionPixels += numPixels;
+	}
+
+	VLOG(1) << "Split " << this->outputChannels.size() << " channels ("
+			<< this->conversionPixels << " pixels) into "
+			<< this->conversionChunks.size() << " conversion chunks";
+
+	// the fused segments refer to the chunks
+	this->fusedSegmentsValid = false;
 }
 
 /**
- * Calculates the actual FPS that the coordinator is achieving.
+ * Works out, for each conversion chunk, which group each of its pixels comes
+ * from. This is done whenever the mappings or channels change.
+ *
+ * Groups are copied into the framebuffer in the order of the output map, so a
+ * later group overwrites an earlier one where they overlap; the same group wins
+ * here. Pixels that no mapped group covers are converted from the framebuffer.
+ *
+ * The segments point at the groups in the given snapshot, so they may only be
+ * used while a snapshot of the same generation is held.
  */
-void EffectRunner::calculateActualFps(void) {
-	this->actualFramesCounter++;
+void EffectRunner::updateFusedSegments(const OutputMapper::Snapshot *snapshot) {
+	// a group (or ubergroup member) that is converted, in output map order
+	struct Source {
+		OutputMapper::OutputGroup *group;
+		OutputMapper::OutputGroup *source;
+		size_t start;
+		size_t count;
+
+		/// index of the first pixel in the source's buffer
+		size_t bufferOffset;
+	};
+
+	std::vector<Source> sources;
+	RangeIndex index;
+
+	this->fusedGeneration = snapshot->generation;
+
+	for(auto const& mapping : snapshot->mappings) {
+		OutputMapper::OutputGroup *group = mapping.group;
+		auto ubergroup = static_cast<OutputMapper::OutputUberGroup *>(group);
+
+		if(mapping.isUbergroup) {
+			// members read their slice of the ubergroup's buffer
+			for(auto const& span : ubergroup->getSpans()) {
+				index.add(span.fbStart, span.count, sources.size());
+				sources.push_back({span.member, ubergroup, span.fbStart, span.count, span.bufferOffset});
+			}
+		} else {
+			size_t count = group->numPixels();
+
+			index.add(group->getStart(), count, sources.size());
+			sources.push_back({group, group, size_t(group->getStart()), count, 0});
+		}
+	}
 
-	auto current = std::chrono::high_resolution_clock::now();
-	std::chrono::duration<double, std::milli> fpsDifference = (current - this->fpsStart);
+	index.build();
 
-	if(fpsDifference.count() >= 1000.f) {
-		this->actualFps = double(this->actualFramesCounter) / (fpsDifference.count() / 1000.f);
+	// split each chunk into runs of pixels that come from the same source
+	this->fusedSegments.clear();
 
-		// reset the frame counter and timer
-		this->actualFramesCounter = 0;
-		this->fpsStart = std::chrono::high_resolution_clock::now();
-	}
-}
+	std::vector<size_t> overlapping;
+	std::vector<ssize_t> owner;
 
+	for(auto &chunk : this->conversionChunks) {
+		size_t begin = chunk.output->channel->fbOffset + chunk.start;
 
+		overlapping.clear();
+		index.query(begin, chunk.count, overlapping);
 
-/**
- * Called whenever we actually have effects to run. This will push each output
- * group's routine onto the thread pool, wait for all of them to finish, then
- * convert the framebuffers, and once the conversion of every buffer has
- * completed, output it to the nodes.
- */
-void EffectRunner::coordinatorRunEffects(void) {
-	// set up the condition variable
-	this->outstandingEffects = this->mapper->outputMap.size();
+		// later sources win, so paint them in map order
+		std::sort(overlapping.begin(), overlapping.end());
+		owner.assign(chunk.count, -1);
 
-	// run each effect
-	this->mapper->outputMapLock.lock();
+		for(size_t i : overlapping) {
+			const Source &src = sources[i];
 
-	for(auto const& [group, routine] : this->mapper->outputMap) {
-		// this->workPool->push([this, &group = group, &routine = routine] (int tid) {
-			// VLOG_EVERY_N(2, 60) << "Executing routine " << *routine << " with group " << group;
-			this->runEffect(group, routine);
-		// });
-	}
+			size_t first = std::max(begin, src.start);
+			size_t last = std::min((begin + chunk.count), (src.start + src.count));
 
-	this->mapper->outputMapLock.unlock();
+			for(size_t p = first; p < last; p++) {
+				owner[p - begin] = i;
+			}
+		}
 
-	// wait for the effects to complete
-/*	{
-        unique_lock<mutex> lk(this->effectLock);
-        this->effectsCv.wait(lk, [this]{
-			return (this->outstandingEffects <= 0);
-		});
+		// then emit a segment for each run
+		chunk.firstSegment = this->fusedSegments.size();
+
+		for(size_t p = 0; p < chunk.count;) {
+			size_t end = p + 1;
+
+			while(end < chunk.count && owner[end] == owner[p]) {
+				end++;
+			}
+
+			FusedSegment segment = {nullptr, nullptr, 0, (chunk.start + p), (end - p)};
+
+			if(owner[p] >= 0) {
+				const Source &src = sources[owner[p]];
+
+				segment.group = src.group;
+				segment.source = src.source;
+				segment.sourceOffset = src.bufferOffset + ((begin + p) - src.start);
+			}
+
+			this->fusedSegments.push_back(segment);
+			p = end;
+		}
+
+		chunk.numSegments = this->fusedSegments.size() - chunk.firstSegment;
 	}
-*/
 
-	// advance frame counter
-	this->frameCounter++;
+	this->fusedSegmentsValid = true;
+
+	VLOG(1) << "Split " << this->conversionChunks.size() << " conversion chunks into "
+			<< this->fusedSegments.size() << " fused segments";
 }
 
 /**
- * Runs a single effect.
+ * Deallocates the buffers for ALL channel buffers.
  */
-void EffectRunner::runEffect(OutputMapper::OutputGroup *group, Routine *routine) {
-	// do boring effect running stuff
-	group->bindBufferToRoutine(routine);
-	routine->execute(this->frameCounter);
-
-	// copy the framebuffer data out of the group
-	group->copyIntoFramebuffer(this->fb);
+void EffectRunner::deleteChannelBuffers(void) {
+	// delete output packets (the output buffers are part of them)
+	for(auto const& output : this->channelOutputs) {
+		for(size_t i = 0; i < kOutputSlots; i++) {
+			ProtocolHandler::freeFramebufferPacket(output.packets[i]);
+		}
 
-	// decrement the outstanding effects
-	this->outstandingEffects--;
+		if(output.deltaPacket) {
+			ProtocolHandler::freeFramebufferPacket(output.deltaPacket);
+		}
+	}
 
-	// notify the coordinator
-    this->effectLock.unlock();
-    this->effectsCv.notify_one();
+	this->channelOutputs.clear();
+	this->conversionChunks.clear();
 }
 
 
 
 /**
- * Handles the conversion of each of the effects' outputs. This copies the data
- * from each effect into the output framebuffer, then converts the HSI data in
- * that framebuffer to the format (RGB/RGBW) required by each of the output
- * channels.
+ * Reads the frame timer settings, and computes the period between frames.
  */
-void EffectRunner::coordinatorDoConversions(void) {
-	// set up the condition variable
-	unsigned int conversions = this->outputChannels.size();
-	this->outstandingConversions = conversions;
+void EffectRunner::setUpFrameTimer(int fps) {
+	CHECK(fps > 0) << "Frame rate must be positive; check runner.fps";
 
-	// handle the case of having zero configured output channels
-	if(conversions == 0) {
-		return;
-	}
+	this->framePeriod = std::chrono::nanoseconds(long(1e9 / double(fps)));
 
-	// perform the copying from framebuffers to channels and conversion
-	for(auto channel : this->outputChannels) {
-		// this->workPool->push([this, &channel = channel] (int tid) {
-			this->convertPixelData(channel);
-		// });
-	}
+	// what to do when a frame runs over its period
+	std::string policy = this->config->Get("runner", "overrunPolicy", "skip");
 
-/*	// wait for the conversions to complete
-	{
-		unique_lock<mutex> lk(this->effectLock);
-		this->conversionCv.wait(lk, [this]{
-			return (this->outstandingConversions <= 0);
-		});
+	if(policy == "skip") {
+		this->overrunPolicy = kOverrunSkip;
+	} else if(policy == "restart") {
+		this->overrunPolicy = kOverrunRestart;
+	} else {
+		LOG(FATAL) << "Invalid overrun policy '" << policy << "'; check runner.overrunPolicy";
 	}
-*/
+
+	// clear any jitter samples
+	std::lock_guard<std::mutex> lk(this->jitterLock);
+
+	this->jitterSamples.clear();
+	this->jitterSamples.reserve(kJitterSamples);
+	this->jitterNextSample = 0;
 }
 
 /**
- * Converts the pixel data for the given channel. This reads the HSI pixels from
- * the main framebuffer, converts it, and writes it into the buffer for that
- * channel.
+ * Applies the configured realtime priority and CPU affinity to the calling
+ * (coordinator) thread. Failing to do so isn't fatal, since it usually only
+ * means that we lack the privileges for it.
  */
-void EffectRunner::convertPixelData(DbChannel *channel) {
-	// actually do the conversion lmao
-	switch(channel->format) {
-		case DbChannel::kPixelFormatRGB:
-			this->_convertToRgb(channel);
-			break;
+void EffectRunner::setUpCoordinatorScheduling(void) {
+	int priority = this->config->GetInteger("runner", "realtimePriority", 0);
+	int cpu = this->config->GetInteger("runner", "coordinatorCpu", -1);
 
-		case DbChannel::kPixelFormatRGBW:
-			this->_convertToRgbw(channel);
-			break;
+#ifdef __linux__
+	int err;
+
+	// use the SCHED_FIFO scheduler
+	if(priority > 0) {
+		struct sched_param param;
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = priority;
+
+		err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+
+		if(err != 0) {
+			LOG(WARNING) << "Couldn't set SCHED_FIFO priority " << priority << ": " << strerror(err);
+		} else {
+			LOG(INFO) << "Coordinator uses SCHED_FIFO, priority " << priority;
+		}
 	}
 
-	// decrement the outstanding conversions
-	this->outstandingConversions--;
+	// pin the thread to a CPU
+	if(cpu >= 0) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(cpu, &cpus);
+
+		err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
 
-	// notify the coordinator
-	this->effectLock.unlock();
-	this->conversionCv.notify_one();
+		if(err != 0) {
+			LOG(WARNING) << "Couldn't pin coordinator to CPU " << cpu << ": " << strerror(err);
+		} else {
+			LOG(INFO) << "Coordinator pinned to CPU " << cpu;
+		}
+	}
+#else
+	LOG_IF(WARNING, (priority > 0 || cpu >= 0)) << "Realtime priority and CPU pinning are only supported on Linux";
+#endif
 }
 
 /**
- * Converts the channel's data to RGB pixels.
+ * Sleeps until the start of the next frame. Frames are scheduled at absolute
+ * deadlines on a monotonic clock, so time spent processing a frame or waking up
+ * late doesn't accumulate into drift.
+ *
+ * If the deadline already passed, the overrun policy decides whether the
+ * missed frames are skipped, or the schedule starts over from now.
  */
-void EffectRunner::_convertToRgb(DbChannel *channel) {
-	HSIPixel *fbPtr = this->fb->data.data();
+void EffectRunner::waitForNextFrame(void) {
+	auto now = std::chrono::steady_clock::now();
+	this->nextFrameDeadline += this->framePeriod;
+
+	// did the frame run past the start of the next one?
+	if(now >= this->nextFrameDeadline) {
+		this->frameOverruns++;
+
+		if(this->overrunPolicy == kOverrunSkip) {
+			auto behind = now - this->nextFrameDeadline;
+			auto missed = (behind / this->framePeriod) + 1;
+
+			this->nextFrameDeadline += (missed * this->framePeriod);
+			this->framesSkipped += missed;
+		} else {
+			this->nextFrameDeadline = now;
+		}
+	}
+
+	// keep the frames of all shards in step
+	if(this->proto->getShard()->isSharded()) {
+		this->alignFrameDeadline();
+	}
 
-  // copy the previous frame
-  uint8_t *channelBuffer = this->channelBuffers[channel];
-	CHECK(channelBuffer != nullptr) << "Don't have output buffer for channel " << channel;
+	// sleep until the deadline
+#ifdef __linux__
+	// steady_clock is CLOCK_MONOTONIC
+	auto sinceEpoch = this->nextFrameDeadline.time_since_epoch();
+	auto secs = std::chrono::duration_cast<std::chrono::seconds>(sinceEpoch);
 
-  uint8_t *prevChannelBuffer = this->channelBuffersPrevFrame[channel];
+	struct timespec deadline;
+	deadline.tv_sec = secs.count();
+	deadline.tv_nsec = std::chrono::duration_cast<std::chrono::nanoseconds>(sinceEpoch - secs).count();
 
-  if(prevChannelBuffer != nullptr) {
-    size_t numBytes = channel->numPixels * 3;
-    memcpy(prevChannelBuffer, channelBuffer, numBytes);
-  }
+	int err;
 
-  // convert pixel data
-	for(int i = 0, j = channel->fbOffset; i < channel->numPixels; i++, j++) {
-		fbPtr[j].convertToRGB(channelBuffer);
-		channelBuffer += 3;
-	}
+	do {
+		err = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, nullptr);
+	} while(err == EINTR);
+
+	LOG_IF(ERROR, err != 0) << "clock_nanosleep failed: " << strerror(err);
+#else
+	std::this_thread::sleep_until(this->nextFrameDeadline);
+#endif
+
+	// record how late we woke up
+	auto late = std::chrono::steady_clock::now() - this->nextFrameDeadline;
+	this->addJitterSample(std::chrono::duration<double, std::micro>(late).count());
 }
 
 /**
- * Converts the channel's data to RGBW pixels.
+ * Moves the deadline of the next frame to the nearest start of a frame by the
+ * wall clock. Frames of all shards then start at the same time, as long as the
+ * clocks of their servers are synchronized.
  */
-void EffectRunner::_convertToRgbw(DbChannel *channel) {
-	HSIPixel *fbPtr = this->fb->data.data();
+void EffectRunner::alignFrameDeadline(void) {
+	auto now = std::chrono::steady_clock::now();
+	auto phase = Shard::wallFramePhase(this->framePeriod);
 
-  // copy the previous frame
-  uint8_t *channelBuffer = this->channelBuffers[channel];
-	CHECK(channelBuffer != nullptr) << "Don't have output buffer for channel " << channel;
+	// how far into a wall clock frame the deadline is
+	auto untilDeadline = std::chrono::duration_cast<std::chrono::nanoseconds>(this->nextFrameDeadline - now);
+	auto offset = (phase + std::max(untilDeadline, std::chrono::nanoseconds::zero())) % this->framePeriod;
 
-  uint8_t *prevChannelBuffer = this->channelBuffersPrevFrame[channel];
-
-  if(prevChannelBuffer != nullptr) {
-    size_t numBytes = channel->numPixels * 4;
-    memcpy(prevChannelBuffer, channelBuffer, numBytes);
-  }
-
-	for(int i = 0, j = channel->fbOffset; i < channel->numPixels; i++, j++) {
-		fbPtr[j].convertToRGBW(channelBuffer);
-		channelBuffer += 4;
+	// move it to whichever frame start is closer
+	if(offset > (this->framePeriod / 2)) {
+		offset -= this->framePeriod;
 	}
+
+	this->nextFrameDeadline -= offset;
 }
 
+/**
+ * Adds a jitter sample; only the last kJitterSamples samples are kept.
+ */
+void EffectRunner::addJitterSample(double micros) {
+	std::lock_guard<std::mutex> lk(this->jitterLock);
+
+	if(this->jitterSamples.size() < kJitterSamples) {
+		this->jitterSamples.push_back(micros);
+	} else {
+		this->jitterSamples[this->jitterNextSample] = micros;
+	}
 
+	this->jitterNextSample = (this->jitterNextSample + 1) % kJitterSamples;
+}
 
 /**
- * Sends pixel data from each framebuffer to the appropriate nodes.
+ * Computes percentiles of how late the last few frames started.
  */
-void EffectRunner::coordinatorSendData(void) {
-	// set up the condition variable
-	unsigned int outputChannels = this->outputChannels.size();
-	this->outstandingSends = outputChannels;
+EffectRunner::JitterStats EffectRunner::getJitterStats(void) {
+	std::vector<double> samples;
 
-	// handle the case of having zero configured output channels
-	if(outputChannels == 0) {
-		return;
+	{
+		std::lock_guard<std::mutex> lk(this->jitterLock);
+		samples = this->jitterSamples;
 	}
 
-	// send each channel's data
-	for(auto channel : this->outputChannels) {
-		// this->workPool->push([this, &channel = channel] (int tid) {
-			this->outputPixelData(channel);
-		// });
-	}
+	JitterStats stats = {0, 0, 0, 0, samples.size()};
 
-	// wait for the sends to complete
-/*	{
-		unique_lock<mutex> lk(this->effectLock);
-		this->sendingCv.wait(lk, [this]{
-			return (this->outstandingSends <= 0);
-		});
+	if(samples.empty()) {
+		return stats;
 	}
-*/
 
-	// wait for any outstanding sends to complete/get acknowledged
-	// this->proto->waitForOutstandingFramebufferWrites();
+	std::sort(samples.begin(), samples.end());
+
+	auto percentile = [&samples](double p) {
+		size_t i = size_t(p * (samples.size() - 1));
+		return samples[i];
+	};
 
-	// send the multicasted "output enable" command
-	this->proto->sendOutputEnableForAllNodes();
+	stats.p50 = percentile(0.5);
+	stats.p90 = percentile(0.9);
+	stats.p99 = percentile(0.99);
+	stats.max = samples.back();
+
+	return stats;
 }
 
 /**
- * Sends data for one channel.
+ * Calculates the actual FPS that the coordinator is achieving.
  */
-void EffectRunner::outputPixelData(DbChannel *channel) {
-	// validate that the node is ok
-	if(channel->node == nullptr) {
-		LOG(WARNING) << "Node may not be null!";
-		return;
-	}
+void EffectRunner::calculateActualFps(void) {
+	this->actualFramesCounter++;
 
-  // get the channel's output buffer
-	uint8_t *channelBuffer = this->channelBuffers[channel];
-	CHECK(channelBuffer != nullptr) << "Don't have output buffer for channel " << channel;
+	auto current = std::chrono::high_resolution_clock::now();
+	std::chrono::duration<double, std::milli> fpsDifference = (current - this->fpsStart);
 
-  // check if the data changed between both frames
-  size_t numPixels = channel->numPixels;
-  size_t lastChangedPixel = numPixels;
+	if(fpsDifference.count() >= 1000.f) {
+		this->actualFps = double(this->actualFramesCounter) / (fpsDifference.count() / 1000.f);
 
-  bool isRGBW = (channel->format == DbChannel::kPixelFormatRGBW);
+		// reset the frame counter and timer
+		this->actualFramesCounter = 0;
+		this->fpsStart = std::chrono::high_resolution_clock::now();
+	}
+}
 
-  uint8_t *prevFrameChannelBuffer = this->channelBuffersPrevFrame[channel];
 
-  if(prevFrameChannelBuffer != nullptr) {
-    // reset the counter since we have a buffer
-    lastChangedPixel = 0;
 
-    // calculate pixel stride
-    size_t pixelStride = (isRGBW == true) ? 4 : 3;
+/**
+ * Called whenever we actually have effects to run. This will push each output
+ * group's routine onto the thread pool, then wait for all of them to finish or
+ * for the effect deadline to expire, whichever comes first.
+ *
+ * Groups whose routine finished in time get their buffer copied into the
+ * framebuffer. Any that didn't are left alone: the framebuffer still holds the
+ * data from the last frame they completed, so that is what will be output. We
+ * don't push such a routine again until its previous invocation completed.
+ *
+ * Copies mark the framebuffer dirty, so the conversion stage can skip regions
+ * that nobody wrote to. Groups at zero brightness don't run their routine at all,
+ * since they output black regardless.
+ */
+void EffectRunner::coordinatorRunEffects(void) {
+	TRACE_SCOPE("coordinatorRunEffects");
 
-    // check if each pixel matches
-    for(size_t pixels = 0; pixels < numPixels; pixels++) {
-      uint8_t *prevPixel = &prevFrameChannelBuffer[(pixels * pixelStride)];
-      uint8_t *pixel = &channelBuffer[(pixels * pixelStride)];
+	std::vector<std::tuple<OutputMapper::OutputGroup *, Routine *, std::future<void>>> pending;
 
-      // compare the bytes of each pixel
-      for(size_t byte = 0; byte < pixelStride; byte++) {
-        if(prevPixel[byte] != pixel[byte]) {
-          // this byte did not match; store the index
-          lastChangedPixel = pixels;
-          break;
-        }
-      }
-    }
-  }
+	// get the deadline for this frame and the frame counter to pass to scripts
+	auto deadline = std::chrono::steady_clock::now() + this->effectDeadline;
+	int frame = this->frameCounter;
 
-  // VLOG(1) << lastChangedPixel << " is the last changed pixel out of " << numPixels << " for " << channel;
+	// when sharded, routines spanning shards must render the same frame on each
+	bool sharded = this->proto->getShard()->isSharded();
 
-	// send the data, if any pixels changed
-  if(lastChangedPixel > 0) {
-	  this->proto->sendDataToNode(channel, channelBuffer, lastChangedPixel, isRGBW);
-  }
+	if(sharded) {
+		frame = int(this->wallFrame & INT32_MAX);
+	}
 
-	// decrement the outstanding sends and notify coordinator
-	this->outstandingSends--;
+	// forget about any overrun effects that have since finished
+	this->overrunRoutines.clear();
 
-	this->effectLock.unlock();
-	this->sendingCv.notify_one();
+	for(auto it = this->overrunEffects.begin(); it != this->overrunEffects.end();) {
+		if(it->second.future.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+			it = this->overrunEffects.erase(it);
+		} else {
+			this->overrunRoutines.insert(it->second.routine);
+			++it;
+		}
+	}
+
+	// start tracking which parts of the framebuffer this frame writes to
+	if(this->dirtyTracking) {
+		this->fb->clearDirty();
+	} else {
+		this->fb->markAllDirty();
+	}
+
+	// push each effect onto the work pool; the snapshot doesn't change even if
+	// mappings are added or removed while the effects run
+	auto snapshot = this->mapper->acquireSnapshot();
+
+	pending.reserve(snapshot->mappings.size());
+	this->loadingRanges.clear();
+
+	for(auto const& mapping : snapshot->mappings) {
+		OutputMapper::OutputGroup *group = mapping.group;
+		Routine *routine = mapping.routine;
+
+		// skip the group if its routine is still busy with an earlier frame
+		if(this->overrunEffects.count(group) != 0 || this->overrunRoutines.count(routine) != 0) {
+			continue;
+		}
+
+		// skip groups whose pixels are only output by other shards
+		if(sharded && !this->feedsOutputChannels(mapping)) {
+			continue;
+		}
+
+		// routines are loaded in the background; hold their pixels until then
+		if(!routine->isLoaded()) {
+			if(routine->claimLoad()) {
+				this->workPool->push([routine] (int tid) {
+					routine->load();
+				});
+			}
+
+			if(!routine->didLoadFail()) {
+				this->addLoadingRanges(mapping);
+			}
+
+			continue;
+		}
+
+		// the group is black no matter what the routine does; skip running it
+		if(this->dirtyTracking && group->isDark()) {
+			pending.push_back(std::make_tuple(group, nullptr, std::future<void>()));
+			continue;
+		}
+
+		OutputMapper::OutputGroup *g = group;
+		Routine *r = routine;
+
+		// the effect may outlive the snapshot if it overruns, so the group must
+		// not be freed until it's done
+		g->effectStarted();
+
+		auto future = this->workPool->push([this, g, r, frame] (int tid) {
+			// VLOG_EVERY_N(2, 60) << "Executing routine " << *r << " with group " << g;
+			this->runEffect(g, r, frame);
+			g->effectFinished();
+		});
+
+		pending.push_back(std::make_tuple(group, routine, std::move(future)));
+	}
+
+	// wait for the effects to complete, then copy their output (in map order,
+	// since groups may overlap)
+	for(auto &[group, routine, future] : pending) {
+		if(!future.valid() || future.wait_until(deadline) == std::future_status::ready) {
+			this->copyEffectOutput(group, routine);
+		} else {
+			// keep the future around so we can check on it next frame
+			this->overrunEffects[group] = {routine, std::move(future)};
+			this->effectOverruns++;
+
+			LOG_EVERY_N(WARNING, 30) << "Effect for " << group
+									 << " missed its frame deadline";
+		}
+	}
+
+	// advance frame counter
+	this->frameCounter++;
+}
+
+/**
+ * Copies a group's pixels into the framebuffer, unless they're already there:
+ * that is the case if the routine reported its output as unchanged (or didn't
+ * run, for a dark group,) and the group doesn't need to be copied for any other
+ * reason, such as a brightness change.
+ *
+ * With fused conversion, the pixels are only marked as copied; the framebuffer
+ * isn't written to.
+ */
+void EffectRunner::copyEffectOutput(OutputMapper::OutputGroup *group, Routine *routine) {
+	bool changed = (routine != nullptr) ? routine->didOutputChange() : false;
+
+	if(!this->dirtyTracking || changed || group->needsCopy(this->fb)) {
+		// with fused conversion, the chunks read the group's buffer themselves
+		if(this->fusedConversion) {
+			group->markCopied(this->fb);
+		} else {
+			group->copyIntoFramebuffer(this->fb);
+		}
+	}
+}
+
+/**
+ * Checks whether any pixels of the mapping's group feed a channel that's output
+ * by this instance.
+ */
+bool EffectRunner::feedsOutputChannels(const OutputMapper::Snapshot::Mapping &mapping) const {
+	if(!mapping.isUbergroup) {
+		return this->fb->hasChannelsOverlapping(mapping.start, mapping.numPixels);
+	}
+
+	auto *ug = static_cast<OutputMapper::OutputUberGroup *>(mapping.group);
+
+	for(auto const& span : ug->getSpans()) {
+		if(this->fb->hasChannelsOverlapping(span.fbStart, span.count)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/**
+ * Adds the pixels of the mapping's group to the ranges that are held for the
+ * current frame, because its routine is still loading.
+ */
+void EffectRunner::addLoadingRanges(const OutputMapper::Snapshot::Mapping &mapping) {
+	if(!mapping.isUbergroup) {
+		this->loadingRanges.push_back({size_t(mapping.start), size_t(mapping.numPixels)});
+		return;
+	}
+
+	auto *ug = static_cast<OutputMapper::OutputUberGroup *>(mapping.group);
+
+	for(auto const& span : ug->getSpans()) {
+		this->loadingRanges.push_back({span.fbStart, span.count});
+	}
+}
+
+/**
+ * Checks whether the channel covers any pixels that were held in the given
+ * frame, because the routine rendering them was still loading.
+ */
+bool EffectRunner::isChannelHeld(const DbChannel *channel, uint64_t frame) const {
+	size_t start = channel->fbOffset;
+	size_t end = start + channel->numPixels;
+
+	for(auto const& range : this->heldRanges[frame % kOutputSlots]) {
+		if(range.start < end && (range.start + range.count) > start) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/**
+ * Runs a single effect. This is invoked on one of the worker threads; the
+ * group's buffer is copied into the framebuffer by the coordinator once the
+ * effect completes.
+ */
+void EffectRunner::runEffect(OutputMapper::OutputGroup *group, Routine *routine, int frame) {
+	TRACE_SCOPE_ARG("runEffect", "routine", routine->getDbRoutine()->getId());
+
+	// do boring effect running stuff
+	group->bindBufferToRoutine(routine);
+	routine->execute(frame);
+}
+
+
+
+/**
+ * Gets the histograms for the stages of the frame. The send stage and the ack
+ * latencies are recorded by the protocol handler.
+ *
+ * The frame histogram covers everything the coordinator does for a frame; with
+ * pipelined output, that doesn't include sending it.
+ */
+void EffectRunner::setUpHistograms(void) {
+	static const char *kName = "lichtenstein_frame_stage_seconds";
+	static const char *kHelp = "Time taken by each stage of a frame";
+
+	Metrics *metrics = Metrics::shared();
+
+	this->effectsHistogram = metrics->histogram(kName, {{"stage", "effects"}}, kHelp);
+	this->conversionHistogram = metrics->histogram(kName, {{"stage", "conversion"}}, kHelp);
+	this->diffHistogram = metrics->histogram(kName, {{"stage", "diff"}}, kHelp);
+	this->frameHistogram = metrics->histogram(kName, {{"stage", "frame"}}, kHelp);
+}
+
+/**
+ * Sets up tracing of the frame pipeline: the size of the trace buffer, and
+ * whether spans are recorded from the start.
+ */
+void EffectRunner::setUpTracing(void) {
+	int capacity = this->config->GetInteger("runner", "traceBufferSize", 65536);
+	CHECK(capacity > 0) << "Trace buffer must hold at least one span; check runner.traceBufferSize";
+
+	Tracer::shared()->setCapacity(capacity);
+
+	if(this->config->GetBoolean("runner", "tracing", false)) {
+#ifdef WITH_TRACING
+		Tracer::shared()->start();
+#else
+		LOG(WARNING) << "Tracing was requested, but the server was built without WITH_TRACING";
+#endif
+	}
+}
+
+/**
+ * Points the script engine at the directory compiled routines are cached in.
+ */
+void EffectRunner::setUpScriptCache(void) {
+	std::string path = this->config->Get("runner", "bytecodeCache", "");
+	ScriptEngine::shared()->setCacheDirectory(path);
+}
+
+/**
+ * Publishes the framebuffer's contents for observers. This happens after the
+ * conversions, so it doesn't hold up the output.
+ *
+ * With fused conversion, the group buffers never get copied into the
+ * framebuffer, so that's done here first; the dirty bits it sets are cleared
+ * before the next frame's effects run. Groups whose effect overran are skipped,
+ * just like when converting.
+ */
+void EffectRunner::publishFrame(uint64_t frame) {
+	if(this->fusedConversion) {
+		auto snapshot = this->mapper->acquireSnapshot();
+
+		for(auto const& mapping : snapshot->mappings) {
+			// overrun effects are still writing their buffers; the framebuffer
+			// keeps their pixels from the last frame they completed
+			if(this->overrunEffects.count(mapping.group) != 0) {
+				continue;
+			}
+
+			mapping.group->copyIntoFramebuffer(this->fb);
+		}
+	}
+
+	this->publisher.publish(frame, this->fb);
+}
+
+/**
+ * Handles the conversion of each of the effects' outputs. This converts the HSI
+ * data in the framebuffer to the format (RGB/RGBW) required by each of the
+ * output channels.
+ *
+ * Channels are split into fixed size chunks, which are shared by the worker
+ * threads and the coordinator: each thread keeps taking the next chunk until
+ * none are left. That way, a single large channel is spread over all threads,
+ * and a thread that's done with its chunk doesn't sit idle waiting for someone
+ * else's. The coordinator always takes part itself, so conversions complete
+ * even if all workers are still busy with overrun effects.
+ */
+void EffectRunner::coordinatorDoConversions(uint64_t frame) {
+	TRACE_SCOPE_ARG("coordinatorDoConversions", "frame", frame);
+
+	// handle the case of having zero configured output channels
+	size_t numChunks = this->conversionChunks.size();
+
+	if(numChunks == 0) {
+		return;
+	}
+
+	auto start = std::chrono::high_resolution_clock::now();
+
+	// figure out which pixels of each channel need to be looked at
+	this->updateDirtyRanges(frame);
+
+	// find out where each chunk's pixels come from, if the mappings changed; the
+	// snapshot is held until the chunks are converted, so that the groups the
+	// segments read from aren't freed in the meantime
+	auto snapshot = this->mapper->acquireSnapshot();
+
+	if(this->fusedConversion) {
+		if(!this->fusedSegmentsValid || this->fusedGeneration != snapshot->generation) {
+			this->updateFusedSegments(snapshot.get());
+		}
+	}
+
+	// set up the job; workers hold on to it until they return
+	auto job = std::make_shared<ConversionJob>();
+
+	job->chunks = &this->conversionChunks;
+	job->numChunks = numChunks;
+	job->frame = frame;
+	job->next = 0;
+	job->completed = 0;
+
+	// get help from up to one worker per chunk (we take one chunk ourselves)
+	size_t helpers = std::min(size_t(this->workPool->size()), (numChunks - 1));
+
+	for(size_t i = 0; i < helpers; i++) {
+		this->workPool->push([this, job] (int tid) {
+			this->convertChunks(job.get());
+		});
+	}
+
+	// convert chunks until there are none left, then wait for the stragglers
+	this->convertChunks(job.get());
+
+	{
+		std::unique_lock<std::mutex> lk(job->lock);
+		job->done.wait(lk, [&job, numChunks]{
+			return (job->completed == numChunks);
+		});
+	}
+
+	// add the conversion time to the moving average
+	auto elapsed = std::chrono::high_resolution_clock::now() - start;
+	double micros = std::chrono::duration<double, std::micro>(elapsed).count();
+
+	this->conversionHistogram->record(elapsed);
+
+	double n = this->avgConversionTimeSamples;
+	this->avgConversionTime = ((this->avgConversionTime * n) + micros) / (n + 1);
+	this->avgConversionTimeSamples++;
+
+	// the next frame can copy unchanged chunks from this one
+	for(auto &output : this->channelOutputs) {
+		output.hasConvertedFrame = true;
+	}
+}
+
+/**
+ * Records, for each channel, which of its pixels lie in dirty regions of the
+ * framebuffer for this frame. Sending uses this instead of the framebuffer's
+ * bitmap, since with pipelining the next frame may already be writing to it.
+ *
+ * This goes over the dirty parts of the framebuffer, and uses the overlap index
+ * to find the channels they feed into; channels that aren't affected are never
+ * looked at.
+ */
+void EffectRunner::updateDirtyRanges(uint64_t frame) {
+	for(auto &output : this->channelOutputs) {
+		std::vector<ProtocolHandler::PixelRange> &ranges = output.dirty(frame);
+		ranges.clear();
+
+		// without a previous frame, everything counts as dirty
+		if(!output.hasConvertedFrame && output.channel->numPixels > 0) {
+			ranges.push_back({0, size_t(output.channel->numPixels)});
+		}
+	}
+
+	// add each dirty stretch of the framebuffer to the channels it overlaps
+	std::vector<size_t> &affected = this->affectedChannels;
+
+	size_t end = this->fb->size();
+	size_t pos = 0;
+
+	while((pos = this->fb->nextDirty(pos, end)) < end) {
+		size_t stop = this->fb->nextClean(pos, end);
+
+		affected.clear();
+		this->fb->channelsOverlapping(pos, (stop - pos), affected);
+
+		for(size_t index : affected) {
+			ChannelOutput &output = this->channelOutputs[index];
+
+			if(!output.hasConvertedFrame) {
+				continue;
+			}
+
+			// clip the stretch to the channel
+			size_t begin = output.channel->fbOffset;
+			size_t first = std::max(pos, begin);
+			size_t last = std::min(stop, (begin + output.channel->numPixels));
+
+			output.dirty(frame).push_back({(first - begin), (last - first)});
+		}
+
+		pos = stop;
+	}
+}
+
+/**
+ * Converts chunks from the given job until all of them have been taken. The
+ * thread that converts the last chunk notifies the coordinator.
+ *
+ * @note A worker may only get to run this after all chunks have already been
+ * converted, possibly even during a later frame; it then returns without ever
+ * touching the (possibly stale) chunk list.
+ */
+void EffectRunner::convertChunks(ConversionJob *job) {
+	size_t numChunks = job->numChunks;
+	size_t i;
+
+	while((i = job->next++) < numChunks) {
+		this->convertPixelData((*job->chunks)[i], job->frame);
+
+		// was this the last chunk?
+		if(++job->completed == numChunks) {
+			std::lock_guard<std::mutex> lk(job->lock);
+			job->done.notify_all();
+		}
+	}
+}
+
+/**
+ * Converts the pixel data for the given chunk. This reads the HSI pixels from
+ * the main framebuffer, converts it, and writes it into the buffer for that
+ * channel.
+ */
+void EffectRunner::convertPixelData(const ConversionChunk &chunk, uint64_t frame) {
+	ChannelOutput *output = chunk.output;
+	TRACE_SCOPE_ARG("convertPixelData", "channel", output->channel->getId());
+
+	// if none of the chunk's pixels changed, reuse the previous frame's
+	if(output->hasConvertedFrame && !this->fb->isDirty((output->channel->fbOffset + chunk.start), chunk.count)) {
+		size_t offset = chunk.start * output->stride;
+		memcpy((output->buffer(frame) + offset), (output->prevBuffer(frame) + offset), (chunk.count * output->stride));
+
+		return;
+	}
+
+	// convert straight from the groups' buffers?
+	if(this->fusedConversion) {
+		this->_convertFused(chunk, frame);
+		return;
+	}
+
+	// actually do the conversion lmao
+	switch(chunk.output->channel->format) {
+		case DbChannel::kPixelFormatRGB:
+			this->_convertToRgb(chunk, frame);
+			break;
+
+		case DbChannel::kPixelFormatRGBW:
+			this->_convertToRgbw(chunk, frame);
+			break;
+	}
+}
+
+/**
+ * Converts the chunk's data to RGB pixels.
+ */
+void EffectRunner::_convertToRgb(const ConversionChunk &chunk, uint64_t frame) {
+	auto span = this->fb->getSpan((chunk.output->channel->fbOffset + chunk.start), chunk.count);
+	uint8_t *channelBuffer = chunk.output->buffer(frame) + (chunk.start * 3);
+
+	// convert pixel data
+	HSIPixel::convertPlanesToRGB(span.h, span.s, span.i, span.size(), channelBuffer);
+}
+
+/**
+ * Converts the chunk's data to RGBW pixels.
+ */
+void EffectRunner::_convertToRgbw(const ConversionChunk &chunk, uint64_t frame) {
+	auto span = this->fb->getSpan((chunk.output->channel->fbOffset + chunk.start), chunk.count);
+	uint8_t *channelBuffer = chunk.output->buffer(frame) + (chunk.start * 4);
+
+	// convert pixel data
+	HSIPixel::convertPlanesToRGBW(span.h, span.s, span.i, span.size(), channelBuffer);
+}
+
+/**
+ * Converts the chunk straight from the buffers of the groups its pixels come
+ * from. Each segment is normalized and scaled for brightness, a block at a time,
+ * into small planes on the stack which stay in the cache, and then converted
+ * into the channel's output buffer.
+ *
+ * Groups whose effect is still running (because it missed its deadline) can't
+ * be read, since the effect writes their buffer; like with the framebuffer,
+ * their pixels from the previous frame are output again.
+ */
+void EffectRunner::_convertFused(const ConversionChunk &chunk, uint64_t frame) {
+	static const size_t kBlockSz = 256;
+
+	alignas(64) float h[kBlockSz];
+	alignas(64) float s[kBlockSz];
+	alignas(64) float i[kBlockSz];
+
+	ChannelOutput *output = chunk.output;
+	size_t stride = output->stride;
+
+	for(size_t n = 0; n < chunk.numSegments; n++) {
+		const FusedSegment &segment = this->fusedSegments[chunk.firstSegment + n];
+
+		uint8_t *out = output->buffer(frame) + (segment.start * stride);
+		HSIPixel *pixels = (segment.source != nullptr) ? segment.source->getDataPointer() : nullptr;
+
+		// reuse the previous frame's pixels if the group's effect is still running
+		if(pixels && this->overrunEffects.count(segment.source) && output->hasConvertedFrame) {
+			memcpy(out, (output->prevBuffer(frame) + (segment.start * stride)), (segment.count * stride));
+			continue;
+		}
+
+		// pixels covered by no group come from the framebuffer
+		if(pixels == nullptr) {
+			auto span = this->fb->getSpan((output->channel->fbOffset + segment.start), segment.count);
+
+			if(output->isRGBW) {
+				HSIPixel::convertPlanesToRGBW(span.h, span.s, span.i, span.size(), out);
+			} else {
+				HSIPixel::convertPlanesToRGB(span.h, span.s, span.i, span.size(), out);
+			}
+
+			continue;
+		}
+
+		// convert the group's pixels a block at a time
+		double brightness = segment.group->getBrightness();
+		pixels += segment.sourceOffset;
+
+		for(size_t off = 0; off < segment.count; off += kBlockSz) {
+			size_t count = std::min(kBlockSz, (segment.count - off));
+
+			Framebuffer::Span block(h, s, i, count);
+			block.store((pixels + off), brightness);
+
+			if(output->isRGBW) {
+				HSIPixel::convertPlanesToRGBW(h, s, i, count, (out + (off * stride)));
+			} else {
+				HSIPixel::convertPlanesToRGB(h, s, i, count, (out + (off * stride)));
+			}
+		}
+	}
+}
+
+
+
+/**
+ * Sends the given frame's pixel data to the appropriate nodes, then tells them
+ * to output it. With pipelining, this runs on the output thread.
+ */
+void EffectRunner::coordinatorSendData(uint64_t frame) {
+	TRACE_SCOPE_ARG("coordinatorSendData", "frame", frame);
+
+	// set up the condition variable
+	unsigned int outputChannels = this->channelOutputs.size();
+	this->outstandingSends = outputChannels;
+
+	// handle the case of having zero configured output channels
+	if(outputChannels == 0) {
+		return;
+	}
+
+	// send each channel's data
+	this->diffTime = std::chrono::nanoseconds::zero();
+
+	for(auto &output : this->channelOutputs) {
+		// this->workPool->push([this, &output = output] (int tid) {
+			this->outputPixelData(output, frame);
+		// });
+	}
+
+	// wait for the sends to complete
+/*	{
+		unique_lock<mutex> lk(this->effectLock);
+		this->sendingCv.wait(lk, [this]{
+			return (this->outstandingSends <= 0);
+		});
+	}
+*/
+
+	this->diffHistogram->record(this->diffTime);
+
+	// send all packets for this frame at once
+	this->proto->flushFramebufferData();
+
+	// wait for the nodes to acknowledge the data, or the sync timeout
+	this->proto->waitForOutstandingFramebufferWrites();
+
+	// send the multicasted "output enable" command (or tell the leading shard
+	// that our nodes are ready for it)
+	this->proto->syncOutput(this->wallFrames[frame % kOutputSlots]);
+}
+
+/**
+ * Returns the index of the first byte at or after start that differs between the
+ * two buffers, or length if there is none. Identical stretches are skipped a
+ * block (and then a word) at a time, rather than comparing byte by byte.
+ */
+static size_t nextDifference(const uint8_t *a, const uint8_t *b, size_t start, size_t length) {
+	size_t pos = start;
+
+	// memcmp is vectorized, so skip unchanged blocks with it
+	static const size_t kBlockSz = 64;
+
+	while((pos + kBlockSz) <= length && memcmp(a + pos, b + pos, kBlockSz) == 0) {
+		pos += kBlockSz;
+	}
+
+	// then find the differing byte a word at a time
+	while((pos + sizeof(uint64_t)) <= length) {
+		uint64_t wordA, wordB;
+
+		memcpy(&wordA, a + pos, sizeof(wordA));
+		memcpy(&wordB, b + pos, sizeof(wordB));
+
+		uint64_t diff = wordA ^ wordB;
+
+		if(diff != 0) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+			return pos + (__builtin_ctzll(diff) / 8);
+#else
+			return pos + (__builtin_clzll(diff) / 8);
+#endif
+		}
+
+		pos += sizeof(uint64_t);
+	}
+
+	// compare the remaining bytes
+	for(; pos < length; pos++) {
+		if(a[pos] != b[pos]) {
+			return pos;
+		}
+	}
+
+	return length;
+}
+
+/**
+ * Finds the ranges of pixels that differ between the previous and the current
+ * frame. Ranges separated by only a few unchanged pixels are merged, if sending
+ * those pixels takes less space than the header of another range.
+ */
+void EffectRunner::findChangedRanges(const uint8_t *prev, const uint8_t *cur, size_t numPixels, size_t pixelStride, std::vector<ProtocolHandler::PixelRange> &ranges) {
+	size_t length = numPixels * pixelStride;
+
+	// how many unchanged pixels are cheaper to send than a range header
+	size_t mergeGap = sizeof(lichtenstein_framebuffer_range_t) / pixelStride;
+
+	size_t pos = 0;
+
+	while((pos = nextDifference(prev, cur, pos, length)) < length) {
+		size_t start = pos / pixelStride;
+		size_t end = start + 1;
+
+		// extend the range until the next change is too far away
+		size_t next;
+
+		while((next = nextDifference(prev, cur, (end * pixelStride), length)) < length) {
+			size_t nextPixel = next / pixelStride;
+
+			if((nextPixel - end) > mergeGap) {
+				break;
+			}
+
+			end = nextPixel + 1;
+		}
+
+		ranges.push_back({start, (end - start)});
+		pos = end * pixelStride;
+	}
+}
+
+/**
+ * Returns the median time taken to send all of a frame's packets, in µS.
+ */
+double EffectRunner::getMedianSendTime(void) const {
+	return this->proto->getMedianSendTime();
+}
+
+/**
+ * Sends data for one channel. Only the pixels that changed since the previous
+ * frame are sent; only pixels in dirty regions of the framebuffer are compared.
+ */
+void EffectRunner::outputPixelData(ChannelOutput &output, uint64_t frame) {
+	DbChannel *channel = output.channel;
+	TRACE_SCOPE_ARG("outputPixelData", "channel", channel->getId());
+
+	// validate that the node is ok
+	if(channel->node == nullptr) {
+		LOG(WARNING) << "Node may not be null!";
+		return;
+	}
+
+	// skip channels fed by routines that are still loading, so the node keeps
+	// showing its last frame, and nodes that can't keep up; either way, the
+	// node must get a full frame next time
+	if(this->isChannelHeld(channel, frame) || !this->proto->shouldSendToNode(channel->node, frame)) {
+		output.hasPrevFrame = false;
+
+		this->outstandingSends--;
+		this->sendingCv.notify_one();
+		return;
+	}
+
+	// get the channel's output buffer
+	uint8_t *channelBuffer = output.buffer(frame);
+
+	// find the ranges of pixels that changed since the last frame
+	size_t numPixels = channel->numPixels;
+	bool isRGBW = output.isRGBW;
+
+	std::vector<ProtocolHandler::PixelRange> &ranges = this->changedRanges;
+	ranges.clear();
+
+	if(output.hasPrevFrame) {
+		auto diffStart = std::chrono::steady_clock::now();
+
+		// only diff the pixels whose framebuffer data may have changed
+		const uint8_t *prevBuffer = output.prevBuffer(frame);
+
+		for(auto &dirty : output.dirty(frame)) {
+			size_t offset = dirty.start * output.stride;
+			size_t first = ranges.size();
+
+			EffectRunner::findChangedRanges((prevBuffer + offset), (channelBuffer + offset), dirty.count, output.stride, ranges);
+
+			for(size_t i = first; i < ranges.size(); i++) {
+				ranges[i].start += dirty.start;
+			}
+		}
+
+		this->diffTime += (std::chrono::steady_clock::now() - diffStart);
+	} else if(numPixels > 0) {
+		ranges.push_back({0, numPixels});
+	}
+
+	// send the data, if any pixels changed
+	if(!ranges.empty()) {
+		// a full frame has to include all pixels up to the last changed one
+		size_t fullPixels = ranges.back().start + ranges.back().count;
+		bool sendDelta = false;
+
+		// if the changes are sparse, send only the changed ranges
+		if(this->deltaFrames && !(ranges.size() == 1 && ranges[0].start == 0)) {
+			size_t fullSize = ProtocolHandler::framebufferDataSize(fullPixels, isRGBW);
+			size_t deltaSize = ProtocolHandler::framebufferDeltaSize(ranges, isRGBW);
+
+			sendDelta = (deltaSize < (fullSize * this->deltaThreshold));
+		}
+
+		if(sendDelta) {
+			this->proto->sendDeltaToNode(channel, output.deltaPacket, channelBuffer, ranges, isRGBW);
+		} else {
+			this->proto->sendDataToNode(channel, output.packet(frame), fullPixels, isRGBW);
+		}
+	}
+
+	// the next frame can be compared against this one
+	output.hasPrevFrame = true;
+
+	// decrement the outstanding sends and notify coordinator
+	this->outstandingSends--;
+	this->sendingCv.notify_one();
+}
+
+#pragma mark - Output Thread
+/**
+ * Output thread entry point
+ */
+void OutputEntryPoint(void *ctx) {
+#ifdef __APPLE__
+	pthread_setname_np("Effect Output");
+#else
+  #ifdef pthread_setname_np
+	 pthread_setname_np(pthread_self(), "Effect Output");
+ #endif
+#endif
+
+	EffectRunner *runner = static_cast<EffectRunner *>(ctx);
+	runner->outputThreadEntry();
+}
+
+/**
+ * Sets up the output thread. When output is pipelined, the coordinator hands
+ * each frame to this thread once it's converted, and then goes on to run the
+ * effects for the next frame while this one is being sent.
+ */
+void EffectRunner::setUpOutputThread(void) {
+	this->outputRunning = true;
+	this->outputPending = false;
+
+	this->outputThread = new std::thread(OutputEntryPoint, this);
+
+	LOG(INFO) << "Pipelining output: frames are sent while the next is computed";
+}
+
+/**
+ * Entry point for the output thread: sends frames as they're queued, in order,
+ * until the thread is stopped and there's nothing left to send.
+ */
+void EffectRunner::outputThreadEntry(void) {
+	std::unique_lock<std::mutex> lk(this->outputLock);
+
+	while(true) {
+		this->outputCv.wait(lk, [this]{
+			return (this->outputPending || !this->outputRunning);
+		});
+
+		if(!this->outputPending) {
+			break;
+		}
+
+		// send the frame without holding the lock
+		uint64_t frame = this->outputPendingFrame;
+
+		lk.unlock();
+		this->coordinatorSendData(frame);
+		lk.lock();
+
+		// let the coordinator queue the next frame
+		this->outputPending = false;
+		this->outputCv.notify_all();
+	}
+}
+
+/**
+ * Stops the output thread after it's sent any frame that's still queued. This
+ * does nothing if output isn't pipelined.
+ */
+void EffectRunner::stopOutputThread(void) {
+	if(this->outputThread == nullptr) {
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lk(this->outputLock);
+		this->outputRunning = false;
+		this->outputCv.notify_all();
+	}
+
+	this->outputThread->join();
+
+	delete this->outputThread;
+	this->outputThread = nullptr;
+}
+
+/**
+ * Hands a converted frame to the output thread. Frames are sent one at a time,
+ * so this waits for the previous frame to be sent first; that also ensures the
+ * buffers of frames still being sent aren't converted into.
+ */
+void EffectRunner::queueFrameForOutput(uint64_t frame) {
+	std::unique_lock<std::mutex> lk(this->outputLock);
+
+	this->outputCv.wait(lk, [this]{
+		return !this->outputPending;
+	});
+
+	this->outputPendingFrame = frame;
+	this->outputPending = true;
+
+	this->outputCv.notify_all();
+}
+
+/**
+ * Waits until the output thread has sent all frames queued for it.
+ */
+void EffectRunner::waitForOutput(void) {
+	std::unique_lock<std::mutex> lk(this->outputLock);
+
+	this->outputCv.wait(lk, [this]{
+		return !this->outputPending;
+	});
+}
+
+#pragma mark - Shows
+/**
+ * Reads the settings for recording shows, and creates the directory they're
+ * stored in.
+ */
+void EffectRunner::setUpShows(void) {
+	this->showDirectory = this->config->Get("runner", "showDirectory", "shows");
+
+	long chunkFrames = this->config->GetInteger("runner", "showChunkFrames", 300);
+	CHECK(chunkFrames > 0) << "Chunks must hold at least one frame; check runner.showChunkFrames";
+
+	this->showChunkFrames = chunkFrames;
+
+	if(mkdir(this->showDirectory.c_str(), 0755) != 0 && errno != EEXIST) {
+		PLOG(WARNING) << "Couldn't create show directory " << this->showDirectory << ": ";
+	}
+}
+
+/**
+ * Returns the path of the show with the given name. Names may not contain any
+ * slashes, so only files in the show directory can be accessed.
+ */
+std::string EffectRunner::showPath(const std::string &name) const {
+	if(name.empty() || name[0] == '.' || name.find('/') != std::string::npos) {
+		throw ShowFile::Error("Invalid show name '" + name + "'");
+	}
+
+	return this->showDirectory + "/" + name + ".lshow";
+}
+
+/**
+ * Starts recording the converted output of all channels into the show with the
+ * given name, replacing it if it exists. This throws if the show can't be
+ * created, or if a show is being played back.
+ */
+void EffectRunner::startRecording(const std::string &name) {
+	std::string path = this->showPath(name);
+
+	std::lock_guard<std::mutex> lk(this->channelBufferMutex);
+	std::lock_guard<std::mutex> lg(this->showLock);
+
+	if(this->player) {
+		throw ShowFile::Error("Can't record while playing back " + this->showName);
+	} else if(this->recorder) {
+		throw ShowFile::Error("Already recording " + this->showName);
+	}
+
+	// the channel table holds every channel that's output
+	std::vector<ShowFile::Channel> channels;
+
+	for(auto const& output : this->channelOutputs) {
+		channels.push_back({uint32_t(output.channel->getId()), uint32_t(output.channel->numPixels), uint32_t(output.stride)});
+	}
+
+	int fps = this->config->GetInteger("runner", "fps", 30);
+
+	this->recorder = std::unique_ptr<ShowFile::Writer>(new ShowFile::Writer(path, fps, channels, this->showChunkFrames));
+	this->showName = name;
+
+	LOG(INFO) << "Recording show " << name << " (" << channels.size() << " channels) to " << path;
+}
+
+/**
+ * Starts playing back the show with the given name, replacing any show that's
+ * already playing. While it plays, no effects are run; if loop is set, the show
+ * starts over once it ends. This throws if the show can't be opened, or if one
+ * is being recorded.
+ */
+void EffectRunner::startPlayback(const std::string &name, bool loop) {
+	std::unique_ptr<ShowFile::Reader> reader(new ShowFile::Reader(this->showPath(name)));
+
+	int fps = this->config->GetInteger("runner", "fps", 30);
+	LOG_IF(WARNING, reader->getFps() != fps) << "Show " << name << " was recorded at " << reader->getFps()
+											 << " fps, but is played back at " << fps << " fps";
+
+	std::lock_guard<std::mutex> lk(this->channelBufferMutex);
+	std::lock_guard<std::mutex> lg(this->showLock);
+
+	if(this->recorder) {
+		throw ShowFile::Error("Can't play back while recording " + this->showName);
+	}
+
+	this->player = std::move(reader);
+	this->showName = name;
+	this->showLoop = loop;
+
+	this->mapShowChannels();
+	this->playingShow = true;
+
+	LOG(INFO) << "Playing back show " << name << " (" << this->player->getNumFrames() << " frames)";
+}
+
+/**
+ * Stops recording or playing back the current show, if any. Effects run again
+ * from the next frame on.
+ */
+void EffectRunner::stopShow(void) {
+	std::lock_guard<std::mutex> lk(this->channelBufferMutex);
+	std::lock_guard<std::mutex> lg(this->showLock);
+
+	if(this->recorder) {
+		this->recorder->finish();
+		this->recorder.reset();
+	}
+
+	if(this->player) {
+		this->endPlayback();
+	}
+}
+
+/**
+ * Returns the show that's being recorded or played back.
+ */
+EffectRunner::ShowStatus EffectRunner::getShowStatus(void) {
+	std::lock_guard<std::mutex> lg(this->showLock);
+
+	ShowStatus status = {false, false, "", 0, 0};
+
+	if(this->recorder) {
+		status.recording = true;
+		status.name = this->showName;
+		status.frames = this->recorder->getNumFrames();
+	} else if(this->player) {
+		status.playing = true;
+		status.name = this->showName;
+		status.frames = this->player->getNumFrames();
+		status.position = this->player->getPosition();
+	}
+
+	return status;
+}
+
+/**
+ * Finds the output of each channel in the show. Channels that are no longer
+ * output, or whose size or format changed since the show was recorded, are
+ * ignored. This must be called with the channel buffer and show locks held.
+ */
+void EffectRunner::mapShowChannels(void) {
+	auto const& channels = this->player->getChannels();
+
+	this->showOutputs.assign(channels.size(), -1);
+	this->showCovered.assign(this->channelOutputs.size(), false);
+
+	for(size_t i = 0; i < channels.size(); i++) {
+		auto const& channel = channels[i];
+
+		for(size_t j = 0; j < this->channelOutputs.size(); j++) {
+			ChannelOutput &output = this->channelOutputs[j];
+
+			if(output.channel->getId() != int(channel.id)) {
+				continue;
+			}
+
+			if(output.channel->numPixels == int(channel.numPixels) && output.stride == channel.stride) {
+				this->showOutputs[i] = j;
+			} else {
+				LOG(WARNING) << "Channel " << channel.id << " changed since show " << this->showName << " was recorded; ignoring it";
+			}
+		}
+	}
+}
+
+/**
+ * Stops the playback. The next frame is converted in full, since the channels'
+ * buffers hold the show's pixels rather than those of the framebuffer. This
+ * must be called with the channel buffer and show locks held.
+ */
+void EffectRunner::endPlayback(void) {
+	LOG(INFO) << "Stopped playing show " << this->showName << " after " << this->player->getPosition() << " frames";
+
+	this->player.reset();
+	this->playingShow = false;
+
+	for(auto &output : this->channelOutputs) {
+		output.hasConvertedFrame = false;
+	}
+}
+
+/**
+ * Adds the converted frame to the show being recorded. Only the pixels that
+ * changed since the previous frame are stored; like when sending, only dirty
+ * regions of the framebuffer are compared.
+ */
+void EffectRunner::recordShowFrame(uint64_t frame) {
+	std::lock_guard<std::mutex> lg(this->showLock);
+
+	if(!this->recorder) {
+		return;
+	}
+
+	TRACE_SCOPE_ARG("recordShowFrame", "frame", frame);
+
+	this->recorder->beginFrame();
+	bool keyFrame = this->recorder->isKeyFrame();
+
+	for(size_t i = 0; i < this->channelOutputs.size(); i++) {
+		ChannelOutput &output = this->channelOutputs[i];
+
+		const uint8_t *buffer = output.buffer(frame);
+		const uint8_t *prevBuffer = output.prevBuffer(frame);
+
+		std::vector<ProtocolHandler::PixelRange> &ranges = this->recordRanges;
+		ranges.clear();
+
+		// key frames hold all pixels anyways
+		if(!keyFrame) {
+			for(auto &dirty : output.dirty(frame)) {
+				size_t offset = dirty.start * output.stride;
+				size_t first = ranges.size();
+
+				EffectRunner::findChangedRanges((prevBuffer + offset), (buffer + offset), dirty.count, output.stride, ranges);
+
+				for(size_t j = first; j < ranges.size(); j++) {
+					ranges[j].start += dirty.start;
+				}
+			}
+		}
+
+		this->recorder->addChannel(i, buffer, ranges);
+	}
+
+	this->recorder->endFrame();
+}
+
+/**
+ * Fills the channels' buffers with the next frame of the show, in place of
+ * running the effects and converting their output. Each channel starts out
+ * with the previous frame's pixels, and the ranges stored in the show are then
+ * copied over them straight from the mapped file; those ranges are all that's
+ * marked as dirty, so nothing else is diffed or sent.
+ *
+ * Channels that aren't in the show keep outputting their last frame. Once the
+ * show ends (and it isn't looped), the playback stops.
+ */
+void EffectRunner::playShowFrame(uint64_t frame) {
+	TRACE_SCOPE_ARG("playShowFrame", "frame", frame);
+	std::lock_guard<std::mutex> lg(this->showLock);
+
+	// read the next frame, starting over at the end when looping
+	bool haveFrame = false;
+
+	if(this->player) {
+		haveFrame = this->player->nextFrame(this->showFrame);
+
+		if(!haveFrame && this->showLoop && this->player->getPosition() > 0) {
+			this->player->rewind();
+			haveFrame = this->player->nextFrame(this->showFrame);
+		}
+	}
+
+	// find the outputs that the frame completely overwrites
+	std::fill(this->showCovered.begin(), this->showCovered.end(), false);
+
+	for(size_t i = 0; haveFrame && i < this->showOutputs.size(); i++) {
+		int index = this->showOutputs[i];
+		auto const& ranges = this->showFrame[i].ranges;
+
+		if(index >= 0 && ranges.size() == 1 && ranges[0].start == 0 &&
+		   ranges[0].count == size_t(this->channelOutputs[index].channel->numPixels)) {
+			this->showCovered[index] = true;
+		}
+	}
+
+	// start from the previous frame
+	for(size_t i = 0; i < this->channelOutputs.size(); i++) {
+		ChannelOutput &output = this->channelOutputs[i];
+		size_t size = output.channel->numPixels * output.stride;
+
+		output.dirty(frame).clear();
+
+		// no need if the show frame holds all of its pixels
+		bool covered = (i < this->showCovered.size()) && this->showCovered[i];
+
+		if(!covered && output.hasConvertedFrame) {
+			memcpy(output.buffer(frame), output.prevBuffer(frame), size);
+		} else if(!covered) {
+			memset(output.buffer(frame), 0, size);
+
+			if(output.channel->numPixels > 0) {
+				output.dirty(frame).push_back({0, size_t(output.channel->numPixels)});
+			}
+		}
+
+		output.hasConvertedFrame = true;
+	}
+
+	// then copy the show's pixels over it
+	for(size_t i = 0; haveFrame && i < this->showOutputs.size(); i++) {
+		int index = this->showOutputs[i];
+
+		if(index < 0) {
+			continue;
+		}
+
+		ChannelOutput &output = this->channelOutputs[index];
+		const uint8_t *pixels = this->showFrame[i].pixels;
+
+		for(auto const& range : this->showFrame[i].ranges) {
+			size_t length = range.count * output.stride;
+
+			memcpy((output.buffer(frame) + (range.start * output.stride)), pixels, length);
+			pixels += length;
+
+			output.dirty(frame).push_back(range);
+		}
+	}
+
+	// stop once the show is over
+	if(!haveFrame && this->player) {
+		this->endPlayback();
+	}
 }
@@ -10,19 +10,29 @@
 
 #include "HSIPixel.h"
 #include "OutputMapper.h"
+#include "ProtocolHandler.h"
+#include "FramePublisher.h"
+#include "ShowFile.h"
 
 #include "INIReader.h"
 #include "CTPL/ctpl.h"
 
 #include <thread>
 #include <atomic>
+#include <chrono>
+#include <future>
+#include <map>
+#include <set>
+#include <memory>
+#include <string>
+#include <vector>
 #include <condition_variable>
 
 class DataStore;
 class Framebuffer;
+class Histogram;
 class DbChannel;
 class Routine;
-class ProtocolHandler;
 
 class EffectRunner {
 	public:
@@ -33,6 +43,12 @@ class EffectRunner {
 		inline OutputMapper *getMapper(void) const {
 			return this->mapper;
 		}
+		inline ProtocolHandler *getProtocolHandler(void) const {
+			return this->proto;
+		}
+		inline FramePublisher *getPublisher(void) {
+			return &this->publisher;
+		}
 
 	private:
 		void setUpThreadPool(void);
@@ -46,9 +62,6 @@ class EffectRunner {
 		std::thread *coordinator;
 		std::atomic_bool coordinatorRunning;
 
-		double avgSleepTime = 0;
-		double avgSleepTimeSamples = 0;
-
 		std::atomic_int frameCounter;
 
 		std::mutex effectLock;
@@ -56,37 +69,395 @@ class EffectRunner {
 	// effect running
 	private:
 		void coordinatorRunEffects(void);
-		void runEffect(OutputMapper::OutputGroup *group, Routine *routine);
+		void copyEffectOutput(OutputMapper::OutputGroup *group, Routine *routine);
+		void runEffect(OutputMapper::OutputGroup *group, Routine *routine, int frame);
+
+		bool feedsOutputChannels(const OutputMapper::Snapshot::Mapping &mapping) const;
+
+		void addLoadingRanges(const OutputMapper::Snapshot::Mapping &mapping);
+		bool isChannelHeld(const DbChannel *channel, uint64_t frame) const;
+
+		/// pixels of groups whose routines are loading in the current frame
+		std::vector<ProtocolHandler::PixelRange> loadingRanges;
 
-		std::condition_variable effectsCv;
-		std::atomic_int outstandingEffects;
+		/// number of the current frame by the wall clock; only used when sharded
+		uint64_t wallFrame = 0;
+
+		/// how long effects may take to run each frame before they're skipped
+		std::chrono::nanoseconds effectDeadline;
+
+		/// an effect that didn't finish before the deadline of a previous frame
+		struct OverrunEffect {
+			Routine *routine;
+			std::future<void> future;
+		};
+
+		/// overrun effects, by the group they're running on
+		std::map<OutputMapper::OutputGroup *, OverrunEffect> overrunEffects;
+		/// routines of the overrun effects; when an ubergroup is replaced, its
+		/// routine may still be running on the old one
+		std::set<Routine *> overrunRoutines;
+
+	public:
+		/// returns how many times an effect missed its frame deadline
+		unsigned long getEffectOverruns(void) const {
+			return this->effectOverruns;
+		}
+
+	private:
+		std::atomic_ulong effectOverruns;
+
+	// channel output state
+	private:
+		/**
+		 * Number of frames of converted pixels kept for each channel: the one
+		 * being converted, the one being sent, and the previous one that it's
+		 * compared against.
+		 */
+		static const size_t kOutputSlots = 3;
+
+		/**
+		 * Output state of a single channel. Each channel has a ring of packets,
+		 * whose payloads hold the converted pixels of the last few frames. A
+		 * frame is converted into the slot given by its frame number, so the
+		 * previous frame never has to be copied, and a frame can be sent while
+		 * the next one is converted.
+		 */
+		struct ChannelOutput {
+			DbChannel *channel;
+
+			bool isRGBW;
+			/// bytes per pixel
+			size_t stride;
+
+			/// packets for each frame, and the pixel data in their payloads
+			uint8_t *packets[kOutputSlots];
+			uint8_t *buffers[kOutputSlots];
+			/// packet for delta frames; only allocated if they're enabled
+			uint8_t *deltaPacket;
+
+			/// whether a frame was sent, which the next one can be compared to
+			bool hasPrevFrame;
+			/// whether a frame was converted, so the previous slot holds its pixels
+			bool hasConvertedFrame;
+
+			/// pixels whose framebuffer data may have changed in each slot's frame
+			std::vector<ProtocolHandler::PixelRange> dirtyRanges[kOutputSlots];
+
+			uint8_t *packet(uint64_t frame) const {
+				return this->packets[frame % kOutputSlots];
+			}
+			uint8_t *buffer(uint64_t frame) const {
+				return this->buffers[frame % kOutputSlots];
+			}
+			uint8_t *prevBuffer(uint64_t frame) const {
+				return this->buffers[(frame + kOutputSlots - 1) % kOutputSlots];
+			}
+			std::vector<ProtocolHandler::PixelRange> &dirty(uint64_t frame) {
+				return this->dirtyRanges[frame % kOutputSlots];
+			}
+		};
 
 	// pixel conversion
 	private:
-		void coordinatorDoConversions(void);
-		void convertPixelData(DbChannel *channel);
+		/**
+		 * A range of pixels in a single channel that's converted as one unit
+		 * of work. Chunks are built whenever the channels are updated.
+		 */
+		struct ConversionChunk {
+			ChannelOutput *output;
+
+			/// first pixel of the chunk, relative to the start of the channel
+			size_t start;
+			/// number of pixels in the chunk
+			size_t count;
+
+			/// with fused conversion, the chunk's segments in fusedSegments
+			size_t firstSegment;
+			size_t numSegments;
+		};
+
+		/**
+		 * State shared between all threads taking part in one frame's
+		 * conversion. Threads take chunks off the list until it runs dry, so
+		 * whoever is free picks up the next chunk regardless of its channel.
+		 */
+		struct ConversionJob {
+			const std::vector<ConversionChunk> *chunks;
+			/// number of chunks in the list when the job was created
+			size_t numChunks;
+			/// frame that's being converted
+			uint64_t frame;
+
+			/// index of the next chunk to be taken
+			std::atomic_size_t next;
+			/// number of chunks that have been converted
+			std::atomic_size_t completed;
+
+			std::mutex lock;
+			std::condition_variable done;
+		};
+
+		void coordinatorDoConversions(uint64_t frame);
+		void convertChunks(ConversionJob *job);
+		void convertPixelData(const ConversionChunk &chunk, uint64_t frame);
+
+		void _convertToRgb(const ConversionChunk &chunk, uint64_t frame);
+		void _convertToRgbw(const ConversionChunk &chunk, uint64_t frame);
+
+		void setUpConversion(void);
+		void updateConversionChunks(void);
+
+		void updateDirtyRanges(uint64_t frame);
+
+		// channels overlapping the dirty range being looked at
+		std::vector<size_t> affectedChannels;
+
+		// whether clean regions of the framebuffer are skipped
+		bool dirtyTracking = true;
+
+		std::vector<ConversionChunk> conversionChunks;
+		size_t conversionChunkSize = 256;
+
+	// fused conversion
+	private:
+		/**
+		 * A run of pixels in a conversion chunk that all come from the same
+		 * group. With fused conversion, chunks are converted straight from the
+		 * groups' buffers (with brightness applied) into the channel's output
+		 * buffer, without going through the framebuffer.
+		 */
+		struct FusedSegment {
+			/// group whose brightness applies; nullptr if no group covers the pixels
+			OutputMapper::OutputGroup *group;
+			/// mapped group whose buffer holds the pixels, e.g. a member's ubergroup
+			OutputMapper::OutputGroup *source;
+			/// index of the first pixel in the source's buffer
+			size_t sourceOffset;
+
+			/// first pixel, relative to the start of the channel
+			size_t start;
+			/// number of pixels in the segment
+			size_t count;
+		};
+
+		void updateFusedSegments(const OutputMapper::Snapshot *snapshot);
+		void _convertFused(const ConversionChunk &chunk, uint64_t frame);
+
+		// whether chunks are converted straight from the group buffers
+		bool fusedConversion = false;
+
+		// output mapper generation the segments were built for
+		unsigned long fusedGeneration = 0;
+		bool fusedSegmentsValid = false;
+
+		std::vector<FusedSegment> fusedSegments;
+
+	// conversion performance counters
+	private:
+		double avgConversionTime = 0;
+		double avgConversionTimeSamples = 0;
+
+		size_t conversionPixels = 0;
+
+	public:
+		/// returns the average time taken to convert all channels, in µS
+		double getAvgConversionTime(void) const {
+			return this->avgConversionTime;
+		}
+		/// returns the total number of pixels converted each frame
+		size_t getConversionPixels(void) const {
+			return this->conversionPixels;
+		}
+
+		double getMedianSendTime(void) const;
+
+	// stage histograms
+	private:
+		void setUpHistograms(void);
+		void setUpTracing(void);
+		void setUpScriptCache(void);
+
+		Histogram *effectsHistogram;
+		Histogram *conversionHistogram;
+		Histogram *diffHistogram;
+		Histogram *frameHistogram;
+
+		/// time spent diffing channels during the frame being sent
+		std::chrono::nanoseconds diffTime;
+
+	// frame publishing
+	private:
+		void publishFrame(uint64_t frame);
+
+		FramePublisher publisher;
+
+	// show recording and playback
+	public:
+		void startRecording(const std::string &name);
+		void startPlayback(const std::string &name, bool loop);
+		void stopShow(void);
+
+		/// what show is being recorded or played back
+		struct ShowStatus {
+			bool recording;
+			bool playing;
+
+			std::string name;
+
+			/// frames recorded so far, or the number of frames in the show
+			uint64_t frames;
+			/// frames played since the start of the show
+			uint64_t position;
+		};
+
+		ShowStatus getShowStatus(void);
+
+	private:
+		void setUpShows(void);
+		std::string showPath(const std::string &name) const;
+
+		void recordShowFrame(uint64_t frame);
+		void playShowFrame(uint64_t frame);
+
+		void mapShowChannels(void);
+		void endPlayback(void);
+
+		// directory shows are stored in, and frames in each chunk of a recording
+		std::string showDirectory;
+		size_t showChunkFrames = 300;
 
-		void _convertToRgb(DbChannel *channel);
-		void _convertToRgbw(DbChannel *channel);
+		// protects the recorder and player; taken after the channel buffer lock
+		std::mutex showLock;
 
-		std::condition_variable conversionCv;
-		std::atomic_int outstandingConversions;
+		std::unique_ptr<ShowFile::Writer> recorder;
+		std::unique_ptr<ShowFile::Reader> player;
+
+		std::string showName;
+		bool showLoop = false;
+
+		// set while a show is played back instead of running the effects
+		std::atomic_bool playingShow{false};
+
+		// output index of each channel in the show, or -1 if it's not output
+		std::vector<int> showOutputs;
+		// whether the current show frame holds all pixels of each output
+		std::vector<bool> showCovered;
+
+		std::vector<ShowFile::Reader::ChannelFrame> showFrame;
+		// ranges of pixels that changed in the channel being recorded
+		std::vector<ProtocolHandler::PixelRange> recordRanges;
 
 	// data sending
 	private:
-		void coordinatorSendData(void);
+		void coordinatorSendData(uint64_t frame);
+
+		void outputPixelData(ChannelOutput &output, uint64_t frame);
 
-		void outputPixelData(DbChannel *channel);
+		void setUpDeltaFrames(void);
+
+	public:
+		static void findChangedRanges(const uint8_t *prev, const uint8_t *cur, size_t numPixels, size_t pixelStride, std::vector<ProtocolHandler::PixelRange> &ranges);
+
+	private:
+		// whether changed ranges are sent as delta packets
+		bool deltaFrames = false;
+		// deltas are only sent if smaller than this fraction of a full frame
+		double deltaThreshold = 0.75;
+
+		// ranges of pixels that changed in the channel being sent
+		std::vector<ProtocolHandler::PixelRange> changedRanges;
 
 		std::condition_variable sendingCv;
 		std::atomic_int outstandingSends;
 
-	// nanosleep inaccuracy compensation
+		// number of the next frame to be converted
+		uint64_t outputFrame = 0;
+
+		// wall clock frame number of each slot's frame, for syncing shards
+		uint64_t wallFrames[kOutputSlots] = {0};
+
+		// pixels that aren't output in each slot's frame, since their routine
+		// was still loading
+		std::vector<ProtocolHandler::PixelRange> heldRanges[kOutputSlots];
+
+	// pipelined output
+	private:
+		friend void OutputEntryPoint(void *ctx);
+
+		void setUpOutputThread(void);
+		void outputThreadEntry(void);
+		void stopOutputThread(void);
+
+		void queueFrameForOutput(uint64_t frame);
+		void waitForOutput(void);
+
+		// whether frames are sent on the output thread while the next is computed
+		bool pipelined = false;
+
+		std::thread *outputThread = nullptr;
+		bool outputRunning = false;
+
+		// set while a frame is waiting to be sent, or is being sent
+		bool outputPending = false;
+		uint64_t outputPendingFrame = 0;
+
+		std::mutex outputLock;
+		std::condition_variable outputCv;
+
+	// frame timing
 	private:
-		double sleepInaccuracy = 0;
-		double sleepInaccuracySamples = 0;
+		/// what to do when a frame takes longer than its period
+		enum OverrunPolicy {
+			/// drop the frames that were missed, staying on the same schedule
+			kOverrunSkip,
+			/// start the next frame immediately, and schedule from there on
+			kOverrunRestart
+		};
 
-		void compensateSleepInaccuracies(long requestedNs, long actualNs);
+		void setUpFrameTimer(int fps);
+		void setUpCoordinatorScheduling(void);
+		void waitForNextFrame(void);
+		void alignFrameDeadline(void);
+
+		void addJitterSample(double micros);
+
+		std::chrono::nanoseconds framePeriod;
+		std::chrono::steady_clock::time_point nextFrameDeadline;
+
+		OverrunPolicy overrunPolicy = kOverrunSkip;
+
+		std::atomic_ulong frameOverruns;
+		std::atomic_ulong framesSkipped;
+
+		// how late the coordinator woke up for the last few frames, in µS
+		static const size_t kJitterSamples = 1024;
+
+		std::mutex jitterLock;
+		std::vector<double> jitterSamples;
+		size_t jitterNextSample = 0;
+
+	public:
+		/// percentiles of how late frames started, in µS
+		struct JitterStats {
+			double p50;
+			double p90;
+			double p99;
+			double max;
+
+			size_t samples;
+		};
+
+		JitterStats getJitterStats(void);
+
+		/// returns how many frames took longer than their period
+		unsigned long getFrameOverruns(void) const {
+			return this->frameOverruns;
+		}
+		/// returns how many frames were skipped because of overruns
+		unsigned long getFramesSkipped(void) const {
+			return this->framesSkipped;
+		}
 
 	// fps accounting
 	private:
@@ -102,18 +473,44 @@ class EffectRunner {
 			return this->actualFps;
 		}
 
+	// group handling
+	public:
+		/**
+		 * Requests that the framebuffer and output groups are updated for the
+		 * groups in the data store before the next frame. This must be called
+		 * whenever a group is created or replaced.
+		 */
+		void groupsChanged(void) {
+			this->groupUpdatePending = true;
+		}
+
+	private:
+		void updateGroups(void);
+		void fitFramebufferToChannels(void);
+
+		std::atomic_bool groupUpdatePending;
+
 	// channel handling
 	public:
 		void updateChannels(void);
 
     void deleteChannelBuffers(void);
 
+		/**
+		 * Requests that the channels are fetched again, and their buffers are
+		 * reallocated, before the next frame. This must be called whenever a
+		 * channel is created or replaced.
+		 */
+		void channelsChanged(void) {
+			this->channelUpdatePending = true;
+		}
+
 		std::atomic_bool channelUpdatePending;
 
 		std::vector<DbChannel *> outputChannels;
 
-    std::map<DbChannel *, uint8_t *> channelBuffers;
-		std::map<DbChannel *, uint8_t *> channelBuffersPrevFrame;
+		// output state of each channel, in the same order as outputChannels
+		std::vector<ChannelOutput> channelOutputs;
 
 		std::mutex channelBufferMutex;
 
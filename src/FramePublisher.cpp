@@ -0,0 +1,109 @@
+#include "FramePublisher.h"
+#include "Framebuffer.h"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+
+/**
+ * Sets the function that's invoked whenever a frame was published. Once this
+ * returns, the previous listener won't be called again.
+ */
+void FramePublisher::setListener(Listener listener) {
+	std::lock_guard<std::mutex> lg(this->lock);
+	this->listener = listener;
+}
+
+/**
+ * Starts publishing frames, at most once per interval. An interval of zero
+ * publishes every frame.
+ */
+void FramePublisher::setInterval(clock::duration interval) {
+	auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(interval);
+	this->interval = std::max(int64_t(0), int64_t(ns.count()));
+}
+
+/**
+ * Stops publishing frames, e.g. because nobody is interested in them any more.
+ * The last published frame stays available.
+ */
+void FramePublisher::disable(void) {
+	this->interval = -1;
+}
+
+/**
+ * Checks whether a frame should be published now. This is cheap enough to be
+ * called by the coordinator every frame.
+ */
+bool FramePublisher::wantsFrame(void) {
+	int64_t interval = this->interval;
+
+	if(interval < 0) {
+		return false;
+	}
+
+	// the publish time is only written by the coordinator, which is the caller
+	return isDue(this->lastPublish, clock::now(), std::chrono::nanoseconds(interval));
+}
+
+/**
+ * Copies the framebuffer into a free frame and publishes it. This should only
+ * be called by the coordinator, while nobody writes to the framebuffer.
+ */
+void FramePublisher::publish(uint64_t number, Framebuffer *fb) {
+	std::shared_ptr<Frame> frame = this->getFreeFrame();
+
+	frame->number = number;
+	frame->time = clock::now();
+
+	// copy the planes
+	size_t elements = fb->size();
+	auto span = fb->getSpan(0, elements);
+
+	frame->h.assign(span.h, span.h + elements);
+	frame->s.assign(span.s, span.s + elements);
+	frame->i.assign(span.i, span.i + elements);
+
+	this->lastPublish = frame->time;
+
+	// swap it in; the old frame goes away once the last observer is done
+	std::lock_guard<std::mutex> lg(this->lock);
+
+	this->current = frame;
+
+	// notify under the lock, so the listener can't be called once it's cleared
+	if(this->listener) {
+		this->listener();
+	}
+}
+
+/**
+ * Returns the most recently published frame, or nullptr if none was published
+ * yet.
+ */
+std::shared_ptr<const FramePublisher::Frame> FramePublisher::latest(void) {
+	std::lock_guard<std::mutex> lg(this->lock);
+	return this->current;
+}
+
+/**
+ * Finds a frame that nobody holds a reference to, or allocates a new one if
+ * all of them are in use.
+ */
+std::shared_ptr<FramePublisher::Frame> FramePublisher::getFreeFrame(void) {
+	std::lock_guard<std::mutex> lg(this->lock);
+
+	for(auto &frame : this->frames) {
+		// our reference is the only one (the current frame is also in current)
+		if(frame.use_count() == 1) {
+			return frame;
+		}
+	}
+
+	auto frame = std::make_shared<Frame>();
+	this->frames.push_back(frame);
+
+	VLOG(1) << "Allocated published frame " << this->frames.size();
+
+	return frame;
+}
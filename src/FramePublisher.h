@@ -0,0 +1,91 @@
+/**
+ * Publishes copies of the framebuffer for observers, such as command server
+ * clients that subscribed to the live output.
+ *
+ * The coordinator publishes a frame only if someone is interested in it, and
+ * at most as often as the most demanding observer asked for. Published frames
+ * are immutable: observers hold a reference to the latest one for as long as
+ * they need it, and never block the coordinator. Frames nobody references any
+ * more are reused for later publishes, so publishing doesn't allocate once the
+ * framebuffer size is stable.
+ *
+ * All methods may be called from any thread.
+ */
+#ifndef FRAMEPUBLISHER_H
+#define FRAMEPUBLISHER_H
+
+#include <chrono>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <functional>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+class Framebuffer;
+
+class FramePublisher {
+	public:
+		typedef std::chrono::steady_clock clock;
+
+		/**
+		 * A copy of the framebuffer at the end of a frame. The components of
+		 * each pixel are stored in separate planes, like in the framebuffer.
+		 */
+		struct Frame {
+			/// output frame number
+			uint64_t number;
+			clock::time_point time;
+
+			std::vector<float> h;
+			std::vector<float> s;
+			std::vector<float> i;
+
+			size_t size() const {
+				return this->h.size();
+			}
+		};
+
+		/// called on the coordinator after each published frame; must be quick
+		typedef std::function<void(void)> Listener;
+
+	public:
+		/**
+		 * Checks whether a frame at the given time is due, if the last one was
+		 * at the given time. Frames may come in slightly early, since the
+		 * coordinator's frame timing jitters a bit.
+		 */
+		static bool isDue(clock::time_point last, clock::time_point now, clock::duration interval) {
+			return (now - last) >= (interval - (interval / 8));
+		}
+
+	public:
+		void setListener(Listener listener);
+		void setInterval(clock::duration interval);
+		void disable(void);
+
+		bool wantsFrame(void);
+		void publish(uint64_t number, Framebuffer *fb);
+
+		std::shared_ptr<const Frame> latest(void);
+
+	private:
+		std::shared_ptr<Frame> getFreeFrame(void);
+
+	private:
+		std::mutex lock;
+
+		/// most recently published frame
+		std::shared_ptr<const Frame> current;
+		/// all frames that were allocated, so they can be reused
+		std::vector<std::shared_ptr<Frame>> frames;
+
+		/// minimum time between published frames, in ns; negative if disabled
+		std::atomic<int64_t> interval{-1};
+		clock::time_point lastPublish;
+
+		Listener listener;
+};
+
+#endif
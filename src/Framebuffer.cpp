@@ -1,12 +1,20 @@
 #include "Framebuffer.h"
 
 #include "DataStore.h"
+#include "Channel.h"
 
 #include <glog/logging.h>
 
 #include <vector>
 #include <tuple>
 #include <iostream>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+
+/// alignment of each plane, in bytes
+static const size_t kPlaneAlignment = 64;
 
 /**
  * Allocates the framebuffer memory.
@@ -20,7 +28,9 @@ Framebuffer::Framebuffer(DataStore *store, INIReader *reader) {
  * Cleans up the memory associated with the framebuffer.
  */
 Framebuffer::~Framebuffer() {
-
+	free(this->h);
+	free(this->s);
+	free(this->i);
 }
 
 /**
@@ -28,7 +38,9 @@ Framebuffer::~Framebuffer() {
  * groups defined in the database. This is called any time that groups are
  * modified.
  *
- * This goes through all defined groups and sums up their sizes.
+ * This goes through all defined groups and sums up their sizes, and rebuilds
+ * the index of which groups cover which pixels. If groups leave gaps between
+ * them, the framebuffer is grown to cover the one that ends last.
  */
 void Framebuffer::recalculateMinSize() {
 	int minSize = 0;
@@ -36,13 +48,17 @@ void Framebuffer::recalculateMinSize() {
 	// fetch all groups, then iterate over them
 	std::vector<DbGroup *> groups = this->store->getAllGroups();
 
+	this->groupIndex.clear();
+
 	for(auto group : groups) {
 		minSize += group->numPixels();
 
-		// delete the groups; they were allocated just for this call
-		delete group;
+		this->groupIndex.add(group->start, group->numPixels(), group->getId());
 	}
 
+	this->groupIndex.build();
+	minSize = std::max(size_t(minSize), this->groupIndex.extent());
+
 	// resize the vector
 	LOG(INFO) << "Total of " << minSize << " pixels across " << groups.size()
 			  << " groups";
@@ -51,10 +67,14 @@ void Framebuffer::recalculateMinSize() {
 }
 
 /**
- * Returns a pointer to the framebuffer's pixel data.
+ * Returns a span covering the given range of pixels.
  */
-std::vector<HSIPixel>::iterator Framebuffer::getDataPointer() {
-	return this->data.begin();
+Framebuffer::Span Framebuffer::getSpan(size_t offset, size_t count) {
+	CHECK((offset + count) <= this->elements) << "Span [" << offset << ", "
+		<< (offset + count) << ") is outside the framebuffer (size "
+		<< this->elements << ")";
+
+	return Span(this->h + offset, this->s + offset, this->i + offset, count);
 }
 
 /**
@@ -64,9 +84,175 @@ std::vector<HSIPixel>::iterator Framebuffer::getDataPointer() {
  * the end.
  */
 void Framebuffer::resize(int elements) {
-	// first, resize the vector to the correct size
-	this->data.resize(elements, {0, 0, 0});
+	float *planes[3] = {
+		Framebuffer::allocPlane(elements),
+		Framebuffer::allocPlane(elements),
+		Framebuffer::allocPlane(elements)
+	};
+	float **oldPlanes[3] = {&this->h, &this->s, &this->i};
+
+	// copy whatever data fits in the new planes and release the old ones
+	size_t toCopy = std::min(size_t(elements), this->elements);
+
+	for(size_t p = 0; p < 3; p++) {
+		if(*oldPlanes[p] != nullptr) {
+			memcpy(planes[p], *oldPlanes[p], (toCopy * sizeof(float)));
+			free(*oldPlanes[p]);
+		}
+
+		*oldPlanes[p] = planes[p];
+	}
+
+	this->elements = elements;
+
+	// everything moved, so all of it needs to be looked at again
+	size_t regions = (this->elements + kDirtyRegionSz - 1) / kDirtyRegionSz;
+	this->dirty.assign(((regions + 63) / 64), 0);
+
+	this->markAllDirty();
+}
+
+/**
+ * Allocates a zeroed plane that can hold the given number of elements. Its
+ * size is rounded up to a whole number of cache lines.
+ */
+float *Framebuffer::allocPlane(size_t elements) {
+	size_t bytes = elements * sizeof(float);
+	bytes = std::max(((bytes + kPlaneAlignment - 1) / kPlaneAlignment) * kPlaneAlignment,
+					 kPlaneAlignment);
+
+	float *plane = static_cast<float *>(aligned_alloc(kPlaneAlignment, bytes));
+	CHECK(plane != nullptr) << "Couldn't allocate framebuffer plane (" << bytes << " bytes)";
+
+	memset(plane, 0, bytes);
+	return plane;
+}
+
+#pragma mark - Overlap Index
+/**
+ * Rebuilds the index of which channels cover which pixels. Channels are
+ * identified by their index in the given list.
+ */
+void Framebuffer::updateChannelIndex(const std::vector<DbChannel *> &channels) {
+	this->channelIndex.clear();
+
+	for(size_t i = 0; i < channels.size(); i++) {
+		this->channelIndex.add(channels[i]->fbOffset, channels[i]->numPixels, i);
+	}
+
+	this->channelIndex.build();
+}
+
+#pragma mark - Dirty Tracking
+/**
+ * Marks the given range of pixels as having been written to.
+ */
+void Framebuffer::markDirty(size_t offset, size_t count) {
+	if(count == 0) {
+		return;
+	}
+
+	size_t first = offset / kDirtyRegionSz;
+	size_t last = (offset + count - 1) / kDirtyRegionSz;
+
+	for(size_t region = first; region <= last; region++) {
+		this->dirty[region / 64] |= (1ULL << (region % 64));
+	}
+}
+
+/**
+ * Marks the entire framebuffer as dirty.
+ */
+void Framebuffer::markAllDirty(void) {
+	std::fill(this->dirty.begin(), this->dirty.end(), ~0ULL);
+}
 
-	// now, reserve that memory
-	this->data.reserve(elements);
+/**
+ * Marks the entire framebuffer as clean.
+ */
+void Framebuffer::clearDirty(void) {
+	std::fill(this->dirty.begin(), this->dirty.end(), 0);
+}
+
+/**
+ * Checks whether any pixel in the given range may have been written to. This is
+ * conservative: pixels near the range that share a region with it count too.
+ */
+bool Framebuffer::isDirty(size_t offset, size_t count) const {
+	if(count == 0) {
+		return false;
+	}
+
+	return (this->nextDirty(offset, (offset + count)) < (offset + count));
+}
+
+/**
+ * Returns the first pixel at or after offset that lies in a dirty region, or end
+ * if there's none before it.
+ */
+size_t Framebuffer::nextDirty(size_t offset, size_t end) const {
+	for(size_t region = offset / kDirtyRegionSz; (region * kDirtyRegionSz) < end; region++) {
+		// skip whole words of clean regions at once
+		if((region % 64) == 0 && this->dirty[region / 64] == 0) {
+			region += 63;
+			continue;
+		}
+
+		if(this->isRegionDirty(region)) {
+			return std::min(std::max(offset, (region * kDirtyRegionSz)), end);
+		}
+	}
+
+	return end;
+}
+
+/**
+ * Returns the first pixel at or after offset that lies in a clean region, or end
+ * if there's none before it.
+ */
+size_t Framebuffer::nextClean(size_t offset, size_t end) const {
+	for(size_t region = offset / kDirtyRegionSz; (region * kDirtyRegionSz) < end; region++) {
+		if(!this->isRegionDirty(region)) {
+			return std::min(std::max(offset, (region * kDirtyRegionSz)), end);
+		}
+	}
+
+	return end;
+}
+
+#pragma mark - Spans
+/**
+ * Returns a span covering part of this span.
+ */
+Framebuffer::Span Framebuffer::Span::subspan(size_t offset, size_t count) const {
+	CHECK((offset + count) <= this->count) << "Subspan out of range";
+
+	return Span(this->h + offset, this->s + offset, this->i + offset, count);
+}
+
+/**
+ * Writes pixels into the span, scaling their intensity by the given brightness.
+ * The input buffer must hold as many pixels as the span.
+ */
+void Framebuffer::Span::store(const HSIPixel *in, double brightness) {
+	for(size_t j = 0; j < this->count; j++) {
+		// wrap hue to [0, 360); this is done in double precision so that large
+		// hues keep their accuracy
+		double H = in[j].h;
+		H = H - (360. * floor(H / 360.));
+
+		double S = in[j].s;
+		double I = in[j].i * brightness;
+
+		this->h[j] = float(H);
+		this->s[j] = float(S > 0 ? (S < 1 ? S : 1) : 0);
+		this->i[j] = float(I > 0 ? (I < 1 ? I : 1) : 0);
+	}
+}
+
+/**
+ * Reads a single pixel from the span.
+ */
+HSIPixel Framebuffer::Span::get(size_t index) const {
+	return HSIPixel(this->h[index], this->s[index], this->i[index]);
 }
@@ -6,26 +6,72 @@
  * grouping configuration, and is safe for concurrent access by multiple threads
  * so long as no two threads attempt to WRITE to the same region of the buffer.
  *
- * Internally, the framebuffer stores each pixel as a HSI tuple. The index of
- * the H component is 0, S is at 1, and I is at 2.
+ * Internally, the framebuffer stores each of the components of the pixels in a
+ * separate plane of floats, each aligned to a cache line. Pixels are normalized
+ * as they are written: hue is wrapped to [0, 360), and saturation and intensity
+ * are clamped to [0, 1]. This way, the converters can work on whole vectors of
+ * pixels without any additional shuffling.
  *
- * TODO: Resize the framebuffer if the configuration of groups is changed.
+ * Writes can be tracked in a dirty bitmap, where each bit covers a fixed size
+ * region of pixels. Consumers check it to skip regions that weren't written to
+ * since the bitmap was last cleared. The bitmap isn't synchronized: all marking
+ * and clearing has to happen on one thread, while nobody is reading it.
+ *
+ * The framebuffer also indexes which groups and channels cover which of its
+ * pixels, so that a range of pixels can be mapped to everything it feeds into
+ * without going through all of them. The index is rebuilt whenever groups or
+ * channels change.
  */
 #ifndef FRAMEBUFFER_H
 #define FRAMEBUFFER_H
 
 #include "HSIPixel.h"
+#include "RangeIndex.h"
 
 #include <vector>
 #include <iostream>
+#include <cstddef>
+#include <cstdint>
 
 #include "INIReader.h"
 
 class DataStore;
+class DbChannel;
 
 class Framebuffer {
 	friend class EffectRunner;
 
+	public:
+		/**
+		 * A view into a contiguous range of pixels in the framebuffer. It holds
+		 * pointers to the start of the range in each of the planes.
+		 */
+		class Span {
+			public:
+				Span(float *h, float *s, float *i, size_t count) : h(h), s(s),
+					 i(i), count(count) { }
+
+				/**
+				 * Returns the number of pixels in the span.
+				 */
+				size_t size() const {
+					return this->count;
+				}
+
+				Span subspan(size_t offset, size_t count) const;
+
+				void store(const HSIPixel *in, double brightness = 1.0);
+				HSIPixel get(size_t index) const;
+
+			public:
+				float *const h;
+				float *const s;
+				float *const i;
+
+			private:
+				size_t count;
+		};
+
 	public:
 		Framebuffer(DataStore *store, INIReader *reader);
 		~Framebuffer();
@@ -34,21 +80,85 @@ class Framebuffer {
 
 		void resize(int elements);
 
-		std::vector<HSIPixel>::iterator getDataPointer();
+		Span getSpan(size_t offset, size_t count);
 
 		/**
 		 * Returns how many elements the framebuffer can accomodate. It is
 		 * very important that no elements are added past this index.
 		 */
 		int size() {
-			return this->data.capacity();
+			return this->elements;
+		}
+
+	// dirty tracking
+	public:
+		/// number of pixels covered by each bit of the dirty bitmap
+		static const size_t kDirtyRegionSz = 64;
+
+		void markDirty(size_t offset, size_t count);
+		void markAllDirty(void);
+		void clearDirty(void);
+
+		bool isDirty(size_t offset, size_t count) const;
+
+		size_t nextDirty(size_t offset, size_t end) const;
+		size_t nextClean(size_t offset, size_t end) const;
+
+	private:
+		inline bool isRegionDirty(size_t region) const {
+			return (this->dirty[region / 64] >> (region % 64)) & 1;
+		}
+
+		/// one bit per region
+		std::vector<uint64_t> dirty;
+
+	// overlap index
+	public:
+		void updateChannelIndex(const std::vector<DbChannel *> &channels);
+
+		/**
+		 * Appends the ids of all groups that cover part of the given range.
+		 */
+		void groupsOverlapping(size_t offset, size_t count, std::vector<size_t> &ids) const {
+			this->groupIndex.query(offset, count, ids);
+		}
+		/**
+		 * Appends the indices of all channels (in the list last passed to
+		 * updateChannelIndex) that cover part of the given range.
+		 */
+		void channelsOverlapping(size_t offset, size_t count, std::vector<size_t> &indices) const {
+			this->channelIndex.query(offset, count, indices);
+		}
+
+		/**
+		 * Checks whether any group covers part of the given range.
+		 */
+		bool hasGroupsOverlapping(size_t offset, size_t count) const {
+			return this->groupIndex.overlaps(offset, count);
+		}
+		/**
+		 * Checks whether any channel covers part of the given range.
+		 */
+		bool hasChannelsOverlapping(size_t offset, size_t count) const {
+			return this->channelIndex.overlaps(offset, count);
 		}
 
+	private:
+		RangeIndex groupIndex;
+		RangeIndex channelIndex;
+
+	private:
+		static float *allocPlane(size_t elements);
+
 	private:
 		DataStore *store;
 		INIReader *config;
 
-		std::vector<HSIPixel> data;
+		size_t elements = 0;
+
+		float *h = nullptr;
+		float *s = nullptr;
+		float *i = nullptr;
 };
 
 #endif
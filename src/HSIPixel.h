@@ -5,8 +5,18 @@
 #define HSIPIXEL_H
 
 #include <iostream>
+#include <cstddef>
+#include <cstdint>
 
 class HSIPixel {
+	public:
+		enum ConversionMode {
+			/// pixels are converted with the full trigonometric functions
+			kConversionExact,
+			/// pixels are converted with precomputed coefficient tables
+			kConversionLookup
+		};
+
 	public:
 		double h = 0;
 		double s = 0;
@@ -48,6 +58,23 @@ class HSIPixel {
 	public:
 		static void convertPixelToRGB(const HSIPixel &in, uint8_t *out);
 		static void convertPixelToRGBW(const HSIPixel &in, uint8_t *out);
+
+		static void convertSpanToRGB(const HSIPixel *in, size_t count, uint8_t *out);
+		static void convertSpanToRGBW(const HSIPixel *in, size_t count, uint8_t *out);
+
+		static void convertPlanesToRGB(const float *h, const float *s,
+									   const float *i, size_t count, uint8_t *out);
+		static void convertPlanesToRGBW(const float *h, const float *s,
+										const float *i, size_t count, uint8_t *out);
+
+		static void setConversionMode(ConversionMode mode);
+		static ConversionMode getConversionMode(void);
+
+	private:
+		static void lookupPixelToRGB(const HSIPixel &in, uint8_t *out);
+		static void lookupPixelToRGBW(const HSIPixel &in, uint8_t *out);
+
+		static void buildLookupTables(void);
 };
 std::ostream &operator<<(std::ostream& strm, const HSIPixel& obj);
 
@@ -54,10 +54,6 @@ LichtensteinUtils::PacketErrors LichtensteinUtils::validatePacket(void *data, si
 
 /**
  * Adds a checksum to the packet.
- *
- * TODO: The CRC code is somehow broken, in that the table is wrong, because the
- * embedded code (with the 1 byte table) gets a different result than the code
- * we use that uses the whole table.
  */
 LichtensteinUtils::PacketErrors LichtensteinUtils::applyChecksum(void *data, size_t length) {
 	lichtenstein_header_t *header = static_cast<lichtenstein_header_t *>(data);
@@ -231,6 +227,65 @@ int LichtensteinUtils::convertPacketByteOrder(void *_packet, bool fromNetworkOrd
 			fb->dataElements = __builtin_bswap32(fb->dataElements);
 			break;
 		}
+		// framebuffer delta
+		case kOpcodeFramebufferDelta: {
+			size_t numRanges = 0;
+
+			// ensure the length is correct
+			if(length < sizeof(lichtenstein_framebuffer_delta_t)) {
+				LOG(WARNING) << "Framebuffer delta packet too small!";
+				return -1;
+			}
+
+			lichtenstein_framebuffer_delta_t *fb;
+			fb = (lichtenstein_framebuffer_delta_t *) _packet;
+
+			fb->destChannel = __builtin_bswap32(fb->destChannel);
+
+			if(fromNetworkOrder) {
+				fb->dataFormat = __builtin_bswap32(fb->dataFormat);
+				fb->numRanges = __builtin_bswap32(fb->numRanges);
+				numRanges = fb->numRanges;
+			} else {
+				numRanges = fb->numRanges;
+			}
+
+			size_t bytesPerPixel = (fb->dataFormat == kDataFormatRGBW) ? 4 : 3;
+
+			if(!fromNetworkOrder) {
+				fb->dataFormat = __builtin_bswap32(fb->dataFormat);
+				fb->numRanges = __builtin_bswap32(fb->numRanges);
+			}
+
+			// byteswap the header of each range
+			size_t offset = sizeof(lichtenstein_framebuffer_delta_t);
+
+			for(size_t i = 0; i < numRanges; i++) {
+				if((offset + sizeof(lichtenstein_framebuffer_range_t)) > length) {
+					LOG(WARNING) << "Framebuffer delta range " << i << " out of bounds!";
+					return -1;
+				}
+
+				lichtenstein_framebuffer_range_t *range;
+				range = (lichtenstein_framebuffer_range_t *) (((uint8_t *) _packet) + offset);
+
+				size_t count = 0;
+
+				range->start = __builtin_bswap32(range->start);
+
+				if(fromNetworkOrder) {
+					range->count = __builtin_bswap32(range->count);
+					count = range->count;
+				} else {
+					count = range->count;
+					range->count = __builtin_bswap32(range->count);
+				}
+
+				offset += sizeof(lichtenstein_framebuffer_range_t) + (count * bytesPerPixel);
+			}
+
+			break;
+		}
 		// output command
 		case kOpcodeSyncOutput: {
 			// ensure the length is correct
@@ -245,6 +300,22 @@ int LichtensteinUtils::convertPacketByteOrder(void *_packet, bool fromNetworkOrd
 			out->channel = __builtin_bswap32(out->channel);
 			break;
 		}
+		// shard ready
+		case kOpcodeShardReady: {
+			// ensure the length is correct
+			if(length < sizeof(lichtenstein_shard_ready_t)) {
+				LOG(WARNING) << "Shard ready packet too small!";
+				return -1;
+			}
+
+			lichtenstein_shard_ready_t *ready;
+			ready = (lichtenstein_shard_ready_t *) _packet;
+
+			ready->shard = __builtin_bswap32(ready->shard);
+			ready->numShards = __builtin_bswap32(ready->numShards);
+			ready->frame = __builtin_bswap32(ready->frame);
+			break;
+		}
 
 		// node adoption
 		case kOpcodeNodeAdoption: {
@@ -0,0 +1,228 @@
+#include "Metrics.h"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <sstream>
+
+#pragma mark - Histograms
+/**
+ * Returns the index of the bucket that holds the given value. Values below the
+ * number of sub-buckets get a bucket each; above that, the exponent selects a
+ * group of buckets, and the bits following the topmost set bit the bucket in
+ * that group.
+ */
+size_t Histogram::bucketFor(uint64_t nanos) {
+	if(nanos < kSubBuckets) {
+		return nanos;
+	}
+
+	size_t exponent = (63 - __builtin_clzll(nanos));
+
+	if(exponent > kMaxExponent) {
+		return (kNumBuckets - 1);
+	}
+
+	size_t sub = (nanos >> (exponent - kSubBucketBits)) & (kSubBuckets - 1);
+	return ((exponent - kSubBucketBits + 1) * kSubBuckets) + sub;
+}
+
+/**
+ * Returns the largest value, in ns, that goes into the given bucket.
+ */
+uint64_t Histogram::upperBound(size_t bucket) {
+	if(bucket < kSubBuckets) {
+		return bucket;
+	}
+
+	size_t exponent = (bucket / kSubBuckets) + kSubBucketBits - 1;
+	uint64_t sub = (bucket % kSubBuckets);
+
+	uint64_t width = (uint64_t(1) << (exponent - kSubBucketBits));
+	return ((uint64_t(1) << exponent) + ((sub + 1) * width) - 1);
+}
+
+/**
+ * Records a value, in ns.
+ */
+void Histogram::record(uint64_t nanos) {
+	this->counts[bucketFor(nanos)].fetch_add(1, std::memory_order_relaxed);
+
+	this->count.fetch_add(1, std::memory_order_relaxed);
+	this->sum.fetch_add(nanos, std::memory_order_relaxed);
+
+	// update the maximum
+	uint64_t max = this->max.load(std::memory_order_relaxed);
+
+	while(nanos > max && !this->max.compare_exchange_weak(max, nanos, std::memory_order_relaxed)) {}
+}
+
+/**
+ * Copies the histogram's counters. Values may be recorded while this happens,
+ * so the total count is recalculated from the buckets to stay consistent with
+ * them.
+ */
+void Histogram::snapshot(Snapshot &out) const {
+	out.count = 0;
+
+	for(size_t i = 0; i < kNumBuckets; i++) {
+		out.counts[i] = this->counts[i].load(std::memory_order_relaxed);
+		out.count += out.counts[i];
+	}
+
+	out.sum = this->sum.load(std::memory_order_relaxed);
+	out.max = this->max.load(std::memory_order_relaxed);
+}
+
+/**
+ * Returns the value (in ns) below which the given fraction of all values lie;
+ * that is, the upper bound of the bucket that contains that percentile.
+ */
+uint64_t Histogram::Snapshot::percentile(double p) const {
+	if(this->count == 0) {
+		return 0;
+	}
+
+	uint64_t rank = std::max(uint64_t(1), uint64_t(p * double(this->count) + 0.5));
+	uint64_t seen = 0;
+
+	for(size_t i = 0; i < kNumBuckets; i++) {
+		seen += this->counts[i];
+
+		if(seen >= rank) {
+			return std::min(upperBound(i), this->max);
+		}
+	}
+
+	return this->max;
+}
+
+#pragma mark - Registry
+/**
+ * Returns the process-wide metrics registry.
+ */
+Metrics *Metrics::shared(void) {
+	static Metrics instance;
+	return &instance;
+}
+
+/**
+ * Returns the histogram with the given name and labels, creating it if it does
+ * not exist yet. The help text is only used when it's created.
+ */
+Histogram *Metrics::histogram(const std::string &name, const Labels &labels,
+							  const std::string &help) {
+	std::lock_guard<std::mutex> lg(this->lock);
+
+	std::string key = keyFor(name, labels);
+	auto it = this->histograms.find(key);
+
+	if(it != this->histograms.end()) {
+		return it->second.histogram.get();
+	}
+
+	Entry &entry = this->histograms[key];
+
+	entry.name = name;
+	entry.labels = labels;
+	entry.help = help;
+	entry.histogram = std::make_unique<Histogram>();
+
+	VLOG(2) << "Created histogram " << key;
+
+	return entry.histogram.get();
+}
+
+/**
+ * Invokes the visitor for each histogram, sorted by name and labels.
+ */
+void Metrics::forEach(Visitor visitor) {
+	std::lock_guard<std::mutex> lg(this->lock);
+
+	for(auto const& [key, entry] : this->histograms) {
+		visitor(entry.name, entry.labels, entry.help, *entry.histogram);
+	}
+}
+
+/**
+ * Formats all histograms in the Prometheus text exposition format. Values are
+ * in seconds; to keep the output small, only the bucket bounds at each power of
+ * two from a microsecond up are included.
+ */
+std::string Metrics::exportPrometheus(void) {
+	std::stringstream out;
+	std::string lastName;
+
+	auto snapshot = std::make_unique<Histogram::Snapshot>();
+
+	this->forEach([&](const std::string &name, const Labels &labels,
+					  const std::string &help, const Histogram &histogram) {
+		// each metric's header is only printed once, before its first histogram
+		if(name != lastName) {
+			if(!help.empty()) {
+				out << "# HELP " << name << ' ' << help << '\n';
+			}
+
+			out << "# TYPE " << name << " histogram\n";
+			lastName = name;
+		}
+
+		// format the labels, leaving room for the bucket's bound
+		std::stringstream labelStr;
+
+		for(auto const& [key, value] : labels) {
+			labelStr << key << "=\"" << value << "\",";
+		}
+
+		std::string prefix = labelStr.str();
+
+		histogram.snapshot(*snapshot);
+
+		// the buckets are cumulative; skip the ones that are above the max
+		uint64_t cumulative = 0;
+
+		for(size_t i = 0; i < Histogram::kNumBuckets; i++) {
+			cumulative += snapshot->counts[i];
+
+			bool lastInGroup = ((i % Histogram::kSubBuckets) == (Histogram::kSubBuckets - 1));
+
+			// nothing in the pipeline takes less than a microsecond
+			if(!lastInGroup || Histogram::upperBound(i) < 1000) {
+				continue;
+			}
+
+			double bound = double(Histogram::upperBound(i) + 1) / 1e9;
+
+			out << name << "_bucket{" << prefix << "le=\"" << bound << "\"} " << cumulative << '\n';
+
+			if(cumulative == snapshot->count && Histogram::upperBound(i) >= snapshot->max) {
+				break;
+			}
+		}
+
+		out << name << "_bucket{" << prefix << "le=\"+Inf\"} " << snapshot->count << '\n';
+
+		// strip the trailing comma for the sum and count
+		if(!prefix.empty()) {
+			prefix.pop_back();
+		}
+
+		out << name << "_sum{" << prefix << "} " << (double(snapshot->sum) / 1e9) << '\n';
+		out << name << "_count{" << prefix << "} " << snapshot->count << '\n';
+	});
+
+	return out.str();
+}
+
+/**
+ * Builds the key under which a histogram is stored.
+ */
+std::string Metrics::keyFor(const std::string &name, const Labels &labels) {
+	std::string key = name;
+
+	for(auto const& [label, value] : labels) {
+		key += '\0' + label + '=' + value;
+	}
+
+	return key;
+}
@@ -0,0 +1,116 @@
+/**
+ * Latency histograms for the frame pipeline, and a registry through which they
+ * are exported.
+ *
+ * Histograms use log-linear buckets, like HDR histograms: each power of two is
+ * split into a fixed number of equally sized buckets, so every recorded value
+ * is within 12.5% of its bucket's bounds, from nanoseconds up to minutes, with a
+ * few hundred counters. Recording a value is a handful of relaxed atomic adds;
+ * most histograms are only ever written by a single thread, so those don't
+ * contend either.
+ *
+ * Histograms are identified by a name and a set of labels, e.g. the stage of the
+ * frame or the id of a routine. Once created, they exist until the process
+ * exits, so the pointers handed out can be cached by whoever records into them.
+ */
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <functional>
+#include <cstddef>
+#include <cstdint>
+
+class Histogram {
+	public:
+		/// number of buckets per power of two is 2^kSubBucketBits
+		static const size_t kSubBucketBits = 3;
+		static const size_t kSubBuckets = (1 << kSubBucketBits);
+		/// values are clamped to 2^kMaxExponent ns (about 18 minutes)
+		static const size_t kMaxExponent = 40;
+
+		static const size_t kNumBuckets = ((kMaxExponent - kSubBucketBits + 2) * kSubBuckets);
+
+	public:
+		void record(uint64_t nanos);
+
+		/**
+		 * Records the given duration.
+		 */
+		template<class Rep, class Period>
+		void record(std::chrono::duration<Rep, Period> duration) {
+			auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+			this->record(uint64_t((ns > 0) ? ns : 0));
+		}
+
+		/**
+		 * A consistent-enough copy of the histogram's counters.
+		 */
+		struct Snapshot {
+			uint64_t counts[kNumBuckets];
+
+			uint64_t count = 0;
+			/// sum and maximum of all values, in ns
+			uint64_t sum = 0;
+			uint64_t max = 0;
+
+			uint64_t percentile(double p) const;
+		};
+
+		void snapshot(Snapshot &out) const;
+
+		static size_t bucketFor(uint64_t nanos);
+		static uint64_t upperBound(size_t bucket);
+
+	private:
+		std::atomic<uint64_t> counts[kNumBuckets] = {};
+
+		std::atomic<uint64_t> count{0};
+		std::atomic<uint64_t> sum{0};
+		std::atomic<uint64_t> max{0};
+};
+
+class Metrics {
+	public:
+		typedef std::map<std::string, std::string> Labels;
+
+		/// called for each histogram by forEach()
+		typedef std::function<void(const std::string &name, const Labels &labels,
+								   const std::string &help, const Histogram &histogram)> Visitor;
+
+	public:
+		static Metrics *shared(void);
+
+		Histogram *histogram(const std::string &name, const Labels &labels,
+							 const std::string &help = "");
+
+		void forEach(Visitor visitor);
+
+		std::string exportPrometheus(void);
+
+	private:
+		Metrics() = default;
+
+		static std::string keyFor(const std::string &name, const Labels &labels);
+
+	private:
+		struct Entry {
+			std::string name;
+			Labels labels;
+			std::string help;
+
+			std::unique_ptr<Histogram> histogram;
+		};
+
+		std::mutex lock;
+		/// all histograms, keyed by their name and labels
+		std::map<std::string, Entry> histograms;
+};
+
+#endif
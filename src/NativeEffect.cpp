@@ -0,0 +1,198 @@
+#include "NativeEffect.h"
+
+#include <glog/logging.h>
+
+#include <map>
+#include <string>
+#include <mutex>
+#include <cmath>
+
+// prefix of routine code that references a native effect
+static const std::string kNativePrefix = "native:";
+
+// protects the registry
+static std::mutex registryLock;
+
+#pragma mark - Built-in Effects
+/*
+ * The built-in effects are written as plain loops without any dependencies
+ * between iterations, so the compiler can vectorize them.
+ */
+namespace {
+	/**
+	 * Fills the buffer with a single color, given by the "hue", "saturation"
+	 * and "intensity" properties. This is a static effect: the buffer is only
+	 * written again when the color changes.
+	 */
+	class SolidEffect : public NativeEffect {
+		public:
+			bool step(HSIPixel *buffer, size_t elements, int frame,
+					  const std::map<std::string, double> &params) {
+				double h = getParam(params, "hue", 0);
+				double s = getParam(params, "saturation", 1);
+				double i = getParam(params, "intensity", 1);
+
+				// nothing to do if this buffer already has this color
+				bool sameBuffer = (buffer == this->lastBuffer && elements == this->lastElements);
+
+				if(sameBuffer && h == this->last.h && s == this->last.s && i == this->last.i) {
+					return false;
+				}
+
+				#pragma omp simd
+				for(size_t x = 0; x < elements; x++) {
+					buffer[x].h = h;
+					buffer[x].s = s;
+					buffer[x].i = i;
+				}
+
+				this->last = HSIPixel(h, s, i);
+				this->lastBuffer = buffer;
+				this->lastElements = elements;
+
+				return true;
+			}
+
+		private:
+			HSIPixel last;
+			HSIPixel *lastBuffer = nullptr;
+			size_t lastElements = 0;
+	};
+
+	/**
+	 * Renders a moving rainbow; this is the same as scripts/rainbow.as.
+	 *
+	 * - size: Determines how many times the rainbow repeats. Default 1.
+	 * - speed: How many degrees the hue changes between frames. Default 1.
+	 */
+	class RainbowEffect : public NativeEffect {
+		public:
+			bool step(HSIPixel *buffer, size_t elements, int frame,
+					  const std::map<std::string, double> &params) {
+				double width = double(elements);
+				double effectSize = getParam(params, "size", 1);
+
+				double hAddend = 360 / (width / effectSize);
+				double offset = double(frame) * getParam(params, "speed", 1);
+
+				#pragma omp simd
+				for(size_t x = 0; x < elements; x++) {
+					buffer[x].h = hAddend * (double(x) + offset);
+					buffer[x].s = 1;
+					buffer[x].i = 1;
+				}
+
+				return true;
+			}
+	};
+
+	/**
+	 * Breathing effect; this is the same as scripts/breathe.as.
+	 *
+	 * - stepSize: How fast the effect runs. Default 0.01.
+	 * - maxIntensity: The maximum value assigned to intensity. Default 1.
+	 * - hue: Hue of the pixels. Default 0.
+	 * - saturation: Saturation of the pixels. Default 1.
+	 */
+	class BreatheEffect : public NativeEffect {
+		public:
+			bool step(HSIPixel *buffer, size_t elements, int frame,
+					  const std::map<std::string, double> &params) {
+				double h = getParam(params, "hue", 0);
+				double s = getParam(params, "saturation", 1);
+				double i = (1 - fabs(sin(this->phase))) * getParam(params, "maxIntensity", 1);
+
+				#pragma omp simd
+				for(size_t x = 0; x < elements; x++) {
+					buffer[x].h = h;
+					buffer[x].s = s;
+					buffer[x].i = i;
+				}
+
+				// like the script, this takes effect in the next frame
+				this->phase = getParam(params, "stepSize", 0.01) * double(frame);
+
+				return true;
+			}
+
+		private:
+			double phase = 0;
+	};
+}
+
+#pragma mark - Registry
+/**
+ * Returns the map of all registered effects. The built-in effects are
+ * registered the first time this is called.
+ */
+std::map<std::string, NativeEffect::Factory> &NativeEffect::registry(void) {
+	static std::map<std::string, Factory> effects = {
+		{"solid", [] { return new SolidEffect(); }},
+		{"rainbow", [] { return new RainbowEffect(); }},
+		{"breathe", [] { return new BreatheEffect(); }},
+	};
+
+	return effects;
+}
+
+/**
+ * Registers a native effect under the given name. Any existing effect with the
+ * same name is replaced.
+ */
+void NativeEffect::registerEffect(const std::string &name, Factory factory) {
+	std::lock_guard<std::mutex> lg(registryLock);
+
+	NativeEffect::registry()[name] = factory;
+
+	VLOG(1) << "Registered native effect '" << name << "'";
+}
+
+/**
+ * Creates a new instance of the native effect with the given name. If there is
+ * no such effect, nullptr is returned.
+ */
+NativeEffect *NativeEffect::create(const std::string &name) {
+	std::lock_guard<std::mutex> lg(registryLock);
+
+	auto &effects = NativeEffect::registry();
+	auto it = effects.find(name);
+
+	if(it == effects.end()) {
+		return nullptr;
+	}
+
+	return it->second();
+}
+
+/**
+ * Checks whether the given routine code references a native effect. If so,
+ * the name of the effect is written to name, and true is returned.
+ */
+bool NativeEffect::parseCode(const std::string &code, std::string &name) {
+	// ignore any surrounding whitespace
+	size_t start = code.find_first_not_of(" \t\r\n");
+	size_t end = code.find_last_not_of(" \t\r\n");
+
+	if(start == std::string::npos) {
+		return false;
+	}
+
+	std::string trimmed = code.substr(start, (end - start + 1));
+
+	if(trimmed.compare(0, kNativePrefix.size(), kNativePrefix) != 0) {
+		return false;
+	}
+
+	name = trimmed.substr(kNativePrefix.size());
+	return true;
+}
+
+/**
+ * Returns the value of the parameter with the given name, or the default value
+ * if it's not set.
+ */
+double NativeEffect::getParam(const std::map<std::string, double> &params,
+							  const std::string &name, double defaultValue) {
+	auto it = params.find(name);
+	return (it != params.end()) ? it->second : defaultValue;
+}
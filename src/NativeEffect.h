@@ -0,0 +1,49 @@
+/**
+ * Interface for effects implemented in C++ rather than AngelScript.
+ *
+ * Native effects are registered under a name; a routine in the database uses
+ * one by having code of the form `native:<name>` instead of a script. They're
+ * wrapped by the Routine class like any script would be, so the rest of the
+ * server (i.e. the output mapper and effect runner) doesn't care whether an
+ * effect is native or scripted.
+ */
+#ifndef NATIVEEFFECT_H
+#define NATIVEEFFECT_H
+
+#include "HSIPixel.h"
+
+#include <map>
+#include <string>
+#include <functional>
+
+class NativeEffect {
+	public:
+		virtual ~NativeEffect() {}
+
+		/**
+		 * Renders a single frame of the effect into the given buffer. Params
+		 * holds the routine's parameters, merged with its defaults.
+		 *
+		 * Returns whether the contents of the buffer changed; if not, the
+		 * effect may also leave the buffer untouched.
+		 */
+		virtual bool step(HSIPixel *buffer, size_t elements, int frame,
+						  const std::map<std::string, double> &params) = 0;
+
+	public:
+		typedef std::function<NativeEffect *(void)> Factory;
+
+		static void registerEffect(const std::string &name, Factory factory);
+		static NativeEffect *create(const std::string &name);
+
+		static bool parseCode(const std::string &code, std::string &name);
+
+	protected:
+		static double getParam(const std::map<std::string, double> &params,
+							   const std::string &name, double defaultValue);
+
+	private:
+		static std::map<std::string, Factory> &registry(void);
+};
+
+#endif
@@ -5,6 +5,8 @@
 #include <glog/logging.h>
 #include <pthread.h>
 
+#include <cstring>
+
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
@@ -16,6 +18,23 @@
 #include "LichtensteinUtils.h"
 
 #include "ProtocolHandler.h"
+#include "Shard.h"
+
+/**
+ * Thread entry point for the discovery worker.
+ */
+void NodeDiscoveryThreadEntry(void *ctx) {
+#ifdef __APPLE__
+	pthread_setname_np("Node Discovery");
+#else
+  #ifdef pthread_setname_np
+	 pthread_setname_np(pthread_self(), "Node Discovery");
+ #endif
+#endif
+
+	NodeDiscovery *discovery = static_cast<NodeDiscovery *>(ctx);
+	discovery->threadEntry();
+}
 
 /**
  * Sets up the node discovery server.
@@ -25,16 +44,45 @@ NodeDiscovery::NodeDiscovery(DataStore *store, INIReader *reader, ProtocolHandle
 	this->config = reader;
 	this->proto = proto;
 
+	// read the queue configuration
+	long queueSize = this->config->GetInteger("server", "discoveryQueueSize", 1024);
+	CHECK(queueSize > 0) << "Invalid discovery queue size " << queueSize << "; check server.discoveryQueueSize";
+
+	this->maxPending = queueSize;
+
+	long debounce = this->config->GetInteger("server", "discoveryDebounce", 5000);
+	CHECK(debounce >= 0) << "Invalid discovery debounce interval " << debounce << "; check server.discoveryDebounce";
+
+	this->debounceInterval = std::chrono::milliseconds(debounce);
+
+	// start the worker thread
+	this->run = true;
+	this->worker = new std::thread(NodeDiscoveryThreadEntry, this);
+
 	// copy the socket and join multicast group
 	this->sock = sock;
 	this->setUpMulticast();
 }
 
 /**
- * De-associates us from the multicast group.
+ * De-associates us from the multicast group, and stops the worker thread.
  */
 NodeDiscovery::~NodeDiscovery() {
 	this->leaveMulticastGroup();
+
+	// stop the worker; anything still queued is dropped
+	{
+		std::lock_guard<std::mutex> lk(this->pendingLock);
+		this->run = false;
+	}
+
+	this->pendingCv.notify_all();
+
+	this->worker->join();
+	delete this->worker;
+
+	LOG_IF(WARNING, this->droppedPackets) << "Dropped " << this->droppedPackets
+			<< " discovery packets because the queue was full";
 }
 
 /**
@@ -85,16 +133,102 @@ void NodeDiscovery::setUpMulticast() {
 	err = setsockopt(this->sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq));
 	PLOG_IF(FATAL, err < 0) << "Couldn't join multicast group";
 
-	// disable multicast loopback
-	int no = 0;
-	setsockopt(this->sock, IPPROTO_IP, IP_MULTICAST_LOOP, &no, sizeof(no));
+	// disable multicast loopback, unless other shards may run on this machine
+	int loop = this->proto->getShard()->isSharded() ? 1 : 0;
+	setsockopt(this->sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
 }
 
+#pragma mark - Queue
 /**
- * Handles a multicast packet received over the wire. This first checks it for
- * validity before processing it.
+ * Returns a key for the hash tables from a MAC address.
+ */
+uint64_t NodeDiscovery::macKey(const uint8_t mac[6]) {
+	uint64_t key = 0;
+
+	for(size_t i = 0; i < 6; i++) {
+		key = (key << 8) | mac[i];
+	}
+
+	return key;
+}
+
+/**
+ * Queues a multicast packet received over the wire; this is called on the
+ * protocol handler's receive thread, so it does as little as possible. If a
+ * packet from the same node is still queued, it's replaced.
  */
 void NodeDiscovery::handleMulticastPacket(void *data, size_t length) {
+	// anything shorter can't be a node announcement
+	if(length < sizeof(lichtenstein_node_announcement_t)) {
+		LOG_EVERY_N(WARNING, 100) << "Ignoring multicast packet of " << length << " bytes";
+		return;
+	}
+
+	// the MAC address isn't affected by byte order
+	auto *packet = static_cast<lichtenstein_node_announcement_t *>(data);
+	uint64_t key = NodeDiscovery::macKey(packet->macAddr);
+
+	uint8_t *bytes = static_cast<uint8_t *>(data);
+
+	{
+		std::lock_guard<std::mutex> lk(this->pendingLock);
+
+		auto it = this->pending.find(key);
+
+		if(it != this->pending.end()) {
+			it->second.assign(bytes, (bytes + length));
+			this->coalescedPackets++;
+		} else if(this->pending.size() < this->maxPending) {
+			this->pending.emplace(key, std::vector<uint8_t>(bytes, (bytes + length)));
+			this->pendingOrder.push_back(key);
+		} else {
+			this->droppedPackets++;
+
+			LOG_EVERY_N(WARNING, 100) << "Discovery queue full, dropping announcement";
+			return;
+		}
+	}
+
+	this->pendingCv.notify_one();
+}
+
+/**
+ * Processes queued packets, in the order the nodes' first packets were queued.
+ */
+void NodeDiscovery::threadEntry(void) {
+	std::vector<uint8_t> data;
+
+	std::unique_lock<std::mutex> lk(this->pendingLock);
+
+	while(this->run) {
+		// wait for a packet
+		if(this->pendingOrder.empty()) {
+			this->pendingCv.wait(lk);
+			continue;
+		}
+
+		// take it off the queue and process it without holding the lock
+		uint64_t key = this->pendingOrder.front();
+		this->pendingOrder.pop_front();
+
+		auto it = this->pending.find(key);
+		data.swap(it->second);
+		this->pending.erase(it);
+
+		lk.unlock();
+
+		this->processMulticastPacket(data.data(), data.size());
+
+		lk.lock();
+	}
+}
+
+#pragma mark - Packet Handling
+/**
+ * Handles a multicast packet taken off the queue. This first checks it for
+ * validity before processing it.
+ */
+void NodeDiscovery::processMulticastPacket(void *data, size_t length) {
 	LichtensteinUtils::PacketErrors err;
 
 	// check validity
@@ -125,15 +259,59 @@ void NodeDiscovery::handleMulticastPacket(void *data, size_t length) {
  * node could be adopted at a later time.
  *
  * Either way, information such as IP and hostname are updated in the database.
+ *
+ * Nodes that announced themselves before are looked up in memory rather than in
+ * the database. If the announcement is the same as the last one processed for
+ * the node, and that one was less than the debounce interval ago, it's dropped.
  */
 void NodeDiscovery::processNodeAnnouncement(void *data, size_t length) {
-	DbNode *node;
+	DbNode *node = nullptr;
 
 	// get the packet
 	lichtenstein_node_announcement_t *packet = static_cast<lichtenstein_node_announcement_t *>(data);
 
-	// see if we've found a node with this MAC address before
-	node = this->store->findNodeWithMac(packet->macAddr);
+	// process the hostname
+	size_t hostnameLen = packet->hostnameLen;
+
+	if((sizeof(lichtenstein_node_announcement_t) + hostnameLen) > length) {
+		LOG(ERROR) << "Hostname length " << hostnameLen << " exceeds announcement length " << length;
+		return;
+	}
+
+	std::string hostname = std::string(packet->hostname, strnlen(packet->hostname, hostnameLen));
+
+	// nodes of other shards are adopted by their servers
+	if(!this->proto->getShard()->ownsNode(packet->macAddr)) {
+		VLOG(3) << "Ignoring announcement from " << DbNode::macToString(packet->macAddr) << ", which belongs to another shard";
+		return;
+	}
+
+	// have we seen this node before?
+	auto now = std::chrono::steady_clock::now();
+	uint64_t key = NodeDiscovery::macKey(packet->macAddr);
+
+	auto known = this->knownNodes.find(key);
+
+	if(known != this->knownNodes.end()) {
+		KnownNode &info = known->second;
+
+		bool same = (info.ip == packet->ip) && (info.hwVersion == packet->hwVersion) &&
+					(info.swVersion == packet->swVersion) &&
+					(info.fbSize == packet->fbSize) &&
+					(info.channels == packet->channels) && (info.hostname == hostname);
+
+		if(same && (now - info.lastProcessed) < this->debounceInterval) {
+			VLOG(3) << "Dropping repeated announcement from " << DbNode::macToString(packet->macAddr);
+			return;
+		}
+
+		node = info.node;
+	} else {
+		// see if we've found a node with this MAC address before
+		node = this->store->findNodeWithMac(packet->macAddr);
+	}
+
+	bool changed = false;
 
 	if(node == nullptr) {
 		LOG(INFO) << "Found new node with MAC "
@@ -141,8 +319,16 @@ void NodeDiscovery::processNodeAnnouncement(void *data, size_t length) {
 				  << ", adding it to database";
 
 		node = new DbNode();
+		changed = true;
 	}
 
+	// did anything other than the IP and last seen time change?
+	changed = changed || (node->hwVersion != packet->hwVersion) ||
+			  (node->swVersion != packet->swVersion) || (node->adopted != 0) ||
+			  (node->hostname != hostname) ||
+			  (node->numChannels != packet->channels) ||
+			  (node->fbSize != packet->fbSize);
+
 	// fill the node's info with what we found in the packet
 	memcpy(node->macAddr, packet->macAddr, 6);
 	node->ip = packet->ip;
@@ -155,26 +341,33 @@ void NodeDiscovery::processNodeAnnouncement(void *data, size_t length) {
 	// if we get the node solicitation, then it's not been adopted
 	node->adopted = 0;
 
-	// process the hostname
-	int hostnameLen = packet->hostnameLen;
-	char *hostnameBuf = new char[hostnameLen + 1];
-
-	std::fill(hostnameBuf, hostnameBuf + hostnameLen + 1, 0);
-	memcpy(hostnameBuf, packet->hostname, hostnameLen);
-
-  node->hostname = std::string(hostnameBuf);
+  node->hostname = hostname;
 
 	// get the framebuffer size and number of channels
 	node->numChannels = packet->channels;
 	node->fbSize = packet->fbSize;
 
-	// update it in the db
-	this->store->update(node);
+	// update it in the db; if only the IP and last seen time changed, that write
+	// is batched with other nodes' in the background
+	if(changed) {
+		this->store->update(node);
+	} else {
+		this->store->updateNodeSeen(node);
+	}
+
+	// remember what it announced
+	KnownNode &info = this->knownNodes[key];
+
+	info.node = node;
+	info.ip = packet->ip;
+	info.hwVersion = packet->hwVersion;
+	info.swVersion = packet->swVersion;
+	info.fbSize = packet->fbSize;
+	info.channels = packet->channels;
+	info.hostname = hostname;
+	info.lastProcessed = now;
 
 	// adopt the node: they should only announce if not adopted
 	LOG(INFO) << "Adopting node " << DbNode::macToString(packet->macAddr);
 	this->proto->adoptNode(node);
-
-	// clean up
-	delete[] hostnameBuf;
 }
@@ -1,15 +1,31 @@
+/**
+ * Handles node announcements received over multicast.
+ *
+ * Announcements are only queued on the protocol handler's receive thread, so a
+ * burst of them (e.g. when all nodes power up at once) doesn't delay other
+ * packets such as framebuffer acks. A separate thread validates and processes
+ * them; announcements from the same node that are still queued are coalesced,
+ * and repeats whose details haven't changed are dropped.
+ */
 #ifndef NODEDISCOVERY_H
 #define NODEDISCOVERY_H
 
 #include <thread>
 #include <string>
 #include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <deque>
+#include <vector>
+#include <unordered_map>
 
 #include <cstddef>
 
 #include "INIReader.h"
 
 class DataStore;
+class DbNode;
 class ProtocolHandler;
 
 class NodeDiscovery {
@@ -24,8 +40,58 @@ class NodeDiscovery {
 		void setUpMulticast();
 
 		void handleMulticastPacket(void *data, size_t length);
+		void processMulticastPacket(void *data, size_t length);
 		void processNodeAnnouncement(void *data, size_t length);
 
+	// queue of received announcements
+	private:
+		friend void NodeDiscoveryThreadEntry(void *ctx);
+
+		void threadEntry(void);
+
+		static uint64_t macKey(const uint8_t mac[6]);
+
+		std::thread *worker = nullptr;
+		std::atomic_bool run;
+
+		/// latest queued packet from each node, keyed by MAC address
+		std::unordered_map<uint64_t, std::vector<uint8_t>> pending;
+		/// order in which nodes' packets were queued
+		std::deque<uint64_t> pendingOrder;
+
+		/// maximum number of nodes with queued packets
+		size_t maxPending = 1024;
+
+		std::mutex pendingLock;
+		std::condition_variable pendingCv;
+
+		/// packets that were dropped because the queue was full
+		size_t droppedPackets = 0;
+		/// packets that replaced a packet from the same node in the queue
+		size_t coalescedPackets = 0;
+
+	// nodes that announced themselves; only accessed from the worker thread
+	private:
+		struct KnownNode {
+			DbNode *node;
+
+			/// details from the last announcement that was processed
+			uint32_t ip;
+			uint32_t hwVersion;
+			uint32_t swVersion;
+			uint32_t fbSize;
+			uint16_t channels;
+			std::string hostname;
+
+			std::chrono::steady_clock::time_point lastProcessed;
+		};
+
+		/// keyed by MAC address
+		std::unordered_map<uint64_t, KnownNode> knownNodes;
+
+		/// unchanged announcements within this long of the last one are dropped
+		std::chrono::milliseconds debounceInterval;
+
 	private:
 		DataStore *store;
 		INIReader *config;
@@ -6,8 +6,10 @@
 
 #include <glog/logging.h>
 
+#include <algorithm>
 #include <map>
 #include <set>
+#include <thread>
 
 /**
  * Initializes the output mapper.
@@ -17,13 +19,32 @@ OutputMapper::OutputMapper(DataStore *s, Framebuffer *f, INIReader *reader) {
 	this->fb = f;
 
 	this->config = reader;
+
+	this->generation = 0;
+
+	// publish an empty snapshot, so readers always have one
+	for(size_t i = 0; i < kMaxSnapshotRefs; i++) {
+		this->heldSnapshots[i] = nullptr;
+		this->slotInUse[i] = false;
+	}
+
+	this->currentSnapshot = new Snapshot{0, {}};
 }
 
 /**
  * Cleans up anything created by the output mapper.
  */
 OutputMapper::~OutputMapper() {
+	// no readers may be left at this point
+	delete this->currentSnapshot.load();
 
+	for(auto snapshot : this->retiredSnapshots) {
+		delete snapshot;
+	}
+
+	for(auto [generation, group] : this->retiredGroups) {
+		delete group;
+	}
 }
 
 /**
@@ -56,7 +77,7 @@ void OutputMapper::addMapping(OutputMapper::OutputGroup *g, Routine *r) {
 	VLOG(1) << "Adding mapping for " << g;
 
 	// take the lock for this scope
-	std::lock_guard<std::recursive_mutex>(this->outputMapLock);
+	std::lock_guard<std::recursive_mutex> lk(this->outputMapLock);
 
 	// check if it's an ubergroup
 	OutputMapper::OutputUberGroup *ug = dynamic_cast<OutputMapper::OutputUberGroup *>(g);
@@ -71,7 +92,7 @@ void OutputMapper::addMapping(OutputMapper::OutputGroup *g, Routine *r) {
 
 		this->_removeMappingsInUbergroup(ug);
 	} else {
-		this->removeMappingForGroup(g);
+		this->_removeMappingForGroup(g);
 	}
 
 	// remove any empty ubergroups
@@ -80,6 +101,7 @@ void OutputMapper::addMapping(OutputMapper::OutputGroup *g, Routine *r) {
 	// we've removed any stale mappings so insert it
 	this->outputMap[g] = r;
 
+	this->publishSnapshot();
 	this->printMap();
 }
 
@@ -94,11 +116,22 @@ void OutputMapper::removeMappingForGroup(OutputGroup *g) {
 	}
 
 	// take the lock for this scope
-	std::lock_guard<std::recursive_mutex>(this->outputMapLock);
+	std::lock_guard<std::recursive_mutex> lk(this->outputMapLock);
 
 	VLOG(1) << "Removing mapping for " << g;
 	this->printMap();
 
+	this->_removeMappingForGroup(g);
+
+	this->publishSnapshot();
+	this->printMap();
+}
+
+/**
+ * Removes an output mapping for the given group, without publishing a new
+ * snapshot. The output map lock must be held.
+ */
+void OutputMapper::_removeMappingForGroup(OutputGroup *g) {
 	bool deleted = false;
 
 	// search for it in the groups themselves
@@ -110,8 +143,13 @@ void OutputMapper::removeMappingForGroup(OutputGroup *g) {
 			// if the groups are equal
 			if(*std::get<0>(*it) == *g) {
 				// delete it
+				OutputGroup *group = it->first;
 				it = this->outputMap.erase(it);
 				deleted = true;
+
+				if(group != g) {
+					this->retireGroup(group);
+				}
 			} else {
 				// otherwise, check the next one.
 				++it;
@@ -135,7 +173,7 @@ void OutputMapper::removeMappingForGroup(OutputGroup *g) {
 				// does this ubergroup contain this group?
 				if(ubergroup->containsMember(g)) {
 					// yee! so delete it
-					ubergroup->removeMember(g);
+					this->_removeMembersFromUbergroup(ubergroup, {g});
 					return;
 				}
 			}
@@ -148,8 +186,6 @@ void OutputMapper::removeMappingForGroup(OutputGroup *g) {
 
 	// remove any empty ubergroups
 	this->removeEmptyUbergroups();
-
-	this->printMap();
 }
 
 /**
@@ -157,7 +193,7 @@ void OutputMapper::removeMappingForGroup(OutputGroup *g) {
  */
 void OutputMapper::removeEmptyUbergroups(void) {
 	// take the lock for this scope
-	std::lock_guard<std::recursive_mutex>(this->outputMapLock);
+	std::lock_guard<std::recursive_mutex> lk(this->outputMapLock);
 
 	// check if there's any empty ubergroups
 	for (auto it = this->outputMap.cbegin(); it != this->outputMap.cend();) {
@@ -169,6 +205,7 @@ void OutputMapper::removeEmptyUbergroups(void) {
 			if(mapUg->numMembers() == 0) {
 				// if so, remove it
 				it = this->outputMap.erase(it);
+				this->retireGroup(mapUg);
 			} else {
 				++it;
 			}
@@ -191,7 +228,7 @@ void OutputMapper::_removeMappingsInUbergroup(OutputMapper::OutputUberGroup *ug)
 	VLOG(1) << "Removing any conflicting mappings in ubergroup " << ug;
 
 	// take the lock for this scope
-	std::lock_guard<std::recursive_mutex>(this->outputMapLock);
+	std::lock_guard<std::recursive_mutex> lk(this->outputMapLock);
 
 	// check if there's any identical ubergroups
 	for (auto it = this->outputMap.cbegin(); it != this->outputMap.cend();) {
@@ -203,6 +240,11 @@ void OutputMapper::_removeMappingsInUbergroup(OutputMapper::OutputUberGroup *ug)
 			if(*ug == *mapUg) {
 				// if so, remove it
 				it = this->outputMap.erase(it);
+
+				// its members are the same as those of the new one
+				if(mapUg != ug) {
+					this->retireGroup(mapUg);
+				}
 			} else {
 				++it;
 			}
@@ -217,28 +259,34 @@ void OutputMapper::_removeMappingsInUbergroup(OutputMapper::OutputUberGroup *ug)
 	// 2. check whether there's any standalone groups in the output map that are
 	//		also in this ubergroup, and if so, remove them.
 
-	// check if there's any ubergroups and whether this is a member in it
+	// check if there's any ubergroups and whether this is a member in it; they
+	// are replaced, so collect them first
+	std::vector<std::pair<OutputUberGroup *, std::vector<OutputGroup *>>> overlapping;
+
 	for(auto [group, routine] : this->outputMap) {
 		auto ubergroup = dynamic_cast<OutputMapper::OutputUberGroup *>(group);
 
 		if(ubergroup != nullptr) {
+			std::vector<OutputGroup *> members;
+
 			// iterate over all groups in the ubergroup we've been passed
 			for(auto group : ug->groups) {
 				// is this in the ubergroup we found?
 				if(ubergroup->containsMember(group)) {
-					// remove it
-					ubergroup->removeMember(group);
-
-					/*// if the ubergroup is empty, remove its mapping
-					if(ubergroup->numMembers() == 0) {
-						// XXX: infinite loop?
-						this->removeMappingForGroup(ubergroup);
-					}*/
+					members.push_back(group);
 				}
 			}
+
+			if(!members.empty()) {
+				overlapping.emplace_back(ubergroup, members);
+			}
 		}
 	}
 
+	for(auto const& [ubergroup, members] : overlapping) {
+		this->_removeMembersFromUbergroup(ubergroup, members);
+	}
+
 	// iterate over all groups in the ubergroup
 	for(auto group : ug->groups) {
 		// search for it in the groups themselves
@@ -246,8 +294,10 @@ void OutputMapper::_removeMappingsInUbergroup(OutputMapper::OutputUberGroup *ug)
 			// if the groups are equal
 			if(*it->first == *group) {
 				// delete it
+				OutputGroup *mapped = it->first;
 				it = this->outputMap.erase(it);
-				// delete (*it).first; // TODO: memory leak?
+
+				this->retireGroup(mapped);
 			} else {
 				++it;
 			}
@@ -255,31 +305,294 @@ void OutputMapper::_removeMappingsInUbergroup(OutputMapper::OutputUberGroup *ug)
 	}
 }
 
+/**
+ * Removes the given members from an ubergroup in the output map. Ubergroups are
+ * never modified, since effects and readers of earlier snapshots may still be
+ * using their spans and buffer: instead, the ubergroup is replaced by a new one
+ * with the remaining members, mapped to the same routine, and the old one is
+ * retired. If no members remain, its mapping is removed.
+ *
+ * The output map lock must be held.
+ */
+void OutputMapper::_removeMembersFromUbergroup(OutputUberGroup *ubergroup, const std::vector<OutputGroup *> &members) {
+	Routine *routine = this->outputMap[ubergroup];
+
+	// figure out which members are left
+	std::vector<OutputGroup *> remaining;
+
+	for(auto member : ubergroup->groups) {
+		bool removed = std::any_of(members.begin(), members.end(), [member](OutputGroup *g) {
+			return (*member == *g);
+		});
+
+		if(removed) {
+			this->retireGroup(member);
+		} else {
+			remaining.push_back(member);
+		}
+	}
+
+	this->outputMap.erase(ubergroup);
+	this->retireGroup(ubergroup);
+
+	// map the remaining members to the routine
+	if(!remaining.empty()) {
+		auto *replacement = new OutputUberGroup(remaining);
+		this->outputMap[replacement] = routine;
+	}
+}
+
+/**
+ * Retires a group (or ubergroup) that was removed from the output map, or from
+ * an ubergroup in it. It's freed once no snapshot through which it could be
+ * reached is held anymore, and no effects run on it. The output map lock must
+ * be held.
+ *
+ * @note Retiring an ubergroup doesn't retire its members, since its replacement
+ * may still contain them.
+ */
+void OutputMapper::retireGroup(OutputGroup *group) {
+	// the current snapshot is the last one that may reference it
+	unsigned long generation = this->currentSnapshot.load()->generation;
+	this->retiredGroups.emplace_back(generation, group);
+}
 
 /**
  * Gets a reference to all real groups (aka groups that reference a single group
- * rather than an ubergroup)
+ * rather than an ubergroup) in the given snapshot. The groups may only be used
+ * for as long as the snapshot is held.
  */
-void OutputMapper::getAllGroups(std::vector<OutputGroup *> &groups) {
-  // search for it in the groups themselves
-	for(auto [group, routine] : this->outputMap) {
-    // make sure the group is not null
-    if(group != nullptr) {
-      // is it an ubergroup?
-      auto ubergroup = dynamic_cast<OutputMapper::OutputUberGroup *>(group);
-
-      if(ubergroup) {
-        // extract all groups in the ubergroup
-        for(auto member : ubergroup->groups) {
-          groups.push_back(member);
-        }
-      } else {
-        groups.push_back(group);
-      }
-    }
-    // group is null: this should never happen.
-    else { }
-  }
+void OutputMapper::getAllGroups(const Snapshot *snapshot, std::vector<OutputGroup *> &groups) {
+	for(auto const& mapping : snapshot->mappings) {
+		if(mapping.isUbergroup) {
+			auto *ubergroup = static_cast<OutputUberGroup *>(mapping.group);
+
+			// extract all groups in the ubergroup
+			for(auto const& span : ubergroup->getSpans()) {
+				groups.push_back(span.member);
+			}
+		} else {
+			groups.push_back(mapping.group);
+		}
+	}
+}
+
+/**
+ * Rebuilds the output groups whose group was replaced in the data store, because
+ * it was changed: they get a buffer that fits the group's new size. Ubergroups
+ * with such a member are replaced by one with the rebuilt member, and retired.
+ *
+ * The old output groups keep the group they were created with, so effects that
+ * are still running on them (and readers of older snapshots) see consistent
+ * sizes until they're done with them; they're retired like removed groups.
+ */
+void OutputMapper::updateGroups(void) {
+	std::lock_guard<std::recursive_mutex> lk(this->outputMapLock);
+
+	// rebuilt groups, by the group they replace
+	std::map<OutputGroup *, OutputGroup *> rebuilt;
+
+	auto current = [this, &rebuilt](OutputGroup *group) -> OutputGroup * {
+		DbGroup *dbGroup = this->store->findGroupWithId(group->getGroupId());
+
+		if(dbGroup == nullptr || dbGroup == group->group) {
+			return group;
+		}
+
+		auto &replacement = rebuilt[group];
+
+		if(replacement == nullptr) {
+			replacement = new OutputGroup(dbGroup);
+			replacement->brightness = group->brightness;
+		}
+
+		return replacement;
+	};
+
+	// find all mappings with a rebuilt group
+	std::vector<std::pair<OutputGroup *, Routine *>> remapped;
+
+	for(auto it = this->outputMap.begin(); it != this->outputMap.end();) {
+		auto [group, routine] = *it;
+		auto ubergroup = dynamic_cast<OutputMapper::OutputUberGroup *>(group);
+
+		OutputGroup *replacement = nullptr;
+
+		if(ubergroup != nullptr) {
+			std::vector<OutputGroup *> members;
+			bool changed = false;
+
+			for(auto member : ubergroup->groups) {
+				members.push_back(current(member));
+				changed |= (members.back() != member);
+			}
+
+			if(changed) {
+				replacement = new OutputUberGroup(members);
+			}
+		} else if(current(group) != group) {
+			replacement = current(group);
+		}
+
+		if(replacement != nullptr) {
+			it = this->outputMap.erase(it);
+			remapped.emplace_back(replacement, routine);
+
+			if(ubergroup != nullptr) {
+				this->retireGroup(ubergroup);
+			}
+		} else {
+			++it;
+		}
+	}
+
+	if(remapped.empty()) {
+		return;
+	}
+
+	for(auto [group, replacement] : rebuilt) {
+		this->retireGroup(group);
+	}
+
+	for(auto [group, routine] : remapped) {
+		this->outputMap[group] = routine;
+	}
+
+	LOG(INFO) << "Rebuilt " << remapped.size() << " mappings for changed groups";
+
+	this->publishSnapshot();
+}
+
+#pragma mark - Snapshots
+/**
+ * Returns a reference to the current snapshot of the output map. This doesn't
+ * take any locks, so it's safe to call on the hot path.
+ *
+ * The snapshot is protected by putting it into one of a few slots, which are
+ * checked before freeing a replaced snapshot. After doing so, the current
+ * snapshot is loaded again: if it changed in the meantime, the writer may not
+ * have seen the slot, so we try again with the new snapshot.
+ */
+OutputMapper::SnapshotRef OutputMapper::acquireSnapshot(void) {
+	// find a free slot
+	size_t slot = 0;
+
+	while(true) {
+		bool expected = false;
+
+		if(this->slotInUse[slot].compare_exchange_weak(expected, true)) {
+			break;
+		}
+
+		// all slots taken; wait for one to be released
+		if(++slot == kMaxSnapshotRefs) {
+			LOG_EVERY_N(WARNING, 1000) << "All " << kMaxSnapshotRefs << " snapshot slots in use";
+
+			slot = 0;
+			std::this_thread::yield();
+		}
+	}
+
+	// protect the current snapshot
+	const Snapshot *snapshot = this->currentSnapshot.load();
+
+	while(true) {
+		this->heldSnapshots[slot].store(snapshot);
+
+		const Snapshot *current = this->currentSnapshot.load();
+
+		if(current == snapshot) {
+			break;
+		}
+
+		snapshot = current;
+	}
+
+	return SnapshotRef(this, slot, snapshot);
+}
+
+/**
+ * Releases a slot taken by a snapshot reference.
+ */
+void OutputMapper::releaseSnapshot(size_t slot) {
+	this->heldSnapshots[slot].store(nullptr);
+	this->slotInUse[slot].store(false);
+}
+
+/**
+ * Builds a snapshot of the output map and publishes it. The previous snapshot
+ * is freed once no readers hold it anymore. The output map lock must be held.
+ */
+void OutputMapper::publishSnapshot(void) {
+	auto snapshot = new Snapshot;
+
+	snapshot->generation = ++this->generation;
+	snapshot->mappings.reserve(this->outputMap.size());
+
+	for(auto const& [group, routine] : this->outputMap) {
+		bool isUbergroup = (dynamic_cast<OutputUberGroup *>(group) != nullptr);
+
+		snapshot->mappings.push_back({group, routine, isUbergroup,
+				(isUbergroup ? -1 : group->getStart()), group->numPixels()});
+	}
+
+	// swap it in and free any snapshots that are no longer held
+	const Snapshot *old = this->currentSnapshot.exchange(snapshot);
+	this->retiredSnapshots.push_back(old);
+
+	this->reclaimSnapshots();
+}
+
+/**
+ * Frees any retired snapshots that aren't held through any slot. The output map
+ * lock must be held.
+ */
+void OutputMapper::reclaimSnapshots(void) {
+	for(auto it = this->retiredSnapshots.begin(); it != this->retiredSnapshots.end();) {
+		bool held = false;
+
+		for(size_t i = 0; i < kMaxSnapshotRefs; i++) {
+			if(this->heldSnapshots[i].load() == *it) {
+				held = true;
+				break;
+			}
+		}
+
+		if(held) {
+			++it;
+		} else {
+			delete *it;
+			it = this->retiredSnapshots.erase(it);
+		}
+	}
+
+	// ubergroups can go once all snapshots that may reference them are gone
+	unsigned long oldest = this->currentSnapshot.load()->generation;
+
+	for(auto snapshot : this->retiredSnapshots) {
+		oldest = std::min(oldest, snapshot->generation);
+	}
+
+	for(auto it = this->retiredGroups.begin(); it != this->retiredGroups.end();) {
+		auto [generation, group] = *it;
+
+		// an overrun effect may still be writing its buffer
+		if(generation < oldest && group->runningEffects == 0) {
+			delete group;
+			it = this->retiredGroups.erase(it);
+		} else {
+			++it;
+		}
+	}
+
+	// as do other objects that were retired
+	for(auto it = this->retiredObjects.begin(); it != this->retiredObjects.end();) {
+		if(it->first < oldest) {
+			it = this->retiredObjects.erase(it);
+		} else {
+			++it;
+		}
+	}
 }
 
 #pragma mark - Group Implementation
@@ -292,10 +605,7 @@ OutputMapper::OutputGroup::~OutputGroup() {
 		this->buffer = nullptr;
 	}
 
-	// delete the group
-	if(this->group) {
-		// delete this->group; TODO: memory leak?
-	}
+	// the group itself belongs to the data store
 }
 
 /**
@@ -304,9 +614,11 @@ OutputMapper::OutputGroup::~OutputGroup() {
  */
 OutputMapper::OutputGroup::OutputGroup(DbGroup *g) {
 	this->group = g;
+	this->runningEffects = 0;
 
 	// allocate the buffer
 	if(g != nullptr) {
+		this->groupRef = g->shared_from_this();
 		this->_resizeBuffer();
 	}
 }
@@ -369,26 +681,48 @@ void OutputMapper::OutputGroup::copyIntoFramebuffer(Framebuffer *fb, HSIPixel *b
 		buffer = this->buffer;
 	}
 
-	// get pointers
-	auto fbPointer = fb->getDataPointer();
-
+	// get the range of the framebuffer the group covers
 	int fbStart = this->group->start;
 	int fbEnd = this->group->end;
 
-	// VLOG_EVERY_N(1, 60) << "Buffer address: 0x" << this->buffer;
+	auto span = fb->getSpan(fbStart, (fbEnd - fbStart + 1));
 
 	// VLOG(1) << "Copying " << *this << " to " << fbStart << " to " << fbEnd;
 
-	for(int i = fbStart, j = 0; i <= fbEnd; i++, j++) {
-		// const HSIPixel p(double(i), 1, 1);
-		// fbPointer[i] = p;
-		fbPointer[i] = buffer[j];
+	// copy the pixels, scaling them for brightness
+	span.store(buffer, this->brightness);
+
+	this->markCopied(fb);
+}
 
-    // scale for brightness
-    fbPointer[i].i *= this->brightness;
+/**
+ * Records that the group's current pixels are in the framebuffer (or, with fused
+ * conversion, will be converted straight into the channels,) and marks its
+ * range of the framebuffer as dirty.
+ */
+void OutputMapper::OutputGroup::markCopied(Framebuffer *fb) {
+	int fbStart = this->group->start;
+	int fbEnd = this->group->end;
+
+	fb->markDirty(fbStart, (fbEnd - fbStart + 1));
+	this->copiedBrightness = this->brightness;
+}
+
+/**
+ * Checks whether the group's pixels have to be copied into the framebuffer again
+ * even if its routine's output didn't change: this is the case if they were
+ * never copied, the brightness changed, or if another group wrote to part of the
+ * same range during this frame.
+ */
+bool OutputMapper::OutputGroup::needsCopy(Framebuffer *fb) {
+	if(this->copiedBrightness != this->brightness) {
+		return true;
 	}
 
-	// VLOG(1) << fbPointer[1] << "; " << this->buffer[1];
+	int fbStart = this->group->start;
+	int fbEnd = this->group->end;
+
+	return fb->isDirty(fbStart, (fbEnd - fbStart + 1));
 }
 
 /**
@@ -448,6 +782,7 @@ OutputMapper::OutputUberGroup::OutputUberGroup(std::vector<OutputGroup *> &membe
 	}
 
 	// resize the framebuffer
+	this->_updateSpans();
 	this->_resizeBuffer();
 }
 
@@ -463,41 +798,29 @@ OutputMapper::OutputUberGroup::~OutputUberGroup() {
 }
 
 /**
- * Inserts the specified output group to the ubergroup.
+ * Flattens the members into a list of spans. Members are laid out in the
+ * ubergroup's buffer in the order they appear in the framebuffer, each with its
+ * own slice of the buffer.
  */
-void OutputMapper::OutputUberGroup::addMember(OutputGroup *group) {
-	// make sure that it's not already in the set
-	if(this->containsMember(group) == false) {
-		this->groups.insert(group);
+void OutputMapper::OutputUberGroup::_updateSpans() {
+	this->spans.clear();
+	this->spans.reserve(this->groups.size());
+
+	for(auto group : this->groups) {
+		this->spans.push_back({group, 0, size_t(group->getStart()), size_t(group->numPixels())});
 	}
 
-	// resize the framebuffer
-	this->_resizeBuffer();
-}
+	std::sort(this->spans.begin(), this->spans.end(), [](const MemberSpan &a, const MemberSpan &b) {
+		return (a.fbStart < b.fbStart);
+	});
 
-/**
- * Removes the specified group from the ubergroup.
- */
-void OutputMapper::OutputUberGroup::removeMember(OutputGroup *group) {
-	// take the lock to modify the groups set
-	// std::lock_guard<std::recursive_mutex>(this->groupsLock);
+	// assign each member its slice of the buffer
+	this->totalPixels = 0;
 
-	// check whether the group even contains this group
-	if(this->containsMember(group)) {
-		for (auto it = this->groups.cbegin(); it != this->groups.cend();) {
-			// if the groups are equal
-			if(**it == *group) {
-				// delete it
-				it = this->groups.erase(it);
-				// delete *it;
-			} else {
-				++it;
-			}
-		}
+	for(auto &span : this->spans) {
+		span.bufferOffset = this->totalPixels;
+		this->totalPixels += span.count;
 	}
-
-	// resize the framebuffer
-	this->_resizeBuffer();
 }
 
 /**
@@ -519,36 +842,66 @@ bool OutputMapper::OutputUberGroup::containsMember(OutputGroup *inGroup) {
 }
 
 /**
- * Copies the pixel data for each of the groups that make up this ubergroup into
- * the appropriate places of the framebuffer.
+ * Copies each member's slice of the ubergroup's buffer into the framebuffer,
+ * scaled by that member's brightness.
  *
- * @note Stuff like brightness changes aren't handled here since we just call
- * into the groups' copy functions, which eventually will call into the base.
+ * @note Members are always plain groups, so their methods are called directly
+ * rather than through the vtable.
  */
 void OutputMapper::OutputUberGroup::copyIntoFramebuffer(Framebuffer *fb, HSIPixel *buffer) {
-	// take the lock to modify the groups set
-	// std::lock_guard<std::recursive_mutex>(this->groupsLock);
+	if(buffer == nullptr) {
+		buffer = this->buffer;
+	}
 
-	for(auto group : this->groups) {
-		group->copyIntoFramebuffer(fb, this->buffer);
+	for(auto const& span : this->spans) {
+		auto fbSpan = fb->getSpan(span.fbStart, span.count);
+		fbSpan.store((buffer + span.bufferOffset), span.member->getBrightness());
+
+		span.member->OutputGroup::markCopied(fb);
 	}
 }
 
 /**
- * Returns the number of pixels in the group.
+ * An ubergroup is dark if all of its members are, since their brightness is
+ * what its pixels are scaled by.
  */
-int OutputMapper::OutputUberGroup::numPixels() {
-	// take the lock to modify the groups set
-	// std::lock_guard<std::recursive_mutex>(this->groupsLock);
+bool OutputMapper::OutputUberGroup::isDark() {
+	for(auto const& span : this->spans) {
+		if(!span.member->OutputGroup::isDark()) {
+			return false;
+		}
+	}
 
-	int elements = 0;
+	return !this->spans.empty();
+}
 
-	// sum up all of the groups' pixels
-	for(auto group : this->groups) {
-		elements += group->numPixels();
+/**
+ * Marks all of the ubergroup's members as copied.
+ */
+void OutputMapper::OutputUberGroup::markCopied(Framebuffer *fb) {
+	for(auto const& span : this->spans) {
+		span.member->OutputGroup::markCopied(fb);
+	}
+}
+
+/**
+ * An ubergroup needs to be copied if any of its members do.
+ */
+bool OutputMapper::OutputUberGroup::needsCopy(Framebuffer *fb) {
+	for(auto const& span : this->spans) {
+		if(span.member->OutputGroup::needsCopy(fb)) {
+			return true;
+		}
 	}
 
-	return elements;
+	return false;
+}
+
+/**
+ * Returns the number of pixels in the group.
+ */
+int OutputMapper::OutputUberGroup::numPixels() {
+	return this->totalPixels;
 }
 
 /**
@@ -12,6 +12,8 @@
 #include <set>
 #include <vector>
 #include <mutex>
+#include <atomic>
+#include <memory>
 #include <exception>
 
 #include "INIReader.h"
@@ -47,6 +49,19 @@ class OutputMapper {
           return this->group->getId();
         }
 
+				/**
+				 * Returns the first pixel of the group in the framebuffer.
+				 */
+				int getStart() const {
+					return this->group->start;
+				}
+				/**
+				 * Returns the last pixel of the group in the framebuffer.
+				 */
+				int getEnd() const {
+					return this->group->end;
+				}
+
 				/**
 				 * Returns an iterator into the group's framebuffer.
 				 */
@@ -75,9 +90,41 @@ class OutputMapper {
 				virtual void bindBufferToRoutine(Routine *r);
 				virtual void copyIntoFramebuffer(Framebuffer *fb, HSIPixel *buffer = nullptr);
 
+				virtual bool needsCopy(Framebuffer *fb);
+				virtual void markCopied(Framebuffer *fb);
+
+				/**
+				 * Whether the group outputs black regardless of its routine's
+				 * output, i.e. its brightness is zero.
+				 */
+				virtual bool isDark() {
+					return (this->brightness == 0.0);
+				}
+
+				/**
+				 * Records that an effect is about to run on the group; until
+				 * effectFinished() is called, the group isn't freed, even if its
+				 * mapping is removed.
+				 */
+				void effectStarted() {
+					this->runningEffects++;
+				}
+				/**
+				 * Records that an effect on the group finished running.
+				 */
+				void effectFinished() {
+					this->runningEffects--;
+				}
+
 			private:
 				virtual void _resizeBuffer();
 
+				/// number of effects running on the group's buffer
+				std::atomic_int runningEffects;
+
+				/// brightness the pixels in the framebuffer were scaled by; < 0 if never copied
+				double copiedBrightness = -1;
+
 				bool bufferChanged = false;
 				Routine *bufferBoundRoutine = nullptr;
 
@@ -89,6 +136,8 @@ class OutputMapper {
 
 			private:
 				DbGroup *group = nullptr;
+				/// keeps the group alive if it's replaced in the data store
+				std::shared_ptr<DbGroup> groupRef;
 
 				friend bool operator==(const OutputGroup& lhs, const OutputGroup& rhs);
 				friend bool operator< (const OutputGroup& lhs, const OutputGroup& rhs);
@@ -110,22 +159,59 @@ class OutputMapper {
 
 				virtual void copyIntoFramebuffer(Framebuffer *fb, HSIPixel *buffer = nullptr);
 
+				virtual bool needsCopy(Framebuffer *fb);
+				virtual void markCopied(Framebuffer *fb);
+				virtual bool isDark();
+
 				int numMembers() {
 					return this->groups.size();
 				}
 
+			public:
+				/**
+				 * A member's slice of the ubergroup's buffer, and where in the
+				 * framebuffer it goes.
+				 */
+				struct MemberSpan {
+					OutputGroup *member;
+
+					/// index of the first pixel in the ubergroup's buffer
+					size_t bufferOffset;
+					/// first pixel in the framebuffer
+					size_t fbStart;
+					/// number of pixels
+					size_t count;
+				};
+
+				/**
+				 * Returns the members' spans, ordered by their position in the
+				 * framebuffer; this is also the order they're laid out in the
+				 * ubergroup's buffer.
+				 *
+				 * The members of an ubergroup never change: removing one replaces
+				 * the ubergroup instead, so the spans are valid for as long as
+				 * the ubergroup is.
+				 */
+				const std::vector<MemberSpan> &getSpans() const {
+					return this->spans;
+				}
+
 			private:
 				// virtual void _resizeBuffer();
 
-				void addMember(OutputGroup *group);
-				void removeMember(OutputGroup *group);
 				bool containsMember(OutputGroup *group);
 
+				void _updateSpans();
+
 			private:
 				// std::recursive_mutex groupsLock;
 
 				std::set<OutputGroup *> groups;
 
+				/// flattened copy of the members, rebuilt when they change
+				std::vector<MemberSpan> spans;
+				size_t totalPixels = 0;
+
 
 			// operators
 				friend bool operator==(const OutputUberGroup& lhs, const OutputUberGroup& rhs);
@@ -134,6 +220,70 @@ class OutputMapper {
 				friend std::ostream &operator<<(std::ostream& strm, const OutputUberGroup& obj);
 		};
 
+	public:
+		/**
+		 * An immutable copy of the output map. Every time the mappings change, a
+		 * new snapshot is built and published; the effect runner reads the
+		 * current snapshot each frame without taking the output map lock.
+		 */
+		struct Snapshot {
+			struct Mapping {
+				OutputGroup *group;
+				Routine *routine;
+
+				bool isUbergroup;
+
+				/// first pixel of the group in the framebuffer; -1 for ubergroups
+				int start;
+				/// number of pixels in the group
+				int numPixels;
+			};
+
+			/// generation of the mappings this snapshot was built from
+			unsigned long generation;
+
+			/// mappings, in the same order as the output map
+			std::vector<Mapping> mappings;
+		};
+
+		/**
+		 * Keeps a snapshot from being freed for as long as it exists, even if
+		 * it's replaced by a newer one in the meantime.
+		 */
+		class SnapshotRef {
+			friend class OutputMapper;
+
+			public:
+				SnapshotRef(const SnapshotRef &) = delete;
+				SnapshotRef &operator=(const SnapshotRef &) = delete;
+
+				SnapshotRef(SnapshotRef &&other) : mapper(other.mapper),
+						slot(other.slot), snapshot(other.snapshot) {
+					other.mapper = nullptr;
+				}
+
+				~SnapshotRef() {
+					if(this->mapper) {
+						this->mapper->releaseSnapshot(this->slot);
+					}
+				}
+
+				const Snapshot *operator->() const {
+					return this->snapshot;
+				}
+				const Snapshot *get() const {
+					return this->snapshot;
+				}
+
+			private:
+				SnapshotRef(OutputMapper *mapper, size_t slot, const Snapshot *snapshot) :
+						mapper(mapper), slot(slot), snapshot(snapshot) {}
+
+				OutputMapper *mapper;
+				size_t slot;
+				const Snapshot *snapshot;
+		};
+
 	public:
 		OutputMapper(DataStore *s, Framebuffer *f, INIReader *reader);
 		~OutputMapper();
@@ -143,15 +293,57 @@ class OutputMapper {
 		void removeMappingForGroup(OutputGroup *g);
 
 		inline Routine *routineForMapping(OutputGroup *g) {
+			std::lock_guard<std::recursive_mutex> lk(this->outputMapLock);
 			return this->outputMap[g];
 		}
 
-    void getAllGroups(std::vector<OutputGroup *> &groups);
+		void getAllGroups(const Snapshot *snapshot, std::vector<OutputGroup *> &groups);
+
+		void updateGroups(void);
+
+		/**
+		 * Retires objects that readers of the current snapshot may still be
+		 * using, such as those replaced in the data store. They're released once
+		 * all snapshots up to the current one are; a new snapshot is published
+		 * so that this happens as soon as their readers are done.
+		 */
+		template<class T> void retire(const std::vector<std::shared_ptr<T>> &objects) {
+			if(objects.empty()) {
+				return;
+			}
+
+			std::lock_guard<std::recursive_mutex> lk(this->outputMapLock);
+			unsigned long generation = this->currentSnapshot.load()->generation;
+
+			for(auto const& object : objects) {
+				this->retiredObjects.emplace_back(generation, object);
+			}
+
+			this->publishSnapshot();
+		}
+
+		SnapshotRef acquireSnapshot(void);
+
+		/**
+		 * Returns a counter that is incremented every time the mappings change,
+		 * so consumers can tell whether state derived from them is stale.
+		 */
+		unsigned long getGeneration(void) const {
+			return this->generation;
+		}
 
 	private:
+		void _removeMappingForGroup(OutputGroup *g);
 		void _removeMappingsInUbergroup(OutputUberGroup *ug);
 
 		void removeEmptyUbergroups(void);
+		void _removeMembersFromUbergroup(OutputUberGroup *ubergroup, const std::vector<OutputGroup *> &members);
+
+		void retireGroup(OutputGroup *group);
+
+		void publishSnapshot(void);
+		void reclaimSnapshots(void);
+		void releaseSnapshot(size_t slot);
 
 		void printMap(void);
 
@@ -164,6 +356,36 @@ class OutputMapper {
 
 		std::recursive_mutex outputMapLock;
 		std::map<OutputGroup *, Routine *> outputMap;
+
+		std::atomic_ulong generation;
+
+	// snapshots
+	public:
+		/// maximum number of snapshots that may be held at once
+		static const size_t kMaxSnapshotRefs = 32;
+
+	private:
+		/// most recently published snapshot
+		std::atomic<const Snapshot *> currentSnapshot;
+
+		/// snapshot held through each slot, so it isn't freed while in use
+		std::atomic<const Snapshot *> heldSnapshots[kMaxSnapshotRefs];
+		/// whether a slot is in use by a reader
+		std::atomic_bool slotInUse[kMaxSnapshotRefs];
+
+		/// replaced snapshots that may still be held; protected by outputMapLock
+		std::vector<const Snapshot *> retiredSnapshots;
+
+		/**
+		 * Groups that were removed from the output map, along with the
+		 * generation of the last snapshot that may reference them. They're freed
+		 * once all snapshots up to that one are, and no effects run on them.
+		 * Protected by outputMapLock.
+		 */
+		std::vector<std::pair<unsigned long, OutputGroup *>> retiredGroups;
+
+		/// other retired objects, released the same way; protected by outputMapLock
+		std::vector<std::pair<unsigned long, std::shared_ptr<void>>> retiredObjects;
 };
 
 // operators
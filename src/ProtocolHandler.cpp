@@ -1,8 +1,13 @@
 #include "ProtocolHandler.h"
 
 #include "NodeDiscovery.h"
+#include "AckTracker.h"
+#include "Metrics.h"
+#include "Shard.h"
+#include "Tracer.h"
 
 #include <chrono>
+#include <algorithm>
 
 #include <glog/logging.h>
 #include <pthread.h>
@@ -12,6 +17,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
 
 #include "lichtenstein_proto.h"
@@ -25,11 +31,94 @@
 static const size_t kClientBufferSz = (1024 * 8);
 /// control buffer size for recvfrom
 static const size_t kControlBufSz = (1024);
+/// most datagrams read with a single receive call
+static const size_t kMaxReceiveBatchSz = 256;
+
+/// port on which nodes listen for framebuffer data
+static const uint16_t kNodePort = 7420;
+
+const double ProtocolHandler::kAckLatencyBounds[] = {
+	100, 250, 500, 1000, 2000, 5000, 10000, 20000, 50000
+};
+
+#ifdef __linux__
+// older libc headers don't define the GSO socket option
+#ifndef UDP_SEGMENT
+	#define UDP_SEGMENT 103
+#endif
+
+/// maximum number of segments the kernel accepts in one GSO send
+static const size_t kMaxGsoSegments = 64;
+/// maximum number of bytes sent in one GSO send
+static const size_t kMaxGsoBytes = 65000;
+/// largest segment that fits in a single Ethernet frame without fragmenting
+static const size_t kMaxGsoSegmentSz = (1500 - 20 - 8);
+/// control buffer space needed for the UDP_SEGMENT message
+static const size_t kGsoControlSz = CMSG_SPACE(sizeof(uint16_t));
+
+/**
+ * Buffers used to build the message vector for sendmmsg. Each message covers
+ * either a single packet, or with GSO a run of equally sized packets to the same
+ * node; each packet gets its own iovec.
+ */
+struct ProtocolHandler::SendBuffers {
+	std::vector<struct mmsghdr> msgs;
+	std::vector<struct iovec> iovs;
+	std::vector<struct sockaddr_in> addrs;
+	std::vector<uint8_t> control;
+
+	// index of the first packet and number of packets covered by each message
+	std::vector<size_t> firstPacket;
+	std::vector<size_t> numPackets;
+};
+#endif
+
+/**
+ * Buffers for a batch of received datagrams. Each datagram gets its own packet
+ * buffer, source address, and control buffer; none of them are cleared between
+ * reads, since the kernel tells us how much of each was written.
+ */
+struct ProtocolHandler::ReceiveBuffers {
+#ifdef __linux__
+	std::vector<struct mmsghdr> msgs;
+#else
+	std::vector<struct msghdr> msgs;
+#endif
+	std::vector<struct iovec> iovs;
+	std::vector<struct sockaddr_storage> addrs;
+	/// number of bytes read into each datagram's buffer
+	std::vector<size_t> lengths;
+
+	std::vector<char> data;
+	std::vector<char> control;
+
+	/**
+	 * Allocates buffers for the given number of datagrams.
+	 */
+	ReceiveBuffers(size_t count) : msgs(count), iovs(count), addrs(count),
+		lengths(count), data(count * kClientBufferSz), control(count * kControlBufSz) {
+		for(size_t i = 0; i < count; i++) {
+			this->iovs[i].iov_base = &this->data[i * kClientBufferSz];
+			this->iovs[i].iov_len = kClientBufferSz;
+		}
+	}
+
+	/**
+	 * Returns the message header for the given datagram.
+	 */
+	struct msghdr *header(size_t i) {
+#ifdef __linux__
+		return &this->msgs[i].msg_hdr;
+#else
+		return &this->msgs[i];
+#endif
+	}
+};
 
 /**
  * Main server entry point
  */
-void ProtocolHandlerEntry(void *ctx) {
+void ProtocolHandlerEntry(void *ctx, size_t index) {
 #ifdef __APPLE__
 	pthread_setname_np("Protocol Handler");
 #else
@@ -39,7 +128,7 @@ void ProtocolHandlerEntry(void *ctx) {
 #endif
 
 	ProtocolHandler *srv = static_cast<ProtocolHandler *>(ctx);
-	srv->threadEntry();
+	srv->threadEntry(index);
 }
 
 /**
@@ -49,16 +138,100 @@ ProtocolHandler::ProtocolHandler(DataStore *store, INIReader *reader) {
 	this->store = store;
 	this->config = reader;
 
-	this->numPendingFBWrites = 0;
+	// which nodes we're responsible for, if there are multiple servers
+	this->shard = new Shard(reader);
+
+	int shardTimeout = this->config->GetInteger("shard", "syncTimeout", 5);
+	CHECK(shardTimeout >= 0) << "Shard sync timeout may not be negative; check shard.syncTimeout";
+	this->shardTimeout = std::chrono::milliseconds(shardTimeout);
+
+	this->shardFrames.resize(this->shard->getCount(), 0);
+
+	// set up the tracking of framebuffer writes
+	int maxPendingWrites = this->config->GetInteger("proto", "maxPendingWrites", 4096);
+	CHECK(maxPendingWrites > 0) << "Maximum number of pending writes must be positive; check proto.maxPendingWrites";
+
+	this->acks = new AckTracker(maxPendingWrites, std::chrono::milliseconds(1), [this](DbNode *node, uint32_t txn) {
+		this->fbWriteTimedOut(node, txn);
+	});
+
+	this->sendHistogram = Metrics::shared()->histogram("lichtenstein_frame_stage_seconds",
+													   {{"stage", "send"}},
+													   "Time taken by each stage of a frame");
+
+	// wait at most this long for acks before syncing output
+	this->syncTimeout = std::chrono::milliseconds(this->config->GetInteger("proto", "syncTimeout", 5));
 
-	// create the background thread
+	// writes that weren't acknowledged in this time count as lost
+	int writeTimeout = this->config->GetInteger("proto", "writeTimeout", 5);
+	CHECK(writeTimeout > 0) << "Write timeout must be positive; check proto.writeTimeout";
+
+	this->writeTimeout = std::chrono::milliseconds(writeTimeout);
+
+	// adapt how often data is sent to each node to its ack times and losses
+	this->adaptiveRate = this->config->GetBoolean("proto", "adaptiveRate", true);
+
+	this->rateMaxRtt = this->config->GetReal("proto", "rateMaxRtt", 3) * 1000.f;
+	CHECK(this->rateMaxRtt > 0) << "Maximum ack time must be positive; check proto.rateMaxRtt";
+
+	this->rateMaxLoss = this->config->GetReal("proto", "rateMaxLoss", 0.1);
+	CHECK(this->rateMaxLoss > 0 && this->rateMaxLoss <= 1) << "Maximum loss must be between 0 and 1; check proto.rateMaxLoss";
+
+	int rateMaxDivisor = this->config->GetInteger("proto", "rateMaxDivisor", 8);
+	CHECK(rateMaxDivisor > 0) << "Maximum rate divisor must be positive; check proto.rateMaxDivisor";
+	this->rateMaxDivisor = rateMaxDivisor;
+
+	int rateInterval = this->config->GetInteger("proto", "rateInterval", 500);
+	CHECK(rateInterval > 0) << "Rate adjustment interval must be positive; check proto.rateInterval";
+	this->rateInterval = std::chrono::milliseconds(rateInterval);
+
+	// split frames that don't fit in a single Ethernet frame?
+	int segmentSize = this->config->GetInteger("proto", "segmentSize", 0);
+	CHECK(segmentSize == 0 || segmentSize >= 64) << "Segments must be at least 64 bytes; check proto.segmentSize";
+	this->segmentSize = segmentSize;
+
+	// send framebuffer data batched?
+	this->batchSends = this->config->GetBoolean("proto", "batchSends", true);
+
+#ifdef __linux__
+	this->sendBuffers = new SendBuffers;
+#else
+	// sendmmsg isn't available
+	this->batchSends = false;
+#endif
+
+	// how many threads receive packets, and how many packets they read at once
+	int receiveThreads = this->config->GetInteger("proto", "receiveThreads", 1);
+	CHECK(receiveThreads > 0) << "Need at least one receive thread; check proto.receiveThreads";
+
+	int receiveBatchSz = this->config->GetInteger("proto", "receiveBatch", 16);
+	CHECK(receiveBatchSz > 0 && receiveBatchSz <= (int) kMaxReceiveBatchSz) << "Invalid receive batch size; check proto.receiveBatch";
+
+#ifdef __linux__
+	this->receiveBatchSz = receiveBatchSz;
+#else
+	// recvmmsg isn't available, and SO_REUSEPORT doesn't balance datagrams
+	this->receiveBatchSz = 1;
+
+	LOG_IF(WARNING, receiveThreads > 1) << "Multiple receive threads aren't supported on this platform";
+	receiveThreads = 1;
+#endif
+
+	// create a socket for each receiver; the first one is also used to send
+	for(int i = 0; i < receiveThreads; i++) {
+		this->receiveSockets.push_back(this->createSocket(receiveThreads > 1));
+	}
+
+	this->sock = this->receiveSockets[0];
+
+	// create the background threads
 	this->run = true;
 
-	LOG(INFO) << "Starting protocol handler thread";
-	this->worker = new std::thread(ProtocolHandlerEntry, this);
+	LOG(INFO) << "Starting " << receiveThreads << " protocol handler thread(s)";
 
-	// unlock mutex
-	this->pendingOutputMutex.unlock();
+	for(int i = 0; i < receiveThreads; i++) {
+		this->workers.push_back(new std::thread(ProtocolHandlerEntry, this, i));
+	}
 }
 
 /**
@@ -73,20 +246,36 @@ ProtocolHandler::~ProtocolHandler() {
 	// close the worker thread
 	this->run = false;
 
-	err = close(this->sock);
-	LOG_IF(ERROR, err != 0) << "Couldn't close multicast socket: " << strerror(errno);
+	for(int sock : this->receiveSockets) {
+		err = close(sock);
+		LOG_IF(ERROR, err != 0) << "Couldn't close multicast socket: " << strerror(errno);
+	}
+
+  // detach the workers so that they can be killed off
+	for(std::thread *worker : this->workers) {
+		worker->detach();
+		delete worker;
+	}
+
+#ifdef __linux__
+	delete this->sendBuffers;
+#endif
 
-  // detach the worker so that it can be killed off
-	this->worker->detach();
-	delete this->worker;
+	delete this->acks;
+	delete this->shard;
 }
 
 #pragma mark Socket Handling and Worker Thread
 /**
- * Creates the server's listening socket.
+ * Creates a listening socket. If reusePort is set, the port may be shared with
+ * other sockets; the kernel then spreads incoming datagrams across them based on
+ * their source address, so all packets from the same node arrive on the same
+ * socket.
+ *
+ * Returns the socket's file descriptor.
  */
-void ProtocolHandler::createSocket() {
-	int err = 0;
+int ProtocolHandler::createSocket(bool reusePort) {
+	int err = 0, sock;
 	struct sockaddr_in addr;
 	int nbytes, addrlen;
 	struct ip_mreq mreq;
@@ -104,19 +293,25 @@ void ProtocolHandler::createSocket() {
 	PLOG_IF(FATAL, err != 1) << "Couldn't convert IP address: ";
 
 	// create the socket
-	this->sock = socket(AF_INET, SOCK_DGRAM, 0);
-	PLOG_IF(FATAL, this->sock < 0) << "Couldn't create listening socket";
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	PLOG_IF(FATAL, sock < 0) << "Couldn't create listening socket";
 
 	// allow re-use of the address
-	err = setsockopt(this->sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+	err = setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
 	PLOG_IF(FATAL, err < 0) << "Couldn't set SO_REUSEADDR";
 
+	// share the port between multiple receivers
+	if(reusePort) {
+		err = setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
+		PLOG_IF(FATAL, err < 0) << "Couldn't set SO_REUSEPORT";
+	}
+
 	// enable the socket info struct
 #ifdef __linux__
-	err = setsockopt(this->sock, IPPROTO_IP, IP_PKTINFO, &yes, sizeof(yes));
+	err = setsockopt(sock, IPPROTO_IP, IP_PKTINFO, &yes, sizeof(yes));
 	PLOG_IF(FATAL, err < 0) << "Couldn't set IP_PKTINFO";
 #else
-	err = setsockopt(this->sock, IPPROTO_IP, IP_RECVDSTADDR, &yes, sizeof(yes));
+	err = setsockopt(sock, IPPROTO_IP, IP_RECVDSTADDR, &yes, sizeof(yes));
 	PLOG_IF(FATAL, err < 0) << "Couldn't set IP_RECVDSTADDR";
 #endif
 
@@ -126,95 +321,128 @@ void ProtocolHandler::createSocket() {
 	addr.sin_port = htons(port);
 
 	// bind to this address
-	err = ::bind(this->sock, (struct sockaddr *) &addr, sizeof(addr));
+	err = ::bind(sock, (struct sockaddr *) &addr, sizeof(addr));
 	PLOG_IF(FATAL, err < 0) << "Couldn't bind listening socket on port " << port;
 
 	LOG(INFO) << "Listening for packets on port " << port;
-}
 
-/**
- * Thread entry point
- */
-void ProtocolHandler::threadEntry() {
-	int err = 0, rsz;
+	// check whether the kernel supports UDP GSO; only the first socket sends
+#ifdef __linux__
+	if(this->receiveSockets.empty() && this->batchSends && this->config->GetBoolean("proto", "gso", true)) {
+		int gsoSize = 0;
+		socklen_t gsoSizeLen = sizeof(gsoSize);
 
-	// allocate the read buffer
-	char *buffer = new char[kClientBufferSz];
+		err = getsockopt(sock, IPPROTO_UDP, UDP_SEGMENT, &gsoSize, &gsoSizeLen);
+		this->useGSO = (err == 0);
 
-	// used for recvmsg
-	struct msghdr msg;
-	struct sockaddr_storage srcAddr;
+		LOG_IF(INFO, !this->useGSO) << "UDP GSO not supported, sending packets individually";
+	}
+#endif
 
-	struct iovec iov[1];
-	iov[0].iov_base = buffer;
-	iov[0].iov_len = kClientBufferSz;
+	return sock;
+}
 
-	char *controlBuf = new char[kControlBufSz];
+/**
+ * Thread entry point for a receiver; index is the receiver's index in the list of
+ * sockets. The first receiver also handles multicast packets.
+ */
+void ProtocolHandler::threadEntry(size_t index) {
+	int sock = this->receiveSockets[index];
 
-	// create the socket
-	this->createSocket();
+	// allocate the read buffers
+	ReceiveBuffers *buf = new ReceiveBuffers(this->receiveBatchSz);
 
 	// create multicast receiver
-	this->discovery = new NodeDiscovery(this->store, this->config, this, this->sock);
+	if(index == 0) {
+		this->discovery = new NodeDiscovery(this->store, this->config, this, sock);
+	}
 
 	// listen on the socket
 	while(this->run) {
-		// populate the message buffer
-		memset(&msg, 0, sizeof(msg));
+		int count = this->receiveBatch(sock, buf);
 
-		msg.msg_name = &srcAddr;
-		msg.msg_namelen = sizeof(srcAddr);
-		msg.msg_iov = iov;
-		msg.msg_iovlen = 1;
-		msg.msg_control = controlBuf;
-		msg.msg_controllen = kControlBufSz;
-
-		// clear the buffer, then read from the socket
-		std::fill(buffer, buffer + kClientBufferSz, 0);
-
-		rsz = recvmsg(this->sock, &msg, 0);
-
-		// if the read size was zero, the connection was closed
-		if(rsz == 0) {
-			LOG(WARNING) << "Connection " << this->sock << " closed by host";
-			break;
-		}
 		// handle error conditions
-		else if(rsz == -1) {
+		if(count < 0) {
 			// ignore messages if we're shutting down
 			if(this->run == true) {
 				PLOG(WARNING) << "Couldn't read from socket: ";
-				break;
 			}
-      // request to terminate: exit
-      else {
-        goto cleanup;
-      }
+
+			break;
 		}
-		// otherwise, try to parse the packet
-		else {
-			VLOG(3) << "Received " << rsz << " bytes";
-			this->handlePacket(buffer, rsz, &msg);
+
+		// otherwise, try to parse each of the packets
+		VLOG(3) << "Received " << count << " datagrams on receiver " << index;
+
+		for(int i = 0; i < count; i++) {
+			struct msghdr *msg = buf->header(i);
+			size_t length = buf->lengths[i];
+
+			// zero-length datagrams can't be valid packets
+			if(length == 0) {
+				continue;
+			}
+
+			VLOG(3) << "Received " << length << " bytes";
+			this->handlePacket(buf->iovs[i].iov_base, length, msg, index);
 		}
 	}
 
-cleanup: ;
-
 	// clean up any resources we allocated
 	LOG(INFO) << "Closing listening socket";
 
-	delete[] buffer;
-	delete[] controlBuf;
+	delete buf;
 }
 
 /**
- * Handles a packet received on the socket.
+ * Reads as many datagrams as are available from the socket into the buffers,
+ * blocking until at least one has arrived. Returns the number of datagrams that
+ * were read, or -1 on error.
  */
-void ProtocolHandler::handlePacket(void *packet, size_t length, struct msghdr *msg) {
+int ProtocolHandler::receiveBatch(int sock, ReceiveBuffers *buf) {
+	// the kernel overwrites the address and control lengths, so reset them
+	for(size_t i = 0; i < this->receiveBatchSz; i++) {
+		struct msghdr *msg = buf->header(i);
+
+		msg->msg_name = &buf->addrs[i];
+		msg->msg_namelen = sizeof(struct sockaddr_storage);
+		msg->msg_iov = &buf->iovs[i];
+		msg->msg_iovlen = 1;
+		msg->msg_control = &buf->control[i * kControlBufSz];
+		msg->msg_controllen = kControlBufSz;
+		msg->msg_flags = 0;
+	}
+
+#ifdef __linux__
+	int count = recvmmsg(sock, buf->msgs.data(), this->receiveBatchSz, MSG_WAITFORONE, nullptr);
+
+	for(int i = 0; i < count; i++) {
+		buf->lengths[i] = buf->msgs[i].msg_len;
+	}
+
+	return count;
+#else
+	ssize_t rsz = recvmsg(sock, buf->header(0), 0);
+
+	if(rsz < 0) {
+		return -1;
+	}
+
+	buf->lengths[0] = rsz;
+	return 1;
+#endif
+}
+
+/**
+ * Handles a packet received on the socket by the given receiver.
+ */
+void ProtocolHandler::handlePacket(void *packet, size_t length, struct msghdr *msg, size_t receiver) {
+	TRACE_SCOPE("handlePacket");
+
 	int err;
 	struct cmsghdr *cmhdr;
 
-  struct in_addr destInAddr;
+  struct in_addr destInAddr = {0};
 
 	static const socklen_t destAddrSz = 128;
 	char destAddr[destAddrSz];
@@ -258,6 +486,25 @@ void ProtocolHandler::handlePacket(void *packet, size_t length, struct msghdr *m
 
 	// if it's a multicast packet, pass it to the discovery handler
 	if(isMulticast) {
+		// every receiver gets a copy of multicast packets; only handle one
+		if(receiver != 0) {
+			return;
+		}
+
+		// other shards coordinate through the multicast group too
+		if(length >= sizeof(lichtenstein_header_t)) {
+			auto *header = static_cast<lichtenstein_header_t *>(packet);
+			uint16_t opcode = ntohs(header->opcode);
+
+			if(opcode == kOpcodeShardReady) {
+				this->handleShardReady(packet, length);
+				return;
+			} else if(opcode == kOpcodeSyncOutput) {
+				// sent by us (or the leading shard); only nodes care about it
+				return;
+			}
+		}
+
 		VLOG(2) << "Received multicast packet: forwarding to discovery handler";
 		this->discovery->handleMulticastPacket(packet, length);
 	}
@@ -268,8 +515,8 @@ void ProtocolHandler::handlePacket(void *packet, size_t length, struct msghdr *m
 		// check validity
 		pErr = LichtensteinUtils::validatePacket(packet, length);
 
-		if(err != LichtensteinUtils::kNoError) {
-			LOG(ERROR) << "Couldn't verify unicast packet: " << err;
+		if(pErr != LichtensteinUtils::kNoError) {
+			LOG(ERROR) << "Couldn't verify unicast packet: " << pErr;
 			return;
 		}
 
@@ -287,6 +534,8 @@ void ProtocolHandler::handlePacket(void *packet, size_t length, struct msghdr *m
 					// find the transaction number in the pending adoptions
 					uint32_t txn = header->txn;
 
+					std::lock_guard<std::mutex> lk(this->adoptionsLock);
+
 					for(size_t i = 0; i < this->pendingAdoptions.size(); i++) {
 						// get the tuple
 						auto tuple = this->pendingAdoptions[i];
@@ -297,9 +546,8 @@ void ProtocolHandler::handlePacket(void *packet, size_t length, struct msghdr *m
 							DbNode *node = std::get<1>(tuple);
 							node->adopted = 1;
 
-							// update it in the DB, then delete it
+							// update it in the DB
 							this->store->update(node);
-							delete node;
 
 							// remove it from the list
 							this->pendingAdoptions.erase(this->pendingAdoptions.begin() + i);
@@ -316,42 +564,32 @@ void ProtocolHandler::handlePacket(void *packet, size_t length, struct msghdr *m
 				}
 
 				// is it a framebuffer write acknowledgement?
-				case kOpcodeFramebufferData: {
-					// find the transaction number in the pending writes vector
+				case kOpcodeFramebufferData:
+				case kOpcodeFramebufferDelta: {
+					// stop tracking the write with this transaction number
 					uint32_t txn = header->txn;
 
-					for(size_t i = 0; i < this->pendingFBDataWrites.size(); i++) {
-						// get the tuple
-						auto tuple = this->pendingFBDataWrites[i];
-
-						// does the transaction number match?
-						if(std::get<0>(tuple) == txn) {
-							// compute how long it took to get the acknowledgement
-							DbNode *node = std::get<1>(tuple);
-							auto sent = std::get<2>(tuple);
-
-							auto current = std::chrono::high_resolution_clock::now();
-							std::chrono::duration<double, std::milli> millis = (current - sent);
-
-							VLOG_EVERY_N(1, 100) << "Received write ack in " << millis.count() << " ms";
+					DbNode *node = nullptr;
+					AckTracker::clock::duration latency;
 
-							// cancel timer
-							this->timer.remove(std::get<3>(tuple));
+					if(this->acks->acknowledge(txn, &node, &latency)) {
+						// compute how long it took to get the acknowledgement
+						std::chrono::duration<double, std::milli> millis = latency;
 
-							// remove it from the list and decrement counter
-							this->pendingFBDataWrites.erase(this->pendingFBDataWrites.begin() + i);
+						VLOG_EVERY_N(1, 100) << "Received write ack in " << millis.count() << " ms";
 
-							// decrement counter and unlock the mutex
-							this->numPendingFBWrites--;
-							this->pendingOutputMutex.unlock();
-							return;
-						}
+						this->recordAckLatency(node, (millis.count() * 1000.f));
+						return;
 					}
 
 					// otherwise, if we get here, we couldn't find the node
 					LOG(WARNING) << "Received unexpected ack for fb write with txn " << txn;
 					break;
 				}
+
+				// nodes acknowledge the start of output; we don't need to track that
+				case kOpcodeSyncOutput:
+					break;
 			}
 		}
 	}
@@ -419,6 +657,7 @@ void ProtocolHandler::adoptNode(DbNode *node) {
 		PLOG_IF(ERROR, errno != 0) << "Couldn't send adoption packet: ";
 	} else {
 		// write this node's info into the pending adoptions
+		std::lock_guard<std::mutex> lk(this->adoptionsLock);
 		this->pendingAdoptions.push_back(std::make_tuple(txn, node));
 	}
 
@@ -428,28 +667,113 @@ void ProtocolHandler::adoptNode(DbNode *node) {
 
 
 /**
- * Sends pixel data to the node.
+ * Allocates a buffer that can hold a framebuffer data packet with the given
+ * number of pixels. A pointer to where the pixel data goes is written to
+ * payload; pixel data can be written there directly, and is sent as-is by
+ * sendDataToNode.
+ *
+ * The buffer must be released with freeFramebufferPacket.
+ */
+uint8_t *ProtocolHandler::allocFramebufferPacket(size_t numPixels, bool isRGBW, uint8_t **payload) {
+	size_t totalPacketLen = ProtocolHandler::framebufferDataSize(numPixels, isRGBW);
+
+	uint8_t *packet = static_cast<uint8_t *>(calloc(1, totalPacketLen));
+	CHECK(packet != nullptr) << "Couldn't allocate " << totalPacketLen << " byte packet";
+
+	if(payload) {
+		*payload = packet + offsetof(lichtenstein_framebuffer_data_t, data);
+	}
+
+	return packet;
+}
+
+/**
+ * Releases a packet buffer allocated by allocFramebufferPacket.
+ */
+void ProtocolHandler::freeFramebufferPacket(uint8_t *packet) {
+	free(packet);
+}
+
+/**
+ * Returns the size of a framebuffer data packet with the given number of pixels.
+ */
+size_t ProtocolHandler::framebufferDataSize(size_t numPixels, bool isRGBW) {
+	return sizeof(lichtenstein_framebuffer_data_t) + ((isRGBW ? 4 : 3) * numPixels);
+}
+
+/**
+ * Returns the size of a framebuffer delta packet containing the given ranges.
+ */
+size_t ProtocolHandler::framebufferDeltaSize(const std::vector<PixelRange> &ranges, bool isRGBW) {
+	size_t size = sizeof(lichtenstein_framebuffer_delta_t);
+
+	for(auto const& range : ranges) {
+		size += sizeof(lichtenstein_framebuffer_range_t);
+		size += ((isRGBW ? 4 : 3) * range.count);
+	}
+
+	return size;
+}
+
+/**
+ * Decides whether data for the given frame should be sent to the node. Nodes
+ * that couldn't be sent to repeatedly are skipped for a while; nodes that are
+ * slow to acknowledge writes, or lose them, only get every few frames, so they
+ * don't congest the network for the others.
+ *
+ * All channels of a node are skipped for the same frames. If a frame is skipped,
+ * the next one sent to the node must contain all pixels, not just a delta.
  */
-void ProtocolHandler::sendDataToNode(DbChannel *channel, void *pixelData, size_t numPixels, bool isRGBW) {
+bool ProtocolHandler::shouldSendToNode(DbNode *node, uint64_t frame) {
+	// exit if the error timer is nonzero
+	if(node->errorTimer != 0) {
+		node->errorTimer--;
+		return false;
+	}
+
+	if(!this->adaptiveRate) {
+		return true;
+	}
+
+	std::lock_guard<std::mutex> lk(this->rateLock);
+	auto it = this->rates.find(node->id);
+
+	if(it == this->rates.end()) {
+		return true;
+	}
+
+	return (frame % it->second.divisor) == 0;
+}
+
+/**
+ * Queues pixel data to be sent to the node. The packet must have been allocated
+ * with allocFramebufferPacket, and its payload must contain the pixel data. Only
+ * the header is filled in here; the payload is sent without being copied when
+ * flushFramebufferData is called, so the packet must not be modified until then.
+ */
+void ProtocolHandler::sendDataToNode(DbChannel *channel, uint8_t *packet, size_t numPixels, bool isRGBW) {
+	TRACE_SCOPE_ARG("sendDataToNode", "node", channel->node->id);
+
 	uint32_t txn;
 	int err;
 	LichtensteinUtils::PacketErrors pErr;
 
-	// exit if the error timer is nonzero
-	if(channel->node->errorTimer != 0) {
-		channel->node->errorTimer--;
+	// only the pixels that are sent count towards the length
+	size_t totalPacketLen = ProtocolHandler::framebufferDataSize(numPixels, isRGBW);
+
+	// if it doesn't fit in one datagram, send it as segments instead
+	if(this->segmentSize != 0 && totalPacketLen > this->segmentSize) {
+		const uint8_t *pixels = packet + offsetof(lichtenstein_framebuffer_data_t, data);
+
+		this->_queueSegments(channel, pixels, {{0, numPixels}}, isRGBW);
 		return;
 	}
 
-	// allocate buffer for packet
-	size_t totalPacketLen = sizeof(lichtenstein_framebuffer_data_t);
-	totalPacketLen += ((isRGBW ? 4 : 3) * numPixels);
+	void *data = packet;
 
-	void *data = malloc(totalPacketLen);
-
-	// clear its memory
+	// clear the header; it's still in network byte order from the last send
 	lichtenstein_framebuffer_data_t *fbPacket = static_cast<lichtenstein_framebuffer_data_t *>(data);
-	memset(data, 0, totalPacketLen);
+	memset(data, 0, sizeof(lichtenstein_framebuffer_data_t));
 
 	// fill in header
 	LichtensteinUtils::populateHeader(&fbPacket->header, kOpcodeFramebufferData);
@@ -464,8 +788,76 @@ void ProtocolHandler::sendDataToNode(DbChannel *channel, void *pixelData, size_t
 	fbPacket->dataFormat = (isRGBW ? kDataFormatRGBW : kDataFormatRGB);
 	fbPacket->dataElements = numPixels;
 
-	size_t numBytesToCopy = ((isRGBW ? 4 : 3) * numPixels);
-	memcpy(&fbPacket->data, pixelData, numBytesToCopy);
+	// byteswap, apply checksum
+	err = LichtensteinUtils::convertToNetworkByteOrder(data, totalPacketLen);
+	CHECK(err == 0) << "Couldn't convert byte order: " << err;
+
+	pErr = LichtensteinUtils::applyChecksum(data, totalPacketLen);
+	CHECK(pErr == LichtensteinUtils::kNoError) << "Error applying checksum: " << pErr;
+
+	// queue it; it's sent when the frame's data is flushed
+	QueuedPacket queued = {channel, packet, totalPacketLen, txn};
+
+	std::lock_guard<std::mutex> lk(this->sendQueueLock);
+	this->sendQueue.push_back(queued);
+}
+
+/**
+ * Queues a delta packet to be sent to the node, which contains only the given
+ * ranges of pixels. The pixel data for each range is copied from the channel's
+ * pixel buffer into the packet.
+ *
+ * The packet must have been allocated with allocFramebufferPacket for all of the
+ * channel's pixels; a delta is only worth sending if it's smaller than that.
+ */
+void ProtocolHandler::sendDeltaToNode(DbChannel *channel, uint8_t *packet, const uint8_t *pixels, const std::vector<PixelRange> &ranges, bool isRGBW) {
+	uint32_t txn;
+	int err;
+	LichtensteinUtils::PacketErrors pErr;
+
+	size_t totalPacketLen = ProtocolHandler::framebufferDeltaSize(ranges, isRGBW);
+	size_t capacity = ProtocolHandler::framebufferDataSize(channel->numPixels, isRGBW);
+
+	CHECK(totalPacketLen <= capacity) << "Delta packet (" << totalPacketLen << " bytes) larger than full frame (" << capacity << " bytes)";
+
+	if(this->segmentSize != 0 && totalPacketLen > this->segmentSize) {
+		this->_queueSegments(channel, pixels, ranges, isRGBW);
+		return;
+	}
+
+	void *data = packet;
+
+	// clear the header; it's still in network byte order from the last send
+	lichtenstein_framebuffer_delta_t *fbPacket = static_cast<lichtenstein_framebuffer_delta_t *>(data);
+	memset(data, 0, sizeof(lichtenstein_framebuffer_delta_t));
+
+	// fill in header
+	LichtensteinUtils::populateHeader(&fbPacket->header, kOpcodeFramebufferDelta);
+	txn = fbPacket->header.txn;
+
+	fbPacket->header.payloadLength = totalPacketLen - sizeof(lichtenstein_header_t);
+
+
+	// write format, channel and the ranges
+	fbPacket->destChannel = channel->nodeOffset;
+
+	fbPacket->dataFormat = (isRGBW ? kDataFormatRGBW : kDataFormatRGB);
+	fbPacket->numRanges = ranges.size();
+
+	size_t pixelStride = (isRGBW ? 4 : 3);
+	size_t offset = sizeof(lichtenstein_framebuffer_delta_t);
+
+	for(auto const& range : ranges) {
+		lichtenstein_framebuffer_range_t *out;
+		out = reinterpret_cast<lichtenstein_framebuffer_range_t *>(packet + offset);
+
+		out->start = range.start;
+		out->count = range.count;
+
+		memcpy(&out->data, pixels + (range.start * pixelStride), (range.count * pixelStride));
+
+		offset += sizeof(lichtenstein_framebuffer_range_t) + (range.count * pixelStride);
+	}
 
 	// byteswap, apply checksum
 	err = LichtensteinUtils::convertToNetworkByteOrder(data, totalPacketLen);
@@ -474,17 +866,344 @@ void ProtocolHandler::sendDataToNode(DbChannel *channel, void *pixelData, size_t
 	pErr = LichtensteinUtils::applyChecksum(data, totalPacketLen);
 	CHECK(pErr == LichtensteinUtils::kNoError) << "Error applying checksum: " << pErr;
 
-	// send it to the node
+	// queue it; it's sent when the frame's data is flushed
+	QueuedPacket queued = {channel, packet, totalPacketLen, txn};
+
+	std::lock_guard<std::mutex> lk(this->sendQueueLock);
+	this->sendQueue.push_back(queued);
+}
+
+/**
+ * Splits a frame into segments of at most segmentSize bytes, and queues them to
+ * be sent to the node. Each segment is a delta packet that contains a run of the
+ * given ranges; ranges that don't fit in the rest of a segment are split. The
+ * segments are numbered with the sequence fields in their headers, and each is
+ * acknowledged on its own, so losing one only loses those pixels.
+ *
+ * The segments are built in a buffer kept for each channel, which isn't touched
+ * again until the channel's next frame.
+ */
+void ProtocolHandler::_queueSegments(DbChannel *channel, const uint8_t *pixels, const std::vector<PixelRange> &ranges, bool isRGBW) {
+	int err;
+	LichtensteinUtils::PacketErrors pErr;
+
+	size_t pixelStride = (isRGBW ? 4 : 3);
+
+	ChannelSegments *cs;
+
+	{
+		std::lock_guard<std::mutex> lk(this->sendQueueLock);
+		cs = &this->channelSegments[channel->getId()];
+	}
+
+	cs->ranges.clear();
+	cs->segments.clear();
+	cs->packets.clear();
+
+	// lay out the segments, splitting ranges at segment boundaries
+	Segment segment = {0, 0, sizeof(lichtenstein_framebuffer_delta_t)};
+	size_t totalLength = 0;
+
+	for(auto const& range : ranges) {
+		size_t start = range.start;
+		size_t left = range.count;
+
+		while(left != 0) {
+			size_t room = this->segmentSize - segment.length;
+
+			// start a new segment if not even a single pixel fits
+			if(room < (sizeof(lichtenstein_framebuffer_range_t) + pixelStride)) {
+				cs->segments.push_back(segment);
+				totalLength += segment.length;
+
+				segment = {cs->ranges.size(), 0, sizeof(lichtenstein_framebuffer_delta_t)};
+				continue;
+			}
+
+			size_t count = std::min(left, (room - sizeof(lichtenstein_framebuffer_range_t)) / pixelStride);
+
+			cs->ranges.push_back({start, count});
+			segment.numRanges++;
+			segment.length += sizeof(lichtenstein_framebuffer_range_t) + (count * pixelStride);
+
+			start += count;
+			left -= count;
+		}
+	}
+
+	if(segment.numRanges != 0) {
+		cs->segments.push_back(segment);
+		totalLength += segment.length;
+	}
+
+	size_t numSegments = cs->segments.size();
+	CHECK(numSegments <= UINT16_MAX) << "Too many segments (" << numSegments << ") for channel " << channel->getId() << "; increase proto.segmentSize";
+
+	if(cs->buffer.size() < totalLength) {
+		cs->buffer.resize(totalLength);
+	}
+
+	// build each segment's packet
+	uint8_t *packet = cs->buffer.data();
+
+	for(size_t i = 0; i < numSegments; i++) {
+		const Segment &seg = cs->segments[i];
+		void *data = packet;
+
+		lichtenstein_framebuffer_delta_t *fbPacket = static_cast<lichtenstein_framebuffer_delta_t *>(data);
+		memset(data, 0, sizeof(lichtenstein_framebuffer_delta_t));
+
+		// fill in header
+		LichtensteinUtils::populateHeader(&fbPacket->header, kOpcodeFramebufferDelta);
+
+		fbPacket->header.sequenceIndex = i;
+		fbPacket->header.sequenceNumPackets = numSegments;
+		fbPacket->header.payloadLength = seg.length - sizeof(lichtenstein_header_t);
+
+		fbPacket->destChannel = channel->nodeOffset;
+
+		fbPacket->dataFormat = (isRGBW ? kDataFormatRGBW : kDataFormatRGB);
+		fbPacket->numRanges = seg.numRanges;
+
+		// copy the segment's ranges
+		size_t offset = sizeof(lichtenstein_framebuffer_delta_t);
+
+		for(size_t r = seg.firstRange; r < (seg.firstRange + seg.numRanges); r++) {
+			const PixelRange &range = cs->ranges[r];
+
+			lichtenstein_framebuffer_range_t *out;
+			out = reinterpret_cast<lichtenstein_framebuffer_range_t *>(packet + offset);
+
+			out->start = range.start;
+			out->count = range.count;
+
+			memcpy(&out->data, pixels + (range.start * pixelStride), (range.count * pixelStride));
+
+			offset += sizeof(lichtenstein_framebuffer_range_t) + (range.count * pixelStride);
+		}
+
+		cs->packets.push_back({channel, packet, seg.length, fbPacket->header.txn});
+
+		// byteswap, apply checksum
+		err = LichtensteinUtils::convertToNetworkByteOrder(data, seg.length);
+		CHECK(err == 0) << "Couldn't convert byte order: " << err;
+
+		pErr = LichtensteinUtils::applyChecksum(data, seg.length);
+		CHECK(pErr == LichtensteinUtils::kNoError) << "Error applying checksum: " << pErr;
+
+		packet += seg.length;
+	}
+
+	// queue them; consecutive segments of equal size can be sent with GSO
+	std::lock_guard<std::mutex> lk(this->sendQueueLock);
+	this->sendQueue.insert(this->sendQueue.end(), cs->packets.begin(), cs->packets.end());
+}
+
+/**
+ * Sends all framebuffer packets queued by sendDataToNode and sendDeltaToNode.
+ * With batching, they're handed to the kernel in as few sendmmsg calls as
+ * possible; packets to the same node are additionally coalesced with UDP GSO if
+ * it's supported.
+ *
+ * The time taken is added to the average send time.
+ */
+void ProtocolHandler::flushFramebufferData(void) {
+	TRACE_SCOPE("flushFramebufferData");
+
+	std::lock_guard<std::mutex> lk(this->sendQueueLock);
+
+	if(this->sendQueue.empty()) {
+		return;
+	}
+
+	auto start = std::chrono::high_resolution_clock::now();
+
+	if(this->batchSends) {
+		this->_sendQueueBatched();
+	} else {
+		this->_sendQueueIndividually(0);
+	}
+
+	this->sendQueue.clear();
+
+	this->sendHistogram->record(std::chrono::high_resolution_clock::now() - start);
+}
+
+/**
+ * Returns the median time taken to send all of a frame's packets, in µS, from
+ * the send stage's histogram.
+ */
+double ProtocolHandler::getMedianSendTime(void) const {
+	Histogram::Snapshot snapshot;
+	this->sendHistogram->snapshot(snapshot);
+
+	return double(snapshot.percentile(0.5)) / 1000.;
+}
+
+/**
+ * Sends the queued packets, starting at the given index, with one sendto call
+ * each.
+ */
+void ProtocolHandler::_sendQueueIndividually(size_t start) {
 	struct sockaddr_in sockAddr;
 
 	memset(&sockAddr, 0, sizeof(sockAddr));
 	sockAddr.sin_family = AF_INET;
-	sockAddr.sin_addr.s_addr = channel->node->ip;
-	sockAddr.sin_port = htons(7420); // TODO: nodes may have different port
+	sockAddr.sin_port = htons(kNodePort); // TODO: nodes may have different port
 
-	if(sendto(this->sock, data, totalPacketLen, 0, (struct sockaddr *) &sockAddr, sizeof(sockAddr)) < 0) {
-		PLOG_IF(WARNING, errno != 0) << "Couldn't send data packet to node " << channel->node << ": ";
+	for(size_t i = start; i < this->sendQueue.size(); i++) {
+		const QueuedPacket &packet = this->sendQueue[i];
+		sockAddr.sin_addr.s_addr = packet.channel->node->ip;
+
+		int err = sendto(this->sock, packet.data, packet.length, 0, (struct sockaddr *) &sockAddr, sizeof(sockAddr));
+
+		if(err < 0) {
+			PLOG_IF(WARNING, errno != 0) << "Couldn't send data packet to node " << packet.channel->node << ": ";
+		}
+
+		this->_framebufferSent(packet, (err >= 0));
+	}
+}
+
+/**
+ * Sends the queued packets with sendmmsg.
+ *
+ * If GSO is enabled, consecutive packets of the same size to the same node are
+ * sent as a single message, which the kernel splits into one datagram per
+ * packet. Should the kernel reject that, GSO is turned off and the remaining
+ * packets are sent individually.
+ */
+void ProtocolHandler::_sendQueueBatched(void) {
+#ifdef __linux__
+	SendBuffers *buf = this->sendBuffers;
+	size_t numQueued = this->sendQueue.size();
+
+	// there are at most as many messages as packets
+	buf->msgs.resize(numQueued);
+	buf->iovs.resize(numQueued);
+	buf->addrs.resize(numQueued);
+	buf->firstPacket.resize(numQueued);
+	buf->numPackets.resize(numQueued);
+
+	if(this->useGSO) {
+		buf->control.resize(numQueued * kGsoControlSz);
+	}
+
+	// build the messages
+	size_t numMsgs = 0;
+
+	for(size_t i = 0; i < numQueued; numMsgs++) {
+		const QueuedPacket &first = this->sendQueue[i];
+
+		struct sockaddr_in *addr = &buf->addrs[numMsgs];
+		memset(addr, 0, sizeof(struct sockaddr_in));
+		addr->sin_family = AF_INET;
+		addr->sin_addr.s_addr = first.channel->node->ip;
+		addr->sin_port = htons(kNodePort);
+
+		// find the run of packets that can be coalesced with this one
+		size_t count = 1;
+
+		if(this->useGSO && first.length <= kMaxGsoSegmentSz) {
+			while((i + count) < numQueued && count < kMaxGsoSegments &&
+				  ((count + 1) * first.length) <= kMaxGsoBytes) {
+				const QueuedPacket &next = this->sendQueue[i + count];
+
+				if(next.channel->node->ip != first.channel->node->ip ||
+				   next.length != first.length) {
+					break;
+				}
+
+				count++;
+			}
+		}
+
+		for(size_t j = 0; j < count; j++) {
+			buf->iovs[i + j].iov_base = this->sendQueue[i + j].data;
+			buf->iovs[i + j].iov_len = this->sendQueue[i + j].length;
+		}
+
+		struct msghdr *hdr = &buf->msgs[numMsgs].msg_hdr;
+		memset(hdr, 0, sizeof(struct msghdr));
+
+		hdr->msg_name = addr;
+		hdr->msg_namelen = sizeof(struct sockaddr_in);
+		hdr->msg_iov = &buf->iovs[i];
+		hdr->msg_iovlen = count;
+
+		// tell the kernel where to split the message
+		if(count > 1) {
+			hdr->msg_control = &buf->control[numMsgs * kGsoControlSz];
+			hdr->msg_controllen = kGsoControlSz;
+
+			struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr);
+			cmsg->cmsg_level = IPPROTO_UDP;
+			cmsg->cmsg_type = UDP_SEGMENT;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+
+			uint16_t segmentSz = first.length;
+			memcpy(CMSG_DATA(cmsg), &segmentSz, sizeof(segmentSz));
+		}
+
+		buf->firstPacket[numMsgs] = i;
+		buf->numPackets[numMsgs] = count;
+
+		i += count;
+	}
+
+	// send the messages; sendmmsg may not take all of them at once
+	size_t sent = 0;
+
+	while(sent < numMsgs) {
+		int err = sendmmsg(this->sock, &buf->msgs[sent], (numMsgs - sent), 0);
+
+		if(err < 0) {
+			// did the kernel reject a GSO message?
+			if(buf->numPackets[sent] > 1 && (errno == EIO || errno == EINVAL)) {
+				PLOG(WARNING) << "Couldn't send with UDP GSO, disabling it: ";
+				this->useGSO = false;
+
+				this->_sendQueueIndividually(buf->firstPacket[sent]);
+				return;
+			}
 
+			// otherwise, the first message couldn't be sent; skip it
+			PLOG_IF(WARNING, errno != 0) << "Couldn't send data packet to node " << this->sendQueue[buf->firstPacket[sent]].channel->node << ": ";
+			err = 0;
+		}
+
+		// mark all packets of the messages that were sent
+		for(size_t m = sent; m < (sent + err); m++) {
+			for(size_t j = 0; j < buf->numPackets[m]; j++) {
+				this->_framebufferSent(this->sendQueue[buf->firstPacket[m] + j], true);
+			}
+		}
+
+		sent += err;
+
+		// if it failed, mark the packets of the message that failed
+		if(err == 0) {
+			for(size_t j = 0; j < buf->numPackets[sent]; j++) {
+				this->_framebufferSent(this->sendQueue[buf->firstPacket[sent] + j], false);
+			}
+
+			sent++;
+		}
+	}
+#else
+	this->_sendQueueIndividually(0);
+#endif
+}
+
+/**
+ * Updates the node's error state after a framebuffer packet was sent (or failed
+ * to send.) On success, the write is tracked until it's acknowledged.
+ */
+void ProtocolHandler::_framebufferSent(const QueuedPacket &packet, bool success) {
+	DbChannel *channel = packet.channel;
+	uint32_t txn = packet.txn;
+
+	if(!success) {
 		// increment the error packets
 		if(channel->node->errorPackets++ >= ProtocolHandler::MaxPacketsWithErrors) {
 			// if 10 packets couldn't be sent, set the timer
@@ -495,87 +1214,168 @@ void ProtocolHandler::sendDataToNode(DbChannel *channel, void *pixelData, size_t
 		channel->node->errorPackets = 0;
 		channel->node->errorTimer = 0;
 
-		// get interval in ms
-		int timeout = this->config->GetInteger("proto", "writeTimeout", 7420);
+		// wait for the node to acknowledge the write
+		bool tracked = this->acks->add(txn, channel->node, this->writeTimeout);
+		LOG_IF_EVERY_N(WARNING, !tracked, 100) << "Too many unacknowledged framebuffer writes, not tracking txn " << txn;
+	}
+}
+
+/**
+ * Called on the ack tracker's thread when a framebuffer write wasn't
+ * acknowledged in time.
+ */
+void ProtocolHandler::fbWriteTimedOut(DbNode *node, uint32_t txn) {
+	// LOG(INFO) << "Node " << node << " didn't respond in time (txn " << txn << ")";
+
+	{
+		std::lock_guard<std::mutex> lk(this->statsLock);
+		this->ackLatencies[node->id].timeouts++;
+	}
 
-		// set up a timer for acknowledgements
-		CppTime::timer_id id;
+	this->updateNodeRate(node, false, 0);
+}
 
-		id = this->timer.add(std::chrono::milliseconds(timeout), [this, &channel = channel, txn](CppTime::timer_id) {
-			this->fbSendTimeoutExpired(channel, txn);
-		});
+/**
+ * Waits for all pixel data frames to be acknowledged by the nodes, or for the
+ * sync timeout to expire, in case a node is unreachable or slow.
+ *
+ * @return Whether all writes were acknowledged (or timed out individually.)
+ */
+bool ProtocolHandler::waitForOutstandingFramebufferWrites(void) {
+	bool done = this->acks->waitUntilEmpty(this->syncTimeout);
 
-		// write this node's info into the pending writes buffer
-		auto start = std::chrono::high_resolution_clock::now();
-		this->pendingFBDataWrites.push_back(std::make_tuple(txn, channel->node, start, id));
+	VLOG_IF(1, !done) << this->acks->size() << " framebuffer writes still unacknowledged at sync time";
 
-		// increment the number of pending writes
-		this->numPendingFBWrites++;
+	return done;
+}
+
+/**
+ * Adds an ack latency sample to the node's histogram.
+ */
+void ProtocolHandler::recordAckLatency(DbNode *node, double micros) {
+	this->updateNodeRate(node, true, micros);
+
+	std::lock_guard<std::mutex> lk(this->statsLock);
+	AckLatencyHistogram &histogram = this->ackLatencies[node->id];
+
+	size_t bucket = 0;
+
+	while(bucket < (kAckLatencyBuckets - 1) && micros > kAckLatencyBounds[bucket]) {
+		bucket++;
 	}
 
-	// delete memory
-	free(data);
+	histogram.counts[bucket]++;
+
+	// and into the node's exported histogram
+	Histogram *&exported = this->ackHistograms[node->id];
+
+	if(exported == nullptr) {
+		exported = Metrics::shared()->histogram("lichtenstein_node_ack_seconds",
+												{{"node", std::to_string(node->id)}},
+												"Time taken by nodes to acknowledge framebuffer writes");
+	}
+
+	exported->record(uint64_t(micros * 1000));
 }
 
 /**
- * Called when the timeout for a particular framebuffer expired. =
+ * Returns a copy of the ack latency histograms of all nodes, keyed by node id.
  */
-void ProtocolHandler::fbSendTimeoutExpired(DbChannel *ch, uint32_t txn) {
-	// LOG(INFO) << "Node didn't respond in time for " << ch << " (txn " << txn << ")";
+std::map<int, ProtocolHandler::AckLatencyHistogram> ProtocolHandler::getAckLatencyHistograms(void) {
+	std::lock_guard<std::mutex> lk(this->statsLock);
+	return this->ackLatencies;
+}
 
-	// remove it from the array
-	for(size_t i = 0; i < this->pendingFBDataWrites.size(); i++) {
-		// get the tuple
-		auto tuple = this->pendingFBDataWrites[i];
+/**
+ * Updates the node's rate state after a write was acknowledged (with the time it
+ * took, in µS) or timed out. Once per interval, the rate is adjusted: if the node
+ * lost too many writes, or took too long to acknowledge them, data is sent to it
+ * half as often. If it's well within both limits, its rate recovers by one step.
+ */
+void ProtocolHandler::updateNodeRate(DbNode *node, bool acked, double micros) {
+	if(!this->adaptiveRate) {
+		return;
+	}
 
-		// does the transaction number match?
-		if(std::get<0>(tuple) == txn) {
-			// remove it from the array
-			this->pendingFBDataWrites.erase(this->pendingFBDataWrites.begin() + i);
+	auto now = std::chrono::steady_clock::now();
 
-			// decrement counter and unlock the mutex
-			this->numPendingFBWrites--;
-			this->pendingOutputMutex.unlock();
-			return;
+	std::lock_guard<std::mutex> lk(this->rateLock);
+	NodeRate &rate = this->rates[node->id];
+
+	if(rate.lastAdjust == std::chrono::steady_clock::time_point()) {
+		rate.lastAdjust = now;
+	}
+
+	// update the smoothed ack time
+	if(acked) {
+		rate.acked++;
+
+		if(rate.rtt == 0) {
+			rate.rtt = micros;
+		} else {
+			rate.rtt += (micros - rate.rtt) * kRttGain;
 		}
+	} else {
+		rate.timedOut++;
 	}
+
+	// adjust the rate once per interval
+	if((now - rate.lastAdjust) < this->rateInterval) {
+		return;
+	}
+
+	rate.loss = double(rate.timedOut) / double(rate.acked + rate.timedOut);
+
+	bool congested = (rate.loss > this->rateMaxLoss) || (rate.rtt > this->rateMaxRtt);
+	bool healthy = (rate.loss <= (this->rateMaxLoss / 2)) && (rate.rtt <= (this->rateMaxRtt / 2));
+
+	if(congested && rate.divisor < this->rateMaxDivisor) {
+		rate.divisor = std::min(rate.divisor * 2, this->rateMaxDivisor);
+
+		LOG(INFO) << "Node " << node->id << " is congested (ack time " << rate.rtt
+				  << " µS, loss " << rate.loss << "); sending every " << rate.divisor << " frames";
+	} else if(healthy && rate.divisor > 1) {
+		rate.divisor--;
+
+		VLOG(1) << "Node " << node->id << " recovered; sending every " << rate.divisor << " frames";
+	}
+
+	rate.acked = 0;
+	rate.timedOut = 0;
+	rate.lastAdjust = now;
 }
 
 /**
- * Waits for all pixel data frames to be sent to the nodes, or for a timeout on
- * waiting for a response, in case a node is unreachable.
+ * Returns a copy of the rate state of all nodes, keyed by node id.
  */
-void ProtocolHandler::waitForOutstandingFramebufferWrites(void) {
-  /* not implemented right now */
+std::map<int, ProtocolHandler::NodeRate> ProtocolHandler::getNodeRates(void) {
+	std::lock_guard<std::mutex> lk(this->rateLock);
+	return this->rates;
 }
 
 /**
  * Multicasts the "output enable" command.
  */
 void ProtocolHandler::sendOutputEnableForAllNodes(void) {
-  return; /* not currently implemented, lol */
-
-	uint32_t txn;
 	int err;
 	LichtensteinUtils::PacketErrors pErr;
 
-	// allocate buffer for packet
+	// the packet is small enough to live on the stack
 	const size_t totalPacketLen = sizeof(lichtenstein_sync_output_t);
 
-	void *data = malloc(totalPacketLen);
+	lichtenstein_sync_output_t out;
+	void *data = &out;
 
-	// clear its memory
-	lichtenstein_sync_output_t *out = static_cast<lichtenstein_sync_output_t *>(data);
 	memset(data, 0, totalPacketLen);
 
 	// fill in header
-	LichtensteinUtils::populateHeader(&out->header, kOpcodeSyncOutput);
-	txn = out->header.txn;
+	LichtensteinUtils::populateHeader(&out.header, kOpcodeSyncOutput);
+	out.header.flags |= kFlagMulticast;
 
-	out->header.payloadLength = sizeof(lichtenstein_sync_output_t) - sizeof(lichtenstein_header_t);
+	out.header.payloadLength = sizeof(lichtenstein_sync_output_t) - sizeof(lichtenstein_header_t);
 
 	// output all channels
-	out->channel = 0xFFFFFFFF;
+	out.channel = 0xFFFFFFFF;
 
 
 	// byteswap, apply checksum
@@ -585,10 +1385,25 @@ void ProtocolHandler::sendOutputEnableForAllNodes(void) {
 	pErr = LichtensteinUtils::applyChecksum(data, totalPacketLen);
 	CHECK(pErr == LichtensteinUtils::kNoError) << "Error applying checksum: " << pErr;
 
+	// send to all nodes
+	if(!this->_sendMulticast(data, totalPacketLen)) {
+		PLOG_IF(ERROR, errno != 0) << "Couldn't send output enable packet: ";
+	}
+}
+
+/**
+ * Multicasts a packet, which must already be in network byte order, to the
+ * multicast group.
+ *
+ * @return Whether the packet was sent.
+ */
+bool ProtocolHandler::_sendMulticast(void *data, size_t length) {
+	int err;
 
 	// set up for the multicast send
 	struct sockaddr_in sockAddr;
 	memset(&sockAddr, 0, sizeof(sockAddr));
+	sockAddr.sin_family = AF_INET;
 
 	// get multicast IP
   std::string multiAddress = this->config->Get("server", "multicastGroup",
@@ -601,13 +1416,131 @@ void ProtocolHandler::sendOutputEnableForAllNodes(void) {
 	int port = this->config->GetInteger("server", "port", 7420);
 	sockAddr.sin_port = htons(port);
 
-	// send to node
-	if(sendto(this->sock, data, totalPacketLen, 0, (struct sockaddr *) &sockAddr, sizeof(sockAddr)) < 0) {
-		PLOG_IF(ERROR, errno != 0) << "Couldn't send output enable packet: ";
+	return (sendto(this->sock, data, length, 0, (struct sockaddr *) &sockAddr, sizeof(sockAddr)) >= 0);
+}
+
+#pragma mark - Shards
+/**
+ * Synchronizes the output of a frame, once its data was acknowledged by the
+ * nodes. Without shards, this just sends the sync output packet.
+ *
+ * Otherwise, only the leading shard sends it: the other shards tell it that
+ * their nodes are ready for the frame instead, and it waits (for at most the
+ * shard sync timeout) until all of them are.
+ *
+ * @param frame Number of the frame by the wall clock
+ */
+void ProtocolHandler::syncOutput(uint64_t frame) {
+	if(!this->shard->isSharded()) {
+		this->sendOutputEnableForAllNodes();
+		return;
 	}
 
-	// delete memory
-	free(data);
+	if(!this->shard->isLeader()) {
+		this->sendShardReady(frame);
+		return;
+	}
+
+	// wait for all other shards to be ready for this frame, or a later one
+	uint32_t wanted = uint32_t(frame);
+	bool ready;
+
+	{
+		std::unique_lock<std::mutex> lk(this->shardLock);
+
+		ready = this->shardCv.wait_for(lk, this->shardTimeout, [this, wanted] {
+			for(size_t i = 1; i < this->shardFrames.size(); i++) {
+				if(int32_t(this->shardFrames[i] - wanted) < 0) {
+					return false;
+				}
+			}
+
+			return true;
+		});
+	}
+
+	LOG_IF_EVERY_N(WARNING, !ready, 100) << "Not all shards were ready for frame " << frame << " at sync time";
+
+	this->sendOutputEnableForAllNodes();
+}
+
+/**
+ * Multicasts a shard ready packet for the given frame, which tells the leading
+ * shard that our nodes have its data.
+ */
+void ProtocolHandler::sendShardReady(uint64_t frame) {
+	int err;
+	LichtensteinUtils::PacketErrors pErr;
+
+	const size_t totalPacketLen = sizeof(lichtenstein_shard_ready_t);
+
+	lichtenstein_shard_ready_t out;
+	void *data = &out;
+
+	memset(data, 0, totalPacketLen);
+
+	// fill in header
+	LichtensteinUtils::populateHeader(&out.header, kOpcodeShardReady);
+	out.header.flags |= kFlagMulticast;
+
+	out.header.payloadLength = sizeof(lichtenstein_shard_ready_t) - sizeof(lichtenstein_header_t);
+
+	out.shard = this->shard->getIndex();
+	out.numShards = this->shard->getCount();
+	out.frame = uint32_t(frame);
+
+	// byteswap, apply checksum
+	err = LichtensteinUtils::convertToNetworkByteOrder(data, totalPacketLen);
+	CHECK(err == 0) << "Couldn't convert byte order: " << err;
+
+	pErr = LichtensteinUtils::applyChecksum(data, totalPacketLen);
+	CHECK(pErr == LichtensteinUtils::kNoError) << "Error applying checksum: " << pErr;
+
+	if(!this->_sendMulticast(data, totalPacketLen)) {
+		PLOG_EVERY_N(ERROR, 100) << "Couldn't send shard ready packet: ";
+	}
+}
+
+/**
+ * Handles a shard ready packet received over multicast. Only the leading shard
+ * cares about these; it remembers the latest frame each shard is ready for.
+ */
+void ProtocolHandler::handleShardReady(void *packet, size_t length) {
+	if(!this->shard->isLeader() || !this->shard->isSharded()) {
+		return;
+	}
+
+	LichtensteinUtils::PacketErrors pErr = LichtensteinUtils::validatePacket(packet, length);
+
+	if(pErr != LichtensteinUtils::kNoError) {
+		LOG_EVERY_N(ERROR, 100) << "Couldn't verify shard ready packet: " << pErr;
+		return;
+	}
+
+	LichtensteinUtils::convertToHostByteOrder(packet, length);
+
+	if(length < sizeof(lichtenstein_shard_ready_t)) {
+		LOG_EVERY_N(WARNING, 100) << "Ignoring shard ready packet of " << length << " bytes";
+		return;
+	}
+
+	auto *ready = static_cast<lichtenstein_shard_ready_t *>(packet);
+
+	// the other server must be configured for the same shards
+	if(ready->numShards != this->shard->getCount() || ready->shard == 0 ||
+	   ready->shard >= this->shard->getCount()) {
+		LOG_EVERY_N(WARNING, 100) << "Ignoring ready packet from shard " << ready->shard << " of "
+								  << ready->numShards << "; we're configured for "
+								  << this->shard->getCount() << " shards";
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lk(this->shardLock);
+		this->shardFrames[ready->shard] = ready->frame;
+	}
+
+	this->shardCv.notify_one();
 }
 
 /**
@@ -615,13 +1548,13 @@ void ProtocolHandler::sendOutputEnableForAllNodes(void) {
  * lock that thread might be waiting on.
  */
 void ProtocolHandler::prepareForShutDown(void) {
-	if(this->numPendingFBWrites != 0) {
-		LOG(INFO) << "Still have " << this->numPendingFBWrites << " pending "
+	size_t pending = this->acks->size();
+
+	if(pending != 0) {
+		LOG(INFO) << "Still have " << pending << " pending "
 				  << "framebuffer writes at shutdown time";
 	}
 
-	for(size_t i = 0; i < 5; i++) {
-		this->numPendingFBWrites = 0;
-		this->pendingOutputMutex.unlock();
-	}
+	// stop waiting on writes to be acknowledged
+	this->acks->cancelWaits();
 }
@@ -11,13 +11,17 @@
 #include <tuple>
 #include <chrono>
 #include <mutex>
-
-#include <cpptime.h>
+#include <condition_variable>
+#include <map>
+#include <cstdint>
 
 class DataStore;
 class INIReader;
 
 class NodeDiscovery;
+class AckTracker;
+class Shard;
+class Histogram;
 class DbNode;
 class DbChannel;
 
@@ -27,42 +31,207 @@ class ProtocolHandler {
 		~ProtocolHandler();
 
 	private:
+		// socket used for sending, and by the first receiver thread
 		int sock;
 
-		void createSocket();
+		int createSocket(bool reusePort);
 
 	private:
-		friend void ProtocolHandlerEntry(void *ctx);
+		friend void ProtocolHandlerEntry(void *ctx, size_t index);
 
-		std::thread *worker;
+		// one socket and thread per receiver; they share the port with SO_REUSEPORT
+		std::vector<int> receiveSockets;
+		std::vector<std::thread *> workers;
 		std::atomic_bool run;
 
-		void threadEntry();
-		void handlePacket(void *packet, size_t length, struct msghdr *msg);
+		// how many datagrams each receiver reads with a single call
+		size_t receiveBatchSz = 16;
+
+		// buffers for receiving a batch of datagrams
+		struct ReceiveBuffers;
+
+		void threadEntry(size_t index);
+		int receiveBatch(int sock, ReceiveBuffers *buf);
+		void handlePacket(void *packet, size_t length, struct msghdr *msg, size_t receiver);
 
 	public:
 		void adoptNode(DbNode *node);
 
-		void sendDataToNode(DbChannel *channel, void *data, size_t numPixels, bool isRGBW);
-		void fbSendTimeoutExpired(DbChannel *ch, uint32_t txn);
-		void waitForOutstandingFramebufferWrites(void);
+		/// a range of pixels in a channel
+		struct PixelRange {
+			size_t start;
+			size_t count;
+		};
+
+		static uint8_t *allocFramebufferPacket(size_t numPixels, bool isRGBW, uint8_t **payload);
+		static void freeFramebufferPacket(uint8_t *packet);
+
+		static size_t framebufferDataSize(size_t numPixels, bool isRGBW);
+		static size_t framebufferDeltaSize(const std::vector<PixelRange> &ranges, bool isRGBW);
+
+		bool shouldSendToNode(DbNode *node, uint64_t frame);
+
+		void sendDataToNode(DbChannel *channel, uint8_t *packet, size_t numPixels, bool isRGBW);
+		void sendDeltaToNode(DbChannel *channel, uint8_t *packet, const uint8_t *pixels, const std::vector<PixelRange> &ranges, bool isRGBW);
+		void flushFramebufferData(void);
+		bool waitForOutstandingFramebufferWrites(void);
 
 		void sendOutputEnableForAllNodes(void);
+		void syncOutput(uint64_t frame);
 
 		void prepareForShutDown(void);
 
+		/**
+		 * Returns the shard of nodes this instance is responsible for.
+		 */
+		const Shard *getShard(void) const {
+			return this->shard;
+		}
+
 	private:
-		std::atomic_int numPendingFBWrites;
-		std::mutex pendingOutputMutex;
+		bool _sendMulticast(void *data, size_t length);
+
+	private:
+		Shard *shard;
+
+		// latest frame each shard said it's ready for; only used by the leader
+		std::mutex shardLock;
+		std::condition_variable shardCv;
+		std::vector<uint32_t> shardFrames;
+
+		// how long the leader waits for the other shards before syncing anyways
+		std::chrono::milliseconds shardTimeout;
+
+		void sendShardReady(uint64_t frame);
+		void handleShardReady(void *packet, size_t length);
+
+	private:
+		// framebuffer writes we're waiting on the nodes to acknowledge
+		AckTracker *acks;
+
+		void fbWriteTimedOut(DbNode *node, uint32_t txn);
+
+		// how long to wait for acknowledgements before sending the sync anyways
+		std::chrono::milliseconds syncTimeout;
+		// how long a node may take to acknowledge a framebuffer write
+		std::chrono::milliseconds writeTimeout;
+
+	public:
+		/// number of buckets in the ack latency histograms
+		static const size_t kAckLatencyBuckets = 10;
+		/// upper bound of each bucket, in µS; the last bucket is unbounded
+		static const double kAckLatencyBounds[kAckLatencyBuckets - 1];
+
+		/// how long a node took to acknowledge framebuffer writes
+		struct AckLatencyHistogram {
+			uint64_t counts[kAckLatencyBuckets] = {0};
+			/// writes that were never acknowledged
+			uint64_t timeouts = 0;
+		};
+
+		std::map<int, AckLatencyHistogram> getAckLatencyHistograms(void);
+
+	private:
+		// ack latency histograms, keyed by node id
+		std::mutex statsLock;
+		std::map<int, AckLatencyHistogram> ackLatencies;
+		// the same, with finer resolution for the metrics export
+		std::map<int, Histogram *> ackHistograms;
+
+		// time taken to send each frame's packets
+		Histogram *sendHistogram;
+
+		void recordAckLatency(DbNode *node, double micros);
+
+	public:
+		/// how often data is sent to a node, adapted to how well it keeps up
+		struct NodeRate {
+			/// smoothed time taken to acknowledge writes, in µS
+			double rtt = 0;
+			/// fraction of writes that timed out during the last interval
+			double loss = 0;
+			/// data is sent to the node only every this many frames
+			unsigned int divisor = 1;
+
+			// acks and timeouts since the rate was last adjusted
+			uint64_t acked = 0;
+			uint64_t timedOut = 0;
+			std::chrono::steady_clock::time_point lastAdjust;
+		};
+
+		std::map<int, NodeRate> getNodeRates(void);
+
+	private:
+		// rate state of each node, keyed by node id
+		std::mutex rateLock;
+		std::map<int, NodeRate> rates;
+
+		// whether rates are adapted, and the thresholds for doing so
+		bool adaptiveRate = true;
+		double rateMaxRtt = 3000;
+		double rateMaxLoss = 0.1;
+		unsigned int rateMaxDivisor = 8;
+		std::chrono::milliseconds rateInterval;
+
+		// weight of a new sample in the smoothed ack time
+		static constexpr double kRttGain = 0.125;
+
+		void updateNodeRate(DbNode *node, bool acked, double micros);
+
+	public:
+		double getMedianSendTime(void) const;
+
+	private:
+		// a framebuffer packet waiting to be sent
+		struct QueuedPacket {
+			DbChannel *channel;
+			uint8_t *data;
+			size_t length;
+			uint32_t txn;
+		};
+
+		// buffers for sendmmsg; kept around so sending doesn't allocate
+		struct SendBuffers;
+		SendBuffers *sendBuffers = nullptr;
+
+		std::mutex sendQueueLock;
+		std::vector<QueuedPacket> sendQueue;
+
+		// whether packets are sent with sendmmsg, and whether UDP GSO is used
+		bool batchSends = true;
+		bool useGSO = false;
+
+		// frames larger than this many bytes are split into segments; 0 disables
+		size_t segmentSize = 0;
+
+		// a segment of a frame, made up of a run of ranges
+		struct Segment {
+			size_t firstRange;
+			size_t numRanges;
+			size_t length;
+		};
+
+		// buffers for the segments of a channel's frame; kept until it's sent
+		struct ChannelSegments {
+			std::vector<uint8_t> buffer;
+			std::vector<PixelRange> ranges;
+			std::vector<Segment> segments;
+			std::vector<QueuedPacket> packets;
+		};
+
+		// segment buffers, keyed by channel id
+		std::map<int, ChannelSegments> channelSegments;
+
+		void _queueSegments(DbChannel *channel, const uint8_t *pixels, const std::vector<PixelRange> &ranges, bool isRGBW);
+
+		void _sendQueueIndividually(size_t start);
+		void _sendQueueBatched(void);
+		void _framebufferSent(const QueuedPacket &packet, bool success);
 
 	private:
 		// adoptions we're waiting on to complete
+		std::mutex adoptionsLock;
 		std::vector<std::tuple<uint32_t, DbNode *>> pendingAdoptions;
-		// nodes we're waiting on to acknowledge a framebuffer write
-		std::vector<std::tuple<uint32_t, DbNode *, std::chrono::time_point<std::chrono::high_resolution_clock>, CppTime::timer_id>> pendingFBDataWrites;
-
-		// timer used for timeouts
-		CppTime::Timer timer;
 
 	private:
 		// after how many packets with errors we assume the node died
@@ -0,0 +1,92 @@
+#include "RangeIndex.h"
+
+#include <algorithm>
+
+/**
+ * Removes all ranges from the index.
+ */
+void RangeIndex::clear(void) {
+	this->entries.clear();
+	this->maxEnd.clear();
+}
+
+/**
+ * Adds a range to the index. Nothing can be found until build() is called.
+ */
+void RangeIndex::add(size_t start, size_t count, size_t value) {
+	// empty ranges never overlap anything
+	if(count == 0) {
+		return;
+	}
+
+	this->entries.push_back({start, (start + count), value});
+}
+
+/**
+ * Sorts the ranges and computes the running maximum of their ends. This must be
+ * called after all ranges are added.
+ */
+void RangeIndex::build(void) {
+	std::stable_sort(this->entries.begin(), this->entries.end(), [](const Entry &a, const Entry &b) {
+		return (a.start < b.start);
+	});
+
+	this->maxEnd.resize(this->entries.size());
+
+	size_t max = 0;
+
+	for(size_t i = 0; i < this->entries.size(); i++) {
+		max = std::max(max, this->entries[i].end);
+		this->maxEnd[i] = max;
+	}
+}
+
+/**
+ * Returns the index of the first range that starts at or after the given pixel,
+ * i.e. one past the last range that could overlap anything before it.
+ */
+size_t RangeIndex::firstStartingAtOrAfter(size_t end) const {
+	auto it = std::lower_bound(this->entries.begin(), this->entries.end(), end, [](const Entry &e, size_t pos) {
+		return (e.start < pos);
+	});
+
+	return (it - this->entries.begin());
+}
+
+/**
+ * Appends the values of all ranges that overlap the given one. They are appended
+ * in reverse order of where the ranges start.
+ */
+void RangeIndex::query(size_t start, size_t count, std::vector<size_t> &values) const {
+	if(count == 0) {
+		return;
+	}
+
+	size_t end = start + count;
+
+	// walk back from the last range starting before the end of the query until
+	// no earlier range reaches into it
+	for(size_t i = this->firstStartingAtOrAfter(end); i-- > 0;) {
+		if(this->maxEnd[i] <= start) {
+			break;
+		}
+
+		if(this->entries[i].end > start) {
+			values.push_back(this->entries[i].value);
+		}
+	}
+}
+
+/**
+ * Checks whether any range overlaps the given one.
+ */
+bool RangeIndex::overlaps(size_t start, size_t count) const {
+	if(count == 0) {
+		return false;
+	}
+
+	size_t i = this->firstStartingAtOrAfter(start + count);
+
+	// the running maximum tells us right away if anything reaches this far
+	return (i > 0) && (this->maxEnd[i - 1] > start);
+}
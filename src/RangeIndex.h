@@ -0,0 +1,58 @@
+/**
+ * A static index of ranges of framebuffer pixels, which finds all ranges that
+ * overlap a given one without looking at every range. Each range carries a
+ * value, e.g. the id of the group or the index of the channel it belongs to.
+ *
+ * The index is built in one go whenever the configuration changes, and is then
+ * only queried: ranges are sorted by their start, and a running maximum of their
+ * ends lets a query stop as soon as no earlier range can reach the queried one.
+ * Queries are safe from multiple threads, as long as nobody rebuilds the index.
+ */
+#ifndef RANGEINDEX_H
+#define RANGEINDEX_H
+
+#include <vector>
+#include <cstddef>
+
+class RangeIndex {
+	public:
+		void clear(void);
+		void add(size_t start, size_t count, size_t value);
+		void build(void);
+
+		void query(size_t start, size_t count, std::vector<size_t> &values) const;
+		bool overlaps(size_t start, size_t count) const;
+
+		/**
+		 * Returns the number of ranges in the index.
+		 */
+		size_t size(void) const {
+			return this->entries.size();
+		}
+
+		/**
+		 * Returns one past the last pixel covered by any range.
+		 */
+		size_t extent(void) const {
+			return this->maxEnd.empty() ? 0 : this->maxEnd.back();
+		}
+
+	private:
+		size_t firstStartingAtOrAfter(size_t end) const;
+
+	private:
+		struct Entry {
+			size_t start;
+			/// one past the last pixel of the range
+			size_t end;
+
+			size_t value;
+		};
+
+		/// all ranges, sorted by their start
+		std::vector<Entry> entries;
+		/// largest end of all ranges up to and including each index
+		std::vector<size_t> maxEnd;
+};
+
+#endif
@@ -2,6 +2,9 @@
 
 #include "DataStore.h"
 #include "Framebuffer.h"
+#include "ScriptEngine.h"
+#include "NativeEffect.h"
+#include "Metrics.h"
 
 #include <glog/logging.h>
 
@@ -10,25 +13,25 @@
 #include <stdexcept>
 #include <chrono>
 #include <random>
+#include <algorithm>
+#include <vector>
 
 #include <angelscript.h>
 #include <scriptstdstring/scriptstdstring.h>
-#include <scriptbuilder/scriptbuilder.h>
 #include <scriptarray/scriptarray.h>
 #include <scriptdictionary/scriptdictionary.h>
-#include <scriptmath/scriptmath.h>
-#include <datetime/datetime.h>
 #include <debugger/debugger.h>
 
-// turn on to profile how long it takes to copy the pixel buffers
-#define PROFILE_BUFCOPY 0
-
-// name of the module that's built
-const char *kEffectModuleName = "EffectRoutine";
+// user data type under which contexts store their routine
+const asPWORD kRoutineUserDataType = 0x524F5554;
 
 // shared debugger
 CDebugger dbg;
 
+// time budget for all routines
+std::chrono::nanoseconds Routine::budget = std::chrono::nanoseconds::zero();
+int Routine::maxOverruns = 0;
+
 // simple test script
 const char *testScript = R"(/**
  * Test script: this fills the buffer with pixels of increasing intensity.
@@ -48,8 +51,6 @@ void effectStep() {
 )";
 
 // declare some C functions
-void ASMessageCallback(const asSMessageInfo *msg, void *param);
-
 void ASScriptPrint(std::string &msg);
 
 void ASHSIPixelConstructor(void *memory);
@@ -60,58 +61,230 @@ int ASRandomIntInRange(int min, int max);
 
 /**
  * Initializes a new routine object with the given database routine (that's how
- * we get our AngelScript code) and properties to pass to that code.
+ * we get our AngelScript code) and properties to pass to that code. With the
+ * deferred load mode, a script isn't compiled until load() is called.
  */
-Routine::Routine(DbRoutine *r, std::map<std::string, double> &params) {
+Routine::Routine(DbRoutine *r, std::map<std::string, double> &params, LoadMode mode) {
 	this->routine = r;
 	this->params = params;
 
 	this->params.insert(r->defaultParams.begin(), r->defaultParams.end());
 
-	this->_setUpAngelscriptState();
+	this->_internParams(r->defaultParams);
+	this->_setUp(mode);
 }
 
-Routine::Routine(DbRoutine *r) {
+Routine::Routine(DbRoutine *r, LoadMode mode) {
 	this->routine = r;
 	this->params = r->defaultParams;
 
-	this->_setUpAngelscriptState();
+	this->_internParams(r->defaultParams);
+	this->_setUp(mode);
 }
 
 /**
- * Destroys the routine. This de-allocates the routine we were passed earlier.
+ * Sets up whatever is needed to execute the routine: if its code references a
+ * native effect, it's instantiated. Otherwise, the code is loaded as a script,
+ * unless that's deferred.
  */
-Routine::~Routine() {
-	delete this->routine;
+void Routine::_setUp(LoadMode mode) {
+	std::string nativeName;
+
+	this->executionHistogram = Metrics::shared()->histogram("lichtenstein_routine_execution_seconds",
+															{{"routine", std::to_string(this->routine->id)}},
+															"Time taken to execute each routine");
+
+	if(NativeEffect::parseCode(this->routine->code, nativeName)) {
+		this->native = NativeEffect::create(nativeName);
+
+		if(this->native == nullptr) {
+			LOG(WARNING) << "Unknown native effect '" << nativeName << "' for "
+						 << this->routine->name;
+			throw LoadError(-1, LoadError::kErrorStageNativeEffect);
+		}
+
+		this->backend = kBackendNative;
+		VLOG(1) << "Using native effect '" << nativeName << "' for " << this->routine->name;
+	} else if(mode == kLoadDeferred) {
+		VLOG(1) << "Deferring loading " << this->routine->name;
+		return;
+	} else {
+		this->_setUpAngelscriptState();
+	}
+
+	this->loaded = true;
+	this->loadClaimed = true;
+}
+
+/**
+ * Loads the routine's code, if that was deferred. This may be called from any
+ * thread. If the code can't be loaded, the error is logged, and the routine
+ * never executes.
+ *
+ * @return Whether the routine is loaded.
+ */
+bool Routine::load(void) {
+	std::lock_guard<std::mutex> lg(this->executionLock);
 
+	if(this->loaded) {
+		return true;
+	}
+
+	try {
+		this->_setUpAngelscriptState();
+	} catch(const LoadError &e) {
+		LOG(ERROR) << "Couldn't load " << this->routine->name << ": " << e.what();
+
+		this->loadFailed = true;
+		return false;
+	}
+
+	// whatever it renders first has to be output
+	this->forceChanged = true;
+	this->loaded = true;
+
+	return true;
+}
+
+/**
+ * Destroys the routine. The database routine we were passed earlier belongs to
+ * the data store, so it's left alone.
+ */
+Routine::~Routine() {
 	// clean up AngelScript contexts
 	this->_cleanUpAngelscriptState();
+
+	delete this->native;
 }
 
 /**
  * Attaches the given buffer to this routine.
  */
 void Routine::attachBuffer(HSIPixel *buf, size_t elements) {
+	std::lock_guard<std::mutex> lg(this->executionLock);
+
 	this->buffer = buf;
 	this->bufferSz = elements;
 
-	this->_updateASBufferArray();
+	this->asBuffer.bind(buf, elements);
+
+	// whatever the routine renders next has to be output
+	this->forceChanged = true;
 }
 
 /**
- * Updates the parameters.
+ * Updates the parameters. Parameters that aren't specified go back to their
+ * default values; the routine picks up the new values the next time it
+ * executes. This doesn't block, even if the routine is executing.
+ *
+ * Only parameters that existed when the routine was created can be changed;
+ * any others are ignored.
  */
 void Routine::changeParams(std::map<std::string, double> &newParams) {
-	this->params = newParams;
+	std::lock_guard<std::mutex> lg(this->paramWriteLock);
+
+	std::vector<double> &values = this->paramBuffers[this->paramWriteIdx];
+	size_t found = 0;
 
-	// merge the default parameters
-	this->params.insert(this->routine->defaultParams.begin(), this->routine->defaultParams.end());
+	for(size_t i = 0; i < this->paramNames.size(); i++) {
+		auto it = newParams.find(this->paramNames[i]);
 
-	// copy them into the script dict
-	this->asParams->DeleteAll();
+		if(it != newParams.end()) {
+			values[i] = it->second;
+			found++;
+		} else {
+			values[i] = this->paramDefaults[i];
+		}
+	}
+
+	LOG_IF(WARNING, found != newParams.size()) << "Ignoring " << (newParams.size() - found)
+											   << " unknown parameters for " << this->routine->name;
+
+	// publish them, and take the routine's previous buffer to write to
+	unsigned int old = this->paramMiddle.exchange(this->paramWriteIdx | kParamsNew);
+	this->paramWriteIdx = (old & kParamIndexMask);
+}
+
+/**
+ * Assigns each parameter a slot, and sets up the parameter buffers with their
+ * initial values. Parameters that don't have a default keep their initial
+ * value as their default.
+ */
+void Routine::_internParams(const std::map<std::string, double> &defaults) {
+	std::vector<double> initial;
 
 	for(auto const& [key, val] : this->params) {
-		this->asParams->Set(key, val);
+		auto it = defaults.find(key);
+
+		this->paramNames.push_back(key);
+		this->paramDefaults.push_back((it != defaults.end()) ? it->second : val);
+
+		initial.push_back(val);
+	}
+
+	for(size_t i = 0; i < 3; i++) {
+		this->paramBuffers[i] = initial;
+	}
+
+	this->paramGlobals.assign(this->paramNames.size(), nullptr);
+}
+
+/**
+ * Finds the script globals named after parameters, and writes the current
+ * values into them. This only works if the routine has a module of its own,
+ * which is the case whenever the script declares global variables.
+ */
+void Routine::_resolveParamGlobals() {
+	for(size_t i = 0; i < this->paramNames.size(); i++) {
+		std::string decl = "double param_" + this->paramNames[i];
+		int index = this->module->GetGlobalVarIndexByDecl(decl.c_str());
+
+		if(index >= 0) {
+			this->paramGlobals[i] = static_cast<double *>(this->module->GetAddressOfGlobalVar(index));
+		} else {
+			this->paramGlobals[i] = nullptr;
+		}
+	}
+
+	this->_applyParams(this->paramBuffers[this->paramReadIdx]);
+}
+
+/**
+ * Picks up new parameter values, if any were published since the last time.
+ * This is called at the start of each execution, with the execution lock held.
+ */
+void Routine::_pickUpParams() {
+	if((this->paramMiddle.load() & kParamsNew) == 0) {
+		return;
+	}
+
+	unsigned int old = this->paramMiddle.exchange(this->paramReadIdx);
+	this->paramReadIdx = (old & kParamIndexMask);
+
+	this->_applyParams(this->paramBuffers[this->paramReadIdx]);
+	this->forceChanged = true;
+}
+
+/**
+ * Copies the parameter values into everywhere the routine's code reads them
+ * from: the parameter map (for native effects), the script's properties
+ * dictionary, and any parameter globals.
+ */
+void Routine::_applyParams(const std::vector<double> &values) {
+	// parameter names are in the map's order, so walk them in lockstep
+	size_t i = 0;
+
+	for(auto &item : this->params) {
+		item.second = values[i];
+
+		if(this->asParams) {
+			this->asParams->Set(item.first, values[i]);
+		}
+		if(this->paramGlobals[i]) {
+			*this->paramGlobals[i] = values[i];
+		}
+
+		i++;
 	}
 }
 
@@ -128,12 +301,7 @@ void Routine::_attachDebugger() {
  * to execute it.
  */
 void Routine::_cleanUpAngelscriptState() {
-	// release the buffer/param dict we created
-	if(this->asBuffer) {
-		this->asBuffer->Release();
-		this->asBuffer = nullptr;
-	}
-
+	// release the param dict we created
 	if(this->asParams) {
 		this->asParams->Release();
 		this->asParams = nullptr;
@@ -148,84 +316,65 @@ void Routine::_cleanUpAngelscriptState() {
 		this->scriptCtx = nullptr;
 	}
 
-	// destroy old angelscript engine
-	if(this->engine) {
-		this->engine->ShutDownAndRelease();
-		this->engine = nullptr;
+	// give back the module; the shared engine stays around
+	if(this->module) {
+		ScriptEngine::shared()->releaseModule(this->module);
+		this->module = nullptr;
+
+		this->effectStepFxn = nullptr;
 	}
 }
 
 /**
- * Sets up the AngelScript interpreter, loading the code from the routine stored
- * in the database.
+ * Sets up the state required to execute the routine: a module with the code
+ * from the routine stored in the database, which is compiled by the shared
+ * engine the first time it's used, and a context to execute it on.
  *
  * @note This throws an exception if the code couldn't be parsed/loaded.
  */
 void Routine::_setUpAngelscriptState() {
-	int err = 0;
-
 	// clean up AngelScript contexts
 	this->_cleanUpAngelscriptState();
 
-	// create script engine and register an error handler
-	this->engine = asCreateScriptEngine();
-	CHECK(this->engine != nullptr) << "Couldn't set up AngelScript context";
+	this->engine = ScriptEngine::shared()->getEngine();
 
-	// register message callback
-	this->engine->SetMessageCallback(asFUNCTION(ASMessageCallback), 0, asCALL_CDECL);
+	// get the compiled module
+	bool usesJIT = false;
+	this->module = ScriptEngine::shared()->acquireModule(this->routine, &usesJIT);
 
-	// register some script addons
-	RegisterStdString(this->engine);
-	RegisterScriptArray(this->engine, true);
-	RegisterScriptDictionary(this->engine);
-	RegisterScriptDateTime(this->engine);
-	RegisterScriptMath(this->engine);
+	this->backend = usesJIT ? kBackendJIT : kBackendInterpreter;
 
-	// register globals (functions, types and global variables)
-	this->_setUpAngelscriptGlobals();
+	// get the effect function out of the script; it may report whether it
+	// changed the buffer by returning a bool
+	this->effectStepFxn = this->module->GetFunctionByDecl("bool effectStep()");
+	this->effectStepReturnsChanged = (this->effectStepFxn != nullptr);
 
-	// creating the module
-	CScriptBuilder builder;
-	err = builder.StartNewModule(engine, kEffectModuleName);
-
-	if(err != 0) {
-		LOG(ERROR) << "Couldn't create new AS module: probably out of memory";
-		throw LoadError(err, LoadError::kErrorStageNewModule);
+	if(this->effectStepFxn == nullptr) {
+		this->effectStepFxn = this->module->GetFunctionByDecl("void effectStep()");
 	}
 
-	// insert the code from the database
-	size_t scriptSz = this->routine->code.size();
-	const char *scriptCode = this->routine->code.c_str();
-
-	// size_t scriptSz = strlen(testScript);
-	// const char *scriptCode = testScript;
-
-	err = builder.AddSectionFromMemory(this->routine->name.c_str(), scriptCode,
-									   scriptSz, 0);
+	if(this->effectStepFxn == nullptr) {
+		LOG(WARNING) << "Missing effectStep() function in " << this->routine->name;
 
-	if(err != 1) {
-		LOG(WARNING) << "Couldn't include user AS code";
-		throw LoadError(err, LoadError::kErrorStageBuildModule);
-	}
+		ScriptEngine::shared()->releaseModule(this->module);
+		this->module = nullptr;
 
-	// build and compile the module
-	err = builder.BuildModule();
-	if(err != 0) {
-		LOG(WARNING) << "Couldn't build AS module: check script syntax";
-		throw LoadError(err, LoadError::kErrorStageBuildModule);
+		throw LoadError(-1, LoadError::kErrorStagePrepareContext);
 	}
 
-	// get the effect function out of the script
-	asIScriptModule *mod = this->engine->GetModule(kEffectModuleName);
-	this->effectStepFxn = mod->GetFunctionByDecl("void effectStep()");
+	// set up a dictionary to hold properties
+	this->asParams = CScriptDictionary::Create(this->engine);
+	CHECK(this->asParams != nullptr) << "Couldn't create dictionary";
 
-	if(this->effectStepFxn == nullptr) {
-		LOG(WARNING) << "Missing effectStep() function in " << this->routine->name;
-		throw LoadError(-1, LoadError::kErrorStagePrepareContext);
+	for(auto const& [key, val] : this->params) {
+		this->asParams->Set(key, val);
 	}
 
+	this->_resolveParamGlobals();
+
 	// create a script context to execute on
 	this->scriptCtx = this->engine->CreateContext();
+	this->scriptCtx->SetUserData(this, kRoutineUserDataType);
 
 #ifdef DEBUG
 	this->_attachDebugger();
@@ -234,118 +383,284 @@ void Routine::_setUpAngelscriptState() {
 	this->scriptCtx->Prepare(this->effectStepFxn);
 
 	if(this->scriptCtx->GetState() == asEXECUTION_PREPARED) {
-		VLOG(1) << "Compiled and prepared script context for " << this->routine->name;
+		VLOG(1) << "Prepared script context for " << this->routine->name
+				<< " (backend: " << this->getBackendName() << ")";
 	}
 }
 
 /**
- * Updates the CScriptArray instance attached to the script under the "buffer"
- * variable. This is called whenever the attached buffer is changed.
+ * Returns a reference to the pixel at the given index. If the index is out of
+ * bounds, a script exception is raised.
  */
-void Routine::_updateASBufferArray() {
-	// release the previously created array
-	if(this->asBuffer) {
-		this->asBuffer->Release();
-		this->asBuffer = nullptr;
+HSIPixel &Routine::ScriptBuffer::at(asUINT index) {
+	// pixel that's handed out for invalid indices; writes to it are discarded
+	static thread_local HSIPixel invalid;
+
+	if(index >= this->elements) {
+		asIScriptContext *ctx = asGetActiveContext();
+
+		if(ctx) {
+			ctx->SetException("Index out of bounds");
+		}
+
+		return invalid;
 	}
 
-	// create the array
-	asITypeInfo *type = this->engine->GetTypeInfoByDecl("array<HSIPixel>");
-	this->asBuffer = CScriptArray::Create(type, this->bufferSz);
+	// the caller may write through the reference
+	this->save(index);
 
-	VLOG(2) << "Bound new CScriptArray size " << this->bufferSz << " for "
-			<< this->routine->name << "; buffer is 0x" << this->buffer;
+	return this->buffer[index];
 }
 
-/**
- * Copies the HSI pixels out of the AngelScript array and into the buffer that
- * was provided for us.
- *
- * This is really kind of hacky, since we _should_ be able to bind the array
- * using the buffer this routine writes into as a backing store, but at least
- * with the CScriptArray class, that's not possible.
+const HSIPixel &Routine::ScriptBuffer::at(asUINT index) const {
+	// reads don't need to be journaled
+	if(index < this->elements) {
+		return this->buffer[index];
+	}
+
+	return const_cast<ScriptBuffer *>(this)->at(index);
+}
+
+/*
+ * Bulk operations on ranges of the buffer. These let scripts do per-pixel work
+ * with a single call rather than looping in the interpreter. The loops have no
+ * dependencies between iterations, so the compiler can vectorize them.
  *
- * This _may_ be a performance problem for very, very large arrays, but in
- * reality, copying N number of 24-byte HSI pixels should be stupid fast even
- * on ancient hardware and should add less than a microsecond to the execution
- * time of the script.
- */
-void Routine::_copyASBufferArrayData() {
-#if PROFILE_BUFCOPY
-	auto start = std::chrono::high_resolution_clock::now();
-#endif
+ * Each takes the index of the first pixel, and the number of pixels, to work
+ * on; by default, that's the entire buffer. The range is clipped to the end of
+ * the buffer.
+ */
+/**
+ * Clips the given range to the buffer. Returns false if nothing is left.
+ */
+bool Routine::ScriptBuffer::clampRange(asUINT &start, asUINT &count) const {
+	if(start >= this->elements) {
+		return false;
+	}
+
+	count = std::min(size_t(count), (this->elements - start));
+	return (count > 0);
+}
+
+/**
+ * Sets all pixels in the range to the given color.
+ */
+void Routine::ScriptBuffer::fill(const HSIPixel &color, asUINT start, asUINT count) {
+	if(!this->clampRange(start, count)) return;
+	this->saveRange(start, count);
+
+	HSIPixel *buf = this->buffer + start;
 
-	for(int i = 0; i < this->bufferSz; i++) {
-		HSIPixel *pixel = static_cast<HSIPixel *>(this->asBuffer->At(i));
-		this->buffer[i] = *pixel;
+	#pragma omp simd
+	for(asUINT x = 0; x < count; x++) {
+		buf[x].h = color.h;
+		buf[x].s = color.s;
+		buf[x].i = color.i;
 	}
+}
 
-	// VLOG(2) << this->buffer[0];
-	// VLOG(2) << this->buffer[30];
+/**
+ * Linearly interpolates the pixels in the range, starting with from at the
+ * first pixel, and ending at to at the last pixel.
+ */
+void Routine::ScriptBuffer::gradient(const HSIPixel &from, const HSIPixel &to,
+									 asUINT start, asUINT count) {
+	if(!this->clampRange(start, count)) return;
+	this->saveRange(start, count);
+
+	HSIPixel *buf = this->buffer + start;
+
+	double steps = (count > 1) ? double(count - 1) : 1;
+	double dh = (to.h - from.h) / steps;
+	double ds = (to.s - from.s) / steps;
+	double di = (to.i - from.i) / steps;
+
+	#pragma omp simd
+	for(asUINT x = 0; x < count; x++) {
+		buf[x].h = from.h + (dh * x);
+		buf[x].s = from.s + (ds * x);
+		buf[x].i = from.i + (di * x);
+	}
+}
 
-	// VLOG_EVERY_N(1, 60) << "Buffer address: 0x" << this->buffer;
+/**
+ * Rotates the pixels in the range by the given number of pixels; positive
+ * offsets move pixels towards the end of the range.
+ */
+void Routine::ScriptBuffer::rotate(int offset, asUINT start, asUINT count) {
+	if(!this->clampRange(start, count)) return;
 
-#if PROFILE_BUFCOPY
-	auto elapsed = std::chrono::high_resolution_clock::now() - start;
-	std::chrono::duration<double, std::micro> micros = elapsed;
-	double copyTime = micros.count();
+	// get an offset in [0, count)
+	long shift = offset % long(count);
 
-	VLOG(3) << "Took " << copyTime << "µS to copy buffers";
-#endif
+	if(shift < 0) {
+		shift += count;
+	}
+
+	if(shift == 0) return;
+	this->saveRange(start, count);
+
+	HSIPixel *buf = this->buffer + start;
+	std::rotate(buf, buf + (count - shift), buf + count);
+}
+
+/**
+ * Multiplies the intensity of all pixels in the range by the given factor.
+ */
+void Routine::ScriptBuffer::scaleIntensity(double factor, asUINT start, asUINT count) {
+	if(!this->clampRange(start, count)) return;
+	this->saveRange(start, count);
+
+	HSIPixel *buf = this->buffer + start;
+
+	#pragma omp simd
+	for(asUINT x = 0; x < count; x++) {
+		buf[x].i *= factor;
+	}
+}
+
+/**
+ * Blends the pixels from the array into the range: each component becomes
+ * (1 - alpha) * pixel + alpha * other. The first pixel of the array is blended
+ * into the first pixel of the range; if the array is shorter than the range,
+ * only as many pixels as it contains are blended.
+ */
+void Routine::ScriptBuffer::blend(const CScriptArray &other, double alpha,
+								  asUINT start, asUINT count) {
+	count = std::min(count, other.GetSize());
+	if(!this->clampRange(start, count)) return;
+	this->saveRange(start, count);
+
+	HSIPixel *buf = this->buffer + start;
+	double keep = 1 - alpha;
+
+	for(asUINT x = 0; x < count; x++) {
+		const HSIPixel *in = static_cast<const HSIPixel *>(other.At(x));
+
+		buf[x].h = (keep * buf[x].h) + (alpha * in->h);
+		buf[x].s = (keep * buf[x].s) + (alpha * in->s);
+		buf[x].i = (keep * buf[x].i) + (alpha * in->i);
+	}
+}
+
+/**
+ * Adds the given number of degrees to the hue of all pixels in the range.
+ */
+void Routine::ScriptBuffer::hueShift(double degrees, asUINT start, asUINT count) {
+	if(!this->clampRange(start, count)) return;
+	this->saveRange(start, count);
+
+	HSIPixel *buf = this->buffer + start;
+
+	#pragma omp simd
+	for(asUINT x = 0; x < count; x++) {
+		buf[x].h += degrees;
+	}
+}
+
+/**
+ * Starts journaling: from now on, pixels are saved the first time the script
+ * accesses them, until endJournal() is called.
+ */
+void Routine::ScriptBuffer::beginJournal(void) {
+	this->journal.clear();
+
+	// start over once the generation wraps around
+	if(++this->generation == 0) {
+		std::fill(this->savedGeneration.begin(), this->savedGeneration.end(), 0);
+		this->generation = 1;
+	}
+
+	this->journaling = true;
+}
+
+/**
+ * Stops journaling. The saved pixels are kept until the next execution starts,
+ * so they can still be rolled back.
+ */
+void Routine::ScriptBuffer::endJournal(void) {
+	this->journaling = false;
+}
+
+/**
+ * Restores all pixels saved in the journal, undoing everything the script did
+ * to the buffer since journaling began.
+ */
+void Routine::ScriptBuffer::rollBack(void) {
+	for(auto const& saved : this->journal) {
+		this->buffer[saved.index] = saved.pixel;
+	}
+
+	this->journal.clear();
+}
+
+/**
+ * Saves all pixels in the (already clipped) range.
+ */
+void Routine::ScriptBuffer::saveRange(asUINT start, asUINT count) {
+	if(!this->journaling) return;
+
+	for(asUINT x = start; x < (start + count); x++) {
+		this->save(x);
+	}
 }
 
 /**
- * Sets up globals accessible to the script, such as the buffer size, an object
- * for interacting with the buffer, and the properties passed when the routine
- * was created.
+ * Registers the globals accessible to scripts with the shared engine, such as
+ * the buffer size, an object for interacting with the buffer, and the
+ * properties passed when the routine was created.
+ *
+ * Since the engine is shared by all routines, the per-routine globals are
+ * registered as property accessors, which look up the routine that owns the
+ * currently executing context.
  */
-void Routine::_setUpAngelscriptGlobals() {
+void Routine::registerScriptInterface(asIScriptEngine *engine) {
 	int err;
 
 	// register the "debug_print" function
-	err = this->engine->RegisterGlobalFunction("void debug_print(const string &in)",
+	err = engine->RegisterGlobalFunction("void debug_print(const string &in)",
 											   asFUNCTION(ASScriptPrint),
 											   asCALL_CDECL);
    	CHECK(err >= 0) << "Couldn't register debug_print: " << err;
 
 	// register the "random_range" function
-	err = this->engine->RegisterGlobalFunction("int random_range(int min, int max)",
+	err = engine->RegisterGlobalFunction("int random_range(int min, int max)",
 											   asFUNCTION(ASRandomIntInRange),
 											   asCALL_CDECL);
    	CHECK(err >= 0) << "Couldn't register random_range: " << err;
 
 	// register the HSIPixel type
-	err = this->engine->RegisterObjectType("HSIPixel", sizeof(HSIPixel),
+	err = engine->RegisterObjectType("HSIPixel", sizeof(HSIPixel),
 										   asOBJ_VALUE | asGetTypeTraits<HSIPixel>());
 	CHECK(err >= 0) << "Couldn't register HSIPixel type: " << err;
 
 	// register a constructor, list constructor, and destructor
-	err = this->engine->RegisterObjectBehaviour("HSIPixel", asBEHAVE_CONSTRUCT,
+	err = engine->RegisterObjectBehaviour("HSIPixel", asBEHAVE_CONSTRUCT,
 												"void f()",
 												asFUNCTION(ASHSIPixelConstructor),
 												asCALL_CDECL_OBJLAST);
 	CHECK(err >= 0) << "Couldn't register HSIPixel constructor: " << err;
-	err = this->engine->RegisterObjectBehaviour("HSIPixel", asBEHAVE_LIST_CONSTRUCT,
+	err = engine->RegisterObjectBehaviour("HSIPixel", asBEHAVE_LIST_CONSTRUCT,
 												"void f(const int &in) {double, double, double}",
 												asFUNCTION(ASHSIPixelListConstructor),
 												asCALL_CDECL_OBJLAST);
 	CHECK(err >= 0) << "Couldn't register HSIPixel list constructor: " << err;
 
-	err = this->engine->RegisterObjectBehaviour("HSIPixel", asBEHAVE_DESTRUCT,
+	err = engine->RegisterObjectBehaviour("HSIPixel", asBEHAVE_DESTRUCT,
 												"void f()",
 												asFUNCTION(ASHSIPixelDestructor),
 												asCALL_CDECL_OBJLAST);
 	CHECK(err >= 0) << "Couldn't register HSIPixel destructor: " << err;
 
 	// register comparison (==) operator
-	err = this->engine->RegisterObjectMethod("HSIPixel",
+	err = engine->RegisterObjectMethod("HSIPixel",
 											 "bool opEquals(const HSIPixel &in) const",
 											 asMETHODPR(HSIPixel, operator==,(const HSIPixel&) const, bool),
 											 asCALL_THISCALL);
  	CHECK(err >= 0) << "Couldn't register HSIPixel comparison (==) operator: " << err;
 
 	// register assignment operator
-	err = this->engine->RegisterObjectMethod("HSIPixel",
+	err = engine->RegisterObjectMethod("HSIPixel",
 											 "HSIPixel &opAssign(const HSIPixel &in)",
 											 asMETHODPR(HSIPixel,operator =, (const HSIPixel &), HSIPixel&),
 											 asCALL_THISCALL);
@@ -353,41 +668,117 @@ void Routine::_setUpAngelscriptGlobals() {
 
 
 	// register fields in the HSIPixel type
-	err = this->engine->RegisterObjectProperty("HSIPixel", "double h",
+	err = engine->RegisterObjectProperty("HSIPixel", "double h",
 											   asOFFSET(HSIPixel, h));
    	CHECK(err >= 0) << "Couldn't register HSIPixel.h: " << err;
 
-	err = this->engine->RegisterObjectProperty("HSIPixel", "double s",
+	err = engine->RegisterObjectProperty("HSIPixel", "double s",
 											   asOFFSET(HSIPixel, s));
    	CHECK(err >= 0) << "Couldn't register HSIPixel.s: " << err;
 
-	err = this->engine->RegisterObjectProperty("HSIPixel", "double i",
+	err = engine->RegisterObjectProperty("HSIPixel", "double i",
 											   asOFFSET(HSIPixel, i));
    	CHECK(err >= 0) << "Couldn't register HSIPixel.i: " << err;
 
 	// set up buffer size
-	err = this->engine->RegisterGlobalProperty("int bufferSz", &this->bufferSz);
+	err = engine->RegisterGlobalFunction("int get_bufferSz() property",
+										 asFUNCTION(Routine::_asGetBufferSz),
+										 asCALL_CDECL);
 	CHECK(err >= 0) << "Couldn't register buffer size global: " << err;
 
+	// register the buffer type; scripts can't create these, only index them
+	err = engine->RegisterObjectType("PixelBuffer", 0, asOBJ_REF | asOBJ_NOCOUNT);
+	CHECK(err >= 0) << "Couldn't register PixelBuffer type: " << err;
+
+	err = engine->RegisterObjectMethod("PixelBuffer", "uint length() const",
+									   asMETHOD(ScriptBuffer, length),
+									   asCALL_THISCALL);
+	CHECK(err >= 0) << "Couldn't register PixelBuffer.length(): " << err;
+
+	err = engine->RegisterObjectMethod("PixelBuffer", "HSIPixel &opIndex(uint)",
+									   asMETHODPR(ScriptBuffer, at, (asUINT), HSIPixel &),
+									   asCALL_THISCALL);
+	CHECK(err >= 0) << "Couldn't register PixelBuffer index operator: " << err;
+
+	err = engine->RegisterObjectMethod("PixelBuffer", "const HSIPixel &opIndex(uint) const",
+									   asMETHODPR(ScriptBuffer, at, (asUINT) const, const HSIPixel &),
+									   asCALL_THISCALL);
+	CHECK(err >= 0) << "Couldn't register const PixelBuffer index operator: " << err;
+
+	// bulk operations
+	err = engine->RegisterObjectMethod("PixelBuffer",
+									   "void fill(const HSIPixel &in, uint start = 0, uint count = 0xFFFFFFFF)",
+									   asMETHOD(ScriptBuffer, fill), asCALL_THISCALL);
+	CHECK(err >= 0) << "Couldn't register PixelBuffer.fill(): " << err;
+
+	err = engine->RegisterObjectMethod("PixelBuffer",
+									   "void gradient(const HSIPixel &in, const HSIPixel &in, uint start = 0, uint count = 0xFFFFFFFF)",
+									   asMETHOD(ScriptBuffer, gradient), asCALL_THISCALL);
+	CHECK(err >= 0) << "Couldn't register PixelBuffer.gradient(): " << err;
+
+	err = engine->RegisterObjectMethod("PixelBuffer",
+									   "void rotate(int, uint start = 0, uint count = 0xFFFFFFFF)",
+									   asMETHOD(ScriptBuffer, rotate), asCALL_THISCALL);
+	CHECK(err >= 0) << "Couldn't register PixelBuffer.rotate(): " << err;
+
+	err = engine->RegisterObjectMethod("PixelBuffer",
+									   "void scale_intensity(double, uint start = 0, uint count = 0xFFFFFFFF)",
+									   asMETHOD(ScriptBuffer, scaleIntensity), asCALL_THISCALL);
+	CHECK(err >= 0) << "Couldn't register PixelBuffer.scale_intensity(): " << err;
+
+	err = engine->RegisterObjectMethod("PixelBuffer",
+									   "void blend(const array<HSIPixel> &in, double, uint start = 0, uint count = 0xFFFFFFFF)",
+									   asMETHOD(ScriptBuffer, blend), asCALL_THISCALL);
+	CHECK(err >= 0) << "Couldn't register PixelBuffer.blend(): " << err;
+
+	err = engine->RegisterObjectMethod("PixelBuffer",
+									   "void hue_shift(double, uint start = 0, uint count = 0xFFFFFFFF)",
+									   asMETHOD(ScriptBuffer, hueShift), asCALL_THISCALL);
+	CHECK(err >= 0) << "Couldn't register PixelBuffer.hue_shift(): " << err;
+
 	// set up the data array
-	err = this->engine->RegisterGlobalProperty("array<HSIPixel> @buffer", &this->asBuffer);
-	CHECK(err >= 0) << "Couldn't register buffer pointer global: " << err;
+	err = engine->RegisterGlobalFunction("PixelBuffer &get_buffer() property",
+										 asFUNCTION(Routine::_asGetBuffer),
+										 asCALL_CDECL);
+	CHECK(err >= 0) << "Couldn't register buffer global: " << err;
 
 	// register frame counter
-	err = this->engine->RegisterGlobalProperty("int frameCounter", &this->frameCounter);
+	err = engine->RegisterGlobalFunction("int get_frameCounter() property",
+										 asFUNCTION(Routine::_asGetFrameCounter),
+										 asCALL_CDECL);
 	CHECK(err >= 0) << "Couldn't register frame counter global: " << err;
 
-	// set up a dictionary to hold properties
-	this->asParams = CScriptDictionary::Create(this->engine);
-	CHECK(this->asParams != nullptr) << "Couldn't create dictionary";
-
-	err = this->engine->RegisterGlobalProperty("dictionary @properties", &this->asParams);
+	// properties dictionary
+	err = engine->RegisterGlobalFunction("dictionary @+ get_properties() property",
+										 asFUNCTION(Routine::_asGetProperties),
+										 asCALL_CDECL);
 	CHECK(err >= 0) << "Couldn't register properties global: " << err;
+}
 
-	// copy all the properties to the params map
-	for(auto const& [key, val] : this->params) {
-		this->asParams->Set(key, val);
-	}
+/**
+ * Returns the routine whose script is currently executing on this thread.
+ */
+Routine *Routine::_activeRoutine(void) {
+	asIScriptContext *ctx = asGetActiveContext();
+	CHECK(ctx != nullptr) << "Script globals accessed outside of a script";
+
+	return static_cast<Routine *>(ctx->GetUserData(kRoutineUserDataType));
+}
+
+/**
+ * Accessors for the per-routine script globals.
+ */
+int Routine::_asGetBufferSz(void) {
+	return Routine::_activeRoutine()->bufferSz;
+}
+Routine::ScriptBuffer &Routine::_asGetBuffer(void) {
+	return Routine::_activeRoutine()->asBuffer;
+}
+int Routine::_asGetFrameCounter(void) {
+	return Routine::_activeRoutine()->frameCounter;
+}
+CScriptDictionary *Routine::_asGetProperties(void) {
+	return Routine::_activeRoutine()->asParams;
 }
 
 /**
@@ -397,21 +788,78 @@ void Routine::_setUpAngelscriptGlobals() {
 void Routine::execute(int frame) {
 	int err;
 
+	// native effects don't need any of the script machinery
+	if(this->native) {
+		this->_executeNative(frame);
+		return;
+	}
+
+	// the code may not have been loaded yet
+	if(!this->loaded) {
+		this->outputChanged = false;
+		return;
+	}
+
 	// acquire the execution lock
 	std::unique_lock<std::mutex> lk(this->executionLock);
 
+	// routines that overran recently don't run every frame
+	if(this->_shouldSkipExecution()) {
+		this->outputChanged = false;
+		return;
+	}
+
 	// start of execution
 	this->_scriptExecStart();
 
+	this->_pickUpParams();
+
 	// prepare the context again… this is required before each invocation
 	this->scriptCtx->Prepare(this->effectStepFxn);
 
 	// copy the frame counter
 	this->frameCounter = frame;
 
-	// execute and check return value
+	// execute and check return value; the watchdog aborts it if it overruns
+	bool budgeted = (Routine::budget.count() > 0);
+
+	if(budgeted) {
+		this->asBuffer.beginJournal();
+
+		auto deadline = ScriptEngine::clock::now() + Routine::budget;
+		ScriptEngine::shared()->watch(this->scriptCtx, deadline);
+	}
+
 	err = this->scriptCtx->Execute();
 
+	// once unwatched, the watchdog can't abort the context anymore; if it did
+	// so after the script finished, the result stands, and the next Prepare()
+	// discards the abort request
+	if(budgeted) {
+		bool aborted = ScriptEngine::shared()->unwatch(this->scriptCtx);
+		this->asBuffer.endJournal();
+
+		VLOG_IF(1, (aborted && err != asEXECUTION_ABORTED)) << *this << " finished just as it was aborted";
+	}
+
+	if(err == asEXECUTION_ABORTED) {
+		this->_handleOverrun();
+		this->_scriptExecEnd();
+
+		return;
+	}
+
+	this->consecutiveOverruns = 0;
+
+	bool changed = true;
+
+	if(err == asEXECUTION_FINISHED && this->effectStepReturnsChanged) {
+		changed = (this->scriptCtx->GetReturnByte() != 0);
+	}
+
+	this->outputChanged = (changed || this->forceChanged);
+	this->forceChanged = false;
+
 	if(err != asEXECUTION_FINISHED) {
 		// handle exceptions
 		if(err == asEXECUTION_EXCEPTION) {
@@ -429,9 +877,82 @@ void Routine::execute(int frame) {
 	// end of execution time
 	this->_scriptExecEnd();
 
-	// release the lock and copy buffers
+	// release the lock; the script wrote straight into the group's buffer
 	lk.unlock();
-	this->_copyASBufferArrayData();
+}
+
+/**
+ * Sets the time budget for all routines' scripts, and how many consecutive
+ * overruns are tolerated before a routine is disabled. A budget of zero lets
+ * scripts run for as long as they like.
+ */
+void Routine::setBudget(std::chrono::nanoseconds budget, int maxOverruns) {
+	Routine::budget = budget;
+	Routine::maxOverruns = maxOverruns;
+}
+
+/**
+ * Checks whether this execution is skipped: that's the case if the routine is
+ * disabled, or it's backing off after overrunning.
+ */
+bool Routine::_shouldSkipExecution() {
+	if(this->disabled) {
+		return true;
+	}
+
+	if(this->skipExecutions > 0) {
+		this->skipExecutions--;
+		return true;
+	}
+
+	return false;
+}
+
+/**
+ * Handles the script having been aborted for exceeding its budget. Whatever it
+ * wrote into the buffer is discarded, so the group still has the output of the
+ * last execution that completed.
+ *
+ * Each consecutive overrun doubles the number of executions that are skipped
+ * after it; once there were too many, the routine is disabled.
+ */
+void Routine::_handleOverrun() {
+	this->asBuffer.rollBack();
+	this->outputChanged = false;
+
+	this->overruns++;
+	this->consecutiveOverruns++;
+
+	if(Routine::maxOverruns > 0 && this->consecutiveOverruns >= Routine::maxOverruns) {
+		LOG(ERROR) << "Disabling " << *this << " after " << this->consecutiveOverruns
+				   << " consecutive overruns";
+
+		this->disabled = true;
+		return;
+	}
+
+	this->skipExecutions = (1 << std::min(this->consecutiveOverruns - 1, 8));
+
+	LOG(WARNING) << *this << " exceeded its time budget (" << this->consecutiveOverruns
+				 << " times in a row); skipping " << this->skipExecutions << " frames";
+}
+
+/**
+ * Executes the native effect that implements this routine.
+ */
+void Routine::_executeNative(int frame) {
+	std::lock_guard<std::mutex> lg(this->executionLock);
+
+	this->_scriptExecStart();
+	this->_pickUpParams();
+
+	this->frameCounter = frame;
+	bool changed = this->native->step(this->buffer, this->bufferSz, frame, this->params);
+
+	this->outputChanged = (changed || this->forceChanged);
+	this->forceChanged = false;
+
+	this->_scriptExecEnd();
 }
 
 /**
@@ -480,29 +1001,23 @@ void ASScriptPrint(std::string &msg) {
 	VLOG(1) << "[" << section << ' ' << line << ':' << col << "] " << msg;
 }
 
+#pragma mark - Performance Counters
 /**
- * message handler for AngelScript - any messages given from the engine are just
- * printed to the log using the standard logging functions.
+ * Returns a human-readable name for the backend that executes the script.
  */
-void ASMessageCallback(const asSMessageInfo *msg, void *param) {
-	// format the message
-	static const int msgBufSz = 4096;
-	char msgBuf[msgBufSz];
-
-	snprintf(msgBuf, msgBufSz, "AngelScript Message [section '%s' (%d:%d)] %s",
-			 msg->section, msg->row, msg->col, msg->message);
-
-	// log it
-	if(msg->type == asMSGTYPE_ERROR) {
-		LOG(ERROR) << msgBuf;
-	} else if(msg->type == asMSGTYPE_WARNING) {
-		LOG(WARNING) << msgBuf;
-	} else if(msg->type == asMSGTYPE_INFORMATION) {
-		LOG(INFO) << msgBuf;
+const char *Routine::getBackendName() const {
+	switch(this->backend) {
+		case kBackendInterpreter:
+			return "interpreter";
+		case kBackendJIT:
+			return "jit";
+		case kBackendNative:
+			return "native";
 	}
+
+	return "unknown";
 }
 
-#pragma mark - Performance Counters
 /**
  * Called immediately after the script has executed. Calculates the difference
  * between the start and end times, converts it to microseconds, and adds it to
@@ -513,6 +1028,8 @@ void Routine::_scriptExecEnd() {
 	auto elapsed = std::chrono::high_resolution_clock::now() - this->lastStart;
 	std::chrono::duration<double, std::micro> micros = elapsed;
 
+	this->executionHistogram->record(elapsed);
+
 	double execTime = micros.count();
 
 	// add it to the moving average
@@ -530,6 +1047,11 @@ void Routine::_scriptExecEnd() {
  * Creates a pretty error string (the "what" string) for this exception.
  */
 void Routine::LoadError::_createWhatString() {
+	if(this->stage == kErrorStageNativeEffect) {
+		snprintf(this->whatBuf, this->whatBufSz, "Unknown native effect");
+		return;
+	}
+
 	snprintf(this->whatBuf, this->whatBufSz,
 			 "AngelScript error: stage %u, error %i", this->stage, this->errCode);
 }
@@ -538,7 +1060,7 @@ void Routine::LoadError::_createWhatString() {
  * Output operator
  */
 std::ostream &operator<<(std::ostream& strm, const Routine& obj) {
-	strm << "Routine {" << obj.routine->name << "}";
+	strm << "Routine {" << obj.routine->name << ", " << obj.getBackendName() << "}";
 
 	return strm;
 }
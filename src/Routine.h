@@ -1,6 +1,22 @@
 /**
  * Encapsulates the code for a particular routine, as well as its state. State
  * is stored as a key/value array that's accessible from within the code.
+ *
+ * The names of the parameters are fixed when the routine is created, and each
+ * gets a slot in an array of values. Changed parameters are written into a
+ * triple buffer of those arrays, and picked up by the routine at the start of
+ * the next execution, so changing them never waits for (or races with) a
+ * running script. Scripts that declare a global `double param_<name>` for a
+ * parameter get its value written straight into that variable.
+ *
+ * Scripts may only run for a limited time each frame: if they exceed it, they
+ * are aborted, and the group keeps the pixels from the last execution that
+ * completed. Routines that keep overrunning run less and less often, and are
+ * eventually disabled.
+ *
+ * A routine's code may also be loaded after it's created: it then doesn't
+ * execute until load() was called (usually on a worker thread), so that routines
+ * don't all have to be compiled before output can start.
  */
 #ifndef ROUTINE_H
 #define ROUTINE_H
@@ -13,13 +29,102 @@
 #include <stdexcept>
 #include <chrono>
 #include <mutex>
+#include <atomic>
+#include <vector>
 
 #include <angelscript.h>
 
 class CScriptArray;
 class CScriptDictionary;
+class NativeEffect;
+class Histogram;
 
 class Routine {
+	public:
+		/**
+		 * Exposes the buffer of the group the routine is bound to as the
+		 * "buffer" global. Scripts index straight into the group's pixels, so
+		 * nothing needs to be copied after the script executes, and rebinding
+		 * the buffer just swaps the pointer.
+		 *
+		 * While a budgeted script executes, the buffer keeps a journal of the
+		 * pixels the script might've changed: the first time a pixel is
+		 * accessed, its old value is saved. If the script is aborted, the
+		 * journal is rolled back, so only the pixels a script touches are ever
+		 * copied.
+		 */
+		class ScriptBuffer {
+			public:
+				void bind(HSIPixel *buffer, size_t elements) {
+					this->buffer = buffer;
+					this->elements = elements;
+
+					if(this->savedGeneration.size() != elements) {
+						this->savedGeneration.assign(elements, 0);
+					}
+				}
+
+				/**
+				 * Returns the number of pixels in the buffer.
+				 */
+				asUINT length() const {
+					return this->elements;
+				}
+
+				HSIPixel &at(asUINT index);
+				const HSIPixel &at(asUINT index) const;
+
+			// bulk operations
+			public:
+				void fill(const HSIPixel &color, asUINT start, asUINT count);
+				void gradient(const HSIPixel &from, const HSIPixel &to,
+							  asUINT start, asUINT count);
+				void rotate(int offset, asUINT start, asUINT count);
+				void scaleIntensity(double factor, asUINT start, asUINT count);
+				void blend(const CScriptArray &other, double alpha,
+						   asUINT start, asUINT count);
+				void hueShift(double degrees, asUINT start, asUINT count);
+
+			// journal
+			public:
+				void beginJournal(void);
+				void endJournal(void);
+				void rollBack(void);
+
+			private:
+				/**
+				 * Saves the pixel's value, unless it was saved already during
+				 * this execution.
+				 */
+				inline void save(asUINT index) {
+					if(this->journaling && this->savedGeneration[index] != this->generation) {
+						this->savedGeneration[index] = this->generation;
+						this->journal.push_back({index, this->buffer[index]});
+					}
+				}
+				void saveRange(asUINT start, asUINT count);
+
+			private:
+				bool clampRange(asUINT &start, asUINT &count) const;
+
+			private:
+				HSIPixel *buffer = nullptr;
+				size_t elements = 0;
+
+				/// a pixel's value from before the execution
+				struct SavedPixel {
+					asUINT index;
+					HSIPixel pixel;
+				};
+
+				bool journaling = false;
+				std::vector<SavedPixel> journal;
+
+				/// execution during which each pixel was last saved
+				std::vector<uint32_t> savedGeneration;
+				uint32_t generation = 0;
+		};
+
 	public:
 		// thrown if the script code can't be loaded
 		class LoadError : public std::runtime_error {
@@ -27,7 +132,8 @@ class Routine {
 				enum ErrorStage {
 					kErrorStageNewModule = 1,
 					kErrorStageBuildModule,
-					kErrorStagePrepareContext
+					kErrorStagePrepareContext,
+					kErrorStageNativeEffect
 				};
 
 			public:
@@ -54,10 +160,31 @@ class Routine {
 				ErrorStage stage;
 		};
 
+	public:
+		/**
+		 * How the routine's effectStep() function is executed.
+		 */
+		enum Backend {
+			kBackendInterpreter,
+			kBackendJIT,
+			kBackendNative
+		};
+
+	public:
+		/**
+		 * When the routine's code is loaded.
+		 */
+		enum LoadMode {
+			/// when the routine is created; the constructor throws if it fails
+			kLoadNow,
+			/// once load() is called; the routine doesn't execute until then
+			kLoadDeferred
+		};
+
 	public:
 		Routine() = delete;
-		Routine(DbRoutine *r);
-		Routine(DbRoutine *r, std::map<std::string, double> &params);
+		Routine(DbRoutine *r, LoadMode mode = kLoadNow);
+		Routine(DbRoutine *r, std::map<std::string, double> &params, LoadMode mode = kLoadNow);
 		~Routine();
 
 		void attachBuffer(HSIPixel *buf, size_t elements);
@@ -66,7 +193,18 @@ class Routine {
 		void execute(int frame);
 
 		/**
-		 * Returns the average time taken to execute the script, in µS.
+		 * Returns whether the last execution changed the routine's output. A
+		 * routine reports that it didn't by returning false from effectStep(),
+		 * or for native effects, from step(). It's always considered changed
+		 * after the buffer or parameters change.
+		 */
+		bool didOutputChange() const {
+			return this->outputChanged;
+		}
+
+		/**
+		 * Returns the average time taken to execute the script, in µS. The
+		 * script was run on the backend returned by getBackend().
 		 */
 		double getAvgExecutionTime() const {
 			return this->avgExecutionTime;
@@ -79,16 +217,143 @@ class Routine {
 			return this->avgExecutionTimeSamples;
 		}
 
+		/**
+		 * Returns the backend that executes the script.
+		 */
+		Backend getBackend() const {
+			return this->backend;
+		}
+		const char *getBackendName() const;
+
+		/**
+		 * Returns the routine in the data store this routine executes.
+		 */
+		const DbRoutine *getDbRoutine() const {
+			return this->routine;
+		}
+
+	// time budget
+	public:
+		static void setBudget(std::chrono::nanoseconds budget, int maxOverruns);
+
+		/**
+		 * Returns how many times the script was aborted for exceeding its time
+		 * budget.
+		 */
+		unsigned long getOverruns() const {
+			return this->overruns;
+		}
+		/**
+		 * Returns whether the routine was disabled for overrunning too often.
+		 */
+		bool isDisabled() const {
+			return this->disabled;
+		}
+
+	// deferred loading
+	public:
+		bool load(void);
+
+		/**
+		 * Returns whether the routine's code was loaded, so it can execute.
+		 */
+		bool isLoaded() const {
+			return this->loaded;
+		}
+		/**
+		 * Returns whether loading the routine's code failed; it never executes.
+		 */
+		bool didLoadFail() const {
+			return this->loadFailed;
+		}
+
+		/**
+		 * Claims the job of loading the routine's code. Only the first caller
+		 * gets it, so a routine is only queued to be loaded once.
+		 */
+		bool claimLoad() {
+			return !this->loadClaimed.exchange(true);
+		}
+
+	private:
+		std::atomic_bool loaded{false};
+		std::atomic_bool loadFailed{false};
+		std::atomic_bool loadClaimed{false};
+
+	private:
+		bool _shouldSkipExecution();
+		void _handleOverrun();
+
+		/// how long scripts may execute each frame; zero if unlimited
+		static std::chrono::nanoseconds budget;
+		/// consecutive overruns after which a routine is disabled; zero if never
+		static int maxOverruns;
+
+		std::atomic_ulong overruns{0};
+		/// overruns since the last execution that completed
+		int consecutiveOverruns = 0;
+		/// executions still to be skipped because of previous overruns
+		int skipExecutions = 0;
+
+		std::atomic_bool disabled{false};
+
 	private:
 		void _attachDebugger();
 
 		void _cleanUpAngelscriptState();
 		void _setUpAngelscriptState();
 
-		void _updateASBufferArray();
-		void _copyASBufferArrayData();
+		void _setUp(LoadMode mode);
+		void _executeNative(int frame);
+
+	// parameters
+	private:
+		void _internParams(const std::map<std::string, double> &defaults);
+		void _resolveParamGlobals();
+		void _pickUpParams();
+		void _applyParams(const std::vector<double> &values);
+
+		/// names of all parameters, in the same (sorted) order as params
+		std::vector<std::string> paramNames;
+		/// value a parameter takes if a change doesn't specify it
+		std::vector<double> paramDefaults;
+
+		/**
+		 * Triple buffer of parameter values: changes are written into the
+		 * writer's buffer, which is then swapped with the middle one. The
+		 * routine swaps its buffer with the middle one when it's marked as
+		 * new, before executing.
+		 */
+		std::vector<double> paramBuffers[3];
+
+		static const unsigned int kParamIndexMask = 0x3;
+		static const unsigned int kParamsNew = 0x4;
+
+		/// index of the middle buffer, and whether it holds new values
+		std::atomic_uint paramMiddle{1};
+		/// buffer changes are written into; protected by paramWriteLock
+		unsigned int paramWriteIdx = 0;
+		/// buffer the routine last picked up; only used while executing
+		unsigned int paramReadIdx = 2;
 
-		void _setUpAngelscriptGlobals();
+		/// serializes writers; the routine itself never takes it
+		std::mutex paramWriteLock;
+
+		/// script globals that receive each parameter's value, if declared
+		std::vector<double *> paramGlobals;
+
+	public:
+		static void registerScriptInterface(asIScriptEngine *engine);
+
+	private:
+		static Routine *_activeRoutine(void);
+
+		static int _asGetBufferSz(void);
+		static ScriptBuffer &_asGetBuffer(void);
+		static int _asGetFrameCounter(void);
+		static CScriptDictionary *_asGetProperties(void);
+
+	private:
 
 		/**
 		 * Called immediately before the script executes. This gets the current
@@ -100,17 +365,25 @@ class Routine {
 		void _scriptExecEnd();
 
 		asIScriptEngine *engine = nullptr;
+		asIScriptModule *module = nullptr;
 		asIScriptContext *scriptCtx = nullptr;
 
 		asIScriptFunction *effectStepFxn = nullptr;
+		/// whether effectStep() returns a bool indicating if it changed the buffer
+		bool effectStepReturnsChanged = false;
+
+		Backend backend = kBackendInterpreter;
+
+		/// if the routine is implemented natively, the effect that implements it
+		NativeEffect *native = nullptr;
 
 	private:
 		DbRoutine *routine = nullptr;
 		std::map<std::string, double> params;
 
-		HSIPixel *buffer;
+		HSIPixel *buffer = nullptr;
 		int bufferSz = 0;
-		CScriptArray *asBuffer = nullptr;
+		ScriptBuffer asBuffer;
 
 		CScriptDictionary *asParams = nullptr;
 
@@ -118,12 +391,20 @@ class Routine {
 
 		std::mutex executionLock;
 
+		/// whether the output changed during the last execution
+		bool outputChanged = true;
+		/// set when the next execution must count as a change, no matter its result
+		bool forceChanged = true;
+
 	private:
 		double avgExecutionTime = 0;
 		double avgExecutionTimeSamples = 0;
 
 		std::chrono::time_point<std::chrono::high_resolution_clock> lastStart;
 
+		/// execution times of all instances of this routine
+		Histogram *executionHistogram = nullptr;
+
 	private:
 		friend std::ostream &operator<<(std::ostream& strm, const Routine& obj);
 };
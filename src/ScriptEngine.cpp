@@ -0,0 +1,735 @@
+#include "ScriptEngine.h"
+
+#include "Routine.h"
+#include "db/Routine.h"
+#include "version.h"
+
+#include <glog/logging.h>
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <thread>
+#include <fstream>
+#include <cstdio>
+
+#include <pthread.h>
+#include <sys/stat.h>
+#include <cerrno>
+
+#include <angelscript.h>
+#include <scriptstdstring/scriptstdstring.h>
+#include <scriptbuilder/scriptbuilder.h>
+#include <scriptarray/scriptarray.h>
+#include <scriptdictionary/scriptdictionary.h>
+#include <scriptmath/scriptmath.h>
+#include <datetime/datetime.h>
+
+#ifdef WITH_AS_JIT
+#include <as_jit.h>
+#endif
+
+static void ASMessageCallback(const asSMessageInfo *msg, void *param);
+
+/**
+ * Header of a file in the bytecode cache; it's followed by the bytecode.
+ */
+struct CachedBytecodeHeader {
+	/// always kCachedBytecodeMagic
+	uint32_t magic;
+	/// size of the routine's code, as a second check that it didn't change
+	uint32_t codeSize;
+	/// whether the code asked for the JIT
+	uint32_t wantsJIT;
+	/// whether the module declares global variables
+	uint32_t hasGlobals;
+	/// build of the server that compiled it; the registered interface may differ
+	char build[48];
+};
+
+static const uint32_t kCachedBytecodeMagic = 0x4c534243;
+
+/**
+ * Binary stream that reads and writes bytecode from a vector in memory.
+ */
+class ByteCodeStream : public asIBinaryStream {
+	public:
+		ByteCodeStream(std::vector<asBYTE> &buffer) : buffer(buffer) { }
+
+		int Write(const void *ptr, asUINT size) {
+			const asBYTE *bytes = static_cast<const asBYTE *>(ptr);
+			this->buffer.insert(this->buffer.end(), bytes, bytes + size);
+
+			return 0;
+		}
+
+		int Read(void *ptr, asUINT size) {
+			if((this->readOffset + size) > this->buffer.size()) {
+				return -1;
+			}
+
+			memcpy(ptr, this->buffer.data() + this->readOffset, size);
+			this->readOffset += size;
+
+			return 0;
+		}
+
+	private:
+		std::vector<asBYTE> &buffer;
+		size_t readOffset = 0;
+};
+
+/**
+ * Sits in between the engine and the actual JIT compiler: functions are only
+ * handed to the JIT if the module they belong to asked for it. For all other
+ * functions, or any that the JIT fails to compile, an error is returned, which
+ * makes the engine run them on the interpreter.
+ */
+class RoutineJITCompiler : public asIJITCompiler {
+	public:
+		RoutineJITCompiler(ScriptEngine *owner, asIJITCompiler *backend) :
+			owner(owner), backend(backend) { }
+		virtual ~RoutineJITCompiler() {
+			delete this->backend;
+		}
+
+		int CompileFunction(asIScriptFunction *function, asJITFunction *output) {
+			if(!this->owner->buildWantsJIT) {
+				return asERROR;
+			}
+
+			int err = this->backend->CompileFunction(function, output);
+
+			if(err < 0) {
+				VLOG(1) << "JIT couldn't compile " << function->GetDeclaration()
+						<< " (" << err << "); it'll be interpreted";
+			} else if(strcmp(function->GetName(), "effectStep") == 0) {
+				this->owner->buildEffectStepJIT = true;
+			}
+
+			return err;
+		}
+
+		void ReleaseJITFunction(asJITFunction func) {
+			this->backend->ReleaseJITFunction(func);
+		}
+
+	private:
+		ScriptEngine *owner;
+		asIJITCompiler *backend;
+};
+
+/**
+ * Watchdog thread entry point
+ */
+void ScriptWatchdogEntry(void *ctx) {
+#ifdef __APPLE__
+	pthread_setname_np("Script Watchdog");
+#else
+  #ifdef pthread_setname_np
+    pthread_setname_np(pthread_self(), "Script Watchdog");
+  #endif
+#endif
+
+	ScriptEngine *engine = static_cast<ScriptEngine *>(ctx);
+	engine->watchdogThreadEntry();
+}
+
+/**
+ * Returns the shared script engine, creating it the first time it's used.
+ */
+ScriptEngine *ScriptEngine::shared(void) {
+	static ScriptEngine instance;
+	return &instance;
+}
+
+/**
+ * Creates the AngelScript engine and registers all add-ons, as well as the
+ * interface that routines expose to scripts.
+ */
+ScriptEngine::ScriptEngine() {
+	// create script engine and register an error handler
+	this->engine = asCreateScriptEngine();
+	CHECK(this->engine != nullptr) << "Couldn't set up AngelScript engine";
+
+	this->engine->SetMessageCallback(asFUNCTION(ASMessageCallback), 0, asCALL_CDECL);
+
+#ifdef WITH_AS_JIT
+	// set up the JIT compiler; the bytecode needs hints for it
+	this->jit = new RoutineJITCompiler(this, new asCJITCompiler());
+
+	this->engine->SetEngineProperty(asEP_INCLUDE_JIT_INSTRUCTIONS, 1);
+	this->engine->SetJITCompiler(this->jit);
+
+	LOG(INFO) << "AngelScript JIT is available";
+#endif
+
+	// register some script addons
+	RegisterStdString(this->engine);
+	RegisterScriptArray(this->engine, true);
+	RegisterScriptDictionary(this->engine);
+	RegisterScriptDateTime(this->engine);
+	RegisterScriptMath(this->engine);
+
+	// register globals (functions, types and global variables)
+	Routine::registerScriptInterface(this->engine);
+
+	VLOG(1) << "Created shared AngelScript engine";
+}
+
+/**
+ * Discards all cached modules and shuts down the engine.
+ */
+ScriptEngine::~ScriptEngine() {
+	// stop the watchdog
+	if(this->watchdog) {
+		{
+			std::lock_guard<std::mutex> lg(this->watchdogLock);
+			this->watchdogRun = false;
+		}
+
+		this->watchdogCv.notify_all();
+		this->watchdog->join();
+
+		delete this->watchdog;
+	}
+
+	for(auto const& [key, cached] : this->cache) {
+		delete cached;
+	}
+
+	this->engine->ShutDownAndRelease();
+	this->engine = nullptr;
+
+	delete this->jit;
+}
+
+/**
+ * Returns a module with the routine's code compiled in. The code is only
+ * compiled if it isn't in the cache yet. Every module returned by this must be
+ * released with releaseModule() once its routine is done with it.
+ *
+ * If usesJIT is specified, it's set to whether the module's effectStep() will
+ * run as native code.
+ *
+ * @note This throws a Routine::LoadError if the code couldn't be compiled.
+ */
+asIScriptModule *ScriptEngine::acquireModule(DbRoutine *routine, bool *usesJIT) {
+	std::lock_guard<std::mutex> lg(this->cacheLock);
+
+	size_t codeHash = std::hash<std::string>()(routine->code);
+	CacheKey key(routine->getId(), codeHash);
+
+	// compile the code if it's not in the cache
+	CachedModule *cached;
+
+	auto it = this->cache.find(key);
+
+	if(it == this->cache.end()) {
+		cached = this->compileModule(routine, codeHash);
+		this->cache[key] = cached;
+
+		// throw out any older versions of the code no one uses anymore
+		this->currentHashes[routine->getId()] = codeHash;
+		this->pruneModules(routine->getId());
+	} else {
+		cached = it->second;
+		VLOG(2) << "Using cached module for " << routine->name;
+	}
+
+	// get a module for the routine
+	bool effectStepJIT;
+	asIScriptModule *module = this->instantiateModule(cached, effectStepJIT);
+
+	cached->refs++;
+	this->instances[module] = {cached, effectStepJIT};
+
+	if(usesJIT) {
+		*usesJIT = effectStepJIT;
+	}
+
+	return module;
+}
+
+/**
+ * Releases a module previously returned by acquireModule().
+ */
+void ScriptEngine::releaseModule(asIScriptModule *module) {
+	std::lock_guard<std::mutex> lg(this->cacheLock);
+
+	auto it = this->instances.find(module);
+	CHECK(it != this->instances.end()) << "Releasing unknown module " << module;
+
+	CachedModule *cached = it->second.cached;
+	this->instances.erase(it);
+
+	// modules with globals are per routine; get rid of it
+	if(module != cached->module) {
+		module->Discard();
+	}
+
+	cached->refs--;
+
+	this->pruneModules(cached->routineId);
+}
+
+/**
+ * Compiles the routine's code into a new module, and saves its bytecode.
+ *
+ * @note This must be called with the cache lock held.
+ */
+ScriptEngine::CachedModule *ScriptEngine::compileModule(DbRoutine *routine, size_t codeHash) {
+	int err;
+
+	auto start = std::chrono::high_resolution_clock::now();
+
+	// creating the module
+	std::string name = "EffectRoutine-" + std::to_string(routine->getId()) +
+					   "-" + std::to_string(this->moduleCounter++);
+
+	// if the code was compiled before, load its bytecode instead
+	if(!this->cacheDirectory.empty()) {
+		CachedModule *cached = this->loadCachedModule(routine, codeHash, name);
+
+		if(cached) {
+			return cached;
+		}
+	}
+
+	bool wantsJIT = false;
+
+	CScriptBuilder builder;
+	builder.SetPragmaCallback(ScriptEngine::pragmaCallback, &wantsJIT);
+
+	err = builder.StartNewModule(this->engine, name.c_str());
+
+	if(err != 0) {
+		LOG(ERROR) << "Couldn't create new AS module: probably out of memory";
+		throw Routine::LoadError(err, Routine::LoadError::kErrorStageNewModule);
+	}
+
+	// insert the code from the database
+	err = builder.AddSectionFromMemory(routine->name.c_str(),
+									   routine->code.c_str(),
+									   routine->code.size(), 0);
+
+	if(err != 1) {
+		LOG(WARNING) << "Couldn't include user AS code";
+		this->engine->DiscardModule(name.c_str());
+
+		throw Routine::LoadError(err, Routine::LoadError::kErrorStageBuildModule);
+	}
+
+	// build and compile the module; pragmas were processed when adding the code
+	if(wantsJIT && !this->hasJIT()) {
+		LOG(WARNING) << routine->name << " asked for the JIT, but it's not "
+					 << "available; using the interpreter";
+	}
+
+	this->buildWantsJIT = wantsJIT;
+	this->buildEffectStepJIT = false;
+
+	err = builder.BuildModule();
+
+	this->buildWantsJIT = false;
+
+	if(err != 0) {
+		LOG(WARNING) << "Couldn't build AS module: check script syntax";
+		this->engine->DiscardModule(name.c_str());
+
+		throw Routine::LoadError(err, Routine::LoadError::kErrorStageBuildModule);
+	}
+
+	// save its bytecode so that it can be instantiated again
+	CachedModule *cached = new CachedModule;
+
+	cached->routineId = routine->getId();
+	cached->codeHash = codeHash;
+	cached->module = this->engine->GetModule(name.c_str());
+	cached->hasGlobals = (cached->module->GetGlobalVarCount() > 0);
+	cached->wantsJIT = wantsJIT;
+	cached->effectStepJIT = this->buildEffectStepJIT;
+
+	if(cached->hasGlobals || !this->cacheDirectory.empty()) {
+		ByteCodeStream stream(cached->bytecode);
+		err = cached->module->SaveByteCode(&stream);
+
+		CHECK(err >= 0) << "Couldn't save bytecode for " << routine->name << ": " << err;
+	}
+
+	// write it to the cache; shared modules don't need it in memory after that
+	if(!this->cacheDirectory.empty()) {
+		this->saveCachedModule(routine, cached);
+
+		if(!cached->hasGlobals) {
+			cached->bytecode.clear();
+			cached->bytecode.shrink_to_fit();
+		}
+	}
+
+	auto elapsed = std::chrono::high_resolution_clock::now() - start;
+	std::chrono::duration<double, std::milli> millis = elapsed;
+
+	VLOG(1) << "Compiled " << routine->name << " in " << millis.count() << " ms ("
+			<< (cached->hasGlobals ? "per-routine" : "shared") << " module, "
+			<< (cached->effectStepJIT ? "JIT" : "interpreted") << ")";
+
+	return cached;
+}
+
+/**
+ * Returns a module to be used by a single routine. Modules without globals are
+ * shared by all routines; all others are loaded from the cached bytecode.
+ *
+ * @note This must be called with the cache lock held.
+ */
+asIScriptModule *ScriptEngine::instantiateModule(CachedModule *cached, bool &effectStepJIT) {
+	int err;
+
+	effectStepJIT = cached->effectStepJIT;
+
+	// modules without globals can be shared by any number of routines
+	if(!cached->hasGlobals) {
+		return cached->module;
+	}
+
+	// the compiled module itself can go to a single routine
+	if(this->instances.find(cached->module) == this->instances.end()) {
+		// it may have been used before, so start from a clean state
+		cached->module->ResetGlobalVars();
+		return cached->module;
+	}
+
+	// otherwise, load its bytecode into a new module
+	std::string name = "EffectRoutine-" + std::to_string(cached->routineId) +
+					   "-" + std::to_string(this->moduleCounter++);
+	asIScriptModule *module = this->engine->GetModule(name.c_str(), asGM_ALWAYS_CREATE);
+
+	// the JIT compiles the loaded functions again
+	this->buildWantsJIT = cached->wantsJIT;
+	this->buildEffectStepJIT = false;
+
+	ByteCodeStream stream(cached->bytecode);
+	err = module->LoadByteCode(&stream);
+
+	this->buildWantsJIT = false;
+	effectStepJIT = this->buildEffectStepJIT;
+
+	CHECK(err >= 0) << "Couldn't load cached bytecode into " << name << ": " << err;
+
+	return module;
+}
+
+/**
+ * Throws out any cached code for the given routine that's not in use and that
+ * has since been replaced by newer code.
+ *
+ * @note This must be called with the cache lock held.
+ */
+void ScriptEngine::pruneModules(int routineId) {
+	size_t currentHash = this->currentHashes[routineId];
+
+	for(auto it = this->cache.begin(); it != this->cache.end();) {
+		CachedModule *cached = it->second;
+
+		if(cached->routineId == routineId && cached->codeHash != currentHash &&
+		   cached->refs == 0) {
+			VLOG(2) << "Discarding stale module " << cached->module->GetName();
+
+			cached->module->Discard();
+			delete cached;
+
+			it = this->cache.erase(it);
+		} else {
+			++it;
+		}
+	}
+}
+
+/**
+ * Handles #pragma directives in routine code. The only one that's supported is
+ * `#pragma jit`, which requests the routine be compiled by the JIT.
+ */
+int ScriptEngine::pragmaCallback(const std::string &text, CScriptBuilder &builder,
+								 void *param) {
+	bool *wantsJIT = static_cast<bool *>(param);
+
+	// strip whitespace around the pragma
+	size_t start = text.find_first_not_of(" \t");
+	size_t end = text.find_last_not_of(" \t\r\n");
+
+	std::string pragma;
+
+	if(start != std::string::npos) {
+		pragma = text.substr(start, (end - start + 1));
+	}
+
+	if(pragma == "jit") {
+		*wantsJIT = true;
+		return 0;
+	}
+
+	LOG(WARNING) << "Unknown pragma '" << pragma << "'";
+	return -1;
+}
+
+#pragma mark - Bytecode Cache
+/**
+ * Sets the directory in which compiled bytecode is cached; it's created if it
+ * doesn't exist yet. An empty path disables the cache.
+ */
+void ScriptEngine::setCacheDirectory(const std::string &path) {
+	std::lock_guard<std::mutex> lg(this->cacheLock);
+
+	// create it, if needed
+	if(!path.empty() && mkdir(path.c_str(), 0755) != 0 && errno != EEXIST) {
+		PLOG(WARNING) << "Couldn't create bytecode cache directory " << path << "; not caching bytecode: ";
+
+		this->cacheDirectory.clear();
+		return;
+	}
+
+	this->cacheDirectory = path;
+
+	LOG_IF(INFO, !path.empty()) << "Caching compiled routines in " << path;
+}
+
+/**
+ * Hashes a routine's code. Unlike std::hash, this is the same across builds and
+ * platforms, so it can be used to name cache files (64-bit FNV-1a.)
+ */
+uint64_t ScriptEngine::stableHash(const std::string &code) {
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	for(unsigned char c : code) {
+		hash ^= c;
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+/**
+ * Returns the path of the cache file for the routine's current code.
+ */
+std::string ScriptEngine::cacheFilePath(DbRoutine *routine) {
+	char hash[17];
+	snprintf(hash, sizeof(hash), "%016llx", (unsigned long long) ScriptEngine::stableHash(routine->code));
+
+	return this->cacheDirectory + "/routine-" + std::to_string(routine->getId()) + "-" + hash + ".asbc";
+}
+
+/**
+ * Tries to load the routine's code from the bytecode cache into a new module
+ * with the given name. If there's no usable cache file, nullptr is returned, and
+ * the code has to be compiled.
+ *
+ * @note This must be called with the cache lock held.
+ */
+ScriptEngine::CachedModule *ScriptEngine::loadCachedModule(DbRoutine *routine, size_t codeHash, const std::string &name) {
+	int err;
+
+	auto start = std::chrono::high_resolution_clock::now();
+	std::string path = this->cacheFilePath(routine);
+
+	std::ifstream file(path, std::ios::binary);
+
+	if(!file) {
+		VLOG(2) << "No cached bytecode for " << routine->name;
+		return nullptr;
+	}
+
+	// check that it's for this code and this build
+	CachedBytecodeHeader header;
+
+	if(!file.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+	   header.magic != kCachedBytecodeMagic ||
+	   header.codeSize != routine->code.size() ||
+	   strncmp(header.build, gVERSION_HASH, sizeof(header.build)) != 0) {
+		VLOG(1) << "Ignoring stale cached bytecode for " << routine->name;
+		return nullptr;
+	}
+
+	CachedModule *cached = new CachedModule;
+	cached->bytecode.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+
+	// load it; the JIT compiles the loaded functions again
+	asIScriptModule *module = this->engine->GetModule(name.c_str(), asGM_ALWAYS_CREATE);
+
+	this->buildWantsJIT = (header.wantsJIT != 0);
+	this->buildEffectStepJIT = false;
+
+	ByteCodeStream stream(cached->bytecode);
+	err = module->LoadByteCode(&stream);
+
+	this->buildWantsJIT = false;
+
+	if(err < 0) {
+		LOG(WARNING) << "Couldn't load cached bytecode for " << routine->name << " (" << err << "); compiling it again";
+
+		module->Discard();
+		delete cached;
+
+		return nullptr;
+	}
+
+	cached->routineId = routine->getId();
+	cached->codeHash = codeHash;
+	cached->module = module;
+	cached->hasGlobals = (header.hasGlobals != 0);
+	cached->wantsJIT = (header.wantsJIT != 0);
+	cached->effectStepJIT = this->buildEffectStepJIT;
+
+	// only modules with globals are instantiated from the bytecode again
+	if(!cached->hasGlobals) {
+		cached->bytecode.clear();
+		cached->bytecode.shrink_to_fit();
+	}
+
+	auto elapsed = std::chrono::high_resolution_clock::now() - start;
+	std::chrono::duration<double, std::milli> millis = elapsed;
+
+	VLOG(1) << "Loaded " << routine->name << " from cached bytecode in " << millis.count() << " ms";
+
+	return cached;
+}
+
+/**
+ * Writes the compiled module's bytecode to the cache. The file is written under
+ * a temporary name and then renamed, so a cache file is never seen half written.
+ * Failing to write it isn't fatal; the code is just compiled again next time.
+ *
+ * @note This must be called with the cache lock held.
+ */
+void ScriptEngine::saveCachedModule(DbRoutine *routine, CachedModule *cached) {
+	std::string path = this->cacheFilePath(routine);
+	std::string tempPath = path + ".tmp";
+
+	CachedBytecodeHeader header;
+	memset(&header, 0, sizeof(header));
+
+	header.magic = kCachedBytecodeMagic;
+	header.codeSize = routine->code.size();
+	header.wantsJIT = cached->wantsJIT;
+	header.hasGlobals = cached->hasGlobals;
+	strncpy(header.build, gVERSION_HASH, sizeof(header.build) - 1);
+
+	{
+		std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+
+		file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+		file.write(reinterpret_cast<const char *>(cached->bytecode.data()), cached->bytecode.size());
+
+		if(!file) {
+			LOG(WARNING) << "Couldn't write cached bytecode to " << tempPath;
+			remove(tempPath.c_str());
+			return;
+		}
+	}
+
+	if(rename(tempPath.c_str(), path.c_str()) != 0) {
+		PLOG(WARNING) << "Couldn't move cached bytecode to " << path << ": ";
+		remove(tempPath.c_str());
+		return;
+	}
+
+	VLOG(2) << "Cached bytecode for " << routine->name << " in " << path;
+}
+
+#pragma mark - Watchdog
+/**
+ * Starts watching the given context, which is about to execute: if it's still
+ * executing at the deadline, it's aborted. The context must be unwatched once
+ * it's done executing.
+ */
+void ScriptEngine::watch(asIScriptContext *ctx, clock::time_point deadline) {
+	std::lock_guard<std::mutex> lg(this->watchdogLock);
+
+	if(this->watchdog == nullptr) {
+		this->watchdog = new std::thread(ScriptWatchdogEntry, this);
+	}
+
+	this->watched[ctx] = deadline;
+	this->watchdogCv.notify_all();
+}
+
+/**
+ * Stops watching the given context. Once this returns, the watchdog no longer
+ * aborts it.
+ *
+ * @return Whether the watchdog aborted the context, i.e. it was past its
+ * deadline and no longer watched.
+ */
+bool ScriptEngine::unwatch(asIScriptContext *ctx) {
+	std::lock_guard<std::mutex> lg(this->watchdogLock);
+	return (this->watched.erase(ctx) == 0);
+}
+
+/**
+ * Sleeps until the earliest deadline of any watched context, then aborts all
+ * contexts that are past theirs.
+ *
+ * Aborting is allowed from another thread; the script stops at the next point
+ * where the VM checks for it, which Execute() then reports as aborted. Code
+ * compiled by the JIT may take a little longer to get to such a point.
+ */
+void ScriptEngine::watchdogThreadEntry(void) {
+	std::unique_lock<std::mutex> lk(this->watchdogLock);
+
+	while(this->watchdogRun) {
+		if(this->watched.empty()) {
+			this->watchdogCv.wait(lk);
+			continue;
+		}
+
+		// find the earliest deadline
+		clock::time_point earliest = clock::time_point::max();
+
+		for(auto const& [ctx, deadline] : this->watched) {
+			earliest = std::min(earliest, deadline);
+		}
+
+		if(this->watchdogCv.wait_until(lk, earliest) == std::cv_status::no_timeout) {
+			// contexts were added or removed; look again
+			continue;
+		}
+
+		// abort everything that's overdue
+		auto now = clock::now();
+
+		for(auto it = this->watched.begin(); it != this->watched.end();) {
+			if(it->second <= now) {
+				it->first->Abort();
+				it = this->watched.erase(it);
+			} else {
+				++it;
+			}
+		}
+	}
+}
+
+/**
+ * message handler for AngelScript - any messages given from the engine are just
+ * printed to the log using the standard logging functions.
+ */
+static void ASMessageCallback(const asSMessageInfo *msg, void *param) {
+	// format the message
+	static const int msgBufSz = 4096;
+	char msgBuf[msgBufSz];
+
+	snprintf(msgBuf, msgBufSz, "AngelScript Message [section '%s' (%d:%d)] %s",
+			 msg->section, msg->row, msg->col, msg->message);
+
+	// log it
+	if(msg->type == asMSGTYPE_ERROR) {
+		LOG(ERROR) << msgBuf;
+	} else if(msg->type == asMSGTYPE_WARNING) {
+		LOG(WARNING) << msgBuf;
+	} else if(msg->type == asMSGTYPE_INFORMATION) {
+		LOG(INFO) << msgBuf;
+	}
+}
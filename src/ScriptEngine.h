@@ -0,0 +1,170 @@
+/**
+ * Owns the single AngelScript engine that all routines share, along with a
+ * cache of compiled modules.
+ *
+ * Modules are cached by routine id and a hash of the routine's code, so that
+ * mapping the same routine to any number of groups only compiles it once. If
+ * the routine's code declares no global variables, every routine instance can
+ * share the same module; otherwise, each instance gets a module of its own
+ * that's loaded from the cached bytecode rather than compiled again, so the
+ * instances' state stays separate.
+ *
+ * Routines can ask for their code to be compiled to native code by the JIT
+ * compiler with a `#pragma jit` line. This only has an effect if the server was
+ * built with the JIT (the WITH_AS_JIT CMake option); otherwise, or if the JIT
+ * can't handle some function, that code runs on the interpreter instead.
+ *
+ * The engine also has a watchdog, which aborts scripts that run for longer than
+ * they were allowed to. It only starts a thread once it's first used.
+ *
+ * Compiled bytecode can also be cached on disk, keyed by routine id and a hash
+ * of the code, so that routines whose code didn't change are loaded from their
+ * bytecode after a restart rather than compiled again. Cached bytecode is only
+ * used by the same build of the server that wrote it.
+ */
+#ifndef SCRIPTENGINE_H
+#define SCRIPTENGINE_H
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <utility>
+#include <chrono>
+#include <thread>
+#include <condition_variable>
+
+#include <angelscript.h>
+
+class CScriptBuilder;
+class DbRoutine;
+class RoutineJITCompiler;
+
+class ScriptEngine {
+	friend class RoutineJITCompiler;
+
+	public:
+		static ScriptEngine *shared(void);
+
+		/**
+		 * Returns the AngelScript engine.
+		 */
+		asIScriptEngine *getEngine(void) const {
+			return this->engine;
+		}
+
+		asIScriptModule *acquireModule(DbRoutine *routine, bool *usesJIT = nullptr);
+		void releaseModule(asIScriptModule *module);
+
+		void setCacheDirectory(const std::string &path);
+
+		/**
+		 * Returns whether the server was built with the JIT compiler.
+		 */
+		bool hasJIT(void) const {
+			return (this->jit != nullptr);
+		}
+
+	// watchdog
+	public:
+		typedef std::chrono::steady_clock clock;
+
+		void watch(asIScriptContext *ctx, clock::time_point deadline);
+		bool unwatch(asIScriptContext *ctx);
+
+	private:
+		friend void ScriptWatchdogEntry(void *ctx);
+
+		void watchdogThreadEntry(void);
+
+		std::mutex watchdogLock;
+		std::condition_variable watchdogCv;
+
+		/// contexts that are executing, and when they have to be done by
+		std::map<asIScriptContext *, clock::time_point> watched;
+
+		std::thread *watchdog = nullptr;
+		bool watchdogRun = true;
+
+	private:
+		ScriptEngine();
+		~ScriptEngine();
+
+		/**
+		 * A single routine's compiled code.
+		 */
+		struct CachedModule {
+			int routineId;
+			size_t codeHash;
+
+			/// module the code was compiled into
+			asIScriptModule *module = nullptr;
+			/// whether the module declares global variables
+			bool hasGlobals = false;
+
+			/// whether the code asked for the JIT
+			bool wantsJIT = false;
+			/// whether effectStep() was compiled by the JIT
+			bool effectStepJIT = false;
+
+			/// the compiled module's bytecode
+			std::vector<asBYTE> bytecode;
+
+			/// number of routines using this code
+			int refs = 0;
+		};
+
+		/**
+		 * A module that was handed out to a routine.
+		 */
+		struct Instance {
+			CachedModule *cached;
+
+			/// whether effectStep() in this module was compiled by the JIT
+			bool effectStepJIT;
+		};
+
+		typedef std::pair<int, size_t> CacheKey;
+
+		CachedModule *compileModule(DbRoutine *routine, size_t codeHash);
+
+		// bytecode cache on disk
+		static uint64_t stableHash(const std::string &code);
+		std::string cacheFilePath(DbRoutine *routine);
+
+		CachedModule *loadCachedModule(DbRoutine *routine, size_t codeHash, const std::string &name);
+		void saveCachedModule(DbRoutine *routine, CachedModule *cached);
+		asIScriptModule *instantiateModule(CachedModule *cached, bool &effectStepJIT);
+
+		static int pragmaCallback(const std::string &text, CScriptBuilder &builder,
+								  void *param);
+
+		void pruneModules(int routineId);
+
+	private:
+		asIScriptEngine *engine = nullptr;
+
+		std::mutex cacheLock;
+		std::map<CacheKey, CachedModule *> cache;
+		/// newest code hash seen for each routine
+		std::map<int, size_t> currentHashes;
+
+		/// maps each module handed out to what it was created from
+		std::map<asIScriptModule *, Instance> instances;
+
+		/// JIT compiler, if built in
+		RoutineJITCompiler *jit = nullptr;
+
+		/// whether the module currently being built/loaded should use the JIT
+		bool buildWantsJIT = false;
+		/// set if effectStep() in the module being built/loaded got compiled
+		bool buildEffectStepJIT = false;
+
+		/// used to generate unique module names
+		unsigned long moduleCounter = 0;
+
+		/// directory compiled bytecode is cached in; empty to not cache it
+		std::string cacheDirectory;
+};
+
+#endif
@@ -0,0 +1,70 @@
+#include "Shard.h"
+
+#include "db/Node.h"
+#include "db/Channel.h"
+
+#include <glog/logging.h>
+
+/**
+ * Reads the shard configuration.
+ */
+Shard::Shard(INIReader *reader) {
+	long count = reader->GetInteger("shard", "count", 1);
+	CHECK(count > 0) << "Need at least one shard; check shard.count";
+
+	long index = reader->GetInteger("shard", "index", 0);
+	CHECK(index >= 0 && index < count) << "Shard index must be less than the number of shards; check shard.index";
+
+	this->count = count;
+	this->index = index;
+}
+
+/**
+ * Checks whether the node with the given MAC address belongs to this shard.
+ */
+bool Shard::ownsNode(const uint8_t mac[6]) const {
+	uint64_t key = 0;
+
+	for(size_t i = 0; i < 6; i++) {
+		key = (key << 8) | mac[i];
+	}
+
+	return (key % this->count) == this->index;
+}
+
+/**
+ * Checks whether the node belongs to this shard.
+ */
+bool Shard::ownsNode(const DbNode *node) const {
+	return this->ownsNode(node->macAddr);
+}
+
+/**
+ * Checks whether the channel belongs to this shard, i.e. whether its node does.
+ * Channels that aren't assigned to a node don't belong to any shard.
+ */
+bool Shard::ownsChannel(const DbChannel *channel) const {
+	if(channel->node == nullptr) {
+		return !this->isSharded();
+	}
+
+	return this->ownsNode(channel->node);
+}
+
+/**
+ * Returns the number of the frame whose start by the wall clock is closest to
+ * now, for frames of the given period. Frames are counted from the Unix epoch.
+ */
+uint64_t Shard::wallFrame(std::chrono::nanoseconds period) {
+	auto sinceEpoch = std::chrono::system_clock::now().time_since_epoch();
+	return (std::chrono::duration_cast<std::chrono::nanoseconds>(sinceEpoch) + (period / 2)) / period;
+}
+
+/**
+ * Returns how far into its frame the wall clock is, for frames of the given
+ * period.
+ */
+std::chrono::nanoseconds Shard::wallFramePhase(std::chrono::nanoseconds period) {
+	auto sinceEpoch = std::chrono::system_clock::now().time_since_epoch();
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(sinceEpoch) % period;
+}
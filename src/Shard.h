@@ -0,0 +1,69 @@
+/**
+ * Describes which part of the installation this server instance is responsible
+ * for, when several instances share one data store.
+ *
+ * Each instance is configured with the number of shards and its own index. Nodes
+ * are assigned to shards by their MAC address, so an instance only adopts, and
+ * sends data to, the nodes (and thus channels) of its shard. The instance with
+ * index 0 leads: followers tell it once their nodes have a frame's data, and it
+ * sends the sync output packet for all of them.
+ *
+ * Frames of all instances are aligned to the wall clock, so they're numbered
+ * the same everywhere as long as the clocks of the servers are synchronized
+ * (e.g. with NTP.)
+ */
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+#include "INIReader.h"
+
+class DbNode;
+class DbChannel;
+
+class Shard {
+	public:
+		Shard(INIReader *reader);
+
+		/**
+		 * Whether there's more than one shard.
+		 */
+		bool isSharded(void) const {
+			return (this->count > 1);
+		}
+		/**
+		 * Whether this instance sends the sync output packets for all shards.
+		 */
+		bool isLeader(void) const {
+			return (this->index == 0);
+		}
+
+		/**
+		 * Returns the index of this instance's shard.
+		 */
+		size_t getIndex(void) const {
+			return this->index;
+		}
+		/**
+		 * Returns the total number of shards.
+		 */
+		size_t getCount(void) const {
+			return this->count;
+		}
+
+		bool ownsNode(const uint8_t mac[6]) const;
+		bool ownsNode(const DbNode *node) const;
+		bool ownsChannel(const DbChannel *channel) const;
+
+		static uint64_t wallFrame(std::chrono::nanoseconds period);
+		static std::chrono::nanoseconds wallFramePhase(std::chrono::nanoseconds period);
+
+	private:
+		size_t index = 0;
+		size_t count = 1;
+};
+
+#endif
@@ -0,0 +1,385 @@
+#include "ShowFile.h"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#pragma mark - Writer
+/**
+ * Creates the show file, and writes its header and channel table. Frames are
+ * buffered until a chunk is full, then written out at once.
+ */
+ShowFile::Writer::Writer(const std::string &path, int fps, const std::vector<Channel> &channels, size_t framesPerChunk) {
+	this->path = path;
+	this->channels = channels;
+	this->framesPerChunk = std::max(framesPerChunk, size_t(1));
+
+	this->file = fopen(path.c_str(), "wb");
+
+	if(this->file == nullptr) {
+		throw Error("Couldn't create " + path + ": " + strerror(errno));
+	}
+
+	// write the header and channel table
+	Header header;
+	memset(&header, 0, sizeof(header));
+
+	header.magic = kMagic;
+	header.version = kVersion;
+	header.fps = fps;
+	header.numChannels = channels.size();
+
+	bool ok = (fwrite(&header, sizeof(header), 1, this->file) == 1);
+
+	if(!channels.empty()) {
+		ok = ok && (fwrite(channels.data(), sizeof(Channel), channels.size(), this->file) == channels.size());
+	}
+
+	if(!ok) {
+		fclose(this->file);
+		this->file = nullptr;
+
+		throw Error("Couldn't write header of " + path + ": " + strerror(errno));
+	}
+}
+
+/**
+ * Writes out any buffered frames and closes the file.
+ */
+ShowFile::Writer::~Writer() {
+	this->finish();
+}
+
+/**
+ * Starts a new frame. After this, addChannel() must be called for each channel
+ * in the recording, in order.
+ */
+void ShowFile::Writer::beginFrame(void) {
+	this->keyFrame = (this->chunkFrames == 0);
+}
+
+/**
+ * Adds a channel's pixels to the frame being recorded. Only the given ranges,
+ * which must hold all pixels that changed since the previous frame, are stored;
+ * in the first frame of each chunk, all pixels are.
+ */
+void ShowFile::Writer::addChannel(size_t index, const uint8_t *pixels, const std::vector<ProtocolHandler::PixelRange> &ranges) {
+	const Channel &channel = this->channels[index];
+
+	// key frames always hold the entire channel
+	if(this->keyFrame) {
+		uint32_t numRanges = (channel.numPixels > 0) ? 1 : 0;
+		this->_append(&numRanges, sizeof(numRanges));
+
+		if(numRanges) {
+			Range range = {0, channel.numPixels};
+
+			this->_append(&range, sizeof(range));
+			this->_append(pixels, (channel.numPixels * channel.stride));
+		}
+
+		return;
+	}
+
+	// otherwise, write the ranges, then their pixels
+	uint32_t numRanges = ranges.size();
+	this->_append(&numRanges, sizeof(numRanges));
+
+	for(auto const& r : ranges) {
+		Range range = {uint32_t(r.start), uint32_t(r.count)};
+		this->_append(&range, sizeof(range));
+	}
+
+	for(auto const& r : ranges) {
+		this->_append((pixels + (r.start * channel.stride)), (r.count * channel.stride));
+	}
+}
+
+/**
+ * Finishes the current frame. Once the chunk is full, it's written to the file.
+ */
+void ShowFile::Writer::endFrame(void) {
+	this->numFrames++;
+
+	if(++this->chunkFrames == this->framesPerChunk) {
+		this->_writeChunk();
+	}
+}
+
+/**
+ * Writes out the last (partial) chunk, and closes the file.
+ */
+void ShowFile::Writer::finish(void) {
+	if(this->file == nullptr) {
+		return;
+	}
+
+	this->_writeChunk();
+
+	if(fclose(this->file) != 0) {
+		PLOG(ERROR) << "Couldn't close show file " << this->path << ": ";
+	}
+
+	this->file = nullptr;
+
+	LOG(INFO) << "Recorded " << this->numFrames << " frames to " << this->path;
+}
+
+/**
+ * Appends data to the chunk being built.
+ */
+void ShowFile::Writer::_append(const void *data, size_t length) {
+	const uint8_t *bytes = static_cast<const uint8_t *>(data);
+	this->chunk.insert(this->chunk.end(), bytes, (bytes + length));
+}
+
+/**
+ * Writes the buffered chunk to the file, and starts a new one. If writing fails,
+ * the recording ends there.
+ */
+void ShowFile::Writer::_writeChunk(void) {
+	if(this->chunkFrames == 0 || this->file == nullptr) {
+		return;
+	}
+
+	ChunkHeader header;
+	memset(&header, 0, sizeof(header));
+
+	header.magic = kChunkMagic;
+	header.numFrames = this->chunkFrames;
+	header.size = this->chunk.size();
+
+	bool ok = (fwrite(&header, sizeof(header), 1, this->file) == 1) &&
+			  (fwrite(this->chunk.data(), 1, this->chunk.size(), this->file) == this->chunk.size()) &&
+			  (fflush(this->file) == 0);
+
+	if(!ok) {
+		PLOG(ERROR) << "Couldn't write to show file " << this->path << "; recording stops here: ";
+
+		fclose(this->file);
+		this->file = nullptr;
+	}
+
+	// start the next chunk with a key frame
+	this->chunk.clear();
+	this->chunkFrames = 0;
+}
+
+#pragma mark - Reader
+/**
+ * Opens and maps the show file, and finds all complete chunks in it.
+ */
+ShowFile::Reader::Reader(const std::string &path) {
+	this->fd = open(path.c_str(), O_RDONLY);
+
+	if(this->fd < 0) {
+		throw Error("Couldn't open " + path + ": " + strerror(errno));
+	}
+
+	struct stat st;
+
+	if(fstat(this->fd, &st) != 0) {
+		int err = errno;
+		close(this->fd);
+
+		throw Error("Couldn't stat " + path + ": " + strerror(err));
+	}
+
+	this->length = st.st_size;
+
+	if(this->length < sizeof(Header)) {
+		close(this->fd);
+		throw Error(path + " isn't a show file");
+	}
+
+	void *map = mmap(nullptr, this->length, PROT_READ, MAP_SHARED, this->fd, 0);
+
+	if(map == MAP_FAILED) {
+		int err = errno;
+		close(this->fd);
+
+		throw Error("Couldn't map " + path + ": " + strerror(err));
+	}
+
+	this->base = static_cast<const uint8_t *>(map);
+
+	// check the header
+	Header header;
+	memcpy(&header, this->base, sizeof(header));
+
+	size_t tableEnd = sizeof(Header) + (size_t(header.numChannels) * sizeof(Channel));
+
+	if(header.magic != kMagic || header.version != kVersion || tableEnd > this->length) {
+		munmap(const_cast<uint8_t *>(this->base), this->length);
+		close(this->fd);
+
+		throw Error(path + " isn't a show file, or was recorded by an incompatible version");
+	}
+
+	this->fps = header.fps;
+
+	this->channels.resize(header.numChannels);
+	memcpy(this->channels.data(), (this->base + sizeof(Header)), (tableEnd - sizeof(Header)));
+
+	// find all chunks; a chunk that was cut short ends the show
+	size_t offset = tableEnd;
+
+	while((offset + sizeof(ChunkHeader)) <= this->length) {
+		ChunkHeader chunk;
+		memcpy(&chunk, (this->base + offset), sizeof(chunk));
+
+		offset += sizeof(ChunkHeader);
+
+		if(chunk.magic != kChunkMagic || chunk.size > (this->length - offset)) {
+			LOG(WARNING) << "Show file " << path << " is truncated after " << this->numFrames << " frames";
+			break;
+		}
+
+		this->chunks.push_back({offset, size_t(chunk.size), chunk.numFrames});
+		this->numFrames += chunk.numFrames;
+
+		offset += chunk.size;
+	}
+
+	// frames are read in order
+	madvise(map, this->length, MADV_SEQUENTIAL);
+
+	this->rewind();
+}
+
+/**
+ * Unmaps and closes the file.
+ */
+ShowFile::Reader::~Reader() {
+	munmap(const_cast<uint8_t *>(this->base), this->length);
+	close(this->fd);
+}
+
+/**
+ * Goes back to the first frame of the show.
+ */
+void ShowFile::Reader::rewind(void) {
+	this->position = 0;
+	this->_enterChunk(0);
+}
+
+/**
+ * Reads the next frame: for each channel in the recording, the ranges of pixels
+ * that changed, and a pointer to their data in the mapped file.
+ *
+ * @return Whether a frame was read; false at the end of the show, or if the
+ * file is corrupt.
+ */
+bool ShowFile::Reader::nextFrame(std::vector<ChannelFrame> &frame) {
+	// go to the next chunk, if we're done with this one
+	while(this->chunkFramesLeft == 0) {
+		if((this->chunkIndex + 1) >= this->chunks.size()) {
+			return false;
+		}
+
+		this->_enterChunk(this->chunkIndex + 1);
+	}
+
+	frame.resize(this->channels.size());
+
+	for(size_t i = 0; i < this->channels.size(); i++) {
+		const Channel &channel = this->channels[i];
+		ChannelFrame &out = frame[i];
+
+		out.ranges.clear();
+
+		// read the ranges
+		uint32_t numRanges;
+
+		if(!this->_read(&numRanges, sizeof(numRanges))) {
+			goto corrupt;
+		}
+
+		size_t bytes = 0;
+
+		for(uint32_t j = 0; j < numRanges; j++) {
+			Range range;
+
+			if(!this->_read(&range, sizeof(range)) || range.count > channel.numPixels ||
+			   range.start > (channel.numPixels - range.count)) {
+				goto corrupt;
+			}
+
+			out.ranges.push_back({range.start, range.count});
+			bytes += size_t(range.count) * channel.stride;
+		}
+
+		// then, their pixels
+		if(bytes > (this->chunkEnd - this->offset)) {
+			goto corrupt;
+		}
+
+		out.pixels = this->base + this->offset;
+		this->offset += bytes;
+	}
+
+	this->chunkFramesLeft--;
+	this->position++;
+
+	return true;
+
+corrupt: ;
+	LOG(ERROR) << "Show file is corrupt at frame " << this->position;
+
+	this->chunkFramesLeft = 0;
+	this->chunkIndex = this->chunks.size();
+
+	return false;
+}
+
+/**
+ * Copies data from the current chunk, and advances past it.
+ *
+ * @return Whether there was enough data left in the chunk.
+ */
+bool ShowFile::Reader::_read(void *out, size_t length) {
+	if(length > (this->chunkEnd - this->offset)) {
+		return false;
+	}
+
+	memcpy(out, (this->base + this->offset), length);
+	this->offset += length;
+
+	return true;
+}
+
+/**
+ * Starts reading the chunk with the given index. The kernel is asked to read
+ * ahead the chunk after it, so the playback rarely has to wait for the disk.
+ */
+void ShowFile::Reader::_enterChunk(size_t index) {
+	this->chunkIndex = index;
+
+	if(index >= this->chunks.size()) {
+		this->chunkFramesLeft = 0;
+		return;
+	}
+
+	const Chunk &chunk = this->chunks[index];
+
+	this->offset = chunk.offset;
+	this->chunkEnd = chunk.offset + chunk.size;
+	this->chunkFramesLeft = chunk.numFrames;
+
+	// prefetch the next chunk (madvise wants a page aligned address)
+	if((index + 1) < this->chunks.size()) {
+		const Chunk &next = this->chunks[index + 1];
+
+		size_t pageSz = sysconf(_SC_PAGESIZE);
+		size_t start = next.offset & ~(pageSz - 1);
+
+		madvise(const_cast<uint8_t *>(this->base + start), (next.offset + next.size - start), MADV_WILLNEED);
+	}
+}
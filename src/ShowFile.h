@@ -0,0 +1,209 @@
+/**
+ * Recordings of the converted output of every channel, which can be played
+ * back later without running any effects or converting any pixels.
+ *
+ * A show file starts with a header and a table of the recorded channels, and is
+ * followed by chunks of frames. The first frame in each chunk holds all pixels
+ * of every channel; later frames in the chunk only hold the ranges of pixels
+ * that changed since the frame before them. Each chunk is written in one go, so
+ * a recording that was cut short simply ends after its last complete chunk.
+ *
+ * Shows are played back from a read-only mapping of the file, so frames are
+ * copied straight from the page cache into the channels' packets.
+ */
+#ifndef SHOWFILE_H
+#define SHOWFILE_H
+
+#include "ProtocolHandler.h"
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+
+class ShowFile {
+	public:
+		// thrown if a show can't be recorded or played back
+		class Error : public std::runtime_error {
+			public:
+				Error(const std::string &what) : std::runtime_error(what) {}
+		};
+
+		/// a channel in the recording
+		struct Channel {
+			/// id of the channel in the data store
+			uint32_t id;
+			/// number of pixels
+			uint32_t numPixels;
+			/// bytes per pixel
+			uint32_t stride;
+		};
+
+	public:
+		/**
+		 * Appends frames to a new show file.
+		 */
+		class Writer {
+			public:
+				Writer(const std::string &path, int fps, const std::vector<Channel> &channels, size_t framesPerChunk);
+				~Writer();
+
+				void beginFrame(void);
+
+				/**
+				 * Returns whether the frame being added is a key frame, which
+				 * holds all pixels regardless of the ranges passed in.
+				 */
+				bool isKeyFrame(void) const {
+					return this->keyFrame;
+				}
+
+				void addChannel(size_t index, const uint8_t *pixels, const std::vector<ProtocolHandler::PixelRange> &ranges);
+				void endFrame(void);
+
+				void finish(void);
+
+				/**
+				 * Returns the number of frames recorded so far.
+				 */
+				uint64_t getNumFrames(void) const {
+					return this->numFrames;
+				}
+
+			private:
+				void _append(const void *data, size_t length);
+				void _writeChunk(void);
+
+			private:
+				std::string path;
+				FILE *file = nullptr;
+
+				std::vector<Channel> channels;
+
+				/// frames in the chunk being built, and its data
+				size_t framesPerChunk;
+				size_t chunkFrames = 0;
+				std::vector<uint8_t> chunk;
+
+				/// whether the frame being added is the first one of its chunk
+				bool keyFrame = true;
+
+				uint64_t numFrames = 0;
+		};
+
+		/**
+		 * Reads frames from a show file, in order.
+		 */
+		class Reader {
+			public:
+				/// a channel's data in a frame, pointing into the mapped file
+				struct ChannelFrame {
+					/// ranges of pixels that changed since the previous frame
+					std::vector<ProtocolHandler::PixelRange> ranges;
+					/// the ranges' pixel data, back to back
+					const uint8_t *pixels;
+				};
+
+			public:
+				Reader(const std::string &path);
+				~Reader();
+
+				bool nextFrame(std::vector<ChannelFrame> &frame);
+				void rewind(void);
+
+				/**
+				 * Returns the channels in the recording.
+				 */
+				const std::vector<Channel> &getChannels(void) const {
+					return this->channels;
+				}
+				/**
+				 * Returns the frame rate the show was recorded at.
+				 */
+				int getFps(void) const {
+					return this->fps;
+				}
+
+				/**
+				 * Returns the total number of frames in the show.
+				 */
+				uint64_t getNumFrames(void) const {
+					return this->numFrames;
+				}
+				/**
+				 * Returns the number of frames that were read since the start
+				 * of the show.
+				 */
+				uint64_t getPosition(void) const {
+					return this->position;
+				}
+
+			private:
+				bool _read(void *out, size_t length);
+				void _enterChunk(size_t index);
+
+			private:
+				/// a chunk of frames in the file
+				struct Chunk {
+					/// offset of its first frame
+					size_t offset;
+					/// bytes of frame data
+					size_t size;
+
+					uint32_t numFrames;
+				};
+
+				int fd = -1;
+
+				const uint8_t *base = nullptr;
+				size_t length = 0;
+
+				int fps = 0;
+				std::vector<Channel> channels;
+
+				std::vector<Chunk> chunks;
+				uint64_t numFrames = 0;
+
+				/// chunk being read, the read offset, and its end
+				size_t chunkIndex = 0;
+				size_t offset = 0;
+				size_t chunkEnd = 0;
+				/// frames left in the current chunk
+				uint32_t chunkFramesLeft = 0;
+
+				uint64_t position = 0;
+		};
+
+	private:
+		/// 'LSHW'
+		static const uint32_t kMagic = 0x4c534857;
+		/// 'CHNK'
+		static const uint32_t kChunkMagic = 0x43484e4b;
+
+		static const uint32_t kVersion = 1;
+
+		struct Header {
+			uint32_t magic;
+			uint32_t version;
+
+			uint32_t fps;
+			uint32_t numChannels;
+		};
+
+		struct ChunkHeader {
+			uint32_t magic;
+			uint32_t numFrames;
+			/// bytes of frame data following the header
+			uint64_t size;
+		};
+
+		/// a range of pixels in a channel; the pixel data follows all ranges
+		struct Range {
+			uint32_t start;
+			uint32_t count;
+		};
+};
+
+#endif
@@ -0,0 +1,199 @@
+#include "Tracer.h"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+
+#include <pthread.h>
+#include <unistd.h>
+
+using json = nlohmann::json;
+
+std::atomic<bool> Tracer::enabled{false};
+
+/**
+ * Returns the shared tracer.
+ */
+Tracer *Tracer::shared(void) {
+	static Tracer *tracer = new Tracer();
+	return tracer;
+}
+
+/**
+ * Sets up the tracer; spans are timed relative to its creation.
+ */
+Tracer::Tracer() {
+	this->epoch = clock::now();
+}
+
+/**
+ * Sets how many spans the ring buffer holds. This has no effect once tracing
+ * has been started for the first time.
+ */
+void Tracer::setCapacity(size_t capacity) {
+	std::lock_guard<std::mutex> lg(this->lock);
+
+	if(this->events) {
+		LOG(WARNING) << "Can't resize trace buffer once tracing was started";
+		return;
+	}
+
+	// round up to a power of two, so slots can be found with a mask
+	size_t rounded = 1;
+
+	while(rounded < capacity) {
+		rounded <<= 1;
+	}
+
+	this->capacity = rounded;
+}
+
+/**
+ * Starts recording spans. Spans recorded before this are discarded.
+ */
+void Tracer::start(void) {
+	std::lock_guard<std::mutex> lg(this->lock);
+
+	if(!this->events) {
+		this->events = std::make_unique<Event[]>(this->capacity);
+	}
+
+	this->startIdx = this->head.load(std::memory_order_relaxed);
+
+	enabled.store(true, std::memory_order_release);
+
+	LOG(INFO) << "Started tracing, buffer holds " << this->capacity << " spans";
+}
+
+/**
+ * Stops recording spans. The spans recorded so far can still be exported.
+ */
+void Tracer::stop(void) {
+	enabled.store(false, std::memory_order_release);
+
+	LOG(INFO) << "Stopped tracing";
+}
+
+/**
+ * Writes a span into the next slot of the ring buffer.
+ */
+void Tracer::record(const char *name, const char *argName, int64_t arg,
+					clock::time_point start, clock::time_point end) {
+	uint32_t tid = this->threadId();
+
+	uint64_t idx = this->head.fetch_add(1, std::memory_order_relaxed);
+	Event &e = this->events[idx & (this->capacity - 1)];
+
+	// mark the slot as being written, then fill it in
+	e.seq.store(0, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	auto startNs = std::chrono::duration_cast<std::chrono::nanoseconds>(start - this->epoch).count();
+	auto durationNs = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+
+	e.name.store(name, std::memory_order_relaxed);
+	e.argName.store(argName, std::memory_order_relaxed);
+	e.arg.store(arg, std::memory_order_relaxed);
+	e.tid.store(tid, std::memory_order_relaxed);
+	e.start.store(uint64_t(std::max<int64_t>(startNs, 0)), std::memory_order_relaxed);
+	e.duration.store(uint64_t(std::max<int64_t>(durationNs, 0)), std::memory_order_relaxed);
+
+	e.seq.store(idx + 1, std::memory_order_release);
+}
+
+/**
+ * Returns the id of the calling thread in the trace. The first time a thread
+ * records a span, it's assigned an id, and its name is remembered.
+ */
+uint32_t Tracer::threadId(void) {
+	static thread_local uint32_t id = 0;
+
+	if(id == 0) {
+		char name[32] = {0};
+		pthread_getname_np(pthread_self(), name, sizeof(name));
+
+		std::lock_guard<std::mutex> lg(this->lock);
+
+		this->threadNames.push_back(name);
+		id = this->threadNames.size();
+	}
+
+	return id;
+}
+
+/**
+ * Exports all spans in the buffer in the Chrome trace format: a dictionary with
+ * a complete ("X") event for each span, and a metadata event that names each
+ * thread.
+ */
+json Tracer::exportChromeTrace(void) {
+	json events = json::array();
+	int pid = getpid();
+
+	std::lock_guard<std::mutex> lg(this->lock);
+
+	// name all threads
+	for(size_t i = 0; i < this->threadNames.size(); i++) {
+		events.push_back({
+			{"name", "thread_name"},
+			{"ph", "M"},
+			{"pid", pid},
+			{"tid", (i + 1)},
+			{"args", {{"name", this->threadNames[i]}}}
+		});
+	}
+
+	if(!this->events) {
+		return {{"traceEvents", events}, {"displayTimeUnit", "ms"}};
+	}
+
+	// only the newest spans are still in the buffer
+	uint64_t head = this->head.load(std::memory_order_acquire);
+	uint64_t first = this->startIdx;
+
+	if(head > this->capacity) {
+		first = std::max(first, head - this->capacity);
+	}
+
+	for(uint64_t idx = first; idx < head; idx++) {
+		Event &e = this->events[idx & (this->capacity - 1)];
+
+		uint64_t seq = e.seq.load(std::memory_order_acquire);
+
+		if(seq != (idx + 1)) {
+			continue;
+		}
+
+		const char *name = e.name.load(std::memory_order_relaxed);
+		const char *argName = e.argName.load(std::memory_order_relaxed);
+		int64_t arg = e.arg.load(std::memory_order_relaxed);
+		uint32_t tid = e.tid.load(std::memory_order_relaxed);
+		uint64_t start = e.start.load(std::memory_order_relaxed);
+		uint64_t duration = e.duration.load(std::memory_order_relaxed);
+
+		// skip the span if it was overwritten while we read it
+		std::atomic_thread_fence(std::memory_order_acquire);
+
+		if(e.seq.load(std::memory_order_relaxed) != seq) {
+			continue;
+		}
+
+		json event = {
+			{"name", name},
+			{"cat", "lichtenstein"},
+			{"ph", "X"},
+			{"pid", pid},
+			{"tid", tid},
+			{"ts", double(start) / 1000.},
+			{"dur", double(duration) / 1000.}
+		};
+
+		if(argName) {
+			event["args"] = {{argName, arg}};
+		}
+
+		events.push_back(event);
+	}
+
+	return {{"traceEvents", events}, {"displayTimeUnit", "ms"}};
+}
@@ -0,0 +1,138 @@
+/**
+ * Records scoped spans of work in the frame pipeline, so that a frame that took
+ * too long can be pulled apart afterwards: the spans can be exported in the
+ * Chrome trace format, and opened in chrome://tracing or Perfetto.
+ *
+ * Spans are written into a fixed-size ring buffer, overwriting the oldest ones
+ * once it's full. Each slot is guarded by a sequence number, so writers never
+ * take a lock, and the exporter skips over slots that are being overwritten.
+ *
+ * While tracing is disabled, a span costs a single load of a flag; building
+ * without WITH_TRACING removes them altogether.
+ */
+#ifndef TRACER_H
+#define TRACER_H
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+#include <nlohmann/json.hpp>
+
+class Tracer {
+	public:
+		typedef std::chrono::steady_clock clock;
+
+	public:
+		static Tracer *shared(void);
+
+		void setCapacity(size_t capacity);
+
+		void start(void);
+		void stop(void);
+
+		/**
+		 * Whether spans are currently being recorded.
+		 */
+		static inline bool isEnabled(void) {
+			return enabled.load(std::memory_order_acquire);
+		}
+
+		void record(const char *name, const char *argName, int64_t arg,
+					clock::time_point start, clock::time_point end);
+
+		nlohmann::json exportChromeTrace(void);
+
+	private:
+		Tracer();
+
+		uint32_t threadId(void);
+
+	private:
+		struct Event {
+			/// index of the event plus one; zero while it's being written
+			std::atomic<uint64_t> seq{0};
+
+			std::atomic<const char *> name{nullptr};
+			std::atomic<const char *> argName{nullptr};
+			std::atomic<int64_t> arg{0};
+
+			std::atomic<uint32_t> tid{0};
+
+			/// relative to the tracer's epoch, in ns
+			std::atomic<uint64_t> start{0};
+			std::atomic<uint64_t> duration{0};
+		};
+
+		static std::atomic<bool> enabled;
+
+		/// number of events the buffer holds; rounded up to a power of two
+		size_t capacity = 65536;
+		/// the buffer is allocated when tracing is first started, and never freed
+		std::unique_ptr<Event[]> events;
+
+		/// index of the next event to be written
+		std::atomic<uint64_t> head{0};
+		/// index of the first event written since tracing was last started
+		uint64_t startIdx = 0;
+
+		clock::time_point epoch;
+
+		/// names of all threads that recorded spans, indexed by their id
+		std::vector<std::string> threadNames;
+
+		std::mutex lock;
+};
+
+/**
+ * Records the time between its construction and destruction as a span.
+ */
+class TraceSpan {
+	public:
+		TraceSpan(const char *name, const char *argName = nullptr, int64_t arg = 0) {
+			if(Tracer::isEnabled()) {
+				this->name = name;
+				this->argName = argName;
+				this->arg = arg;
+
+				this->start = Tracer::clock::now();
+			}
+		}
+
+		~TraceSpan() {
+			if(this->name) {
+				Tracer::shared()->record(this->name, this->argName, this->arg,
+										 this->start, Tracer::clock::now());
+			}
+		}
+
+		TraceSpan(const TraceSpan &) = delete;
+		TraceSpan &operator=(const TraceSpan &) = delete;
+
+	private:
+		const char *name = nullptr;
+		const char *argName = nullptr;
+		int64_t arg = 0;
+
+		Tracer::clock::time_point start;
+};
+
+#define TRACE_CONCAT_INNER(a, b) a ## b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+
+#ifdef WITH_TRACING
+/// traces the rest of the enclosing scope; the name must be a string literal
+#define TRACE_SCOPE(name) TraceSpan TRACE_CONCAT(_traceSpan, __LINE__)(name)
+/// same as TRACE_SCOPE, but also records an integer argument
+#define TRACE_SCOPE_ARG(name, argName, arg) TraceSpan TRACE_CONCAT(_traceSpan, __LINE__)(name, argName, arg)
+#else
+#define TRACE_SCOPE(name)
+#define TRACE_SCOPE_ARG(name, argName, arg)
+#endif
+
+#endif
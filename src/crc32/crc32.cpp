@@ -7,7 +7,7 @@
 //
 
 // this code has been modified from the original by removing all CRC routines
-// besides crc32_16bytes.
+// besides crc32_16bytes. hardware accelerated routines are in crc32_hw.cpp.
 
 
 #include "crc32.h"
@@ -36,8 +36,8 @@
 #endif
 
 
-/// zlib's CRC32 polynomial
-const uint32_t Polynomial = 0x04C11DB7;
+/// zlib's CRC32 polynomial (bit reversed, since all algorithms here process the LSB first)
+const uint32_t Polynomial = 0xEDB88320;
 
 /// swap endianess
 static inline uint32_t swap(uint32_t x)
@@ -241,11 +241,69 @@ uint32_t crc32_1byte(const void* data, size_t length, uint32_t previousCrc32)
 }
 
 
+/// an implementation that crc32_fast can use
+struct Crc32Implementation {
+	const char *name;
+	uint32_t (*function)(const void* data, size_t length, uint32_t previousCrc32);
+};
+
+/**
+ * Picks the fastest implementation supported by this CPU. Hardware implementations
+ * are only used if they agree with the table-based code on a test buffer, since
+ * the nodes need to compute the exact same checksum.
+ */
+static Crc32Implementation crc32_select(void) {
+	// software fallback
+	Crc32Implementation best = {"slicing-by-16", crc32_16bytes};
+
+	Crc32Implementation candidates[] = {
+		{"pclmulqdq", crc32_pclmul_supported() ? crc32_pclmul : nullptr},
+		{"armv8-crc32", crc32_armv8_supported() ? crc32_armv8 : nullptr},
+	};
+
+	// test buffer and lengths that exercise the bulk and tail paths
+	uint8_t test[1021];
+	for(size_t i = 0; i < sizeof(test); i++) {
+		test[i] = uint8_t((i * 2654435761u) >> 24);
+	}
+
+	static const size_t lengths[] = {0, 1, 15, 63, 64, 65, 127, 200, 1000, sizeof(test)};
+
+	for(const Crc32Implementation &candidate : candidates) {
+		if(candidate.function == nullptr) {
+			continue;
+		}
+
+		bool matches = true;
+
+		for(size_t length : lengths) {
+			if(candidate.function(test, length, 0) != crc32_1byte(test, length, 0)) {
+				matches = false;
+			}
+		}
+
+		if(matches) {
+			return candidate;
+		}
+	}
+
+	return best;
+}
+
+/// returns the implementation that crc32_fast uses; it is selected on first use
+static const Crc32Implementation &crc32_implementation(void) {
+	static const Crc32Implementation impl = crc32_select();
+	return impl;
+}
+
 /// compute CRC32 using the fastest algorithm for large datasets on modern CPUs
 uint32_t crc32_fast(const void* data, size_t length, uint32_t previousCrc32) {
-	// return crc32_16bytes(data, length, previousCrc32);
-	// return crc32_16bytes_prefetch(data, length, previousCrc32);
-	return crc32_1byte(data, length, previousCrc32);
+	return crc32_implementation().function(data, length, previousCrc32);
+}
+
+/// returns the name of the algorithm used by crc32_fast
+const char *crc32_fast_name(void) {
+	return crc32_implementation().name;
 }
 
 
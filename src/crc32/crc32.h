@@ -11,7 +11,7 @@
 // size_t
 #include <stddef.h>
 
-// crc32_fast selects the fastest algorithm depending on flags (CRC32_USE_LOOKUP_...)
+// crc32_fast selects the fastest algorithm supported by the CPU at runtime
 /// compute CRC32 using the fastest algorithm for large datasets on modern CPUs
 uint32_t crc32_fast(const void* data, size_t length, uint32_t previousCrc32 = 0);
 
@@ -25,3 +25,16 @@ uint32_t crc32_1byte(const void* data, size_t length, uint32_t previousCrc32);
 uint32_t crc32_16bytes (const void* data, size_t length, uint32_t previousCrc32 = 0);
 /// compute CRC32 (Slicing-by-16 algorithm, prefetch upcoming data blocks)
 uint32_t crc32_16bytes_prefetch(const void* data, size_t length, uint32_t previousCrc32 = 0, size_t prefetchAhead = 256);
+
+/// compute CRC32 by folding with carry-less multiplication (x86 with PCLMULQDQ only)
+uint32_t crc32_pclmul(const void* data, size_t length, uint32_t previousCrc32 = 0);
+/// whether this CPU supports crc32_pclmul
+bool crc32_pclmul_supported(void);
+
+/// compute CRC32 with the ARMv8 CRC32 instructions
+uint32_t crc32_armv8(const void* data, size_t length, uint32_t previousCrc32 = 0);
+/// whether this CPU supports crc32_armv8
+bool crc32_armv8_supported(void);
+
+/// returns the name of the algorithm used by crc32_fast
+const char *crc32_fast_name(void);
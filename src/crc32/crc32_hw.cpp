@@ -0,0 +1,218 @@
+/**
+ * Hardware accelerated CRC32 routines. These compute the same checksum as the
+ * table-based code in crc32.cpp (zlib's CRC32) and are selected at runtime by
+ * crc32_fast, based on what the CPU supports.
+ *
+ * On x86, the data is folded 64 bytes at a time with carry-less multiplication
+ * (PCLMULQDQ) and then reduced with a Barrett reduction, as described in Intel's
+ * "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction".
+ *
+ * On ARMv8, the dedicated CRC32 instructions already use zlib's polynomial. (The
+ * SSE4.2 crc32 instruction does not; it computes CRC32C.)
+ */
+#include "crc32.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+	#define CRC32_HAVE_PCLMUL 1
+
+	#include <immintrin.h>
+	#include <cpuid.h>
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+	#define CRC32_HAVE_ARMV8 1
+
+	#include <arm_acle.h>
+	#include <string.h>
+
+	#ifdef __linux__
+		#include <sys/auxv.h>
+		#include <asm/hwcap.h>
+	#endif
+#endif
+
+#pragma mark - PCLMULQDQ
+#ifdef CRC32_HAVE_PCLMUL
+/**
+ * Folding constants for the reflected CRC32 polynomial. Each is x^n mod P for the
+ * distance that is folded across, bit reflected and shifted left by one.
+ */
+/// fold across 512 bits (64 byte blocks)
+static const uint64_t kFold512Lo = 0x154442bd4, kFold512Hi = 0x1c6e41596;
+/// fold across 128 bits (16 byte blocks)
+static const uint64_t kFold128Lo = 0x1751997d0, kFold128Hi = 0x0ccaa009e;
+/// fold 64 bits down to 32
+static const uint64_t kFold64 = 0x163cd6124;
+/// polynomial and Barrett constant (floor(x^64 / P)), both reflected
+static const uint64_t kPolynomial = 0x1db710641, kBarrett = 0x1f7011641;
+
+/**
+ * Runs the CRC over a buffer whose length is a multiple of 16, and at least 64.
+ * The CRC is not inverted on input or output.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul_fold(uint32_t crc, const uint8_t *data, size_t length) {
+	const __m128i *current = reinterpret_cast<const __m128i *>(data);
+
+	// load the first 64 bytes, and mix in the CRC so far
+	__m128i x1 = _mm_loadu_si128(current + 0);
+	__m128i x2 = _mm_loadu_si128(current + 1);
+	__m128i x3 = _mm_loadu_si128(current + 2);
+	__m128i x4 = _mm_loadu_si128(current + 3);
+
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+
+	current += 4;
+	length -= 64;
+
+	// fold 64 bytes at a time into the four accumulators
+	__m128i k = _mm_set_epi64x(kFold512Hi, kFold512Lo);
+
+	while(length >= 64) {
+		__m128i t1 = _mm_clmulepi64_si128(x1, k, 0x11);
+		__m128i t2 = _mm_clmulepi64_si128(x2, k, 0x11);
+		__m128i t3 = _mm_clmulepi64_si128(x3, k, 0x11);
+		__m128i t4 = _mm_clmulepi64_si128(x4, k, 0x11);
+
+		x1 = _mm_clmulepi64_si128(x1, k, 0x00);
+		x2 = _mm_clmulepi64_si128(x2, k, 0x00);
+		x3 = _mm_clmulepi64_si128(x3, k, 0x00);
+		x4 = _mm_clmulepi64_si128(x4, k, 0x00);
+
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, t1), _mm_loadu_si128(current + 0));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, t2), _mm_loadu_si128(current + 1));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, t3), _mm_loadu_si128(current + 2));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, t4), _mm_loadu_si128(current + 3));
+
+		current += 4;
+		length -= 64;
+	}
+
+	// fold the accumulators into a single one
+	k = _mm_set_epi64x(kFold128Hi, kFold128Lo);
+
+	__m128i t = _mm_clmulepi64_si128(x1, k, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k, 0x00), t), x2);
+
+	t = _mm_clmulepi64_si128(x1, k, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k, 0x00), t), x3);
+
+	t = _mm_clmulepi64_si128(x1, k, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k, 0x00), t), x4);
+
+	// fold in the remaining 16 byte blocks
+	while(length >= 16) {
+		t = _mm_clmulepi64_si128(x1, k, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k, 0x00), t), _mm_loadu_si128(current));
+
+		current++;
+		length -= 16;
+	}
+
+	// fold 128 bits down to 64 (this also appends 32 zero bits)
+	const __m128i mask32 = _mm_set_epi32(0, 0, 0, ~0);
+
+	t = _mm_clmulepi64_si128(x1, k, 0x10);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), t);
+
+	// then down to 32 bits
+	k = _mm_set_epi64x(0, kFold64);
+
+	t = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k, 0x00);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 4), t);
+
+	// Barrett reduction to get the final 32 bit CRC
+	k = _mm_set_epi64x(kBarrett, kPolynomial);
+
+	t = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k, 0x10);
+	t = _mm_clmulepi64_si128(_mm_and_si128(t, mask32), k, 0x00);
+	x1 = _mm_xor_si128(x1, t);
+
+	return uint32_t(_mm_extract_epi32(x1, 1));
+}
+
+/// compute CRC32 by folding with carry-less multiplication (x86 with PCLMULQDQ only)
+uint32_t crc32_pclmul(const void* data, size_t length, uint32_t previousCrc32) {
+	const uint8_t *current = static_cast<const uint8_t *>(data);
+
+	// short buffers are faster with the tables
+	if(length < 64) {
+		return crc32_16bytes(data, length, previousCrc32);
+	}
+
+	// fold all complete 16 byte blocks, then do the rest with the tables
+	size_t folded = (length & ~size_t(15));
+
+	uint32_t crc = crc32_pclmul_fold(~previousCrc32, current, folded);
+	return crc32_16bytes(current + folded, (length - folded), ~crc);
+}
+
+/// whether this CPU supports crc32_pclmul
+bool crc32_pclmul_supported(void) {
+	unsigned int eax, ebx, ecx, edx;
+
+	if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+		return false;
+	}
+
+	return (ecx & bit_PCLMUL) && (ecx & bit_SSE4_1);
+}
+#else
+/// compute CRC32 by folding with carry-less multiplication (x86 with PCLMULQDQ only)
+uint32_t crc32_pclmul(const void* data, size_t length, uint32_t previousCrc32) {
+	return crc32_16bytes(data, length, previousCrc32);
+}
+
+/// whether this CPU supports crc32_pclmul
+bool crc32_pclmul_supported(void) {
+	return false;
+}
+#endif
+
+#pragma mark - ARMv8 CRC32
+#ifdef CRC32_HAVE_ARMV8
+/// compute CRC32 with the ARMv8 CRC32 instructions
+uint32_t crc32_armv8(const void* data, size_t length, uint32_t previousCrc32) {
+	uint32_t crc = ~previousCrc32;
+	const uint8_t *current = static_cast<const uint8_t *>(data);
+
+	// process 8 bytes at a time, then the remaining bytes
+	while(length >= 8) {
+		uint64_t value;
+		memcpy(&value, current, sizeof(value));
+
+		crc = __crc32d(crc, value);
+
+		current += 8;
+		length -= 8;
+	}
+
+	while(length-- != 0) {
+		crc = __crc32b(crc, *current++);
+	}
+
+	return ~crc;
+}
+
+/// whether this CPU supports crc32_armv8
+bool crc32_armv8_supported(void) {
+#if defined(__APPLE__)
+	// all Apple ARM CPUs support the CRC32 instructions
+	return true;
+#elif defined(__linux__)
+	return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+#else
+	return false;
+#endif
+}
+#else
+/// compute CRC32 with the ARMv8 CRC32 instructions
+uint32_t crc32_armv8(const void* data, size_t length, uint32_t previousCrc32) {
+	return crc32_16bytes(data, length, previousCrc32);
+}
+
+/// whether this CPU supports crc32_armv8
+bool crc32_armv8_supported(void) {
+	return false;
+}
+#endif
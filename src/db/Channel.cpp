@@ -6,18 +6,26 @@
 
 #include <vector>
 #include <iostream>
+#include <algorithm>
 
 #include <nlohmann/json.hpp>
 
 
 #pragma mark - Public Query Interface
 /**
- * Returns all channels in the datastore in a vector.
+ * Returns all channels in the datastore in a vector. Once all channels have been
+ * loaded, this doesn't hit the database anymore.
  */
 std::vector<DbChannel *> DataStore::getAllChannels() {
 	int err = 0, result, count;
 	sqlite3_stmt *statement = nullptr;
 
+	std::lock_guard<std::recursive_mutex> lk(this->cacheLock);
+
+	if(this->channelCache.allValid) {
+		return this->channelCache.all;
+	}
+
 	std::vector<DbChannel *> groups;
 
 	// execute the query
@@ -26,15 +34,16 @@ std::vector<DbChannel *> DataStore::getAllChannels() {
 
 	// execute the query
 	while((result = this->sqlStep(statement)) == SQLITE_ROW) {
-		// create the group, populate it, and add it to the vector
-		DbChannel *group = new DbChannel(statement, this);
-
-		groups.push_back(group);
+		// find (or create) the channel and add it to the vector
+		groups.push_back(this->_channelFromRow(statement));
 	}
 
 	// free our statement
 	this->sqlFinalize(statement);
 
+	this->channelCache.all = groups;
+	this->channelCache.allValid = true;
+
 	return groups;
 }
 
@@ -48,6 +57,8 @@ std::vector<DbChannel *> DataStore::getChannelsForNode(DbNode *node) {
 
 	std::vector<DbChannel *> channels;
 
+	std::lock_guard<std::recursive_mutex> lk(this->cacheLock);
+
 	// execute the query
 	err = this->sqlPrepare("SELECT * FROM channels WHERE node = :nodeId;", &statement);
 	CHECK(err == SQLITE_OK) << "Couldn't prepare statement: " << sqlite3_errstr(err);
@@ -58,10 +69,8 @@ std::vector<DbChannel *> DataStore::getChannelsForNode(DbNode *node) {
 
 	// execute the query
 	while((result = this->sqlStep(statement)) == SQLITE_ROW) {
-		// create the channel, populate it, and add it to the vector
-		DbChannel *channel = new DbChannel(statement, this, node);
-
-		channels.push_back(channel);
+		// find (or create) the channel and add it to the vector
+		channels.push_back(this->_channelFromRow(statement, node));
 	}
 
 	// free our statement
@@ -83,15 +92,21 @@ DbChannel *DataStore::findChannelWithId(int id) {
 		return nullptr;
 	}
 
+	// is the channel cached?
+	std::lock_guard<std::recursive_mutex> lk(this->cacheLock);
+
+	DbChannel *group = this->channelCache.find(id);
+
+	if(group != nullptr) {
+		return group;
+	}
+
 	// check whether the channel exists
 /*	if(DbChannel::_idExists(id, this) == false) {
 		return nullptr;
 	}
 */
 
-	// allocate the object for later
-	DbChannel *group = nullptr;
-
 	// it exists, so we must now get it from the db
 	err = this->sqlPrepare("SELECT * FROM channels WHERE id = :id;", &statement);
 	CHECK(err == SQLITE_OK) << "Couldn't prepare statement: " << sqlite3_errstr(err);
@@ -105,7 +120,7 @@ DbChannel *DataStore::findChannelWithId(int id) {
 
 	if(result == SQLITE_ROW) {
 		// populate the group object
-		group = new DbChannel(statement, this);
+		group = this->_channelFromRow(statement);
 	}
 
 	// free our statement
@@ -118,17 +133,81 @@ DbChannel *DataStore::findChannelWithId(int id) {
 /**
  * Updates the specified channel. If a channel with this id already exists (as
  * would be expected if it was previously fetched from the database) the
- * existing channel is updated. Otherwise, a new channel is created.
+ * existing channel is updated, and a copy passed in replaces the cached
+ * channel. Otherwise, a new channel is created. Either way, the data store takes
+ * ownership of it.
+ *
+ * If the channel was moved to a different node, or replaced, the nodes' lists of
+ * channels are updated as well.
  */
 void DataStore::update(DbChannel *channel) {
+	std::lock_guard<std::recursive_mutex> lk(this->cacheLock);
+
+	int oldNodeId = channel->nodeId;
+	DbChannel *previous = nullptr;
+
 	// does the group exist?
 	if(channel->id != 0) {
 		// it does, so we can just update it
 		channel->_update(this);
+
+		previous = this->channelCache.find(channel->id);
+		this->channelCache.replace(channel->id, channel);
 	} else {
 		// it doesn't, so we need to create it
 		channel->_create(this);
+		this->channelCache.insert(channel->id, channel);
+
+		oldNodeId = -1;
 	}
+
+	// binding the channel updated its node id; did the node change?
+	if(channel->nodeId != oldNodeId || previous != channel) {
+		DbNode *oldNode = this->nodeCache.find(oldNodeId);
+
+		if(oldNode != nullptr) {
+			auto &list = oldNode->channels;
+			list.erase(std::remove(list.begin(), list.end(), previous), list.end());
+			list.erase(std::remove(list.begin(), list.end(), channel), list.end());
+		}
+
+		if(channel->node != nullptr) {
+			auto &list = channel->node->channels;
+
+			if(std::find(list.begin(), list.end(), channel) == list.end()) {
+				list.push_back(channel);
+			}
+		}
+	}
+}
+
+/**
+ * Returns the channels that were replaced by update() since the last call.
+ * These are freed once the returned pointers are released.
+ */
+std::vector<std::shared_ptr<DbChannel>> DataStore::takeReplacedChannels() {
+	std::lock_guard<std::recursive_mutex> lk(this->cacheLock);
+	return this->channelCache.takeReplaced();
+}
+
+#pragma mark - Cache
+/**
+ * Returns the cached channel for the row a statement is currently returning,
+ * creating it from the row if it isn't cached yet.
+ *
+ * @note Creating a channel loads its node, which in turn loads all of the node's
+ * channels; this may include the channel we're creating. In that case, the
+ * channel created by the node is used.
+ */
+DbChannel *DataStore::_channelFromRow(sqlite3_stmt *statement, DbNode *node) {
+	DbChannel *channel = this->channelCache.find(this->_idFromRow(statement));
+
+	if(channel == nullptr) {
+		channel = new DbChannel(statement, this, node);
+		channel = this->channelCache.insert(channel->id, channel);
+	}
+
+	return channel;
 }
 
 #pragma mark - Private Query Interface
@@ -54,7 +54,7 @@ class DbChannel {
     /**
      * Returns the id
      */
-    inline int getId(void) {
+    inline int getId(void) const {
       return this->id;
     }
 
@@ -6,6 +6,8 @@
 
 #include <glog/logging.h>
 
+#include <algorithm>
+
 using json = nlohmann::json;
 
 /**
@@ -90,6 +92,12 @@ DataStore::DataStore(INIReader *reader) {
 	this->path = this->config->Get("db", "path", "");
 	this->useDbLock = this->config->GetBoolean("db", "serializeAccess", false);
 
+	// how long node updates may be held back
+	long interval = this->config->GetInteger("db", "writeBehindInterval", 1000);
+	CHECK(interval >= 0) << "Invalid write-behind interval " << interval << "; check db.writeBehindInterval";
+
+	this->writeBehindInterval = std::chrono::milliseconds(interval);
+
 	// open the db
 	this->open();
 }
@@ -102,8 +110,9 @@ DataStore::DataStore(INIReader *reader) {
  * @note No further access to the database is possible after this point.
  */
 DataStore::~DataStore() {
-	// kill the checkpoint thread
+	// kill the checkpoint thread, then write anything it didn't get to
 	this->terminateCheckpointThread();
+	this->flushPendingWrites();
 
 	// close the database
 	this->commit();
@@ -133,14 +142,42 @@ int DataStore::sqlExec(const char *sql, char **errmsg) {
  * A thin wrapper around sqlite3_prepare_v2; passes the current DB instance, the
  * given SQL, and a pointer to an sqlite statement. Returns the error code of
  * the sqlite3_prepare_v2 function.
+ *
+ * Statements are cached by their SQL for as long as the database is open; if
+ * the statement for this SQL was prepared before, it's reused. If it's still in
+ * use (for example, a query that runs while iterating over the results of the
+ * same query) a new statement is prepared that isn't cached.
  */
 int DataStore::sqlPrepare(const char *sql, sqlite3_stmt **stmt) {
 	int err = 0;
 
+	// is there a cached statement that's not in use?
+	std::unique_lock<std::mutex> statementsLk(this->statementsLock);
+
+	auto it = this->statements.find(sql);
+
+	if(it != this->statements.end() && !it->second.inUse) {
+		it->second.inUse = true;
+		*stmt = it->second.statement;
+
+		return SQLITE_OK;
+	}
+
+	bool cache = (it == this->statements.end());
+
 	// prepare the query
 	LOCK_START();
 	err = sqlite3_prepare_v2(this->db, sql, -1, stmt, 0);
 
+	// keep it around for next time
+	if(err == SQLITE_OK && cache) {
+		auto &cached = this->statements[sql];
+		cached.statement = *stmt;
+		cached.inUse = true;
+
+		this->statementsByHandle[*stmt] = &cached;
+	}
+
 
 	if(err != SQLITE_OK) {
 		VLOG(2) << "Created statement " << std::hex << *stmt << std::dec << " with SQL `"
@@ -258,11 +295,28 @@ int DataStore::sqlStep(sqlite3_stmt *stmt) {
 }
 
 /**
- * Finalizes/closes a previously created statement.
+ * Finalizes/closes a previously created statement. Cached statements are instead
+ * reset, and their bindings cleared, so they can be used again.
  */
 int DataStore::sqlFinalize(sqlite3_stmt *stmt) {
 	int result = 0;
 
+	std::unique_lock<std::mutex> statementsLk(this->statementsLock);
+
+	auto it = this->statementsByHandle.find(stmt);
+
+	if(it != this->statementsByHandle.end()) {
+		LOCK_START();
+		result = sqlite3_reset(stmt);
+		sqlite3_clear_bindings(stmt);
+		LOCK_END();
+
+		it->second->inUse = false;
+		return result;
+	}
+
+	statementsLk.unlock();
+
 	LOCK_START();
 	result = sqlite3_finalize(stmt);
 
@@ -369,6 +423,23 @@ std::string DataStore::sqlColumnName(sqlite3_stmt *statement, int index) {
 	return nameStr;
 }
 
+#pragma mark - Object Cache
+/**
+ * Returns the value of the id column of the row a statement is currently
+ * returning, or 0 if there is no such column.
+ */
+int DataStore::_idFromRow(sqlite3_stmt *statement) {
+	int numColumns = this->sqlGetNumColumns(statement);
+
+	for(int i = 0; i < numColumns; i++) {
+		if(this->sqlColumnName(statement, i) == "id") {
+			return this->sqlGetColumnInt(statement, i);
+		}
+	}
+
+	return 0;
+}
+
 #pragma mark - Background Checkpointing
 /**
  * Background checkpoint thread entry point
@@ -388,22 +459,29 @@ void BackgroundCheckpointThreadEntry(void *ctx) {
 
 /**
  * Checks whether the conditions for a checkpoint thread are met (WAL journal
- * mode and non-zero checkpoint interval)
+ * mode and non-zero checkpoint interval) and creates it. The thread is also
+ * created if pending writes are flushed in the background.
  */
 void DataStore::createCheckpointThread() {
 	// verify journal mode
   std::string journalMode = this->config->Get("db", "journal", "WAL");
 
 	if(journalMode != "WAL") {
-		VLOG(1) << "Not creating checkpoint thread: journal mode is " << journalMode;
-		return;
-	}
+		VLOG(1) << "Not checkpointing: journal mode is " << journalMode;
+	} else {
+		// verify duration
+		int duration = this->config->GetInteger("db", "checkpointInterval", 0);
 
-	// verify duration
-	int duration = this->config->GetInteger("db", "checkpointInterval", 0);
+		if(duration <= 0) {
+			VLOG(1) << "Not checkpointing: interval is " << duration;
+		} else {
+			this->checkpointInterval = duration;
+		}
+	}
 
-	if(duration <= 0) {
-		VLOG(1) << "Not creating checkpoint thread: interval is " << duration;
+	// is there anything for the thread to do?
+	if(this->checkpointInterval == 0 && this->writeBehindInterval.count() == 0) {
+		VLOG(1) << "Not creating checkpoint thread";
 		return;
 	}
 
@@ -412,27 +490,58 @@ void DataStore::createCheckpointThread() {
 }
 
 /**
- * Entry point for the checkpoint thread. This just sits in a loop sleeping
- * until the checkpoint interval has elapsed.
+ * Entry point for the checkpoint thread. This sits in a loop sleeping until
+ * either pending writes need to be flushed, or the checkpoint interval has
+ * elapsed.
  */
 void DataStore::_checkpointThreadEntry() {
-	int duration = this->config->GetInteger("db", "checkpointInterval", 0);
-	LOG(INFO) << "Performing background checkpoint every " << duration
-			  << " seconds";
+	using clock = std::chrono::steady_clock;
+
+	LOG_IF(INFO, this->checkpointInterval) << "Performing background checkpoint every "
+			<< this->checkpointInterval << " seconds";
+
+	auto nextCheckpoint = clock::now() + std::chrono::seconds(this->checkpointInterval);
+	auto nextFlush = clock::now() + this->writeBehindInterval;
+
+	std::unique_lock<std::mutex> lk(this->checkpointThreadLock);
+
+	while(this->checkpointThreadRun) {
+		// sleep until whichever comes first
+		auto wakeup = nextCheckpoint;
+
+		if(this->writeBehindInterval.count() != 0) {
+			wakeup = (this->checkpointInterval != 0) ? std::min(nextFlush, nextCheckpoint) : nextFlush;
+		}
+
+		this->checkpointThreadCv.wait_until(lk, wakeup);
+
+		if(!this->checkpointThreadRun) {
+			break;
+		}
 
-	// enter a while loop: not ideal, but we can just kill the thread off
-	while(1) {
-		std::this_thread::sleep_until(std::chrono::system_clock::now() + std::chrono::seconds(duration));
+		// do the work without holding the lock
+		auto now = clock::now();
+		lk.unlock();
 
-		LOG(INFO) << "Performing background checkpoint";
-		this->commit();
+		if(this->writeBehindInterval.count() != 0 && now >= nextFlush) {
+			this->flushPendingWrites();
+			nextFlush = now + this->writeBehindInterval;
+		}
+
+		if(this->checkpointInterval != 0 && now >= nextCheckpoint) {
+			LOG(INFO) << "Performing background checkpoint";
+			this->commit();
+
+			nextCheckpoint = now + std::chrono::seconds(this->checkpointInterval);
+		}
+
+		lk.lock();
 	}
 }
 
 /**
- * Brutally murders the checkpoint thread. We don't have a way to "wake" the
- * thread so we just get the native handle and kill it. Waiting for the
- * checkpoint lock prevents us from killing it in the middle of a checkpoint.
+ * Stops the checkpoint thread, and waits for it to finish any checkpoint or
+ * flush that it's in the middle of.
  */
 void DataStore::terminateCheckpointThread() {
 	// exit if there's no thread to kill
@@ -442,18 +551,66 @@ void DataStore::terminateCheckpointThread() {
 
 	LOG(INFO) << "Terminating checkpoint thread";
 
-	// get the checkpoint lock; this waits until any checkpoints are done
-	std::unique_lock<std::mutex> checkpointLk(this->checkpointLock);
+	{
+		std::lock_guard<std::mutex> lk(this->checkpointThreadLock);
+		this->checkpointThreadRun = false;
+	}
 
-	// platform-specific hax: get the pthread_t handle
-	pthread_cancel(this->checkpointThread->native_handle());
+	this->checkpointThreadCv.notify_all();
 	this->checkpointThread->join();
 
 	// delete thread
 	delete this->checkpointThread;
+	this->checkpointThread = nullptr;
+}
 
-	// we need to release the lock again or we'll deadlock later
-	checkpointLk.unlock();
+#pragma mark - Write-Behind
+/**
+ * Writes all pending node updates to the database in a single transaction.
+ */
+void DataStore::flushPendingWrites() {
+	int err = 0, result;
+	char *errStr = nullptr;
+	sqlite3_stmt *statement = nullptr;
+
+	// take the pending writes; new ones can be queued while we write these
+	std::unordered_map<int, PendingNodeWrite> writes;
+
+	{
+		std::lock_guard<std::mutex> lk(this->pendingWritesLock);
+		writes.swap(this->pendingNodeWrites);
+	}
+
+	if(writes.empty()) {
+		return;
+	}
+
+	VLOG(2) << "Flushing " << writes.size() << " pending node writes";
+
+	err = this->sqlExec("BEGIN TRANSACTION;", &errStr);
+	CHECK(err == SQLITE_OK) << "Couldn't begin transaction: " << errStr;
+
+	for(auto const& [id, write] : writes) {
+		err = this->sqlPrepare("UPDATE nodes SET ip = :ip, lastSeen = :lastseen WHERE id = :id;", &statement);
+		CHECK(err == SQLITE_OK) << "Couldn't prepare statement: " << sqlite3_errstr(err);
+
+		err = this->sqlBind(statement, ":ip", int(write.ip));
+		CHECK(err == SQLITE_OK) << "Couldn't bind node IP address: " << sqlite3_errstr(err);
+
+		err = this->sqlBind(statement, ":lastseen", int(write.lastSeen));
+		CHECK(err == SQLITE_OK) << "Couldn't bind node last seen timestamp: " << sqlite3_errstr(err);
+
+		err = this->sqlBind(statement, ":id", id);
+		CHECK(err == SQLITE_OK) << "Couldn't bind node id: " << sqlite3_errstr(err);
+
+		result = this->sqlStep(statement);
+		CHECK(result == SQLITE_DONE) << "Couldn't execute query: " << sqlite3_errstr(result);
+
+		this->sqlFinalize(statement);
+	}
+
+	err = this->sqlExec("COMMIT;", &errStr);
+	CHECK(err == SQLITE_OK) << "Couldn't commit transaction: " << errStr;
 }
 
 #pragma mark - Database I/O
@@ -587,6 +744,9 @@ void DataStore::close() {
 	// optimize the database before closing
 	this->optimize();
 
+	// cached statements would keep the database from closing
+	this->finalizeCachedStatements();
+
 	// attempt to close the db
 	LOCK_START();
 
@@ -597,6 +757,27 @@ void DataStore::close() {
 	LOCK_END();
 }
 
+/**
+ * Finalizes all cached statements. None of them may be in use.
+ */
+void DataStore::finalizeCachedStatements() {
+	std::lock_guard<std::mutex> statementsLk(this->statementsLock);
+
+	LOCK_START();
+
+	for(auto &[sql, cached] : this->statements) {
+		LOG_IF(ERROR, cached.inUse) << "Statement `" << sql << "` is still in use";
+		sqlite3_finalize(cached.statement);
+	}
+
+	LOCK_END();
+
+	VLOG(1) << "Finalized " << this->statements.size() << " cached statements";
+
+	this->statements.clear();
+	this->statementsByHandle.clear();
+}
+
 #pragma mark - Schema Version Management
 /**
  * Checks the version of the database schema, upgrading it if needed. If the
@@ -2,6 +2,18 @@
  * The data store is a simple database that's used to keep track of all state in
  * the server: the stored effect routines, available nodes, lighting groups, and
  * mapping the various sections of the framebuffer to output channels.
+ *
+ * Objects loaded from the database are cached: there is only ever one current
+ * object for a given id, which is owned by the data store. Pointers returned by
+ * the query functions stay valid for as long as the data store exists, and must
+ * not be deleted.
+ *
+ * Cached objects are shared between threads, so they aren't changed in place:
+ * to change an object, a modified copy of it is passed to update(), which writes
+ * it to the database and replaces the cached object with it. Anyone still
+ * holding the old object keeps seeing the old values until they fetch it again.
+ * The replaced objects are kept until they're taken (with takeReplacedGroups()
+ * and takeReplacedChannels()) by whoever knows when they're no longer in use.
  */
 #ifndef DATASTORE_H
 #define DATASTORE_H
@@ -10,8 +22,13 @@
 #include <vector>
 #include <iostream>
 #include <map>
+#include <unordered_map>
+#include <algorithm>
+#include <memory>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <chrono>
 
 #include <ctime>
 
@@ -74,6 +91,8 @@ class DataStore {
 
 		void update(DbChannel *channel);
 
+		std::vector<std::shared_ptr<DbChannel>> takeReplacedChannels();
+
 	// types and functions relating to routines
 	private:
 		friend class DbRoutine;
@@ -94,6 +113,8 @@ class DataStore {
 
 		void update(DbGroup *group);
 
+		std::vector<std::shared_ptr<DbGroup>> takeReplacedGroups();
+
 	// types and functions relating to nodes
 	private:
 		friend class DbNode;
@@ -104,6 +125,103 @@ class DataStore {
 		DbNode *findNodeWithId(int id);
 
 		void update(DbNode *node);
+		void updateNodeSeen(DbNode *node);
+
+	// object cache
+	private:
+		/**
+		 * All objects of one type that have been loaded from the database, keyed
+		 * by their id. The cache owns the objects.
+		 */
+		template<class T> class ObjectCache {
+			public:
+				/**
+				 * Returns the object with the given id, or nullptr if it isn't
+				 * cached.
+				 */
+				T *find(int id) const {
+					auto it = this->objects.find(id);
+					return (it != this->objects.end()) ? it->second.get() : nullptr;
+				}
+
+				/**
+				 * Adds an object to the cache, which takes ownership of it. If an
+				 * object with that id is already cached, the new one is deleted
+				 * and the cached one is returned.
+				 */
+				T *insert(int id, T *object) {
+					auto &slot = this->objects[id];
+
+					if(!slot) {
+						slot.reset(object);
+						this->allValid = false;
+					} else if(slot.get() != object) {
+						delete object;
+					}
+
+					return slot.get();
+				}
+
+				/**
+				 * Replaces the cached object with the given id by a new one, which
+				 * the cache takes ownership of. The old object is kept around
+				 * until it's taken with takeReplaced(), since it may still be in
+				 * use.
+				 */
+				void replace(int id, T *object) {
+					auto &slot = this->objects[id];
+
+					if(slot.get() == object) {
+						return;
+					}
+
+					if(slot) {
+						std::replace(this->all.begin(), this->all.end(), slot.get(), object);
+						this->replaced.push_back(slot);
+					} else {
+						this->allValid = false;
+					}
+
+					slot.reset(object);
+				}
+
+				/**
+				 * Returns all objects that were replaced since the last call. The
+				 * cache no longer holds on to them.
+				 */
+				std::vector<std::shared_ptr<T>> takeReplaced() {
+					std::vector<std::shared_ptr<T>> replaced;
+					replaced.swap(this->replaced);
+
+					return replaced;
+				}
+
+			public:
+				/// every object of this type, if all of them have been loaded
+				std::vector<T *> all;
+				bool allValid = false;
+
+			private:
+				std::unordered_map<int, std::shared_ptr<T>> objects;
+
+				/// objects that were replaced by a newer copy
+				std::vector<std::shared_ptr<T>> replaced;
+		};
+
+		int _idFromRow(sqlite3_stmt *statement);
+
+		DbChannel *_channelFromRow(sqlite3_stmt *statement, DbNode *node = nullptr);
+		DbRoutine *_routineFromRow(sqlite3_stmt *statement);
+		DbGroup *_groupFromRow(sqlite3_stmt *statement);
+		DbNode *_nodeFromRow(sqlite3_stmt *statement);
+
+		ObjectCache<DbChannel> channelCache;
+		ObjectCache<DbRoutine> routineCache;
+		ObjectCache<DbGroup> groupCache;
+		ObjectCache<DbNode> nodeCache;
+
+		/// protects the caches; recursive since loading an object may load others
+		std::recursive_mutex cacheLock;
 
 	private:
 		void open();
@@ -128,6 +246,48 @@ class DataStore {
 		std::thread *checkpointThread = nullptr;
 		std::mutex checkpointLock;
 
+		/// seconds between checkpoints; 0 if the thread doesn't checkpoint
+		int checkpointInterval = 0;
+
+		/// cleared to stop the background thread
+		bool checkpointThreadRun = true;
+		std::mutex checkpointThreadLock;
+		std::condition_variable checkpointThreadCv;
+
+	// write-behind of frequently changing node fields
+	private:
+		struct PendingNodeWrite {
+			uint32_t ip;
+			time_t lastSeen;
+		};
+
+		void flushPendingWrites();
+
+		/// how often pending writes are flushed; 0 to write them immediately
+		std::chrono::milliseconds writeBehindInterval;
+
+		/// pending writes, keyed by node id; later writes replace earlier ones
+		std::unordered_map<int, PendingNodeWrite> pendingNodeWrites;
+		std::mutex pendingWritesLock;
+
+	// prepared statement cache
+	private:
+		struct CachedStatement {
+			sqlite3_stmt *statement;
+
+			/// set while the statement is handed out
+			bool inUse;
+		};
+
+		void finalizeCachedStatements();
+
+		/// statements, keyed by their SQL
+		std::unordered_map<std::string, CachedStatement> statements;
+		/// cache entry of each cached statement, to find it when it's finalized
+		std::unordered_map<sqlite3_stmt *, CachedStatement *> statementsByHandle;
+
+		std::mutex statementsLock;
+
 	private:
 		int sqlExec(const char *sql, char **errmsg);
 		int sqlPrepare(const char *sql, sqlite3_stmt **stmt);
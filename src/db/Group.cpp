@@ -12,12 +12,19 @@
 
 #pragma mark - Public Query Interface
 /**
- * Returns all groups in the datastore in a vector.
+ * Returns all groups in the datastore in a vector. Once all groups have been
+ * loaded, this doesn't hit the database anymore.
  */
 std::vector<DbGroup *> DataStore::getAllGroups() {
 	int err = 0, result, count;
 	sqlite3_stmt *statement = nullptr;
 
+	std::lock_guard<std::recursive_mutex> lk(this->cacheLock);
+
+	if(this->groupCache.allValid) {
+		return this->groupCache.all;
+	}
+
 	std::vector<DbGroup *> groups;
 
 	// execute the query
@@ -26,15 +33,16 @@ std::vector<DbGroup *> DataStore::getAllGroups() {
 
 	// execute the query
 	while((result = this->sqlStep(statement)) == SQLITE_ROW) {
-		// create the group, populate it, and add it to the vector
-		DbGroup *group = new DbGroup(statement, this);
-
-		groups.push_back(group);
+		// find (or create) the group and add it to the vector
+		groups.push_back(this->_groupFromRow(statement));
 	}
 
 	// free our statement
 	this->sqlFinalize(statement);
 
+	this->groupCache.all = groups;
+	this->groupCache.allValid = true;
+
 	return groups;
 }
 
@@ -50,15 +58,21 @@ DbGroup *DataStore::findGroupWithId(int id) {
 		return nullptr;
 	}
 
+	// is the group cached?
+	std::lock_guard<std::recursive_mutex> lk(this->cacheLock);
+
+	DbGroup *group = this->groupCache.find(id);
+
+	if(group != nullptr) {
+		return group;
+	}
+
 	// check whether the group exists
 /*	if(DbGroup::_idExists(id, this) == false) {
 		return nullptr;
 	}
 */
 
-	// allocate the object for later
-	DbGroup *group = nullptr;
-
 	// it exists, so we must now get it from the db
 	err = this->sqlPrepare("SELECT * FROM groups WHERE id = :id;", &statement);
 	CHECK(err == SQLITE_OK) << "Couldn't prepare statement: " << sqlite3_errstr(err);
@@ -72,7 +86,7 @@ DbGroup *DataStore::findGroupWithId(int id) {
 
 	if(result == SQLITE_ROW) {
 		// populate the group object
-		group = new DbGroup(statement, this);
+		group = this->_groupFromRow(statement);
 	}
 
 	// free our statement
@@ -85,19 +99,49 @@ DbGroup *DataStore::findGroupWithId(int id) {
 /**
  * Updates the specified group. If a group with this id already exists (as would
  * be expected if it was previously fetched from the database) the existing
- * group is updated. Otherwise, a new group is created.
+ * group is updated, and a copy passed in replaces the cached group. Otherwise,
+ * a new group is created. Either way, the data store takes ownership of it.
  */
 void DataStore::update(DbGroup *group) {
+	std::lock_guard<std::recursive_mutex> lk(this->cacheLock);
+
 	// does the group exist?
 	if(group->id != 0) {
 		// it does, so we can just update it
 		group->_update(this);
+		this->groupCache.replace(group->id, group);
 	} else {
 		// it doesn't, so we need to create it
 		group->_create(this);
+		this->groupCache.insert(group->id, group);
 	}
 }
 
+/**
+ * Returns the groups that were replaced by update() since the last call. These
+ * are freed once the returned pointers are released.
+ */
+std::vector<std::shared_ptr<DbGroup>> DataStore::takeReplacedGroups() {
+	std::lock_guard<std::recursive_mutex> lk(this->cacheLock);
+	return this->groupCache.takeReplaced();
+}
+
+#pragma mark - Cache
+/**
+ * Returns the cached group for the row a statement is currently returning,
+ * creating it from the row if it isn't cached yet.
+ */
+DbGroup *DataStore::_groupFromRow(sqlite3_stmt *statement) {
+	DbGroup *group = this->groupCache.find(this->_idFromRow(statement));
+
+	if(group == nullptr) {
+		group = new DbGroup(statement, this);
+		group = this->groupCache.insert(group->id, group);
+	}
+
+	return group;
+}
+
 #pragma mark - Private Query Interface
 /**
  * Creates a new group in the database, then assigns the id value of the group
@@ -13,10 +13,12 @@
 
 #include <nlohmann/json.hpp>
 
+#include <memory>
+
 class DataStore;
 class DbRoutine;
 
-class DbGroup {
+class DbGroup : public std::enable_shared_from_this<DbGroup> {
 	// allow access to id field by command server for JSON serialization
 	friend class DataStore;
 	friend class CommandServer;
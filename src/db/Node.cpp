@@ -10,12 +10,19 @@
 
 #pragma mark - Public Query Interface
 /**
- * Returns all nodes in the datastore in a vector.
+ * Returns all nodes in the datastore in a vector. Once all nodes have been
+ * loaded, this doesn't hit the database anymore.
  */
 std::vector<DbNode *> DataStore::getAllNodes() {
 	int err = 0, result, count;
 	sqlite3_stmt *statement = nullptr;
 
+	std::lock_guard<std::recursive_mutex> lk(this->cacheLock);
+
+	if(this->nodeCache.allValid) {
+		return this->nodeCache.all;
+	}
+
 	std::vector<DbNode *> nodes;
 
 	// execute the query
@@ -24,15 +31,16 @@ std::vector<DbNode *> DataStore::getAllNodes() {
 
 	// execute the query
 	while((result = this->sqlStep(statement)) == SQLITE_ROW) {
-		// create the node, populate it, and add it to the vector
-		DbNode *node = new DbNode(statement, this);
-
-		nodes.push_back(node);
+		// find (or create) the node and add it to the vector
+		nodes.push_back(this->_nodeFromRow(statement));
 	}
 
 	// free our statement
 	this->sqlFinalize(statement);
 
+	this->nodeCache.all = nodes;
+	this->nodeCache.allValid = true;
+
 	return nodes;
 }
 
@@ -40,13 +48,15 @@ std::vector<DbNode *> DataStore::getAllNodes() {
  * Finds a node with the given MAC address. Returns a pointer to a Node object
  * if it exists, or nullptr if not.
  *
- * @note The caller is responsible for deleting the returned object when it is
- * no longer needed.
+ * @note Nodes aren't cached by MAC address, so this always queries the database;
+ * if the node was loaded before, that same object is returned.
  */
 DbNode *DataStore::findNodeWithMac(uint8_t macIn[6]) {
 	int err = 0, result, count;
 	sqlite3_stmt *statement = nullptr;
 
+	std::lock_guard<std::recursive_mutex> lk(this->cacheLock);
+
 	// check whether the node exists
 /*	if(DbNode::_macExists(macIn, this) == false) {
 		return nullptr;
@@ -69,7 +79,7 @@ DbNode *DataStore::findNodeWithMac(uint8_t macIn[6]) {
 
 	if(result == SQLITE_ROW) {
 		// populate the node object
-		node = new DbNode(statement, this);
+		node = this->_nodeFromRow(statement);
 	}
 
 	// free our statement
@@ -91,8 +101,14 @@ DbNode *DataStore::findNodeWithId(int id) {
 		return nullptr;
 	}
 
-	// allocate the object for later
-	DbNode *node = nullptr;
+	// is the node cached?
+	std::lock_guard<std::recursive_mutex> lk(this->cacheLock);
+
+	DbNode *node = this->nodeCache.find(id);
+
+	if(node != nullptr) {
+		return node;
+	}
 
 	// it exists, so we must now get it from the db
 	err = this->sqlPrepare("SELECT * FROM nodes WHERE id = :id;", &statement);
@@ -107,7 +123,7 @@ DbNode *DataStore::findNodeWithId(int id) {
 
 	if(result == SQLITE_ROW) {
 		// populate the group object
-		node = new DbNode(statement, this);
+		node = this->_nodeFromRow(statement);
 	}
 
 	// free our statement
@@ -119,9 +135,18 @@ DbNode *DataStore::findNodeWithId(int id) {
 
 /**
  * Updates a node in the database based off the data in the passed object. If
- * the node doesn't exist, it's created.
+ * the node doesn't exist, it's created, and the data store takes ownership of
+ * it.
  */
 void DataStore::update(DbNode *node) {
+	std::lock_guard<std::recursive_mutex> lk(this->cacheLock);
+
+	// this writes the current IP and last seen time, so drop any pending write
+	{
+		std::lock_guard<std::mutex> writesLk(this->pendingWritesLock);
+		this->pendingNodeWrites.erase(node->id);
+	}
+
 	// does the node exist?
 	// if(this->_nodeWithMacExists(node->macAddr)) {
 	if(node->id != 0) {
@@ -130,6 +155,7 @@ void DataStore::update(DbNode *node) {
 	} else {
 		// it doesn't, so we need to create it
 		node->_create(this);
+		this->nodeCache.insert(node->id, node);
 	}
 
 	// update each channel too
@@ -140,25 +166,52 @@ void DataStore::update(DbNode *node) {
 	}
 }
 
-#pragma mark - Constructor and Destructor
 /**
- * Creates a node, and also fetches the channels associated with it. We will
- * delete those channels later.
+ * Writes a node's IP address and last seen timestamp to the database. Unlike
+ * update(), this isn't done right away: the write is queued, coalesced with any
+ * other writes for the same node, and done on the background thread in a single
+ * transaction with the writes for all other nodes.
+ *
+ * Since there's only one instance of each node, the new values are visible to
+ * the rest of the server immediately.
  */
-DbNode::DbNode(sqlite3_stmt *statement, DataStore *db) {
-	this->_fromRow(statement, db);
+void DataStore::updateNodeSeen(DbNode *node) {
+	// new nodes must be created in the database first
+	if(node->id == 0 || this->writeBehindInterval.count() == 0) {
+		this->update(node);
+		return;
+	}
 
-	// also fetch the channels that go with this node
-	this->channels = db->getChannelsForNode(this);
+	std::lock_guard<std::mutex> lk(this->pendingWritesLock);
+	this->pendingNodeWrites[node->id] = {node->ip, node->lastSeen};
 }
 
+#pragma mark - Cache
 /**
- * When we're deallocated, also deallocate each of the channels.
+ * Returns the cached node for the row a statement is currently returning,
+ * creating it from the row if it isn't cached yet.
  */
-DbNode::~DbNode() {
-	for(auto channel : this->channels) {
-		delete channel;
+DbNode *DataStore::_nodeFromRow(sqlite3_stmt *statement) {
+	DbNode *node = this->nodeCache.find(this->_idFromRow(statement));
+
+	if(node == nullptr) {
+		node = new DbNode(statement, this);
+		node = this->nodeCache.insert(node->id, node);
 	}
+
+	return node;
+}
+
+#pragma mark - Constructor
+/**
+ * Creates a node, and also fetches the channels associated with it. Like the
+ * node, they're owned by the data store.
+ */
+DbNode::DbNode(sqlite3_stmt *statement, DataStore *db) {
+	this->_fromRow(statement, db);
+
+	// also fetch the channels that go with this node
+	this->channels = db->getChannelsForNode(this);
 }
 
 #pragma mark - Private Query Interface
@@ -20,6 +20,8 @@ class DbNode {
 	friend class CommandServer;
 
 	friend class DbChannel;
+	// and by the protocol handler to keep per-node statistics
+	friend class ProtocolHandler;
 
 	public:
 		friend void to_json(nlohmann::json& j, const DbNode& n);
@@ -57,7 +59,6 @@ class DbNode {
 	public:
 		// Node() = delete;
 		DbNode() {}
-		~DbNode();
 
 		/// converts a MAC address to a string
 		static const std::string macToString(const uint8_t macIn[6]);
@@ -13,12 +13,19 @@ using json = nlohmann::json;
 
 #pragma mark - Public Query Interface
 /**
- * Returns all routines in the datastore in a vector.
+ * Returns all routines in the datastore in a vector. Once all routines have been
+ * loaded, this doesn't hit the database anymore.
  */
 std::vector<DbRoutine *> DataStore::getAllRoutines() {
 	int err = 0, result, count;
 	sqlite3_stmt *statement = nullptr;
 
+	std::lock_guard<std::recursive_mutex> lk(this->cacheLock);
+
+	if(this->routineCache.allValid) {
+		return this->routineCache.all;
+	}
+
 	std::vector<DbRoutine *> routines;
 
 	// execute the query
@@ -27,15 +34,16 @@ std::vector<DbRoutine *> DataStore::getAllRoutines() {
 
 	// execute the query
 	while((result = this->sqlStep(statement)) == SQLITE_ROW) {
-		// create the routine, populate it, and add it to the vector
-		DbRoutine *routine = new DbRoutine(statement, this);
-
-		routines.push_back(routine);
+		// find (or create) the routine and add it to the vector
+		routines.push_back(this->_routineFromRow(statement));
 	}
 
 	// free our statement
 	this->sqlFinalize(statement);
 
+	this->routineCache.all = routines;
+	this->routineCache.allValid = true;
+
 	return routines;
 }
 
@@ -52,15 +60,21 @@ DbRoutine *DataStore::findRoutineWithId(int id) {
 		return nullptr;
 	}
 
+	// is the routine cached?
+	std::lock_guard<std::recursive_mutex> lk(this->cacheLock);
+
+	DbRoutine *routine = this->routineCache.find(id);
+
+	if(routine != nullptr) {
+		return routine;
+	}
+
 	// check whether the routine exists
 /*	if(DbRoutine::_idExists(id, this) == false) {
 		return nullptr;
 	}
 */
 
-	// allocate the object for later
-	DbRoutine *routine = nullptr;
-
 	// it exists, so we must now get it from the db
 	err = this->sqlPrepare("SELECT * FROM routines WHERE id = :id;", &statement);
 	CHECK(err == SQLITE_OK) << "Couldn't prepare statement: " << sqlite3_errstr(err);
@@ -73,7 +87,7 @@ DbRoutine *DataStore::findRoutineWithId(int id) {
 	result = this->sqlStep(statement);
 
 	if(result == SQLITE_ROW) {
-		routine = new DbRoutine(statement, this);
+		routine = this->_routineFromRow(statement);
 	}
 
 	// free our statement
@@ -86,9 +100,12 @@ DbRoutine *DataStore::findRoutineWithId(int id) {
 /**
  * Updates the specified routine. If a routine with this id already exists (as
  * expected if it was previously fetched from the database) the existing routine
- * is updated. Otherwise, a new routine is created.
+ * is updated. Otherwise, a new routine is created, and the data store takes
+ * ownership of it.
  */
 void DataStore::update(DbRoutine *routine) {
+	std::lock_guard<std::recursive_mutex> lk(this->cacheLock);
+
 	// convert the default properties back into a JSON object
 	routine->_encodeJSON();
 
@@ -99,7 +116,24 @@ void DataStore::update(DbRoutine *routine) {
 	} else {
 		// it doesn't, so we need to create it
 		routine->_create(this);
+		this->routineCache.insert(routine->id, routine);
+	}
+}
+
+#pragma mark - Cache
+/**
+ * Returns the cached routine for the row a statement is currently returning,
+ * creating it from the row if it isn't cached yet.
+ */
+DbRoutine *DataStore::_routineFromRow(sqlite3_stmt *statement) {
+	DbRoutine *routine = this->routineCache.find(this->_idFromRow(statement));
+
+	if(routine == nullptr) {
+		routine = new DbRoutine(statement, this);
+		routine = this->routineCache.insert(routine->id, routine);
 	}
+
+	return routine;
 }
 
 #pragma mark - Private Query Interface
@@ -40,7 +40,7 @@ class DbRoutine {
     /**
      * Returns the id
      */
-    inline int getId(void) {
+    inline int getId(void) const {
       return this->id;
     }
 
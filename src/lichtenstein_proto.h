@@ -55,6 +55,8 @@ typedef enum {
 	kOpcodeSystemSleep			= 10,
 	kOpcodeKeepalive			= 11,
 	kOpcodeNodeReconfig			= 12,
+	kOpcodeFramebufferDelta		= 13,
+	kOpcodeShardReady			= 14,
 } lichtenstein_header_opcode_t;
 
 /**
@@ -223,6 +225,38 @@ typedef struct {
 } lichtenstein_framebuffer_data_t;
 
 
+/**
+ * Header of a range of pixels in a framebuffer delta packet. It's immediately
+ * followed by the pixel data for that range, after which the next range starts.
+ *
+ * @note start and count are in terms of pixels, not bytes.
+ */
+typedef struct {
+	uint32_t start;
+	uint32_t count;
+
+	char data[];
+} lichtenstein_framebuffer_range_t;
+
+/**
+ * Framebuffer delta packet: instead of the entire framebuffer, only the ranges
+ * of pixels that changed since the previous frame are sent. Pixels outside of
+ * these ranges keep the value they had in the node's framebuffer.
+ *
+ * Ranges are sorted by their start pixel, and may not overlap.
+ */
+typedef struct {
+	lichtenstein_header_t header;
+
+	uint32_t destChannel;
+
+	uint32_t dataFormat;
+	uint32_t numRanges;
+
+	char data[];
+} lichtenstein_framebuffer_delta_t;
+
+
 /**
  * Sync output packet: When a node receives this packet, it will begin the
  * output of the previously received data. This is used to synchronize output
@@ -238,6 +272,25 @@ typedef struct {
 } lichtenstein_sync_output_t;
 
 
+/**
+ * Shard ready packet: When the server is split into multiple shards, each of
+ * the following shards multicasts this packet once all of its nodes acknowledged
+ * (or timed out on) a frame's data. The leading shard waits for them before it
+ * sends the sync output packet. Nodes ignore this packet.
+ *
+ * Frames are numbered by the wall clock, so they're the same on all shards; only
+ * the low 32 bits of the frame number are sent.
+ */
+typedef struct {
+	lichtenstein_header_t header;
+
+	uint32_t shard;
+	uint32_t numShards;
+
+	uint32_t frame;
+} lichtenstein_shard_ready_t;
+
+
 /**
  * Node reconfiguration: Sends a new configuration to the node. The values in
  * this packet are persisted into nonvolatile storage on the node.
@@ -21,6 +21,8 @@
 #include "EffectRunner.h"
 #include "Routine.h"
 
+#include "crc32/crc32.h"
+
 // when set to false, the server terminates
 std::atomic_bool keepRunning;
 
@@ -95,6 +97,8 @@ int main(int argc, char *argv[]) {
 	store = new DataStore(configReader);
 
 	// start the protocol parser (binary lichtenstein protocol)
+	LOG(INFO) << "Using " << crc32_fast_name() << " for packet checksums";
+
 	protocol = new ProtocolHandler(store, configReader);
 
 	// start the effect evaluator
@@ -146,7 +150,7 @@ int main(int argc, char *argv[]) {
 
 		// create the output group and add the mapping
 		OutputMapper::OutputGroup *g = new OutputMapper::OutputGroup(dbG);
-		Routine *r = new Routine(dbR);
+		Routine *r = new Routine(dbR, Routine::kLoadDeferred);
 
 		mapper->addMapping(g, r);
 	}
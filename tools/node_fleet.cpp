@@ -0,0 +1,537 @@
+/**
+ * Emulates a fleet of lichtenstein nodes in a single process, to load test the
+ * server with more nodes than are physically around.
+ *
+ * Each node gets its own address, counting up from the base address; by default,
+ * these are on the loopback interface (Linux routes all of 127/8 there.) Nodes
+ * announce themselves over multicast until they're adopted, then acknowledge
+ * the framebuffer writes sent to them after a configurable latency, and may
+ * drop some of them instead. Checksums and the layout of all received packets
+ * are validated, and the rates at which nodes received frames are printed
+ * regularly.
+ *
+ * When running on the same machine as the server, multicast needs to be enabled
+ * on the loopback interface (`ip link set lo multicast on`) for announcements
+ * to reach it, and the server should listen on a different address or port than
+ * the nodes. Sync packets are never seen here, since the server doesn't loop
+ * its multicast back. The addresses match those used by pipeline_bench, so the
+ * fleet can also acknowledge its writes.
+ *
+ * Build with -DBUILD_TOOLS=ON.
+ */
+#include "lichtenstein_proto.h"
+#include "LichtensteinUtils.h"
+
+#include <glog/logging.h>
+#include <gflags/gflags.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+DEFINE_int32(nodes, 16, "Number of nodes to emulate");
+DEFINE_int32(channels, 2, "Number of output channels on each node");
+DEFINE_int32(pixels, 300, "Number of pixels on each channel, for the framebuffer size");
+DEFINE_string(base, "127.0.2.1", "Address of the first node; the others count up from it");
+DEFINE_int32(port, 7420, "Port on which the nodes listen");
+DEFINE_string(group, "239.42.0.69", "Multicast group to announce nodes to");
+DEFINE_string(interface, "127.0.0.1", "Address of the interface to send announcements on");
+DEFINE_double(announce, 5, "Seconds between announcements of unadopted nodes; zero disables them");
+DEFINE_bool(adopted, false, "Whether nodes start out adopted, e.g. if they're already in the server's database");
+DEFINE_int32(latency, 500, "Mean time after which framebuffer writes are acknowledged, in µS");
+DEFINE_int32(jitter, 0, "Maximum deviation from the mean latency, in µS");
+DEFINE_double(loss, 0, "Fraction of framebuffer writes that aren't acknowledged");
+DEFINE_double(stats, 1, "Seconds between printing statistics");
+DEFINE_double(seconds, 0, "How long to run for; zero runs until killed");
+
+typedef std::chrono::steady_clock Clock;
+
+/**
+ * State of a single emulated node.
+ */
+struct Node {
+	int index;
+	int sock;
+
+	struct in_addr addr;
+	uint8_t mac[6];
+
+	bool adopted = false;
+
+	/// counters since the last statistics were printed
+	uint64_t frames = 0;
+	uint64_t bytes = 0;
+	uint64_t acked = 0;
+	uint64_t dropped = 0;
+	uint64_t invalid = 0;
+};
+
+/**
+ * An acknowledgement that's sent once it's due.
+ */
+struct PendingAck {
+	Clock::time_point due;
+
+	Node *node;
+	struct sockaddr_in to;
+
+	uint16_t opcode;
+	uint32_t txn;
+
+	bool operator<(const PendingAck &other) const {
+		// the priority queue returns the largest element first
+		return (this->due > other.due);
+	}
+};
+
+static std::vector<Node> nodes;
+
+static std::mutex ackLock;
+static std::condition_variable ackCv;
+static std::priority_queue<PendingAck> acks;
+
+static std::atomic_bool run(true);
+
+/**
+ * Creates the sockets for all nodes.
+ */
+static void createNodes(void) {
+	int err;
+	unsigned int yes = 1;
+
+	struct in_addr base;
+	err = inet_pton(AF_INET, FLAGS_base.c_str(), &base);
+	CHECK(err == 1) << "Invalid base address " << FLAGS_base;
+
+	nodes.resize(FLAGS_nodes);
+
+	for(int i = 0; i < FLAGS_nodes; i++) {
+		Node &node = nodes[i];
+
+		node.index = i;
+		node.addr.s_addr = htonl(ntohl(base.s_addr) + i);
+		node.adopted = FLAGS_adopted;
+
+		// locally administered MAC addresses
+		node.mac[0] = 0x02;
+		node.mac[1] = 0x4c;
+		node.mac[2] = 0x49;
+		node.mac[3] = (i >> 16) & 0xFF;
+		node.mac[4] = (i >> 8) & 0xFF;
+		node.mac[5] = (i & 0xFF);
+
+		node.sock = socket(AF_INET, SOCK_DGRAM, 0);
+		PCHECK(node.sock >= 0) << "Couldn't create socket";
+
+		// the server may be listening on the wildcard address
+		err = setsockopt(node.sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+		PCHECK(err == 0) << "Couldn't set SO_REUSEADDR";
+
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+
+		addr.sin_family = AF_INET;
+		addr.sin_addr = node.addr;
+		addr.sin_port = htons(FLAGS_port);
+
+		err = bind(node.sock, (struct sockaddr *) &addr, sizeof(addr));
+		PCHECK(err == 0) << "Couldn't bind node " << i << " to " << inet_ntoa(node.addr);
+	}
+}
+
+/**
+ * Sends an acknowledgement for the given packet.
+ */
+static void sendAck(const PendingAck &ack) {
+	lichtenstein_header_t header;
+	memset(&header, 0, sizeof(header));
+
+	LichtensteinUtils::populateHeader(&header, ack.opcode);
+
+	header.flags = (kFlagResponse | kFlagAck | kFlagChecksummed);
+	header.txn = ack.txn;
+	header.payloadLength = 0;
+
+	LichtensteinUtils::convertToNetworkByteOrder(&header, sizeof(header));
+	LichtensteinUtils::applyChecksum(&header, sizeof(header));
+
+	int err = sendto(ack.node->sock, &header, sizeof(header), 0, (struct sockaddr *) &ack.to, sizeof(ack.to));
+	PLOG_IF(ERROR, err < 0) << "Couldn't send ack from node " << ack.node->index;
+}
+
+/**
+ * Sends acknowledgements once they're due.
+ */
+static void ackThreadEntry(void) {
+	std::unique_lock<std::mutex> lk(ackLock);
+
+	while(run) {
+		if(acks.empty()) {
+			ackCv.wait_for(lk, std::chrono::milliseconds(100));
+			continue;
+		}
+
+		PendingAck ack = acks.top();
+
+		if(ack.due > Clock::now()) {
+			ackCv.wait_until(lk, ack.due);
+			continue;
+		}
+
+		acks.pop();
+
+		lk.unlock();
+		sendAck(ack);
+		lk.lock();
+	}
+}
+
+/**
+ * Queues an acknowledgement to be sent after the configured latency, or sends
+ * it right away if there's no latency.
+ */
+static void queueAck(PendingAck &ack, std::mt19937 &random) {
+	int latency = FLAGS_latency;
+
+	if(FLAGS_jitter > 0) {
+		std::uniform_int_distribution<int> jitter(-FLAGS_jitter, FLAGS_jitter);
+		latency = std::max(0, latency + jitter(random));
+	}
+
+	if(latency == 0) {
+		sendAck(ack);
+		return;
+	}
+
+	ack.due = Clock::now() + std::chrono::microseconds(latency);
+
+	std::lock_guard<std::mutex> lk(ackLock);
+	acks.push(ack);
+	ackCv.notify_one();
+}
+
+/**
+ * Checks that a framebuffer data or delta packet matches its channel, and that
+ * its pixel data fits the packet exactly.
+ */
+static bool validateFramebufferPacket(void *data, size_t length) {
+	lichtenstein_header_t *header = static_cast<lichtenstein_header_t *>(data);
+
+	if(header->opcode == kOpcodeFramebufferData) {
+		lichtenstein_framebuffer_data_t *fb = static_cast<lichtenstein_framebuffer_data_t *>(data);
+		size_t stride = (fb->dataFormat == kDataFormatRGBW) ? 4 : 3;
+
+		if(fb->destChannel >= (uint32_t) FLAGS_channels) {
+			return false;
+		}
+
+		return (length == (sizeof(lichtenstein_framebuffer_data_t) + (fb->dataElements * stride)));
+	} else {
+		lichtenstein_framebuffer_delta_t *fb = static_cast<lichtenstein_framebuffer_delta_t *>(data);
+		size_t stride = (fb->dataFormat == kDataFormatRGBW) ? 4 : 3;
+
+		if(fb->destChannel >= (uint32_t) FLAGS_channels) {
+			return false;
+		}
+
+		// each range must be in bounds; the byte order conversion checked that
+		// their headers are
+		size_t offset = sizeof(lichtenstein_framebuffer_delta_t);
+
+		for(size_t i = 0; i < fb->numRanges; i++) {
+			lichtenstein_framebuffer_range_t *range;
+			range = reinterpret_cast<lichtenstein_framebuffer_range_t *>(static_cast<uint8_t *>(data) + offset);
+
+			offset += sizeof(lichtenstein_framebuffer_range_t) + (range->count * stride);
+		}
+
+		return (offset == length);
+	}
+}
+
+/**
+ * Handles a packet received by a node.
+ */
+static void handlePacket(Node &node, void *data, size_t length, const struct sockaddr_in &from, std::mt19937 &random) {
+	// validate the checksum and convert it
+	if(LichtensteinUtils::validatePacket(data, length) != LichtensteinUtils::kNoError ||
+	   LichtensteinUtils::convertToHostByteOrder(data, length) != 0) {
+		node.invalid++;
+		return;
+	}
+
+	lichtenstein_header_t *header = static_cast<lichtenstein_header_t *>(data);
+
+	PendingAck ack;
+	ack.node = &node;
+	ack.to = from;
+	ack.opcode = header->opcode;
+	ack.txn = header->txn;
+
+	switch(header->opcode) {
+		case kOpcodeNodeAdoption:
+			if(!node.adopted) {
+				LOG(INFO) << "Node " << node.index << " (" << inet_ntoa(node.addr) << ") adopted";
+			}
+
+			node.adopted = true;
+			sendAck(ack);
+			break;
+
+		case kOpcodeFramebufferData:
+		case kOpcodeFramebufferDelta: {
+			if(!validateFramebufferPacket(data, length)) {
+				node.invalid++;
+				return;
+			}
+
+			node.frames++;
+			node.bytes += length;
+
+			// drop some writes, if requested
+			std::uniform_real_distribution<double> loss(0, 1);
+
+			if(FLAGS_loss > 0 && loss(random) < FLAGS_loss) {
+				node.dropped++;
+				return;
+			}
+
+			node.acked++;
+			queueAck(ack, random);
+			break;
+		}
+
+		case kOpcodeSyncOutput:
+			sendAck(ack);
+			break;
+
+		default:
+			VLOG(1) << "Node " << node.index << " ignoring packet with opcode " << header->opcode;
+			break;
+	}
+}
+
+/**
+ * Multicasts an announcement for the given node.
+ */
+static void announce(int sock, const Node &node, const struct sockaddr_in &group) {
+	static const size_t kMaxHostnameLen = 32;
+
+	char hostname[kMaxHostnameLen];
+	snprintf(hostname, sizeof(hostname), "fleet-%d", node.index);
+
+	size_t hostnameLen = strlen(hostname) + 1;
+	size_t length = sizeof(lichtenstein_node_announcement_t) + hostnameLen;
+
+	uint8_t buffer[sizeof(lichtenstein_node_announcement_t) + kMaxHostnameLen];
+	memset(buffer, 0, sizeof(buffer));
+
+	lichtenstein_node_announcement_t *packet = reinterpret_cast<lichtenstein_node_announcement_t *>(buffer);
+
+	LichtensteinUtils::populateHeader(&packet->header, kOpcodeNodeAnnouncement);
+
+	packet->header.flags = (kFlagMulticast | kFlagChecksummed);
+	packet->header.payloadLength = (length - sizeof(lichtenstein_header_t));
+
+	packet->swVersion = 0x00001000;
+	packet->hwVersion = 0x00001000;
+
+	memcpy(packet->macAddr, node.mac, sizeof(node.mac));
+
+	packet->port = FLAGS_port;
+	packet->ip = node.addr.s_addr;
+
+	packet->fbSize = (FLAGS_channels * FLAGS_pixels * 4);
+	packet->channels = FLAGS_channels;
+
+	packet->hostnameLen = hostnameLen;
+	memcpy(packet->hostname, hostname, hostnameLen);
+
+	LichtensteinUtils::convertToNetworkByteOrder(packet, length);
+	LichtensteinUtils::applyChecksum(packet, length);
+
+	int err = sendto(sock, packet, length, 0, (struct sockaddr *) &group, sizeof(group));
+	PLOG_IF(ERROR, err < 0) << "Couldn't send announcement for node " << node.index;
+}
+
+/**
+ * Creates the socket on which announcements are multicast.
+ */
+static int createMulticastSocket(void) {
+	int err;
+	unsigned char ttl = 1, loop = 1;
+
+	int sock = socket(AF_INET, SOCK_DGRAM, 0);
+	PCHECK(sock >= 0) << "Couldn't create multicast socket";
+
+	struct in_addr interface;
+	err = inet_pton(AF_INET, FLAGS_interface.c_str(), &interface);
+	CHECK(err == 1) << "Invalid interface address " << FLAGS_interface;
+
+	err = setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, &interface, sizeof(interface));
+	PCHECK(err == 0) << "Couldn't set multicast interface";
+
+	// the server may be running on this machine
+	err = setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+	PCHECK(err == 0) << "Couldn't enable multicast loopback";
+
+	err = setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+	PCHECK(err == 0) << "Couldn't set multicast TTL";
+
+	return sock;
+}
+
+/**
+ * Prints the statistics since they were last printed, then resets them.
+ */
+static void printStats(double seconds) {
+	size_t adopted = 0;
+	uint64_t frames = 0, bytes = 0, acked = 0, dropped = 0, invalid = 0;
+	uint64_t minFrames = UINT64_MAX, maxFrames = 0;
+
+	for(Node &node : nodes) {
+		adopted += node.adopted ? 1 : 0;
+
+		frames += node.frames;
+		bytes += node.bytes;
+		acked += node.acked;
+		dropped += node.dropped;
+		invalid += node.invalid;
+
+		minFrames = std::min(minFrames, node.frames);
+		maxFrames = std::max(maxFrames, node.frames);
+
+		node.frames = node.bytes = node.acked = node.dropped = node.invalid = 0;
+	}
+
+	printf("%zu/%zu adopted, writes/s per node: min %.1f avg %.1f max %.1f, %.1f Mbit/s, %llu acked, %llu dropped, %llu invalid\n",
+		   adopted, nodes.size(), (minFrames / seconds), (frames / seconds / nodes.size()),
+		   (maxFrames / seconds), ((bytes * 8) / seconds / (1000 * 1000)),
+		   (unsigned long long) acked, (unsigned long long) dropped,
+		   (unsigned long long) invalid);
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+	FLAGS_logtostderr = 1;
+	google::InitGoogleLogging(argv[0]);
+
+	gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+	CHECK(FLAGS_nodes > 0) << "Need at least one node";
+	CHECK(FLAGS_channels > 0 && FLAGS_channels <= (int) kLichtensteinMaxChannels) << "Invalid number of channels";
+	CHECK(FLAGS_loss >= 0 && FLAGS_loss <= 1) << "Loss must be between 0 and 1";
+
+	createNodes();
+
+	int multicastSock = createMulticastSocket();
+
+	struct sockaddr_in group;
+	memset(&group, 0, sizeof(group));
+
+	group.sin_family = AF_INET;
+	group.sin_port = htons(FLAGS_port);
+
+	int err = inet_pton(AF_INET, FLAGS_group.c_str(), &group.sin_addr);
+	CHECK(err == 1) << "Invalid multicast group " << FLAGS_group;
+
+	LOG(INFO) << "Emulating " << FLAGS_nodes << " nodes starting at " << FLAGS_base;
+
+	std::thread ackThread(ackThreadEntry);
+
+	// poll all nodes' sockets
+	std::vector<struct pollfd> fds(nodes.size());
+
+	for(size_t i = 0; i < nodes.size(); i++) {
+		fds[i].fd = nodes[i].sock;
+		fds[i].events = POLLIN;
+	}
+
+	std::mt19937 random(std::random_device{}());
+	static uint8_t buffer[65536];
+
+	auto start = Clock::now();
+	auto lastStats = start;
+	auto lastAnnounce = start - std::chrono::hours(1);
+
+	while(true) {
+		auto now = Clock::now();
+
+		if(FLAGS_seconds > 0 && std::chrono::duration<double>(now - start).count() >= FLAGS_seconds) {
+			break;
+		}
+
+		// announce nodes that haven't been adopted yet
+		if(FLAGS_announce > 0 && std::chrono::duration<double>(now - lastAnnounce).count() >= FLAGS_announce) {
+			for(const Node &node : nodes) {
+				if(!node.adopted) {
+					announce(multicastSock, node, group);
+				}
+			}
+
+			lastAnnounce = now;
+		}
+
+		// print statistics
+		std::chrono::duration<double> sinceStats = (now - lastStats);
+
+		if(sinceStats.count() >= FLAGS_stats) {
+			printStats(sinceStats.count());
+			lastStats = now;
+		}
+
+		// wait for packets, then drain all readable sockets
+		err = poll(fds.data(), fds.size(), 100);
+
+		if(err < 0) {
+			PLOG_IF(FATAL, errno != EINTR) << "poll failed";
+			continue;
+		}
+
+		for(size_t i = 0; i < fds.size(); i++) {
+			if(!(fds[i].revents & POLLIN)) {
+				continue;
+			}
+
+			while(true) {
+				struct sockaddr_in from;
+				socklen_t fromLen = sizeof(from);
+
+				ssize_t len = recvfrom(fds[i].fd, buffer, sizeof(buffer), MSG_DONTWAIT, (struct sockaddr *) &from, &fromLen);
+
+				if(len < 0) {
+					break;
+				}
+
+				handlePacket(nodes[i], buffer, len, from, random);
+			}
+		}
+	}
+
+	// clean up
+	run = false;
+	ackCv.notify_all();
+	ackThread.join();
+
+	for(Node &node : nodes) {
+		close(node.sock);
+	}
+
+	close(multicastSock);
+	return 0;
+}